@@ -20,13 +20,19 @@ FreeApcContextStructure(_Inout_ PAPC_CONTEXT_HEADER Context);
 VOID
 IncrementApcCount(_In_ UINT32 ContextId);
 
+PKAPC
+AllocateApcAndIncrementApcCount(_In_ UINT32 ContextId);
+
 VOID
 FreeApcAndDecrementApcCount(_Inout_ PRKAPC Apc, _In_ UINT32 ContextId);
 
+VOID
+ReleaseApcAndDecrementApcCount(_Inout_ PRKAPC Apc, _In_ UINT32 ContextId);
+
 NTSTATUS
 QueryActiveApcContextsForCompletion();
 
-VOID
+NTSTATUS
 InsertApcContext(_In_ PVOID Context);
 
 BOOLEAN
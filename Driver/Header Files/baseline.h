@@ -0,0 +1,66 @@
+#ifndef BASELINE_H
+#define BASELINE_H
+
+#include "common.h"
+
+/*
+ * Rather than hashing a modules entire .text section on every sweep, a
+ * baseline of per page hashes is taken once. Each sweep then verifies a small
+ * subset of pages, pages_per_sweep at a time.
+ *
+ * Pages are visited in the order (start + n * stride) % page_count, where both
+ * start and stride are chosen randomly when the baseline is created and the
+ * stride is coprime with page_count. This guarantees every page is verified
+ * once every page_count / pages_per_sweep sweeps, while the next page to be
+ * verified cannot be predicted from the previous.
+ */
+#define BASELINE_PAGE_SIZE               PAGE_SIZE
+#define BASELINE_DEFAULT_PAGES_PER_SWEEP 16
+
+typedef struct _MODULE_PAGE_BASELINE {
+    UINT32 text_size;
+    UINT32 page_count;
+    UINT32 start;
+    UINT32 stride;
+    UINT32 cursor;
+    UINT32 pages_per_sweep;
+
+    /* pages a sweep skipped since they could not be copied */
+    UINT32 unreadable_pages;
+
+    /* page_count SHA256 hashes */
+    UCHAR hashes[][SHA_256_HASH_LENGTH];
+
+} MODULE_PAGE_BASELINE, *PMODULE_PAGE_BASELINE;
+
+#define BASELINE_NO_MISMATCH MAXULONG
+
+NTSTATUS
+BaselineCreateModulePageHashes(_In_ PVOID                   TextBase,
+                               _In_ UINT32                  TextSize,
+                               _In_ UINT32                  PagesPerSweep,
+                               _Out_ PMODULE_PAGE_BASELINE* Baseline);
+
+VOID
+BaselineFreeModulePageHashes(_In_ PMODULE_PAGE_BASELINE Baseline);
+
+NTSTATUS
+BaselineVerifyModulePages(_Inout_ PMODULE_PAGE_BASELINE Baseline,
+                          _In_ PVOID                    TextBase,
+                          _Out_ PUINT32                 MismatchOffset);
+
+NTSTATUS
+BaselineVerifyModulePageList(_In_ PMODULE_PAGE_BASELINE Baseline,
+                             _In_ PVOID                 TextBase,
+                             _In_reads_(Count) PUINT32  Pages,
+                             _In_ UINT32                Count,
+                             _Out_ PUINT32              MismatchOffset);
+
+VOID
+BaselineReportModifiedPage(_In_ PVOID  ImageBase,
+                           _In_ UINT32 ImageSize,
+                           _In_ PCHAR  ModulePath,
+                           _In_ UINT32 TextOffset,
+                           _In_ UINT32 PageOffset);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "driver.h"
 #include "common.h"
+#include "baseline.h"
 
 #include <wdf.h>
 
@@ -21,12 +22,21 @@ typedef struct _DRIVER_LIST_ENTRY {
     CHAR       path[DRIVER_PATH_LENGTH];
     CHAR       text_hash[SHA_256_HASH_LENGTH];
 
+    /* per page hashes of .text, see baseline.h. NULL until the module has
+     * been hashed. */
+    PMODULE_PAGE_BASELINE page_baseline;
+
     /*
      * This LIST_ENTRY is to be used for modules where the hashing needs to
      * be deferred. For example, when x86 modules can't be hashed on driver
      * load.
      */
     LIST_ENTRY deferred_entry;
+    UINT64     deferred_time;
+    UINT32     deferred_attempts;
+
+    /* the slice that last failed to hash the module, see deferred.c */
+    UINT64 deferred_slice;
 
 } DRIVER_LIST_ENTRY, *PDRIVER_LIST_ENTRY;
 
@@ -71,17 +71,32 @@ typedef struct _THREAD_LIST_HEAD {
 
 } THREAD_LIST_HEAD, *PTHREAD_LIST_HEAD;
 
+/* times are in 100ns units, from a module being deferred to being hashed */
+typedef struct _DEFERRED_HASH_STATISTICS {
+    UINT64 hashed;
+    UINT64 failed;
+    UINT64 abandoned;
+    UINT64 slices;
+    UINT64 last_latency;
+    UINT64 max_latency;
+    UINT64 total_latency;
+
+} DEFERRED_HASH_STATISTICS, *PDEFERRED_HASH_STATISTICS;
+
 typedef struct _DRIVER_LIST_HEAD {
     LIST_ENTRY       list_entry;
     volatile ULONG   count;
     volatile BOOLEAN active;
     KGUARDED_MUTEX   lock;
 
-    /* modules that need to be hashed later. */
-    PIO_WORKITEM     work_item;
-    LIST_ENTRY       deferred_list;
-    volatile BOOLEAN deferred_complete;
-    volatile LONG    can_hash_x86;
+    /* modules that need to be hashed later, see deferred.h. the count and
+     * statistics are protected by lock. */
+    PIO_WORKITEM             work_item;
+    LIST_ENTRY               deferred_list;
+    volatile ULONG           deferred_count;
+    DEFERRED_HASH_STATISTICS deferred_statistics;
+    volatile BOOLEAN         deferred_complete;
+    volatile LONG            can_hash_x86;
 
 } DRIVER_LIST_HEAD, *PDRIVER_LIST_HEAD;
 
@@ -105,6 +120,25 @@ typedef struct _PROCESS_MAP_MODULE_ENTRY {
     CHAR       path[MAX_MODULE_PATH];
 } PROCESS_MAP_MODULE_ENTRY, *PPROCESS_MAP_MODULE_ENTRY;
 
+/*
+ * The path is interned in the shared path table, see procmod.h. If the table
+ * is full path_id is PROCESS_MODULE_PATH_INVALID and the module owns a private
+ * copy of its path instead.
+ */
+typedef struct _PROCESS_MODULE {
+    UINT64 base;
+    UINT32 size;
+    UINT32 path_id;
+    PCHAR  path;
+} PROCESS_MODULE, *PPROCESS_MODULE;
+
+/* Sorted by base, so containment lookups are a binary search. */
+typedef struct _PROCESS_MODULE_ARRAY {
+    PPROCESS_MODULE modules;
+    UINT32          count;
+    UINT32          capacity;
+} PROCESS_MODULE_ARRAY, *PPROCESS_MODULE_ARRAY;
+
 typedef struct _PROCESS_LIST_ENTRY {
     /* IMPORTANT THIS IS FIRST!*/
     HANDLE          process_id;
@@ -229,6 +263,9 @@ typedef struct _IRP_QUEUE_ENTRY {
 #define AES_256_KEY_SIZE 32
 #define AES_256_IV_SIZE  16
 
+/* 14 rounds plus the initial whitening key */
+#define AES_256_ROUND_KEYS_SIZE (15 * 16)
+
 typedef struct _HEARTBEAT_CONFIGURATION {
     volatile UINT32 counter;
 
@@ -277,12 +314,16 @@ typedef struct _ACTIVE_SESSION {
     struct {
         UINT32            cookie;
         UINT32            magic_number;
-        PUCHAR            aes_key[AES_256_KEY_SIZE];
-        PUCHAR            iv[AES_256_IV_SIZE];
+        UCHAR             aes_key[AES_256_KEY_SIZE];
+        UCHAR             iv[AES_256_IV_SIZE];
         BCRYPT_KEY_HANDLE key_handle;
 
         PUCHAR key_object;
         UINT32 key_object_length;
+
+        /* expanded encryption key schedule, valid if aes_ni is set */
+        DECLSPEC_ALIGN(16) UCHAR round_keys[AES_256_ROUND_KEYS_SIZE];
+        BOOLEAN                  aes_ni;
     };
 
     struct SESSION_STATISTICS {
@@ -313,6 +354,7 @@ typedef struct _ACTIVE_SESSION {
 #define TEMP_BUFFER_POOL               'ffff'
 #define DRIVER_PATH_POOL_TAG           'path'
 #define POOL_TAG_INTEGRITY             'intg'
+#define POOL_TAG_BASELINE              'lsab'
 #define POOL_TAG_MODULE_MEMORY_BUF     'lolo'
 #define POOL_TAG_MODULE_MEMORY_BUF_2   'leeo'
 #define POOL_TAG_HASH_OBJECT           'hobj'
@@ -338,6 +380,18 @@ typedef struct _ACTIVE_SESSION {
 #define POOL_TAG_MODULE_LIST           'elom'
 #define POOL_TAG_RB_TREE               'eert'
 #define POOL_TAG_HASHMAP               'hsah'
+#define POOL_TAG_RING                  'gnir'
+#define POOL_TAG_STACKWALK             'klws'
+#define POOL_TAG_MODULE_INDEX          'xdim'
+#define POOL_TAG_WORK_POOL             'lpkw'
+#define POOL_TAG_OB_FILTER             'rtfo'
+#define POOL_TAG_HANDLE_CACHE          'ehch'
+#define POOL_TAG_PROCESS_MODULE        'domp'
+#define POOL_TAG_USER_MODULE           'domu'
+#define POOL_TAG_PCI_DEVICE            'vdcp'
+#define POOL_TAG_HV_TIMING             'mith'
+#define POOL_TAG_EPT                   'htpe'
+#define POOL_TAG_PERF                  'frep'
 
 #define IA32_APERF_MSR 0x000000E8
 
@@ -786,9 +840,10 @@ typedef struct _OBJECT_HEADER {
     QUAD  Body;
 } OBJECT_HEADER, *POBJECT_HEADER;
 
-#define IMAGE_SCN_MEM_EXECUTE 0x20000000
-#define IMAGE_SCN_MEM_READ    0x40000000
-#define IMAGE_SCN_MEM_WRITE   0x80000000
+#define IMAGE_SCN_MEM_DISCARDABLE 0x02000000
+#define IMAGE_SCN_MEM_EXECUTE     0x20000000
+#define IMAGE_SCN_MEM_READ        0x40000000
+#define IMAGE_SCN_MEM_WRITE       0x80000000
 
 #define IMAGE_SIZEOF_SHORT_NAME 8
 
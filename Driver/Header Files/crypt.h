@@ -5,6 +5,36 @@
 
 #define XOR_ROTATION_AMT 13
 
+/*
+ * A SHA256 hash object created with BCRYPT_HASH_REUSABLE_FLAG, meaning it is
+ * reset by BCryptFinishHash and can immediately be used for the next hash.
+ * This avoids querying the object length, allocating the hash object and
+ * creating the hash on every call.
+ */
+typedef struct _CRYPT_HASH_CONTEXT {
+    BCRYPT_HASH_HANDLE handle;
+    PUCHAR             object;
+    ULONG              object_size;
+
+    /* set once data has been hashed but not yet finished */
+    BOOLEAN dirty;
+
+    /* index into the context cache, or CRYPT_HASH_CONTEXT_NOT_CACHED */
+    UINT32 cache_index;
+
+} CRYPT_HASH_CONTEXT, *PCRYPT_HASH_CONTEXT;
+
+/* one for each integrity verification worker with room to spare */
+#define CRYPT_HASH_CONTEXT_CACHE_SIZE 8
+#define CRYPT_HASH_CONTEXT_NOT_CACHED MAXULONG
+
+typedef struct _CRYPT_HASH_CONTEXT_CACHE {
+    /* bit n is set while contexts[n] is free */
+    volatile LONG      free_mask;
+    CRYPT_HASH_CONTEXT contexts[CRYPT_HASH_CONTEXT_CACHE_SIZE];
+
+} CRYPT_HASH_CONTEXT_CACHE, *PCRYPT_HASH_CONTEXT_CACHE;
+
 FORCEINLINE
 VOID
 CryptEncryptPointer64(_Inout_ PUINT64 Pointer, _In_ UINT64 Key)
@@ -28,6 +58,34 @@ CryptDecryptPointerOutOfPlace64(_In_ PUINT64 Pointer, _In_ UINT64 Key)
     return temp;
 }
 
+/* the imports key is made up of CRYPT_IMPORT_KEY_LANES 64 bit lanes */
+#define CRYPT_IMPORT_KEY_LANES 4
+
+/*
+ * Entry n is keyed by lane n % 4 of the imports key, rotated by n / 4 and
+ * mixed with n, so neighbouring entries and entries sharing a lane are
+ * encrypted with different keys.
+ */
+FORCEINLINE
+UINT64
+CryptDeriveImportEntryKey(_In_ PUINT64 Keys, _In_ UINT32 EntryIndex)
+{
+    return _rotl64(Keys[EntryIndex % CRYPT_IMPORT_KEY_LANES],
+                   (EntryIndex / CRYPT_IMPORT_KEY_LANES) & 63) ^
+           ((UINT64)EntryIndex * 0x9E3779B97F4A7C15ull);
+}
+
+/* Inlined into each Imp* wrapper, the decrypted pointer is never stored. */
+FORCEINLINE
+UINT64
+CryptDecryptImportEntry(_In_ PUINT64 Array,
+                        _In_ PUINT64 Keys,
+                        _In_ UINT32  EntryIndex)
+{
+    return CryptDecryptPointerOutOfPlace64(
+        &Array[EntryIndex], CryptDeriveImportEntryKey(Keys, EntryIndex));
+}
+
 VOID
 CryptEncryptImportsArray(_In_ PUINT64 Array, _In_ UINT32 Entries);
 
@@ -45,6 +103,11 @@ CryptRequestRequiredBufferLength(_In_ UINT32 BufferLength);
 NTSTATUS
 CryptEncryptBuffer(_In_ PVOID Buffer, _In_ UINT32 BufferLength);
 
+NTSTATUS
+CryptEncryptBufferBatch(_Inout_updates_(Count) PVOID* Buffers,
+                        _In_reads_(Count) PUINT32     Lengths,
+                        _In_ UINT32                   Count);
+
 NTSTATUS
 CryptInitialiseSessionCryptObjects();
 
@@ -75,4 +138,41 @@ CryptHashBuffer_sha256(_In_ PVOID   Buffer,
                        _Out_ PVOID* HashResult,
                        _Out_ PULONG HashResultSize);
 
+NTSTATUS
+CryptHashBufferEx_sha256(_In_ PVOID  Buffer,
+                         _In_ ULONG  BufferSize,
+                         _Out_ PVOID Hash,
+                         _In_ ULONG  HashSize);
+
+NTSTATUS
+CryptCreateHashContext(_Out_ PCRYPT_HASH_CONTEXT Context);
+
+VOID
+CryptDestroyHashContext(_Inout_ PCRYPT_HASH_CONTEXT Context);
+
+NTSTATUS
+CryptInitialiseHashContextCache();
+
+VOID
+CryptFreeHashContextCache();
+
+PCRYPT_HASH_CONTEXT
+CryptAcquireHashContext();
+
+VOID
+CryptReleaseHashContext(_In_ PCRYPT_HASH_CONTEXT Context);
+
+NTSTATUS
+CryptHashInit(_Inout_ PCRYPT_HASH_CONTEXT Context);
+
+NTSTATUS
+CryptHashUpdate(_Inout_ PCRYPT_HASH_CONTEXT Context,
+                _In_ PVOID                  Buffer,
+                _In_ ULONG                  BufferSize);
+
+NTSTATUS
+CryptHashFinal(_Inout_ PCRYPT_HASH_CONTEXT Context,
+               _Out_ PVOID                 Hash,
+               _In_ ULONG                  HashSize);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include "common.h"
+#include "callbacks.h"
+
+/*
+ * x86 modules cannot be hashed when they load early in boot, so they are
+ * queued on the driver list's deferred_list until hashing becomes possible.
+ * Rather than draining the queue in a single work item, which at boot or game
+ * launch may run for a long time while many images are loading, the queue is
+ * drained in slices on the background work queue. A slice hashes modules
+ * until its budget is spent, always hashing at least one, then yields for
+ * yield_interval before the next slice is queued from a timer DPC.
+ *
+ * Modules are hashed without the list lock held, which is only taken to
+ * dequeue a module and to record its result, so image load notifications are
+ * never blocked by a hash.
+ */
+#define DEFERRED_HASH_DEFAULT_SLICE_BUDGET_US   1000
+#define DEFERRED_HASH_DEFAULT_YIELD_INTERVAL_MS 20
+#define DEFERRED_HASH_UNLOAD_POLL_INTERVAL      (MILLISECONDS(10))
+
+/* a module failing to hash is requeued at the tail and retried in a later
+ * slice, this many times in total before it is abandoned */
+#define DEFERRED_HASH_MAX_ATTEMPTS 3
+
+typedef struct _DEFERRED_HASH_QUEUE {
+    volatile BOOLEAN  active;
+    PDRIVER_LIST_HEAD list;
+
+    /*
+     * state = 1: a slice is queued, waiting on the timer or running
+     * state = 0: no slice is scheduled
+     */
+    volatile LONG state;
+
+    UINT32 slice_budget_us;
+    UINT32 yield_interval_ms;
+
+    KTIMER timer;
+    KDPC   dpc;
+
+} DEFERRED_HASH_QUEUE, *PDEFERRED_HASH_QUEUE;
+
+NTSTATUS
+DeferredHashInitialise(_In_ PDRIVER_LIST_HEAD List);
+
+VOID
+DeferredHashFree();
+
+VOID
+DeferredHashConfigure(_In_ UINT32 SliceBudgetUs, _In_ UINT32 YieldIntervalMs);
+
+VOID
+DeferredHashEnqueue(_In_ PDRIVER_LIST_ENTRY Entry);
+
+VOID
+DeferredHashStart();
+
+VOID
+DeferredHashQueryStatistics(_Out_ PULONG                    Depth,
+                            _Out_ PDEFERRED_HASH_STATISTICS Statistics);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef EPT_H
+#define EPT_H
+
+#include "common.h"
+
+/*
+ * A function hooked through EPT has its page mapped execute only, so reading
+ * it raises an EPT violation and the read costs a VM exit. Reads of the
+ * target functions are timed against reads of control functions which are
+ * not expected to be hooked, with the line flushed before each read so both
+ * measure a cache miss.
+ *
+ * The controls are timed on every processor once per boot, and the median
+ * and 90th percentile kept as that processor's baseline. A check then reads
+ * a batch of target pages on every processor in parallel, each within a
+ * single interrupt disabled window. As a hook applies to an entire page,
+ * targets sharing a page are only read once, and a check reads at most
+ * EPT_MAX_PAGES_PER_CHECK pages, continuing from where the previous check
+ * stopped, so adding targets does not add to the cost of a check.
+ *
+ * A hypervisor may leave a page readable after the first violation until it
+ * is next executed, so only a single read of each page per check is
+ * meaningful. Rather than averaging samples, a page must exceed the baseline
+ * in EPT_REQUIRED_STRIKES consecutive checks to be reported, rejecting a read
+ * delayed by an SMI or interrupt.
+ */
+#define EPT_MAX_PAGES_PER_CHECK 32
+#define EPT_CALIBRATION_ROUNDS  64
+#define EPT_REQUIRED_STRIKES    2
+
+/*
+ * a read is flagged when it exceeds this percentage of the baseline p90. Below
+ * 100 every read slower than the p90 would be flagged.
+ */
+#define EPT_DEFAULT_THRESHOLD_PERCENT 300
+#define EPT_MIN_THRESHOLD_PERCENT     100
+
+typedef struct _EPT_TARGET {
+    PCWSTR  name;
+    BOOLEAN control;
+
+} EPT_TARGET, *PEPT_TARGET;
+
+typedef struct _EPT_RESOLVED_TARGET {
+    PVOID  address;
+    UINT32 target;
+
+} EPT_RESOLVED_TARGET, *PEPT_RESOLVED_TARGET;
+
+typedef struct _EPT_PAGE {
+    /* the first target on the page, which is the address read */
+    PVOID  address;
+    UINT32 first_target;
+    UINT32 target_count;
+    UINT32 strikes;
+
+} EPT_PAGE, *PEPT_PAGE;
+
+typedef struct _EPT_BASELINE {
+    UINT64 median;
+    UINT64 p90;
+
+} EPT_BASELINE, *PEPT_BASELINE;
+
+typedef struct _EPT_STATISTICS {
+    UINT64 checks;
+    UINT64 pages_read;
+    UINT64 pages_flagged;
+    UINT64 hooks_reported;
+
+} EPT_STATISTICS, *PEPT_STATISTICS;
+
+typedef struct _EPT_DETECTION {
+    volatile BOOLEAN active;
+    BOOLEAN          calibrated;
+    UINT32           threshold_percent;
+
+    UINT32        processor_count;
+    PEPT_BASELINE baselines;
+
+    /* resolved targets sorted by address, and the pages they lie on */
+    PEPT_RESOLVED_TARGET targets;
+    UINT32               target_count;
+    PEPT_PAGE            pages;
+    UINT32               page_count;
+
+    /* control function addresses */
+    PVOID* controls;
+    UINT32 control_count;
+
+    /* the batch of the current check, and a timing per processor per page */
+    UINT32  batch_start;
+    UINT32  batch_count;
+    UINT32  cursor;
+    PUINT64 timings;
+
+    EPT_STATISTICS statistics;
+    KGUARDED_MUTEX lock;
+
+} EPT_DETECTION, *PEPT_DETECTION;
+
+VOID
+EptDetectionInitialiseLock();
+
+NTSTATUS
+EptDetectionInitialise();
+
+VOID
+EptDetectionFree();
+
+NTSTATUS
+EptDetectionSetThreshold(_In_ UINT32 ThresholdPercent);
+
+NTSTATUS
+EptDetectHooks();
+
+VOID
+EptDetectionQueryStatistics(_Out_ PEPT_STATISTICS Statistics);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef HANDLES_H
+#define HANDLES_H
+
+#include "common.h"
+#include "containers/map.h"
+#include "workpool.h"
+
+/*
+ * Enumerating every handle table of every process on each request is
+ * expensive, and nearly all of them are unchanged since the previous pass.
+ * For each process we remember a signature of its handle table, being the
+ * handle count and the allocation high water marks, along with a summary of
+ * the handles that refer to the protected process. A table whose signature is
+ * unchanged is skipped, only new processes and those whose signature changed
+ * are walked again.
+ *
+ * The signature cannot see a handle closed and another opened into the same
+ * slot, nor access raised on an existing entry in place. Freed entries are
+ * reused most recently freed first, so even the free list reads the same
+ * after such a close and open. So a table holding any handle to the
+ * protected process is walked on every pass, and every other table is walked
+ * at least once each HANDLE_CACHE_FULL_WALK_INTERVAL passes regardless of its
+ * signature. The interval bounds how many passes a handle opened that way
+ * goes unseen for, while still skipping three of every four walks of a table
+ * that does not change.
+ *
+ * The signature is read before a table is walked, so a table changing during
+ * the walk is walked again on the next pass. Processes are walked in parallel
+ * using the work pool, one task per process.
+ */
+#define HANDLE_CACHE_BUCKET_COUNT       64
+#define HANDLE_CACHE_FULL_WALK_INTERVAL 4
+
+/* room for processes created between the count being read and collection */
+#define HANDLE_CACHE_COLLECT_SLACK 32
+
+typedef struct _HANDLE_TABLE_SIGNATURE {
+    LONG  handle_count;
+    ULONG high_water_mark;
+    ULONG next_handle_needing_pool;
+
+} HANDLE_TABLE_SIGNATURE, *PHANDLE_TABLE_SIGNATURE;
+
+typedef struct _HANDLE_TABLE_SUMMARY {
+    /* IMPORTANT THIS IS FIRST! */
+    HANDLE                 process_id;
+    PEPROCESS              process;
+    HANDLE_TABLE_SIGNATURE signature;
+
+    /* handles referring to the protected process, and an order independent
+     * hash of their values and granted access */
+    UINT32 protected_count;
+    UINT64 protected_hash;
+
+    /* the pass that last walked the table, and that last saw the process */
+    UINT64 walked;
+    UINT64 seen;
+
+} HANDLE_TABLE_SUMMARY, *PHANDLE_TABLE_SUMMARY;
+
+/*
+ * Invoked for each handle referring to the protected process, while the
+ * handle table entry is locked. The routine may strip access from the entry.
+ */
+typedef VOID (*HANDLE_CACHE_ENTRY_ROUTINE)(_In_ PHANDLE_TABLE_ENTRY Entry,
+                                           _In_ HANDLE              Handle,
+                                           _In_ PEPROCESS           Owner,
+                                           _In_opt_ PVOID           Context);
+
+typedef struct _HANDLE_CACHE_STATISTICS {
+    UINT32 processes;
+    UINT32 walked;
+    UINT32 skipped;
+
+    /* walked tables whose protected handle summary changed */
+    UINT32 changed;
+
+    /* summaries of processes that no longer exist */
+    UINT32 pruned;
+
+    /* processes not collected due to the collection array being full */
+    UINT32 dropped;
+
+} HANDLE_CACHE_STATISTICS, *PHANDLE_CACHE_STATISTICS;
+
+typedef struct _HANDLE_CACHE {
+    volatile BOOLEAN active;
+    RTL_HASHMAP      summaries;
+    UINT64           pass;
+
+    /* serialises passes, the summaries are protected by their bucket lock */
+    KGUARDED_MUTEX lock;
+
+    /* held by HandleCacheRemoveProcess rather than the lock, so process exit
+     * is not held up by a pass. HandleCacheFree waits for it to run down
+     * before deleting the summaries. */
+    EX_RUNDOWN_REF rundown;
+
+} HANDLE_CACHE, *PHANDLE_CACHE;
+
+NTSTATUS
+HandleCacheInitialise();
+
+VOID
+HandleCacheFree();
+
+VOID
+HandleCacheRemoveProcess(_In_ HANDLE ProcessId);
+
+NTSTATUS
+HandleCacheRun(_In_ PRTL_HASHMAP                 ProcessMap,
+               _In_ PEPROCESS                    Protected,
+               _In_ HANDLE_CACHE_ENTRY_ROUTINE   Routine,
+               _In_opt_ PVOID                    Context,
+               _In_ PWORK_POOL_CONFIGURATION     Configuration,
+               _Out_opt_ PHANDLE_CACHE_STATISTICS Statistics);
+
+#endif
@@ -3,14 +3,59 @@
 
 #include <ntifs.h>
 #include "common.h"
+#include "types/types.h"
+
+/*
+ * A single timing of cpuid is easily skewed by an SMI or a cache miss, so
+ * every processor takes a number of short bursts of samples in parallel from
+ * a generic call DPC. Interrupts are only disabled for the duration of a
+ * burst, bounding the window to HV_TIMING_MAX_SAMPLES_PER_BURST samples of
+ * each instruction.
+ *
+ * cpuid unconditionally exits to a hypervisor, so under one its median cost
+ * is several times that of a reference workload which natively costs about
+ * the same as cpuid.
+ */
+#define HV_TIMING_DEFAULT_BURST_COUNT       32
+#define HV_TIMING_DEFAULT_SAMPLES_PER_BURST 8
+#define HV_TIMING_DEFAULT_THRESHOLD_PERCENT 300
+
+#define HV_TIMING_MAX_BURST_COUNT       256
+#define HV_TIMING_MAX_SAMPLES_PER_BURST 16
+
+/* dependent divisions making up the reference workload */
+#define HV_TIMING_REFERENCE_DIVISIONS 4
+#define HV_TIMING_REFERENCE_DIVISOR   0x8000000000000001ull
+
+typedef struct _HV_TIMING_PROCESSOR {
+    PUINT64 cpuid;
+    PUINT64 reference;
+    UINT32  count;
+    UINT32  aperf_zero_count;
+    UINT64  sink;
+    BOOLEAN sampled;
+
+} HV_TIMING_PROCESSOR, *PHV_TIMING_PROCESSOR;
+
+typedef struct _HV_TIMING_CONTEXT {
+    HYPERVISOR_TIMING_CONFIGURATION configuration;
+    UINT32                          processor_count;
+    PHV_TIMING_PROCESSOR            processors;
+
+} HV_TIMING_CONTEXT, *PHV_TIMING_CONTEXT;
 
 NTSTATUS
 PerformVirtualizationDetection(_Inout_ PIRP Irp);
 
+NTSTATUS
+HvMeasureTimingDistribution(
+    _In_opt_ PHYPERVISOR_TIMING_CONFIGURATION Configuration,
+    _Out_ PHYPERVISOR_TIMING_DISTRIBUTION     Distribution);
+
 BOOLEAN
 APERFMsrTimingCheck();
 
 extern INT
 TestINVDEmulation();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,81 @@
+#ifndef HWID_H
+#define HWID_H
+
+#include "common.h"
+
+/*
+ * Reading the SMBIOS tables, querying the serial of the boot drive over
+ * IOCTL_STORAGE_QUERY_PROPERTY, round tripping the TPM and walking the PCI
+ * bus are all slow and do not change between sessions. Rather than being
+ * performed synchronously in DriverEntry and again at session start, they are
+ * gathered once on a work item queued at the end of DriverEntry, and the
+ * results kept in a versioned snapshot which later sessions copy.
+ *
+ * The snapshot is only regathered when a device interface of one of the
+ * classes below arrives or is removed. Besides disks these are the classes
+ * that pci functions register, so a function hot plugged onto the bus causes
+ * the pci walk to be redone. A function exposing none of them is found by
+ * the next refresh. Notifications are coalesced, so a burst of arrivals as a
+ * dock is connected results in a single refresh.
+ */
+
+/* disk, storage port, display adapter, network and usb host controller */
+#define HW_ID_NOTIFICATION_CLASS_COUNT 5
+
+/* delay before a refresh, coalescing notifications raised together */
+#define HW_ID_REFRESH_COALESCE_DELAY (MILLISECONDS(500))
+#define HW_ID_UNLOAD_POLL_INTERVAL   (MILLISECONDS(10))
+
+/* identifiers successfully gathered into a snapshot */
+#define HW_ID_FLAG_VENDOR             0x00000001
+#define HW_ID_FLAG_MOTHERBOARD_SERIAL 0x00000002
+#define HW_ID_FLAG_DRIVE_SERIAL       0x00000004
+#define HW_ID_FLAG_OS_VERSION         0x00000008
+
+typedef struct _HW_ID_SNAPSHOT {
+    /* incremented on each gather, 0 before the first completes */
+    UINT64 version;
+    UINT32 flags;
+
+    /* results of the checks run alongside the gather */
+    NTSTATUS tpm_status;
+    NTSTATUS pci_status;
+
+    SYSTEM_INFORMATION information;
+
+} HW_ID_SNAPSHOT, *PHW_ID_SNAPSHOT;
+
+typedef struct _HW_ID_CACHE {
+    volatile BOOLEAN active;
+
+    PIO_WORKITEM work_item;
+    PVOID        notification_entries[HW_ID_NOTIFICATION_CLASS_COUNT];
+
+    /* set while the work item is queued or running */
+    volatile LONG queued;
+
+    /* set by a notification, cleared by the worker before it gathers */
+    volatile LONG refresh_requested;
+
+    /* signalled once the first snapshot is published */
+    KEVENT ready;
+
+    /* protected by lock */
+    HW_ID_SNAPSHOT snapshot;
+    KGUARDED_MUTEX lock;
+
+} HW_ID_CACHE, *PHW_ID_CACHE;
+
+NTSTATUS
+HwIdCacheInitialise();
+
+VOID
+HwIdCacheFree();
+
+NTSTATUS
+HwIdCacheQuery(_In_ UINT32 TimeoutMs, _Out_ PHW_ID_SNAPSHOT Snapshot);
+
+VOID
+HwIdCacheRequestRefresh();
+
+#endif
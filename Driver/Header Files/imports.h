@@ -540,6 +540,42 @@ void (*pRtlFreeUnicodeString)(
         PUNICODE_STRING UnicodeString
         );
 
+typedef 
+LONG (*pKeSetEvent)(
+        PKEVENT   Event,
+        KPRIORITY Increment,
+        BOOLEAN   Wait
+        );
+
+typedef 
+void* (*pMmMapIoSpaceEx)(
+        PHYSICAL_ADDRESS PhysicalAddress,
+        SIZE_T           NumberOfBytes,
+        ULONG            Protect
+        );
+
+typedef 
+void (*pMmUnmapIoSpace)(
+        void*  BaseAddress,
+        SIZE_T NumberOfBytes
+        );
+
+typedef 
+NTSTATUS (*pIoRegisterPlugPlayNotification)(
+        IO_NOTIFICATION_EVENT_CATEGORY        EventCategory,
+        ULONG                                 EventCategoryFlags,
+        void*                                 EventCategoryData,
+        PDRIVER_OBJECT                        DriverObject,
+        PDRIVER_NOTIFICATION_CALLBACK_ROUTINE CallbackRoutine,
+        void*                                 Context,
+        void**                                NotificationEntry
+        );
+
+typedef 
+NTSTATUS (*pIoUnregisterPlugPlayNotificationEx)(
+        void* NotificationEntry
+        );
+
 // clang-format on
 
 #define OB_DEREFERENCE_OBJECT_INDEX                0
@@ -640,6 +676,12 @@ void (*pRtlFreeUnicodeString)(
 #define RTL_COMPARE_UNICODE_STRING_INDEX     76
 #define RTL_FREE_UNICODE_STRING_INDEX        77
 #define PS_GET_PROCESS_IMAGE_FILE_NAME_INDEX 78
+#define KE_SET_EVENT_INDEX                   79
+
+#define MM_MAP_IO_SPACE_EX_INDEX                      80
+#define MM_UNMAP_IO_SPACE_INDEX                       81
+#define IO_REGISTER_PLUG_PLAY_NOTIFICATION_INDEX      82
+#define IO_UNREGISTER_PLUG_PLAY_NOTIFICATION_EX_INDEX 83
 
 typedef struct _DRIVER_IMPORTS
 {
@@ -741,7 +783,13 @@ typedef struct _DRIVER_IMPORTS
         pRtlCompareUnicodeString   DrvImpRtlCompareUnicodeString;
         pRtlFreeUnicodeString      DrvImpRtlFreeUnicodeString;
         pPsGetProcessImageFileName DrvImpPsGetProcessImageFileName;
-        UINT64                     dummy;
+        pKeSetEvent                DrvImpKeSetEvent;
+
+        pMmMapIoSpaceEx                     DrvImpMmMapIoSpaceEx;
+        pMmUnmapIoSpace                     DrvImpMmUnmapIoSpace;
+        pIoRegisterPlugPlayNotification     DrvImpIoRegisterPlugPlayNotification;
+        pIoUnregisterPlugPlayNotificationEx DrvImpIoUnregisterPlugPlayNotificationEx;
+        UINT64                              dummy;
 
 } DRIVER_IMPORTS, *PDRIVER_IMPORTS;
 
@@ -1073,4 +1121,28 @@ ImpRtlCompareUnicodeString(_In_ PCUNICODE_STRING String1,
 VOID
 ImpRtlFreeUnicodeString(_In_ PUNICODE_STRING UnicodeString);
 
+LONG
+ImpKeSetEvent(_In_ PKEVENT Event, _In_ KPRIORITY Increment, _In_ BOOLEAN Wait);
+
+PVOID
+ImpMmMapIoSpaceEx(_In_ PHYSICAL_ADDRESS PhysicalAddress,
+                  _In_ SIZE_T           NumberOfBytes,
+                  _In_ ULONG            Protect);
+
+VOID
+ImpMmUnmapIoSpace(_In_ PVOID BaseAddress, _In_ SIZE_T NumberOfBytes);
+
+NTSTATUS
+ImpIoRegisterPlugPlayNotification(
+    _In_ IO_NOTIFICATION_EVENT_CATEGORY        EventCategory,
+    _In_ ULONG                                 EventCategoryFlags,
+    _In_opt_ PVOID                             EventCategoryData,
+    _In_ PDRIVER_OBJECT                        DriverObject,
+    _In_ PDRIVER_NOTIFICATION_CALLBACK_ROUTINE CallbackRoutine,
+    _Inout_opt_ PVOID                          Context,
+    _Out_ PVOID*                               NotificationEntry);
+
+NTSTATUS
+ImpIoUnregisterPlugPlayNotificationEx(_In_ PVOID NotificationEntry);
+
 #endif
\ No newline at end of file
@@ -116,7 +116,7 @@ ValidateOurDriversDispatchRoutines();
 
 VOID
 DeferredModuleHashingCallback(_In_ PDEVICE_OBJECT DeviceObject, 
-                              _In_opt PVOID Context);
+                              _In_opt_ PVOID Context);
 
 VOID
 FindWinLogonProcess(_In_ PPROCESS_LIST_ENTRY Node, _In_opt_ PVOID Context);
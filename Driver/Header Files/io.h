@@ -6,6 +6,15 @@
 #include <wdf.h>
 #include "common.h"
 
+/* Returns a PERF_STATISTICS, see perf.h. */
+#define IOCTL_QUERY_PERF_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x20030, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/* Pended until at least one report is available, see REPORT_BATCH_HEADER. */
+#define IOCTL_RETRIEVE_REPORT_BATCH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x20031, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/* size is that of the whole mapping, SHARED_MAPPING_SIZE */
 typedef struct _SHARED_MAPPING_INIT {
     PVOID  buffer;
     SIZE_T size;
@@ -31,6 +40,96 @@ typedef struct _SHARED_STATE {
 
 } SHARED_STATE, *PSHARED_STATE;
 
+/*
+ * The remainder of the shared mapping following the SHARED_STATE is a single
+ * producer, single consumer ring of encrypted report packets. The driver is
+ * the only producer and the user mode module the only consumer.
+ *
+ * > `layout`:
+ *   - The ring header begins at SHARED_REPORT_RING_OFFSET within the mapping
+ *     and its data area extends to the end of the mapping, rounded down to a
+ *     power of two.
+ *   - head and tail are free running byte counts, a records offset within
+ *     data being its position & (size - 1). head is only written by user
+ *     mode, tail only by the driver.
+ *   - Each record is a SHARED_REPORT_RECORD followed by length bytes of an
+ *     encrypted packet, framed by its PACKET_HEADER exactly as when returned
+ *     through an IRP. Records are padded to SHARED_REPORT_RECORD_ALIGNMENT
+ *     and never wrap; if a record does not fit before the end of the data
+ *     area a SHARED_REPORT_RECORD_PADDING record fills the remainder.
+ *   - If the consumer sets waiting before sleeping, the driver signals the
+ *     event registered at initialisation once new records are published.
+ *
+ * Since user mode can write any part of the mapping, the driver keeps its
+ * own copy of tail and validates head before using it.
+ */
+#define SHARED_REPORT_RING_OFFSET        64
+#define SHARED_REPORT_RING_MAGIC         'gnir'
+#define SHARED_REPORT_RECORD_ALIGNMENT   16
+#define SHARED_REPORT_RECORD_DATA        0x0
+#define SHARED_REPORT_RECORD_PADDING     0x1
+
+typedef struct _SHARED_REPORT_RECORD {
+    UINT32 length;
+    UINT32 type;
+    UINT64 sequence;
+
+} SHARED_REPORT_RECORD, *PSHARED_REPORT_RECORD;
+
+typedef struct _SHARED_REPORT_RING {
+    UINT32 magic;
+    UINT32 size;
+
+    DECLSPEC_CACHEALIGN volatile UINT32 head;
+    volatile UINT32                     waiting;
+
+    DECLSPEC_CACHEALIGN volatile UINT32 tail;
+    volatile UINT32                     dropped;
+
+    DECLSPEC_CACHEALIGN UCHAR data[];
+
+} SHARED_REPORT_RING, *PSHARED_REPORT_RING;
+
+/*
+ * The shared mapping is allocated with room for the SHARED_STATE, the ring
+ * header and SHARED_REPORT_RING_DATA_SIZE bytes of ring data, rounded up to
+ * whole pages. A single page, as the mapping used to be, cannot hold a ring of
+ * SHARED_REPORT_RING_MIN_SIZE once the header is taken out, so reports would
+ * only ever be delivered via IRPs.
+ */
+#define SHARED_REPORT_RING_DATA_SIZE 0x10000
+#define SHARED_MAPPING_SIZE                                        \
+    ROUND_TO_PAGES(SHARED_REPORT_RING_OFFSET +                     \
+                   sizeof(SHARED_REPORT_RING) +                    \
+                   SHARED_REPORT_RING_DATA_SIZE)
+
+/*
+ * An IOCTL_RETRIEVE_REPORT_BATCH output buffer begins with a
+ * REPORT_BATCH_HEADER and is followed by count records laid out as within the
+ * shared report ring, each a SHARED_REPORT_RECORD followed by length bytes of
+ * an encrypted packet and padded to SHARED_REPORT_RECORD_ALIGNMENT. Every
+ * record is of type SHARED_REPORT_RECORD_DATA and record sequence numbers are
+ * contiguous across batches, so user mode can restore the order in which the
+ * reports were scheduled however its requests complete.
+ *
+ * > `fields`:
+ *   - length is the number of bytes following the header.
+ *   - queued is the number of reports still waiting for a request once this
+ *     batch was filled, a non zero value meaning more requests should be kept
+ *     pending.
+ *   - dropped is the total number of reports discarded since the queue was
+ *     created.
+ */
+#define REPORT_BATCH_MIN_BUFFER_SIZE 0x1000
+
+typedef struct _REPORT_BATCH_HEADER {
+    UINT32 count;
+    UINT32 length;
+    UINT32 queued;
+    UINT32 dropped;
+
+} REPORT_BATCH_HEADER, *PREPORT_BATCH_HEADER;
+
 typedef struct _SHARED_MAPPING {
     volatile LONG    work_item_status;
     PVOID            user_buffer;
@@ -42,6 +141,19 @@ typedef struct _SHARED_MAPPING {
     KDPC             timer_dpc;
     PIO_WORKITEM     work_item;
 
+    /* > `report ring`:
+     *   - ring points into kernel_buffer, NULL if the mapping is too small.
+     *   - ring_tail is the authoritative tail, ring->tail is only a copy.
+     *   - ring_event is referenced from the handle supplied by user mode.
+     *   - ring_draining is set while a caller is moving reports into the
+     *     ring, ring_tail and ring_sequence are only accessed by it. */
+    PSHARED_REPORT_RING ring;
+    UINT32              ring_size;
+    UINT32              ring_tail;
+    UINT64              ring_sequence;
+    PKEVENT             ring_event;
+    volatile LONG       ring_draining;
+
 } SHARED_MAPPING, *PSHARED_MAPPING;
 
 NTSTATUS
@@ -0,0 +1,88 @@
+#ifndef IRPBATCH_H
+#define IRPBATCH_H
+
+#include "common.h"
+#include "io.h"
+
+#include "containers/ring.h"
+
+/*
+ * Reports are returned to user mode in batches, each pending
+ * IOCTL_RETRIEVE_REPORT_BATCH request being filled with as many reports as
+ * fit in its output buffer. User mode is expected to keep several requests
+ * pending at once so that a request is almost always waiting when a report is
+ * scheduled.
+ *
+ * > `ordering`:
+ *   - Requests are held in a cancel safe queue in the order they arrived and
+ *     the oldest is always completed first.
+ *   - Scheduled reports are pushed to a ring, which never allocates, and the
+ *     ring is drained into requests by a single drainer at a time. A report
+ *     that does not fit the request being filled is carried over to the next.
+ *   - If no request is pending the report simply stays in the ring until one
+ *     arrives, so no report is copied more than once. Only once the ring is
+ *     full are reports dropped.
+ *
+ * Every function other than IrpBatchInitialise and IrpBatchFree may be called
+ * at IRQL <= DISPATCH_LEVEL.
+ */
+#define IRP_BATCH_RING_CAPACITY 1024
+
+typedef struct _IRP_BATCH_QUEUE {
+    IO_CSQ     csq;
+    LIST_ENTRY irps;
+    KSPIN_LOCK lock;
+
+    volatile LONG irp_count;
+
+    RTL_RING reports;
+
+    /* > `drainer`:
+     *   - draining is set while a caller is moving reports into requests.
+     *   - carry is a report taken from the ring but not yet returned, and
+     *     sequence the sequence of the next record. Both are only accessed by
+     *     the drainer. */
+    volatile LONG  draining;
+    RTL_RING_ENTRY carry;
+    UINT64         sequence;
+
+    /* > `counters`:
+     *   - deferred is the number of reports scheduled while no request was
+     *     pending, which should stay close to 0 under normal load.
+     *   - dropped is the number of reports discarded, either since the ring
+     *     was full or the report could never fit a request. */
+    volatile LONG64 reports_completed;
+    volatile LONG64 irps_completed;
+    volatile LONG64 reports_deferred;
+    volatile LONG64 reports_dropped;
+
+    volatile BOOLEAN active;
+
+} IRP_BATCH_QUEUE, *PIRP_BATCH_QUEUE;
+
+typedef struct _IRP_BATCH_STATISTICS {
+    UINT32 irps_pending;
+    UINT32 reports_queued;
+    UINT64 reports_completed;
+    UINT64 irps_completed;
+    UINT64 reports_deferred;
+    UINT64 reports_dropped;
+
+} IRP_BATCH_STATISTICS, *PIRP_BATCH_STATISTICS;
+
+NTSTATUS
+IrpBatchInitialise();
+
+VOID
+IrpBatchFree();
+
+NTSTATUS
+IrpBatchQueueIrp(_Inout_ PIRP Irp);
+
+VOID
+IrpBatchSchedulePacket(_In_ PVOID Buffer, _In_ UINT32 BufferLength);
+
+VOID
+IrpBatchQueryStatistics(_Out_ PIRP_BATCH_STATISTICS Statistics);
+
+#endif
@@ -8,23 +8,116 @@
  * entrys data. */
 typedef struct _RTL_HASHMAP_ENTRY {
     LIST_ENTRY entry;
-    UINT32     in_use;
-    CHAR       object[];
+
+    /* index passed on insertion, used to rehash resizable maps */
+    UINT32                 hash;
+    DECLSPEC_ALIGN(8) CHAR object[];
 } RTL_HASHMAP_ENTRY, *PRTL_HASHMAP_ENTRY;
 
+/*
+ * Storage used for the buckets. With chained storage each bucket is a list of
+ * pool allocated entries. With open addressed storage each bucket is a group of
+ * RTL_HASHMAP_GROUP_SLOTS objects stored inline in the bucket array, alongside
+ * a bitmask of the occupied slots. Probing is confined to the keys home group,
+ * which means the per bucket locking scheme is unchanged. Should a group become
+ * full, further entries overflow into a chained list belonging to the group.
+ *
+ * Objects stored inline are never moved once inserted, so pointers returned by
+ * the hashmap remain stable for both storage types.
+ */
+typedef enum _RTL_HASHMAP_STORAGE {
+    HashmapStorageChained = 0,
+    HashmapStorageOpenAddressed
+
+} RTL_HASHMAP_STORAGE;
+
+#define RTL_HASHMAP_GROUP_SLOTS     4
+#define RTL_HASHMAP_GROUP_FULL_MASK ((1ul << RTL_HASHMAP_GROUP_SLOTS) - 1)
+
+typedef struct _RTL_HASHMAP_GROUP {
+    /* entries that did not fit in the inline slots */
+    LIST_ENTRY overflow;
+
+    /* bit n is set if slot n is in use */
+    UINT32 occupied;
+
+    /* RTL_HASHMAP_GROUP_SLOTS objects, each of RTL_HASHMAP::slot_size */
+    DECLSPEC_ALIGN(8) CHAR slots[];
+
+} RTL_HASHMAP_GROUP, *PRTL_HASHMAP_GROUP;
+
+/*
+ * Buckets share a fixed number of lock stripes, bucket n being protected by
+ * stripe n % lock_stripes. Since two buckets may map to the same stripe, a
+ * caller must never hold more than one bucket lock at a time. Each stripe is
+ * padded to its own cache line to avoid false sharing between stripes.
+ */
+#define RTL_HASHMAP_DEFAULT_LOCK_STRIPES 64
+
+typedef struct _RTL_HASHMAP_LOCK {
+    DECLSPEC_CACHEALIGN KGUARDED_MUTEX lock;
+
+} RTL_HASHMAP_LOCK, *PRTL_HASHMAP_LOCK;
+
+#define RTL_HASHMAP_BITMAP_BITS 32
+
+/*
+ * Resizable maps double their bucket count once the load factor, expressed as
+ * entries per 100 buckets, passes max_load_factor. Rather than rehashing the
+ * whole table at once, old buckets are migrated RTL_HASHMAP_MIGRATION_BATCH at
+ * a time by each acquisition of the stripe they belong to, and by releases
+ * helping idle stripes along.
+ *
+ * Resizable maps must use chained storage since inline objects would have to
+ * move. Both the bucket and stripe counts are rounded to powers of two, which
+ * keeps a keys stripe the same across a resize. The hash function should
+ * return a full 32 bit hash rather than an index, it is mixed and masked by
+ * the map itself.
+ */
+#define RTL_HASHMAP_DEFAULT_MAX_LOAD_FACTOR 200
+#define RTL_HASHMAP_MIGRATION_BATCH         2
+#define RTL_HASHMAP_MAX_BUCKET_COUNT        0x40000000
+
+typedef struct _RTL_HASHMAP_CONFIGURATION {
+    RTL_HASHMAP_STORAGE storage;
+
+    /* 0 selects min(BucketCount, RTL_HASHMAP_DEFAULT_LOCK_STRIPES) */
+    UINT32 lock_stripes;
+
+    BOOLEAN resizable;
+
+    /* 0 selects RTL_HASHMAP_DEFAULT_MAX_LOAD_FACTOR */
+    UINT32 max_load_factor;
+
+} RTL_HASHMAP_CONFIGURATION, *PRTL_HASHMAP_CONFIGURATION;
+
 typedef UINT32 (*HASH_FUNCTION)(_In_ UINT64 Key);
 
 /* Struct1 being the node being compared to the value in Struct 2*/
 typedef BOOLEAN (*COMPARE_FUNCTION)(_In_ PVOID Struct1, _In_ PVOID Struct2);
 
 typedef struct _RTL_HASHMAP {
-    /* Array of RTL_HASHMAP_ENTRIES with length = bucket_count */
+    /* Array of RTL_HASHMAP_ENTRIES with length = bucket_count, chained only */
     PRTL_HASHMAP_ENTRY buckets;
 
-    /* per bucket locks */
-    PKGUARDED_MUTEX locks;
+    /* Array of groups each of group_size with length = bucket_count, open
+     * addressed only */
+    PRTL_HASHMAP_GROUP groups;
+    RTL_HASHMAP_STORAGE storage;
+    UINT32              slot_size;
+    UINT32              group_size;
+
+    /* lock stripes, see RTL_HASHMAP_LOCK */
+    PRTL_HASHMAP_LOCK locks;
+    UINT32            lock_stripes;
+
+    /* bit n is set while bucket n holds at least one entry. Bits are updated
+     * under the buckets lock, but a word is shared between stripes so all
+     * updates are interlocked. */
+    volatile LONG* occupancy;
 
-    /* Number of buckets, ideally a prime number */
+    /* Number of buckets, ideally a prime number, or a power of two for
+     * resizable maps */
     UINT32 bucket_count;
 
     /* Size of each custom object existing after the RTL_HASHMAP_ENTRY */
@@ -41,8 +134,40 @@ typedef struct _RTL_HASHMAP {
     PVOID           context;
     volatile UINT32 active;
 
+    /* number of live entries, across all stripes */
+    volatile LONG entry_count;
+
+    /* > `resize state`:
+     *   - resize_lock is held exclusive while the tables are swapped, and
+     *     shared by enumeration so the tables cannot change beneath it.
+     *   - old_buckets is non NULL while a resize is in progress.
+     *   - migration_cursors[n] is the number of old buckets belonging to
+     *     stripe n that have been migrated, updated under that stripes
+     *     lock. */
+    BOOLEAN            resizable;
+    UINT32             max_load_factor;
+    UINT32             resize_count;
+    EX_PUSH_LOCK       resize_lock;
+    volatile LONG      resize_pending;
+    PRTL_HASHMAP_ENTRY old_buckets;
+    volatile LONG*     old_occupancy;
+    UINT32             old_bucket_count;
+    PUINT32            migration_cursors;
+    volatile LONG      migration_remaining;
+    volatile LONG      helper_stripe;
+
 } RTL_HASHMAP, *PRTL_HASHMAP;
 
+typedef struct _RTL_HASHMAP_STATISTICS {
+    UINT32  bucket_count;
+    UINT32  entry_count;
+    UINT32  load_factor;
+    UINT32  longest_chain;
+    UINT32  resize_count;
+    BOOLEAN resizable;
+
+} RTL_HASHMAP_STATISTICS, *PRTL_HASHMAP_STATISTICS;
+
 typedef VOID (*ENUMERATE_HASHMAP)(_In_ PRTL_HASHMAP_ENTRY Entry,
                                   _In_opt_ PVOID          Context);
 
@@ -57,6 +182,15 @@ RtlHashmapCreate(_In_ UINT32           BucketCount,
                  _In_opt_ PVOID        Context,
                  _Out_ PRTL_HASHMAP    Hashmap);
 
+NTSTATUS
+RtlHashmapCreateEx(_In_ UINT32                         BucketCount,
+                   _In_ UINT32                         EntryObjectSize,
+                   _In_ HASH_FUNCTION                  HashFunction,
+                   _In_ COMPARE_FUNCTION               CompareFunction,
+                   _In_opt_ PVOID                      Context,
+                   _In_opt_ PRTL_HASHMAP_CONFIGURATION Configuration,
+                   _Out_ PRTL_HASHMAP                  Hashmap);
+
 PVOID
 RtlHashmapEntryInsert(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index);
 
@@ -88,4 +222,11 @@ RtlHashmapReleaseBucket(_Inout_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index);
 VOID
 RtlHashmapSetInactive(_Inout_ PRTL_HASHMAP Hashmap);
 
+VOID
+RtlHashmapQueryStatistics(_In_ PRTL_HASHMAP             Hashmap,
+                          _Out_ PRTL_HASHMAP_STATISTICS Statistics);
+
+VOID
+RtlHashmapPrintCurrentStatistics(_In_ PRTL_HASHMAP Hashmap);
+
 #endif
\ No newline at end of file
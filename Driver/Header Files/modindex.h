@@ -0,0 +1,94 @@
+#ifndef MODINDEX_H
+#define MODINDEX_H
+
+#include "common.h"
+#include "modules.h"
+
+/*
+ * An immutable snapshot of every loaded modules [base, end) range sorted by
+ * base, answering "which module contains this address" with a binary search
+ * rather than a walk of the driver list under its lock.
+ *
+ * Snapshots are never modified once published. A writer copies the current
+ * snapshot, applies its change and publishes the copy with a pointer swap,
+ * after which the previous snapshot is freed once no reader can still hold
+ * it. Readers never block, so lookups are safe at any IRQL, including from
+ * DPCs and NMI callbacks.
+ *
+ * Readers register against the current epoch, of which only two are tracked.
+ * Writers publish under the lock and retire the previous snapshot. Once the
+ * lock is released the writer advances the epoch and waits for the readers of
+ * the previous epoch to drain, as only they can have observed a retired
+ * snapshot, then frees it. The waits are serialised by their own lock, so a
+ * preempted reader holds up only the reclaim and not the next publish.
+ */
+#define MODULE_INDEX_DRAIN_INTERVAL (MILLISECONDS(1))
+
+typedef struct _MODULE_INDEX_RANGE {
+    UINT64 base;
+    UINT64 end;
+
+} MODULE_INDEX_RANGE, *PMODULE_INDEX_RANGE;
+
+typedef struct _MODULE_INDEX_SNAPSHOT {
+    UINT32                         count;
+    UINT32                         capacity;
+    struct _MODULE_INDEX_SNAPSHOT* retired;
+    MODULE_INDEX_RANGE             ranges[];
+
+} MODULE_INDEX_SNAPSHOT, *PMODULE_INDEX_SNAPSHOT;
+
+typedef struct _MODULE_INDEX {
+    volatile BOOLEAN active;
+
+    PMODULE_INDEX_SNAPSHOT volatile current;
+
+    DECLSPEC_CACHEALIGN volatile LONG epoch;
+    volatile LONG                     readers[2];
+
+    /* serialises writers, readers never take it */
+    KGUARDED_MUTEX lock;
+
+    /* snapshots replaced but not yet freed, protected by the lock */
+    PMODULE_INDEX_SNAPSHOT retired;
+
+    /* serialises advancing the epoch and waiting for it to drain */
+    KGUARDED_MUTEX reclaim_lock;
+
+    volatile LONG64 generation;
+
+} MODULE_INDEX, *PMODULE_INDEX;
+
+/* Returned by ModuleIndexAcquireSnapshot, to be passed to the release. */
+typedef LONG MODULE_INDEX_READ_TOKEN, *PMODULE_INDEX_READ_TOKEN;
+
+NTSTATUS
+ModuleIndexInitialise(_In_ PSYSTEM_MODULES Modules);
+
+VOID
+ModuleIndexFree();
+
+NTSTATUS
+ModuleIndexRebuild(_In_ PSYSTEM_MODULES Modules);
+
+NTSTATUS
+ModuleIndexInsertModule(_In_ PVOID ImageBase, _In_ UINT32 ImageSize);
+
+PMODULE_INDEX_SNAPSHOT
+ModuleIndexAcquireSnapshot(_Out_ PMODULE_INDEX_READ_TOKEN Token);
+
+VOID
+ModuleIndexReleaseSnapshot(_In_ MODULE_INDEX_READ_TOKEN Token);
+
+PMODULE_INDEX_RANGE
+ModuleIndexSnapshotFindRange(_In_ PMODULE_INDEX_SNAPSHOT Snapshot,
+                             _In_ UINT64                 Address);
+
+BOOLEAN
+ModuleIndexFindModule(_In_ UINT64                Address,
+                      _Out_opt_ PMODULE_INDEX_RANGE Range);
+
+BOOLEAN
+ModuleIndexIsAddressBacked(_In_ UINT64 Address);
+
+#endif
@@ -22,10 +22,18 @@ typedef struct _SYSTEM_MODULES {
 #define APC_CONTEXT_ID_STACKWALK 0x1
 #define APC_CONTEXT_ID_STARTADDRESS 0x2
 
+/*
+ * Context ids double as the index of the contexts slot within the apc context
+ * array, so must be less than MAXIMUM_APC_CONTEXTS.
+ */
 typedef struct _APC_CONTEXT_HEADER {
     LONG     context_id;
     volatile INT count;
     volatile INT allocation_in_progress;
 
+    /* KAPC objects for this context, initialised by InsertApcContext */
+    LOOKASIDE_LIST_EX apc_pool;
+
 } APC_CONTEXT_HEADER, *PAPC_CONTEXT_HEADER;
 
+#endif
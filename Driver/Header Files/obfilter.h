@@ -0,0 +1,100 @@
+#ifndef OBFILTER_H
+#define OBFILTER_H
+
+#include "common.h"
+
+/*
+ * The handle operation callbacks run for every process and thread handle
+ * opened on the system, nearly all of which target processes other than the
+ * one we protect. The protected process and the requesters permitted full
+ * access are published as a sequence counted snapshot, so operations on any
+ * other process are dismissed with a single pointer comparison without
+ * taking a lock.
+ *
+ * Operations on the protected process consult a small per processor cache of
+ * verdicts, keyed by the requester and tagged with the snapshot sequence, so
+ * the verdict of a requester is only computed by the slow path once per
+ * snapshot. Publishing or invalidating advances the sequence, discarding
+ * every cached verdict at once.
+ */
+#define OB_FILTER_MAX_ALLOWED     8
+#define OB_FILTER_CACHE_ENTRIES   16
+
+typedef enum _OB_FILTER_VERDICT {
+    ObFilterAllow = 0,
+    ObFilterStrip
+
+} OB_FILTER_VERDICT;
+
+typedef OB_FILTER_VERDICT (*OB_FILTER_SLOW_PATH)(_In_ PEPROCESS Requester,
+                                                 _In_ PEPROCESS Target);
+
+/*
+ * The sequence is odd while the writer is updating the snapshot. Readers
+ * retry if the sequence was odd, or changed while they were reading.
+ */
+typedef struct _OB_FILTER_SNAPSHOT {
+    volatile LONG64      sequence;
+    PEPROCESS volatile   protected_process;
+    UINT32               allowed_count;
+    PEPROCESS            allowed[OB_FILTER_MAX_ALLOWED];
+
+} OB_FILTER_SNAPSHOT, *POB_FILTER_SNAPSHOT;
+
+typedef struct _OB_FILTER_CACHE_ENTRY {
+    PEPROCESS         requester;
+    HANDLE            requester_id;
+    LONG64            sequence;
+    OB_FILTER_VERDICT verdict;
+
+} OB_FILTER_CACHE_ENTRY, *POB_FILTER_CACHE_ENTRY;
+
+/* Only accessed at DISPATCH_LEVEL on its own processor. */
+typedef struct _OB_FILTER_CPU_CACHE {
+    OB_FILTER_CACHE_ENTRY entries[OB_FILTER_CACHE_ENTRIES];
+    UINT64                hits;
+    UINT64                misses;
+
+} DECLSPEC_CACHEALIGN OB_FILTER_CPU_CACHE, *POB_FILTER_CPU_CACHE;
+
+typedef struct _OB_FILTER {
+    volatile BOOLEAN     active;
+    OB_FILTER_SNAPSHOT   snapshot;
+    UINT32               processor_count;
+    POB_FILTER_CPU_CACHE caches;
+
+    /* serialises writers, readers never take it */
+    KGUARDED_MUTEX lock;
+
+} OB_FILTER, *POB_FILTER;
+
+typedef struct _OB_FILTER_STATISTICS {
+    UINT64 sequence;
+    UINT64 hits;
+    UINT64 misses;
+
+} OB_FILTER_STATISTICS, *POB_FILTER_STATISTICS;
+
+NTSTATUS
+ObFilterInitialise();
+
+VOID
+ObFilterFree();
+
+NTSTATUS
+ObFilterPublish(_In_opt_ PEPROCESS                     ProtectedProcess,
+                _In_reads_opt_(AllowedCount) PEPROCESS* Allowed,
+                _In_ UINT32                             AllowedCount);
+
+VOID
+ObFilterInvalidateCache();
+
+OB_FILTER_VERDICT
+ObFilterQuery(_In_ PEPROCESS           Requester,
+              _In_ PEPROCESS           Target,
+              _In_ OB_FILTER_SLOW_PATH SlowPath);
+
+VOID
+ObFilterQueryStatistics(_Out_ POB_FILTER_STATISTICS Statistics);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef PAGESCAN_H
+#define PAGESCAN_H
+
+#include "common.h"
+#include "pool.h"
+
+/*
+ * System space is swept by walking the paging structures of its upper half
+ * rather than probing every page. PML4 and PDPT entries that are not present
+ * skip an entire 512 GiB or 1 GiB region at once, and large pages are passed
+ * to the callback as a single 1 GiB or 2 MiB page.
+ *
+ * The sweep is divided into 2 MiB units, claimed in order from a shared cursor
+ * by PAGE_SCAN_THREAD_COUNT work items alongside the calling thread. No unit
+ * is claimed once the time budget has elapsed, and the cursor is kept across
+ * runs, so a sweep spans as many runs as it needs to.
+ *
+ * The callback is invoked concurrently from each thread and returns FALSE to
+ * end the sweep early.
+ */
+#define PAGE_SCAN_THREAD_COUNT 4
+
+/* 256 PML4 entries of kernel space with 512 * 512 2 MiB units each */
+#define PAGE_SCAN_UNITS_PER_PDPTE 512ull
+#define PAGE_SCAN_UNITS_PER_PML4E (512ull * PAGE_SCAN_UNITS_PER_PDPTE)
+#define PAGE_SCAN_UNIT_COUNT      (256ull * PAGE_SCAN_UNITS_PER_PML4E)
+
+/* 10 milliseconds in 100ns units */
+#define PAGE_SCAN_DEFAULT_BUDGET (10ull * 1000 * 10)
+
+typedef struct _PAGE_SCAN_CONTEXT {
+    /* next unit of the sweep, kept across runs */
+    DECLSPEC_CACHEALIGN volatile LONG64 cursor;
+
+    /* Stores the number of actively executing worker threads */
+    DECLSPEC_CACHEALIGN volatile LONG active_thread_count;
+
+    /* set once the callback has ended the sweep */
+    volatile LONG stop;
+
+    /* interrupt time after which no further unit is claimed */
+    UINT64 deadline;
+
+    /* physical address of the PML4 being walked */
+    UINT64 pml4;
+
+    PAGE_CALLBACK callback;
+    PVOID         callback_context;
+
+    KEVENT workers_complete;
+
+    /* array of pointers to work items, used to free work items when
+     * complete */
+    PIO_WORKITEM work_items[PAGE_SCAN_THREAD_COUNT];
+
+    UINT64          sweeps;
+    volatile LONG64 pages;
+    volatile LONG64 units;
+
+} PAGE_SCAN_CONTEXT, *PPAGE_SCAN_CONTEXT;
+
+VOID
+PageScanInitialise(_Out_ PPAGE_SCAN_CONTEXT Context);
+
+NTSTATUS
+PageScanRun(_Inout_ PPAGE_SCAN_CONTEXT Context,
+            _In_ PAGE_CALLBACK         Callback,
+            _In_opt_ PVOID             CallbackContext,
+            _In_ UINT64                Budget,
+            _Out_ PBOOLEAN             Complete);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include "../common.h"
+
+/*
+ * A signature compiled once into a form suited to repeated scanning. Bytes
+ * whose mask is 0 are wildcards. The two rarest exact bytes, according to a
+ * rough frequency table for x64 code, are chosen as anchors. Scanning first
+ * compares 32 candidate positions at a time against both anchors, and only
+ * positions matching both are verified against the full pattern.
+ */
+#define PATTERN_MAX_LENGTH 64
+
+#define PATTERN_MASK_WILDCARD '?'
+
+typedef struct _COMPILED_PATTERN {
+    UINT32 length;
+    UINT32 anchor_offset[2];
+    UCHAR  anchor_byte[2];
+    UCHAR  bytes[PATTERN_MAX_LENGTH];
+    UCHAR  mask[PATTERN_MAX_LENGTH];
+
+} COMPILED_PATTERN, *PCOMPILED_PATTERN;
+
+/* Number of bytes scanned for each pattern in turn, a cache line, so the
+ * patterns after the first compare against a line the first just loaded. */
+#define PATTERN_SCAN_STEP 64
+
+/*
+ * If Mask is NULL, 0x00 bytes within the signature are treated as wildcards,
+ * the same as ScanForSignature. Otherwise Mask must be SignatureLength chars
+ * long with PATTERN_MASK_WILDCARD marking a wildcard, i.e "xx??x".
+ */
+NTSTATUS
+IntCompilePattern(_In_ PCHAR              Signature,
+                  _In_ SIZE_T             SignatureLength,
+                  _In_opt_ PCHAR          Mask,
+                  _Out_ PCOMPILED_PATTERN Pattern);
+
+PVOID
+IntScanForPattern(_In_ PVOID             BaseAddress,
+                  _In_ SIZE_T            Length,
+                  _In_ PCOMPILED_PATTERN Pattern);
+
+/*
+ * Finds the first occurrence of each pattern in a single pass over the region.
+ * Results[n] receives the address of the first match of Patterns[n], or NULL.
+ * Returns the number of patterns found.
+ */
+UINT32
+IntScanForPatterns(_In_ PVOID                          BaseAddress,
+                   _In_ SIZE_T                         Length,
+                   _In_reads_(Count) PCOMPILED_PATTERN Patterns,
+                   _In_ UINT32                         Count,
+                   _Out_writes_(Count) PVOID*          Results);
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef PCIDEV_H
+#define PCIDEV_H
+
+#include "common.h"
+
+/*
+ * Rather than reading the configuration space of every device on each
+ * validation, the devices found are kept in a table sorted by their
+ * segment, bus, device and function along with their verdict. The table is
+ * only rescanned when a PnP notification has been received, and a rescan only
+ * visits the root buses previously populated and the buses reachable from
+ * them through bridges. A verdict is carried over from the previous scan for
+ * a function whose identifiers are unchanged.
+ *
+ * Configuration space is read through the memory mapped ECAM regions
+ * described by the ACPI MCFG table, mapping the 1MiB region of a bus once
+ * per scan rather than once per read. Every full_interval every bus of every
+ * region is walked regardless, catching a device on a bus not reachable
+ * through a bridge.
+ */
+
+#define PCI_ACPI_PROVIDER_SIGNATURE 'ACPI'
+#define PCI_MCFG_TABLE_SIGNATURE    'GFCM'
+
+#define PCI_ECAM_BUS_SHIFT      20
+#define PCI_ECAM_DEVICE_SHIFT   15
+#define PCI_ECAM_FUNCTION_SHIFT 12
+#define PCI_ECAM_BUS_SIZE       (1ul << PCI_ECAM_BUS_SHIFT)
+
+#define PCI_MAX_BUSES     256
+#define PCI_MAX_DEVICES   32
+#define PCI_MAX_FUNCTIONS 8
+
+#define PCI_CONFIG_ID_OFFSET         0x00
+#define PCI_CONFIG_CLASS_OFFSET      0x08
+#define PCI_CONFIG_HEADER_OFFSET     0x0C
+#define PCI_CONFIG_BRIDGE_BUS_OFFSET 0x18
+
+#define PCI_INVALID_VENDOR_ID         0xFFFF
+#define PCI_HEADER_TYPE_MASK          0x7F
+#define PCI_HEADER_TYPE_BRIDGE        0x01
+#define PCI_HEADER_TYPE_MULTIFUNCTION 0x80
+
+#define PCI_DEVICE_KEY(segment, bus, device, function)                    \
+    (((UINT32)(segment) << 16) | ((UINT32)(bus) << 8) |                   \
+     ((UINT32)(device) << 3) | (UINT32)(function))
+
+#define PCI_DEVICE_KEY_BUS(key) (((key) >> 8) & 0xFF)
+
+#define PCI_DEVICE_TABLE_INITIAL_CAPACITY 128
+
+/* 10 minutes in 100ns units */
+#define PCI_DEVICE_DEFAULT_FULL_INTERVAL (10ull * 60 * 1000 * 1000 * 10)
+
+#pragma pack(push, 1)
+
+typedef struct _PCI_MCFG_ALLOCATION {
+    UINT64 base_address;
+    UINT16 segment;
+    UINT8  start_bus;
+    UINT8  end_bus;
+    UINT32 reserved;
+
+} PCI_MCFG_ALLOCATION, *PPCI_MCFG_ALLOCATION;
+
+typedef struct _PCI_MCFG_TABLE {
+    UINT32              signature;
+    UINT32              length;
+    UINT8               revision;
+    UINT8               checksum;
+    CHAR                oem_id[6];
+    CHAR                oem_table_id[8];
+    UINT32              oem_revision;
+    UINT32              creator_id;
+    UINT32              creator_revision;
+    UINT64              reserved;
+    PCI_MCFG_ALLOCATION allocations[];
+
+} PCI_MCFG_TABLE, *PPCI_MCFG_TABLE;
+
+#pragma pack(pop)
+
+typedef enum _PCI_DEVICE_VERDICT {
+    PciDeviceVerdictClean = 0,
+    PciDeviceVerdictBlacklisted
+
+} PCI_DEVICE_VERDICT;
+
+typedef struct _PCI_DEVICE_ENTRY {
+    UINT32             key;
+    UINT16             vendor_id;
+    UINT16             device_id;
+    UINT32             class_revision;
+    UINT8              header_type;
+    PCI_DEVICE_VERDICT verdict;
+
+} PCI_DEVICE_ENTRY, *PPCI_DEVICE_ENTRY;
+
+typedef struct _PCI_DEVICE_ARRAY {
+    PPCI_DEVICE_ENTRY entries;
+    UINT32            count;
+    UINT32            capacity;
+
+} PCI_DEVICE_ARRAY, *PPCI_DEVICE_ARRAY;
+
+typedef struct _PCI_DEVICE_STATISTICS {
+    UINT64 validations;
+    UINT64 scans;
+    UINT64 full_scans;
+    UINT64 buses_mapped;
+    UINT64 functions_read;
+    UINT64 verdicts_reused;
+    UINT32 device_count;
+    UINT32 blacklisted_count;
+
+} PCI_DEVICE_STATISTICS, *PPCI_DEVICE_STATISTICS;
+
+typedef struct _PCI_DEVICE_TABLE {
+    volatile BOOLEAN active;
+
+    /* ecam allocations of the mcfg table, sorted by segment and bus */
+    PPCI_MCFG_ALLOCATION allocations;
+    UINT32               allocation_count;
+
+    /* sorted by key */
+    PCI_DEVICE_ARRAY devices;
+
+    /* set from a PnP notification */
+    volatile LONG rescan_pending;
+
+    UINT64 full_interval;
+    UINT64 last_full_scan;
+
+    PCI_DEVICE_STATISTICS statistics;
+    KGUARDED_MUTEX        lock;
+
+} PCI_DEVICE_TABLE, *PPCI_DEVICE_TABLE;
+
+VOID
+PciDeviceTableInitialiseLock();
+
+NTSTATUS
+PciDeviceTableInitialise();
+
+VOID
+PciDeviceTableFree();
+
+VOID
+PciDeviceTableRequestRescan();
+
+VOID
+PciDeviceTableSetFullInterval(_In_ UINT64 Interval);
+
+NTSTATUS
+PciDeviceTableValidate();
+
+VOID
+PciDeviceTableQueryStatistics(_Out_ PPCI_DEVICE_STATISTICS Statistics);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "common.h"
+#include "types/types.h"
+
+#include <intrin.h>
+
+/*
+ * Every check, callback routine and container operation records its duration
+ * in TSC ticks, and optionally the bytes it scanned, against a
+ * PERF_COUNTER_ID. Counters are kept per processor so recording is a handful
+ * of unsynchronised increments at DISPATCH_LEVEL, and are only merged when
+ * queried.
+ *
+ * Durations are additionally counted in a histogram of PERF_HISTOGRAM_BUCKETS
+ * log-linear buckets, each power of two split into
+ * PERF_HISTOGRAM_SUB_BUCKETS, from which the 99th percentile is estimated.
+ * Durations beyond the last bucket, around 2^33 ticks, are counted in it.
+ */
+#define PERF_HISTOGRAM_SUB_BUCKET_SHIFT 2
+#define PERF_HISTOGRAM_SUB_BUCKETS      (1 << PERF_HISTOGRAM_SUB_BUCKET_SHIFT)
+#define PERF_HISTOGRAM_BUCKETS          128
+
+typedef struct _PERF_COUNTER {
+    UINT64 invocations;
+    UINT64 total_ticks;
+    UINT64 min_ticks;
+    UINT64 max_ticks;
+    UINT64 bytes;
+    UINT32 histogram[PERF_HISTOGRAM_BUCKETS];
+
+} PERF_COUNTER, *PPERF_COUNTER;
+
+/* Only written at DISPATCH_LEVEL on its own processor. */
+typedef struct _PERF_CPU_COUNTERS {
+    PERF_COUNTER counters[PerfCounterMax];
+
+} DECLSPEC_CACHEALIGN PERF_CPU_COUNTERS, *PPERF_CPU_COUNTERS;
+
+typedef struct _PERF_COUNTERS {
+    volatile BOOLEAN   active;
+    UINT32             processor_count;
+    PPERF_CPU_COUNTERS processors;
+
+    UINT64 start_tsc;
+    UINT64 start_interrupt_time;
+
+} PERF_COUNTERS, *PPERF_COUNTERS;
+
+/* Returns the start of a duration to be passed to PerfRecord. */
+FORCEINLINE
+UINT64
+PerfBegin()
+{
+    return __rdtsc();
+}
+
+NTSTATUS
+PerfCountersInitialise();
+
+VOID
+PerfCountersFree();
+
+VOID
+PerfRecord(_In_ PERF_COUNTER_ID Id, _In_ UINT64 Start, _In_ UINT64 Bytes);
+
+VOID
+PerfQueryStatistics(_Out_ PPERF_STATISTICS Statistics);
+
+NTSTATUS
+PerfQueryStatisticsIrp(_Inout_ PIRP Irp);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef PROCMOD_H
+#define PROCMOD_H
+
+#include "common.h"
+
+/*
+ * A PROCESS_MODULE_ARRAY holds the loaded modules of a process sorted by base
+ * address, so checking whether a user address lies within a module is a
+ * binary search rather than a walk of a list. It takes the place of the
+ * module_list of PROCESS_LIST_ENTRY once the image load callbacks insert into
+ * it, and is then protected by the process hashmap bucket lock of the owning
+ * process. Until then the entry carries only the list.
+ *
+ * Most processes load the same system DLLs, so rather than each module storing
+ * a MAX_MODULE_PATH buffer, paths are interned once in a shared table and
+ * modules refer to them by id. Paths are never removed from the table, so an
+ * id remains valid until the table is freed and can be resolved without a
+ * lock. Once the table holds PROCESS_MODULE_PATH_MAX_COUNT paths, or a path
+ * cannot be interned, the module keeps a private copy of its path instead, so
+ * a module path should always be read via ProcessModuleGetModulePath.
+ */
+#define PROCESS_MODULE_PATH_INVALID MAXUINT32
+
+#define PROCESS_MODULE_PATH_CHUNK_SIZE  512
+#define PROCESS_MODULE_PATH_CHUNK_COUNT 64
+#define PROCESS_MODULE_PATH_MAX_COUNT \
+    (PROCESS_MODULE_PATH_CHUNK_SIZE * PROCESS_MODULE_PATH_CHUNK_COUNT)
+
+#define PROCESS_MODULE_PATH_ARENA_SIZE    0x10000
+#define PROCESS_MODULE_PATH_INDEX_INITIAL 1024
+
+#define PROCESS_MODULE_ARRAY_INITIAL_CAPACITY 32
+
+typedef struct _PROCESS_MODULE_PATH {
+    UINT32 hash;
+    UINT16 length;
+
+    /* null terminated */
+    CHAR string[];
+
+} PROCESS_MODULE_PATH, *PPROCESS_MODULE_PATH;
+
+typedef struct _PROCESS_MODULE_PATH_ARENA {
+    struct _PROCESS_MODULE_PATH_ARENA* next;
+    UINT32                             used;
+    DECLSPEC_ALIGN(8) CHAR             data[];
+
+} PROCESS_MODULE_PATH_ARENA, *PPROCESS_MODULE_PATH_ARENA;
+
+typedef struct _PROCESS_MODULE_PATH_TABLE {
+    volatile BOOLEAN active;
+
+    /* chunks of id to path mappings, allocated as ids are assigned. A chunk
+     * is published before the count covering its ids. */
+    PPROCESS_MODULE_PATH* volatile chunks[PROCESS_MODULE_PATH_CHUNK_COUNT];
+    volatile LONG                  count;
+
+    /* open addressed index of ids by path hash, 0 being an empty slot and id
+     * n being stored as n + 1. Only used while holding the lock. */
+    PUINT32 index;
+    UINT32  index_capacity;
+
+    PPROCESS_MODULE_PATH_ARENA arenas;
+
+    /* serialises interning, resolving an id never takes it */
+    KGUARDED_MUTEX lock;
+
+} PROCESS_MODULE_PATH_TABLE, *PPROCESS_MODULE_PATH_TABLE;
+
+/* Returning TRUE ends the enumeration. */
+typedef BOOLEAN (*PROCESS_MODULE_ARRAY_CALLBACK)(_In_ PPROCESS_MODULE Module,
+                                                 _In_opt_ PVOID Context);
+
+NTSTATUS
+ProcessModulePathTableInitialise();
+
+VOID
+ProcessModulePathTableFree();
+
+NTSTATUS
+ProcessModuleInternPath(_In_ PCHAR Path, _Out_ PUINT32 PathId);
+
+PCHAR
+ProcessModuleGetPath(_In_ UINT32 PathId);
+
+PCHAR
+ProcessModuleGetModulePath(_In_ PPROCESS_MODULE Module);
+
+VOID
+ProcessModuleArrayInitialise(_Out_ PPROCESS_MODULE_ARRAY Array);
+
+VOID
+ProcessModuleArrayFree(_Inout_ PPROCESS_MODULE_ARRAY Array);
+
+NTSTATUS
+ProcessModuleArrayInsert(_Inout_ PPROCESS_MODULE_ARRAY Array,
+                         _In_ UINT64                   Base,
+                         _In_ UINT32                   Size,
+                         _In_ PCHAR                    Path);
+
+PPROCESS_MODULE
+ProcessModuleArrayFind(_In_ PPROCESS_MODULE_ARRAY Array, _In_ UINT64 Address);
+
+PPROCESS_MODULE
+ProcessModuleArrayFindByPath(_In_ PPROCESS_MODULE_ARRAY Array,
+                             _In_ PCHAR                 Path);
+
+VOID
+ProcessModuleArrayEnumerate(_In_ PPROCESS_MODULE_ARRAY         Array,
+                            _In_ PROCESS_MODULE_ARRAY_CALLBACK Callback,
+                            _In_opt_ PVOID                     Context);
+
+#endif
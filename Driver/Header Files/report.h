@@ -0,0 +1,90 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include "common.h"
+
+/*
+ * Reports that fire repeatedly for the same cause, i.e handle operations on
+ * the protected process from the same offender, are coalesced before being
+ * built. The first occurrence of a key is always reported. Repeats within
+ * REPORT_COALESCE_WINDOW of it are counted rather than reported, and once the
+ * window closes a single COALESCED_REPORT carrying the count and the first and
+ * last timestamps is sent instead.
+ *
+ * Keys are held in a fixed table of REPORT_COALESCE_ENTRY_COUNT entries, the
+ * least recently seen being evicted (and its summary sent) when a new key
+ * arrives and the table is full. Nothing is allocated once initialised.
+ */
+#define REPORT_COALESCE_ENTRY_COUNT  128
+#define REPORT_COALESCE_BUCKET_COUNT 64
+
+/* 10 seconds in 100ns units */
+#define REPORT_COALESCE_WINDOW (10ull * 1000 * 1000 * 10)
+
+typedef struct _REPORT_COALESCE_KEY {
+    UINT32 report_code;
+    UINT32 report_sub_type;
+
+    /* report specific, i.e a process id and an address */
+    UINT64 subject[2];
+
+} REPORT_COALESCE_KEY, *PREPORT_COALESCE_KEY;
+
+typedef struct _REPORT_COALESCE_ENTRY {
+    LIST_ENTRY                     lru_entry;
+    struct _REPORT_COALESCE_ENTRY* bucket_next;
+    REPORT_COALESCE_KEY            key;
+    BOOLEAN                        in_use;
+    UINT32                         suppressed_count;
+
+    /* interrupt time the window opened, for measuring the window */
+    UINT64 window_start;
+
+    /* system time of the first and last occurrence */
+    UINT64 first_seen;
+    UINT64 last_seen;
+
+} REPORT_COALESCE_ENTRY, *PREPORT_COALESCE_ENTRY;
+
+typedef struct _REPORT_COALESCER {
+    volatile BOOLEAN active;
+    KGUARDED_MUTEX   lock;
+
+    /* most recently seen at the head */
+    LIST_ENTRY             lru;
+    PREPORT_COALESCE_ENTRY buckets[REPORT_COALESCE_BUCKET_COUNT];
+    REPORT_COALESCE_ENTRY  entries[REPORT_COALESCE_ENTRY_COUNT];
+
+    volatile LONG64 reported;
+    volatile LONG64 suppressed;
+    volatile LONG64 summaries;
+
+} REPORT_COALESCER, *PREPORT_COALESCER;
+
+typedef struct _REPORT_COALESCER_STATISTICS {
+    UINT64 reported;
+    UINT64 suppressed;
+    UINT64 summaries;
+
+} REPORT_COALESCER_STATISTICS, *PREPORT_COALESCER_STATISTICS;
+
+VOID
+ReportInitialiseCoalescer();
+
+VOID
+ReportFreeCoalescer();
+
+BOOLEAN
+ReportShouldSchedule(_In_ UINT32 ReportCode,
+                     _In_ UINT32 ReportSubType,
+                     _In_ UINT64 Subject1,
+                     _In_ UINT64 Subject2);
+
+VOID
+ReportFlushCoalescedReports();
+
+VOID
+ReportQueryCoalescerStatistics(
+    _Out_ PREPORT_COALESCER_STATISTICS Statistics);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef RING_H
+#define RING_H
+
+#include "../common.h"
+
+/*
+ * Bounded multi producer, single consumer ring of report descriptors. Slots
+ * are allocated once from non paged pool when the ring is created, so pushing
+ * a report never allocates and never takes a lock, making it safe to call from
+ * any IRQL <= DISPATCH_LEVEL.
+ *
+ * Each slot carries a sequence number. A producer claims the slot at tail by
+ * advancing tail with an interlocked compare exchange once the slots sequence
+ * equals tail, and publishes it by setting the sequence to tail + 1. The
+ * consumer only reads a slot once its sequence shows it has been published,
+ * and releases it for the next lap by setting the sequence to head + capacity.
+ *
+ * When the ring is full the push fails rather than waiting or falling back to
+ * an allocation, the caller is expected to free the report and it is counted
+ * in dropped.
+ */
+#define RTL_RING_DEFAULT_CAPACITY 256
+
+typedef struct _RTL_RING_ENTRY {
+    PVOID  buffer;
+    UINT32 buffer_size;
+
+} RTL_RING_ENTRY, *PRTL_RING_ENTRY;
+
+typedef struct _RTL_RING_SLOT {
+    volatile LONG64 sequence;
+    RTL_RING_ENTRY  entry;
+
+} RTL_RING_SLOT, *PRTL_RING_SLOT;
+
+typedef struct _RTL_RING {
+    /* capacity slots, capacity being a power of two */
+    PRTL_RING_SLOT slots;
+    UINT32         capacity;
+    UINT32         mask;
+
+    /* producers and the consumer write to different cache lines */
+    DECLSPEC_CACHEALIGN volatile LONG64 tail;
+    DECLSPEC_CACHEALIGN volatile LONG64 head;
+
+    /* set while a consumer is draining the ring */
+    volatile LONG consumer_active;
+
+    /* > `counters`:
+     *   - pushed is the total number of entries accepted.
+     *   - dropped is the total number of entries rejected since the ring was
+     *     full.
+     *   - popped is the total number of entries removed by the consumer. */
+    DECLSPEC_CACHEALIGN volatile LONG64 pushed;
+    volatile LONG64                     dropped;
+    volatile LONG64                     popped;
+
+    volatile UINT32 active;
+
+} RTL_RING, *PRTL_RING;
+
+typedef struct _RTL_RING_STATISTICS {
+    UINT32 capacity;
+    UINT32 count;
+    UINT64 pushed;
+    UINT64 dropped;
+    UINT64 popped;
+
+} RTL_RING_STATISTICS, *PRTL_RING_STATISTICS;
+
+/* Ring is caller allocated, a Capacity of 0 selects RTL_RING_DEFAULT_CAPACITY
+ * and any other value is rounded up to a power of two. */
+NTSTATUS
+RtlRingCreate(_In_ UINT32 Capacity, _Out_ PRTL_RING Ring);
+
+/* The ring must be drained, the entries still within it are not freed. */
+VOID
+RtlRingDelete(_In_ PRTL_RING Ring);
+
+BOOLEAN
+RtlRingPush(_In_ PRTL_RING Ring, _In_ PVOID Buffer, _In_ UINT32 BufferSize);
+
+UINT32
+RtlRingPopBatch(_In_ PRTL_RING                    Ring,
+                _Out_writes_(Count) PRTL_RING_ENTRY Entries,
+                _In_ UINT32                         Count);
+
+UINT32
+RtlRingCount(_In_ PRTL_RING Ring);
+
+VOID
+RtlRingQueryStatistics(_In_ PRTL_RING             Ring,
+                       _Out_ PRTL_RING_STATISTICS Statistics);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "common.h"
+#include "io.h"
+
+/*
+ * Rather than running each integrity check to completion when it is
+ * requested, checks are registered with the scheduler and advanced one slice
+ * at a time from the heartbeat work item. A slice is given a deadline and
+ * must return by it, recording where it stopped so the next slice can
+ * resume. A check whose slice reports it complete is next due cadence later.
+ *
+ * Each tick runs at most one slice of every due check, lowest priority value
+ * first, until the tick budget is spent. Checks left over are aged so a low
+ * priority check cannot be starved by higher priority ones.
+ *
+ * Budgets are configured in microseconds, all times are recorded in 100ns
+ * units.
+ */
+#define SCHED_CHECK_COUNT (ssValidateWin32kDispatchTables + 1)
+
+#define SCHED_DEFAULT_TICK_BUDGET_US  2000
+#define SCHED_DEFAULT_SLICE_BUDGET_US 500
+#define SCHED_DEFAULT_PRIORITY        8
+
+/* 30 seconds in 100ns units */
+#define SCHED_DEFAULT_CADENCE (30ull * 1000 * 1000 * 10)
+
+#define SCHED_US_TO_100NS(us) ((UINT64)(us) * 10)
+
+/*
+ * Performs work until the interrupt time reaches Deadline, setting Complete
+ * once the check has finished its cycle. The next slice after completion
+ * begins a new cycle.
+ */
+typedef NTSTATUS (*SCHED_SLICE_ROUTINE)(_In_ UINT64     Deadline,
+                                        _In_opt_ PVOID  Context,
+                                        _Out_ PBOOLEAN Complete);
+
+typedef struct _SCHED_CHECK_STATISTICS {
+    UINT64 slices;
+    UINT64 cycles;
+    UINT64 failures;
+
+    /* slices that returned after their deadline */
+    UINT64 overruns;
+
+    /* ticks the check was due but did not fit within the tick budget */
+    UINT64 deferred;
+
+    UINT64 total_time;
+    UINT64 max_slice_time;
+    UINT64 last_cycle_time;
+
+} SCHED_CHECK_STATISTICS, *PSCHED_CHECK_STATISTICS;
+
+typedef struct _SCHED_CHECK {
+    SCHED_SLICE_ROUTINE routine;
+    PVOID               context;
+
+    /* lower values run first */
+    UINT32 priority;
+    UINT32 slice_budget_us;
+    UINT64 cadence;
+
+    BOOLEAN in_progress;
+    UINT32  age;
+    UINT64  next_due;
+    UINT64  cycle_time;
+
+    SCHED_CHECK_STATISTICS statistics;
+
+} SCHED_CHECK, *PSCHED_CHECK;
+
+typedef struct _SCHED_SCHEDULER {
+    volatile BOOLEAN active;
+
+    /* set while a tick is running, ticks never overlap */
+    volatile LONG running;
+
+    UINT32         tick_budget_us;
+    KGUARDED_MUTEX lock;
+    SCHED_CHECK    checks[SCHED_CHECK_COUNT];
+
+} SCHED_SCHEDULER, *PSCHED_SCHEDULER;
+
+VOID
+SchedInitialise();
+
+VOID
+SchedFree();
+
+NTSTATUS
+SchedRegisterCheck(_In_ SHARED_STATE_OPERATION_ID Id,
+                   _In_ SCHED_SLICE_ROUTINE       Routine,
+                   _In_opt_ PVOID                 Context);
+
+VOID
+SchedUnregisterCheck(_In_ SHARED_STATE_OPERATION_ID Id);
+
+NTSTATUS
+SchedConfigureCheck(_In_ SHARED_STATE_OPERATION_ID Id,
+                    _In_ UINT32                    Priority,
+                    _In_ UINT64                    Cadence,
+                    _In_ UINT32                    SliceBudgetUs);
+
+VOID
+SchedSetTickBudget(_In_ UINT32 TickBudgetUs);
+
+NTSTATUS
+SchedRequestCheck(_In_ SHARED_STATE_OPERATION_ID Id);
+
+VOID
+SchedRunTick();
+
+NTSTATUS
+SchedQueryCheckStatistics(_In_ SHARED_STATE_OPERATION_ID Id,
+                          _Out_ PSCHED_CHECK_STATISTICS  Statistics);
+
+#endif
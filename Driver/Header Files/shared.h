@@ -0,0 +1,28 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include "common.h"
+#include "io.h"
+
+#include "containers/ring.h"
+
+/* Minimum data area worth creating a report ring for. */
+#define SHARED_REPORT_RING_MIN_SIZE 0x1000
+
+NTSTATUS
+SharedRingInitialise(_Inout_ PSHARED_MAPPING Mapping,
+                     _In_opt_ HANDLE         EventHandle);
+
+VOID
+SharedRingFree(_Inout_ PSHARED_MAPPING Mapping);
+
+BOOLEAN
+SharedRingWritePacket(_Inout_ PSHARED_MAPPING Mapping,
+                      _In_ PVOID              Packet,
+                      _In_ UINT32             PacketLength);
+
+UINT32
+SharedRingDrainReports(_Inout_ PSHARED_MAPPING Mapping,
+                       _In_ PRTL_RING          Reports);
+
+#endif
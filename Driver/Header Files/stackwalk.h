@@ -0,0 +1,89 @@
+#ifndef STACKWALK_H
+#define STACKWALK_H
+
+#include "common.h"
+
+/*
+ * Rather than interrupting every logical processor at once and validating each
+ * frame against the module list as it is captured, processors are visited
+ * group_size at a time. Each processor only copies its frames into its own
+ * preallocated buffer, and once every group has completed the frames are
+ * resolved in a single pass against one snapshot of the module index.
+ * Each invalid address is reported once per scan, regardless of how many
+ * processors it was seen on.
+ *
+ * In DPC mode the frames are those of the DPC itself. In NMI mode the only
+ * frame is the instruction pointer the NMI interrupted, taken from the
+ * machine frame on the NMI stack.
+ *
+ * Each group is given a new non zero generation. A processor is armed with the
+ * generation of its group, and remaining holds that generation in its upper
+ * half alongside the count of processors yet to complete. A capture that
+ * completes after its group timed out therefore cannot decrement the count of
+ * the group that followed.
+ */
+#define STACKWALK_MAX_FRAMES          (STACK_FRAME_POOL_SIZE / sizeof(UINT64))
+#define STACKWALK_DEFAULT_GROUP_SIZE  8
+#define STACKWALK_MAX_REPORTS_PER_SCAN 16
+
+/* 1 second in 100ns units, per group */
+#define STACKWALK_GROUP_TIMEOUT (1ull * 1000 * 1000 * 10)
+
+#define STACKWALK_REMAINING(Generation, Count) \
+    ((LONG64)(((UINT64)(Generation) << 32) | (UINT32)(Count)))
+#define STACKWALK_REMAINING_GENERATION(Remaining) \
+    ((UINT32)((UINT64)(Remaining) >> 32))
+#define STACKWALK_REMAINING_COUNT(Remaining) ((UINT32)(Remaining))
+
+typedef enum _STACKWALK_MODE {
+    StackwalkModeDpc = 0,
+    StackwalkModeNmi
+
+} STACKWALK_MODE;
+
+typedef struct _STACKWALK_CPU_BUFFER {
+    /* the generation of the group in flight the processor is part of, 0 if
+     * it is not part of one */
+    volatile LONG armed;
+    UINT32        frame_count;
+    UINT64        kthread;
+    UINT64        frames[STACKWALK_MAX_FRAMES];
+
+} DECLSPEC_CACHEALIGN STACKWALK_CPU_BUFFER, *PSTACKWALK_CPU_BUFFER;
+
+typedef struct _STACKWALK_SCHEDULER {
+    UINT32 processor_count;
+    UINT32 group_size;
+
+    /* processor_count of each, indexed by processor index */
+    PKDPC                 dpcs;
+    PSTACKWALK_CPU_BUFFER buffers;
+
+    /* generation and processors of the current group yet to complete, see
+     * STACKWALK_REMAINING */
+    volatile LONG64 remaining;
+    UINT32          generation;
+    KEVENT          group_complete;
+
+    /* held for the duration of a scan, as the buffers are shared */
+    KGUARDED_MUTEX lock;
+
+    volatile LONG64 scans;
+    volatile LONG64 frames;
+    volatile LONG64 timeouts;
+    volatile LONG64 invalid_frames;
+
+} STACKWALK_SCHEDULER, *PSTACKWALK_SCHEDULER;
+
+NTSTATUS
+StackwalkInitialiseScheduler(_In_ UINT32                 GroupSize,
+                             _Out_ PSTACKWALK_SCHEDULER* Scheduler);
+
+VOID
+StackwalkFreeScheduler(_In_ PSTACKWALK_SCHEDULER Scheduler);
+
+NTSTATUS
+StackwalkRunScan(_In_ PSTACKWALK_SCHEDULER Scheduler,
+                 _In_ STACKWALK_MODE       Mode);
+
+#endif
@@ -6,6 +6,8 @@
 VOID
 IntCopyMemory(_In_ PVOID Destination, _In_ PVOID Source, _In_ SIZE_T Length);
 
+VOID
+IntZeroMemory(_Out_ PVOID Destination, _In_ SIZE_T Length);
 
 SIZE_T
 IntStringLength(_In_ PCHAR String, _In_ SIZE_T MaxLength);
@@ -22,4 +24,15 @@ IntCompareString(_In_ PCHAR String1, _In_ PCHAR String2);
 PWCHAR
 IntWideStringCopy(_In_ PWCHAR Destination, _In_ PWCHAR Source);
 
+/* Returns TRUE if AVX2 may be used for a buffer of Length bytes, in which
+ * case the callers AVX region must be closed with IntEndAvx2. */
+BOOLEAN
+IntBeginAvx2(_In_ SIZE_T Length, _Out_ PXSTATE_SAVE State);
+
+VOID
+IntEndAvx2(_In_ PXSTATE_SAVE State);
+
+BOOLEAN
+IntIsAesNiSupported();
+
 #endif
\ No newline at end of file
@@ -21,7 +21,7 @@ typedef UINT32 (*RB_COMPARE)(_In_ PVOID Key, _In_ PVOID Object);
 
 typedef struct _RB_TREE {
     PRB_TREE_NODE     root;
-    KGUARDED_MUTEX    lock;
+    EX_PUSH_LOCK      lock;
     RB_COMPARE        compare;
     LOOKASIDE_LIST_EX pool;
     UINT32            object_size;
@@ -31,11 +31,46 @@ typedef struct _RB_TREE {
     volatile UINT32 insertion_count;
     volatile UINT32 deletion_count;
 
+    /* number of lock acquisitions that could not be made without waiting */
+    volatile UINT32 contention_count;
+
 } RB_TREE, *PRB_TREE;
 
+/*
+ * In-order iterator over the tree. The iterator only remains valid whilst the
+ * tree lock is held, to continue an enumeration after the lock has been dropped
+ * use RtlRbTreeIteratorResume with the key of the last object visited.
+ */
+typedef struct _RB_TREE_ITERATOR {
+    PRB_TREE      tree;
+    PRB_TREE_NODE current;
+
+} RB_TREE_ITERATOR, *PRB_TREE_ITERATOR;
+
 typedef VOID (*RB_CALLBACK)(PRB_TREE_NODE Node);
 typedef VOID (*RB_ENUM_CALLBACK)(_In_ PVOID Object, _In_opt_ PVOID Context);
 
+#define RB_TREE_SNAPSHOT_DEFAULT_CHUNK_SIZE 64
+
+/*
+ * A flat copy of the objects stored in the tree, in key order. objects can
+ * either be supplied by the caller alongside its capacity, or left NULL in
+ * which case it will be allocated (and grown as needed) by RtlRbTreeSnapshot
+ * and must be released with RtlRbTreeFreeSnapshot.
+ */
+typedef struct _RB_TREE_SNAPSHOT {
+    PVOID   objects;
+    UINT32  object_size;
+    UINT32  count;
+    UINT32  capacity;
+    BOOLEAN pooled;
+
+} RB_TREE_SNAPSHOT, *PRB_TREE_SNAPSHOT;
+
+#define RB_TREE_SNAPSHOT_OBJECT(snapshot, index) \
+    ((PVOID)((UINT64)(snapshot)->objects +       \
+             (UINT64)(index) * (snapshot)->object_size))
+
 PVOID
 RtlRbTreeInsertNode(_In_ PRB_TREE Tree, _In_ PVOID Key);
 
@@ -55,21 +90,67 @@ RtlRbTreeEnumerate(_In_ PRB_TREE         Tree,
                    _In_ RB_ENUM_CALLBACK Callback,
                    _In_opt_ PVOID        Context);
 
+PVOID
+RtlRbTreeIteratorBegin(_In_ PRB_TREE Tree, _Out_ PRB_TREE_ITERATOR Iterator);
+
+PVOID
+RtlRbTreeIteratorNext(_Inout_ PRB_TREE_ITERATOR Iterator);
+
+PVOID
+RtlRbTreeIteratorResume(_In_ PRB_TREE           Tree,
+                        _In_ PVOID              Key,
+                        _Out_ PRB_TREE_ITERATOR Iterator);
+
 #define ENUMERATE_THREADS(callback, context) \
     RtlRbTreeEnumerate(GetThreadTree(), callback, context)
 
+NTSTATUS
+RtlRbTreeSnapshot(_In_ PRB_TREE             Tree,
+                  _In_ UINT32               ChunkSize,
+                  _In_opt_ RB_ENUM_CALLBACK CaptureCallback,
+                  _In_opt_ RB_ENUM_CALLBACK ReleaseCallback,
+                  _In_opt_ PVOID            Context,
+                  _Inout_ PRB_TREE_SNAPSHOT Snapshot);
+
+VOID
+RtlRbTreeFreeSnapshot(_Inout_ PRB_TREE_SNAPSHOT Snapshot,
+                      _In_opt_ RB_ENUM_CALLBACK ReleaseCallback,
+                      _In_opt_ PVOID            Context);
+
+#define SNAPSHOT_THREADS(snapshot, capture, release, context)  \
+    RtlRbTreeSnapshot(GetThreadTree(),                         \
+                      RB_TREE_SNAPSHOT_DEFAULT_CHUNK_SIZE,     \
+                      capture,                                 \
+                      release,                                 \
+                      context,                                 \
+                      snapshot)
+
 VOID
 RtlRbTreeDeleteTree(_In_ PRB_TREE Tree);
 
 VOID
 RtlRbTreeInOrderPrint(_In_ PRB_TREE Tree);
 
+/*
+ * The tree lock is a push lock, allowing lookups and enumerations to acquire it
+ * shared while only insertions and deletions require exclusive access. Each
+ * acquisition is first attempted without blocking, and one that fails is
+ * recorded in the trees contention_count before waiting for the lock.
+ */
+
+/* To be used by routines that modify the tree, i.e insert and delete. */
 FORCEINLINE
 STATIC
 VOID
 RtlRbTreeAcquireLock(_Inout_ PRB_TREE Tree)
 {
-    KeAcquireGuardedMutex(&Tree->lock);
+    KeEnterCriticalRegion();
+
+    if (ExTryAcquirePushLockExclusiveEx(&Tree->lock, 0))
+        return;
+
+    InterlockedIncrement(&Tree->contention_count);
+    ExAcquirePushLockExclusiveEx(&Tree->lock, 0);
 }
 
 FORCEINLINE
@@ -77,7 +158,32 @@ STATIC
 VOID
 RtlRbTreeReleaselock(_Inout_ PRB_TREE Tree)
 {
-    KeReleaseGuardedMutex(&Tree->lock);
+    ExReleasePushLockExclusiveEx(&Tree->lock, 0);
+    KeLeaveCriticalRegion();
+}
+
+/* To be used by routines that only read the tree, i.e lookups. */
+FORCEINLINE
+STATIC
+VOID
+RtlRbTreeAcquireLockShared(_Inout_ PRB_TREE Tree)
+{
+    KeEnterCriticalRegion();
+
+    if (ExTryAcquirePushLockSharedEx(&Tree->lock, 0))
+        return;
+
+    InterlockedIncrement(&Tree->contention_count);
+    ExAcquirePushLockSharedEx(&Tree->lock, 0);
+}
+
+FORCEINLINE
+STATIC
+VOID
+RtlRbTreeReleaseLockShared(_Inout_ PRB_TREE Tree)
+{
+    ExReleasePushLockSharedEx(&Tree->lock, 0);
+    KeLeaveCriticalRegion();
 }
 
 VOID
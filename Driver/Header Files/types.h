@@ -17,10 +17,12 @@
 #define REPORT_SELF_DRIVER_PATCHED        160
 #define REPORT_BLACKLISTED_PCIE_DEVICE    170
 #define REPORT_EPT_HOOK                   180
+#define REPORT_COALESCED                  190
 
 #define REPORT_SUBTYPE_NO_BACKING_MODULE      0x0
 #define REPORT_SUBTYPE_INVALID_DISPATCH       0x1
 #define REPORT_SUBTYPE_EXCEPTION_THROWING_RET 0x2
+#define REPORT_SUBTYPE_PATCHED_PAGE           0x3
 
 #define PACKET_TYPE_REPORT    0x0
 #define PACKET_TYPE_HEARTBEAT 0x1
@@ -77,10 +79,47 @@ typedef enum _TABLE_ID {
     Win32kBase_gDxgInterface
 } TABLE_ID;
 
+/*
+ * Optionally sent as the input of the virtualisation detection IOCTL, a zero
+ * field using the default.
+ */
+typedef struct _HYPERVISOR_TIMING_CONFIGURATION {
+    UINT32 burst_count;
+    UINT32 samples_per_burst;
+
+    /* cpuid is flagged on a processor when its median exceeds the median of
+     * the reference workload by this percentage */
+    UINT32 threshold_percent;
+
+} HYPERVISOR_TIMING_CONFIGURATION, *PHYPERVISOR_TIMING_CONFIGURATION;
+
+/* timings are in TSC ticks */
+typedef struct _HYPERVISOR_TIMING_DISTRIBUTION {
+    UINT32 processor_count;
+    UINT32 samples_per_processor;
+
+    UINT64 cpuid_min;
+    UINT64 cpuid_median;
+    UINT64 cpuid_p90;
+    UINT64 reference_min;
+    UINT64 reference_median;
+    UINT64 reference_p90;
+
+    /* processors whose cpuid median exceeded the threshold */
+    UINT32 flagged_processor_count;
+
+    /* bursts over which APERF did not advance across a cpuid */
+    UINT32 aperf_zero_count;
+    UINT32 burst_count;
+
+} HYPERVISOR_TIMING_DISTRIBUTION, *PHYPERVISOR_TIMING_DISTRIBUTION;
+
 typedef struct _HYPERVISOR_DETECTION_REPORT {
-    REPORT_PACKET_HEADER header;
-    UINT8                aperf_msr_timing_check;
-    UINT8                invd_emulation_check;
+    REPORT_PACKET_HEADER           header;
+    UINT8                          aperf_msr_timing_check;
+    UINT8                          invd_emulation_check;
+    UINT8                          cpuid_timing_check;
+    HYPERVISOR_TIMING_DISTRIBUTION distribution;
 
 } HYPERVISOR_DETECTION_REPORT, *PHYPERVISOR_DETECTION_REPORT;
 
@@ -202,6 +241,36 @@ typedef struct _SYSTEM_MODULE_INTEGRITY_CHECK_REPORT {
 
 } SYSTEM_MODULE_INTEGRITY_CHECK_REPORT, *PSYSTEM_MODULE_INTEGRITY_CHECK_REPORT;
 
+/* Sent with REPORT_PATCHED_SYSTEM_MODULE and REPORT_SUBTYPE_PATCHED_PAGE when a
+ * page of .text no longer matches its baseline. */
+typedef struct _SYSTEM_MODULE_PAGE_INTEGRITY_REPORT {
+    REPORT_PACKET_HEADER header;
+    UINT64               image_base;
+    UINT32               image_size;
+
+    /* offset of .text from image_base */
+    UINT32 text_offset;
+
+    /* offset of the modified page from the start of .text */
+    UINT32 page_offset;
+    CHAR   path_name[0x100];
+
+} SYSTEM_MODULE_PAGE_INTEGRITY_REPORT, *PSYSTEM_MODULE_PAGE_INTEGRITY_REPORT;
+
+/* Sent once a coalescing window closes, summarising the repeats of a report
+ * that were suppressed after the first was sent. Timestamps are system time. */
+typedef struct _COALESCED_REPORT {
+    REPORT_PACKET_HEADER header;
+    UINT32               report_code;
+    UINT32               report_sub_type;
+    UINT64               subject[2];
+    UINT32               suppressed_count;
+    UINT32               reserved;
+    UINT64               first_seen;
+    UINT64               last_seen;
+
+} COALESCED_REPORT, *PCOALESCED_REPORT;
+
 typedef struct _EPT_HOOK_REPORT {
     REPORT_PACKET_HEADER header;
     UINT64               control_average;
@@ -225,4 +294,72 @@ typedef struct _BLACKLISTED_PCIE_DEVICE_REPORT {
 
 } BLACKLISTED_PCIE_DEVICE_REPORT, *PBLACKLISTED_PCIE_DEVICE_REPORT;
 
+/*
+ * The first counters share their value with the SHARED_STATE_OPERATION_ID of
+ * the check they time.
+ */
+typedef enum _PERF_COUNTER_ID {
+    PerfCounterRunNmiCallbacks = 0,
+    PerfCounterValidateDriverObjects,
+    PerfCounterEnumerateHandleTables,
+    PerfCounterScanForUnlinkedProcesses,
+    PerfCounterPerformModuleIntegrityCheck,
+    PerfCounterScanForAttachedThreads,
+    PerfCounterScanForEptHooks,
+    PerfCounterInitiateDpcStackwalk,
+    PerfCounterValidateSystemModules,
+    PerfCounterValidateWin32kDispatchTables,
+    PerfCounterValidateUserModule,
+    PerfCounterPageTableScan,
+    PerfCounterHandleOperationCallback,
+    PerfCounterImageLoadCallback,
+    PerfCounterProcessCreateCallback,
+    PerfCounterThreadCreateCallback,
+    PerfCounterDeferredModuleHash,
+    PerfCounterRbTreeInsert,
+    PerfCounterRbTreeDelete,
+    PerfCounterRbTreeFind,
+    PerfCounterHashmapInsert,
+    PerfCounterHashmapLookup,
+    PerfCounterHashmapDelete,
+    PerfCounterMax
+} PERF_COUNTER_ID;
+
+#define PERF_STATISTICS_VERSION 1
+
+/* durations are in TSC ticks */
+typedef struct _PERF_COUNTER_STATISTICS {
+    UINT64 invocations;
+    UINT64 total_ticks;
+    UINT64 min_ticks;
+    UINT64 max_ticks;
+
+    /* the upper bound of the histogram bucket holding the 99th percentile,
+     * within 25% of the exact value */
+    UINT64 p99_ticks;
+    UINT64 bytes;
+
+} PERF_COUNTER_STATISTICS, *PPERF_COUNTER_STATISTICS;
+
+/*
+ * Returned by the performance statistics IOCTL. Counters may be appended by a
+ * later version, so readers should only rely on the first counter_count.
+ * The TSC and interrupt time taken when counting began and when the
+ * statistics were queried let the reader derive the TSC frequency.
+ */
+typedef struct _PERF_STATISTICS {
+    UINT32 version;
+    UINT32 size;
+    UINT32 counter_count;
+    UINT32 processor_count;
+
+    UINT64 start_tsc;
+    UINT64 start_interrupt_time;
+    UINT64 query_tsc;
+    UINT64 query_interrupt_time;
+
+    PERF_COUNTER_STATISTICS counters[PerfCounterMax];
+
+} PERF_STATISTICS, *PPERF_STATISTICS;
+
 #endif
\ No newline at end of file
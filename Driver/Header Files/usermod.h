@@ -0,0 +1,105 @@
+#ifndef USERMOD_H
+#define USERMOD_H
+
+#include "common.h"
+#include "baseline.h"
+#include "ia32.h"
+
+/*
+ * Revalidating our user mode module by rehashing its entire image on every
+ * request is expensive when requested every few seconds. Instead, per page
+ * hashes of its code sections are taken when the session is initialised,
+ * along with the state of the PTE mapping each page. As with HashUserModule
+ * only executable, non writable sections are baselined, since the headers,
+ * .data and the import table are legitimately written to at runtime.
+ *
+ * Image pages are shared copy on write, so a page cannot be modified without
+ * its PTE changing, either to a private page frame, by becoming writable, or
+ * by being marked dirty. A revalidation only rehashes pages whose PTE differs
+ * from the recorded state, and every full_interval rehashes every page
+ * regardless. Pages that are not resident cannot have been modified since
+ * they were last verified without first being made resident, so are left
+ * until they are.
+ */
+
+/* 60 seconds in 100ns units */
+#define USER_MODULE_DEFAULT_FULL_INTERVAL (60ull * 1000 * 1000 * 10)
+
+/* the PTE bits that must be unchanged for a page to be skipped */
+#define USER_MODULE_PTE_STATE_MASK \
+    (0x000FFFFFFFFFF000ull | PTE_64_PRESENT_FLAG | PTE_64_WRITE_FLAG | \
+     PTE_64_DIRTY_FLAG)
+
+typedef struct _USER_MODULE_STATISTICS {
+    UINT64 validations;
+    UINT64 full_validations;
+    UINT64 pages_hashed;
+    UINT64 pages_skipped;
+    UINT64 mismatches;
+
+} USER_MODULE_STATISTICS, *PUSER_MODULE_STATISTICS;
+
+#define USER_MODULE_MAX_CODE_SECTIONS 8
+
+typedef struct _USER_MODULE_SECTION {
+    /* page aligned offset of the section within the image */
+    UINT32 offset;
+    UINT32 size;
+
+    /* index of the sections first page within page_state */
+    UINT32 first_page;
+
+    PMODULE_PAGE_BASELINE baseline;
+
+} USER_MODULE_SECTION, *PUSER_MODULE_SECTION;
+
+typedef struct _USER_MODULE_CACHE {
+    volatile BOOLEAN active;
+
+    /* referenced for the lifetime of the cache */
+    PEPROCESS process;
+    PVOID     base;
+    UINT32    size;
+
+    USER_MODULE_SECTION sections[USER_MODULE_MAX_CODE_SECTIONS];
+    UINT32              section_count;
+
+    /* > `pages`:
+     *   - page_count is the number of pages across every section.
+     *   - page_state is the PTE state of each page masked by
+     *     USER_MODULE_PTE_STATE_MASK, as of when the page was last verified.
+     *   - pages is the scratch list of the pages of a section to verify. */
+    UINT32  page_count;
+    PUINT64 page_state;
+    PUINT32 pages;
+
+    UINT64 full_interval;
+    UINT64 last_full_validation;
+
+    USER_MODULE_STATISTICS statistics;
+    KGUARDED_MUTEX         lock;
+
+} USER_MODULE_CACHE, *PUSER_MODULE_CACHE;
+
+VOID
+UserModuleCacheInitialiseLock();
+
+NTSTATUS
+UserModuleCacheInitialise(_In_ PEPROCESS Process,
+                          _In_ PVOID     ImageBase,
+                          _In_ UINT32    ImageSize);
+
+VOID
+UserModuleCacheFree();
+
+VOID
+UserModuleCacheSetFullInterval(_In_ UINT64 Interval);
+
+NTSTATUS
+UserModuleCacheValidate(_Out_ PBOOLEAN Modified,
+                        _Out_ PUINT32  MismatchOffset);
+
+VOID
+UserModuleCacheQueryStatistics(_Out_ PUSER_MODULE_STATISTICS Statistics);
+
+#endif
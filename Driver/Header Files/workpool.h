@@ -0,0 +1,84 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "common.h"
+#include "modules.h"
+
+/*
+ * A pool of work items that runs an array of tasks to completion. The tasks
+ * are split into one contiguous range per worker. Workers take tasks from the
+ * head of their own range, and once it is empty steal from the tail of the
+ * others, so a range holding the chunks of one large module does not leave
+ * the rest of the pool idle.
+ *
+ * The pool is sized to the processors that are not busy, as reported by
+ * CalculateCpuCoreUsage, bounded by max_workers and by cpu_share. While a
+ * session is active each worker also limits its own duty cycle, so the pool
+ * as a whole never uses more than cpu_share percent of total processor time.
+ */
+#define WORK_POOL_DEFAULT_MAX_WORKERS   8
+#define WORK_POOL_DEFAULT_CPU_SHARE     25
+#define WORK_POOL_DEFAULT_BUSY_CORE     75
+#define WORK_POOL_UNTHROTTLED           100
+
+/* modules larger than this are split across several tasks */
+#define WORK_POOL_MODULE_CHUNK_SIZE 0x100000
+
+typedef struct _WORK_POOL_TASK {
+    PVOID  item;
+    UINT32 offset;
+    UINT32 length;
+
+} WORK_POOL_TASK, *PWORK_POOL_TASK;
+
+typedef VOID (*WORK_POOL_ROUTINE)(_In_ PWORK_POOL_TASK Task,
+                                  _In_opt_ PVOID       Context);
+
+typedef struct _WORK_POOL_CONFIGURATION {
+    UINT32 max_workers;
+
+    /* percent of total processor time the pool may use during a session */
+    UINT32 cpu_share;
+
+    /* cores at or above this percent usage are not counted as available */
+    UINT32 busy_core_usage;
+
+} WORK_POOL_CONFIGURATION, *PWORK_POOL_CONFIGURATION;
+
+/* The low half is the head, the next task of the owner, and the high half the
+ * tail, one past the last task. Both are updated together. */
+typedef struct _WORK_POOL_QUEUE {
+    DECLSPEC_CACHEALIGN volatile LONG64 range;
+
+} WORK_POOL_QUEUE, *PWORK_POOL_QUEUE;
+
+typedef struct _WORK_POOL_STATISTICS {
+    UINT32 worker_count;
+    UINT64 executed;
+    UINT64 stolen;
+
+    /* total time workers were held back by the throttle, in 100ns units */
+    UINT64 throttled;
+
+} WORK_POOL_STATISTICS, *PWORK_POOL_STATISTICS;
+
+NTSTATUS
+WorkPoolRun(_In_ PWORK_POOL_TASK          Tasks,
+            _In_ UINT32                   TaskCount,
+            _In_ WORK_POOL_ROUTINE        Routine,
+            _In_opt_ PVOID                Context,
+            _In_ PWORK_POOL_CONFIGURATION Configuration,
+            _Out_opt_ PWORK_POOL_STATISTICS Statistics);
+
+NTSTATUS
+WorkPoolBuildModuleTasks(_In_ PSYSTEM_MODULES   Modules,
+                         _Out_ PWORK_POOL_TASK* Tasks,
+                         _Out_ PUINT32          TaskCount);
+
+VOID
+WorkPoolFreeTasks(_In_ PWORK_POOL_TASK Tasks);
+
+VOID
+WorkPoolInitialiseConfiguration(_Out_ PWORK_POOL_CONFIGURATION Configuration);
+
+#endif
@@ -4,74 +4,134 @@
 #include "imports.h"
 #include "lib/stdlib.h"
 
+/*
+ * Each context occupies the slot of the apc context array indexed by its
+ * context id, so lookups are a single read. Slots are only published, claimed
+ * and cleared with interlocked operations, and no path takes a lock.
+ *
+ * A context is kept alive by its count and allocation_in_progress. The thread
+ * inserting a context sets allocation_in_progress beforehand and clears it
+ * once it has counted every APC it will queue, so a count is only ever taken
+ * by that thread or by one already holding a count. A context found with
+ * neither can never be counted again, and is freed.
+ *
+ * Only the thread that has claimed a contexts slot, by tagging the pointer in
+ * it with APC_CONTEXT_SLOT_CLAIMED, may inspect the context for freeing, so
+ * two threads never race to free the same context. Lookups ignore the tag.
+ */
+#define APC_CONTEXT_SLOT_CLAIMED ((ULONG_PTR)1)
+
+FORCEINLINE
+STATIC
+PVOID volatile*
+GetApcContextSlots()
+{
+    return (PVOID volatile*)GetApcContextArray();
+}
+
 VOID
 GetApcContextByIndex(_Out_ PVOID* Context, _In_ UINT32 Index)
 {
-    NT_ASSERT(Index <= MAXIMUM_APC_CONTEXTS);
-    AcquireDriverConfigLock();
-    *Context = (PVOID)GetApcContextArray()[Index];
-    ReleaseDriverConfigLock();
+    NT_ASSERT(Index < MAXIMUM_APC_CONTEXTS);
+    *Context = (PVOID)((ULONG_PTR)ReadPointerAcquire(
+                           &GetApcContextSlots()[Index]) &
+                       ~APC_CONTEXT_SLOT_CLAIMED);
 }
 
 VOID
 GetApcContext(_Out_ PVOID* Context, _In_ UINT32 ContextIdentifier)
 {
-    NT_ASSERT(ContextIdentifier <= MAXIMUM_APC_CONTEXTS);
+    NT_ASSERT(ContextIdentifier < MAXIMUM_APC_CONTEXTS);
 
-    PAPC_CONTEXT_HEADER header = NULL;
+    *Context = NULL;
 
-    AcquireDriverConfigLock();
+    if (ContextIdentifier >= MAXIMUM_APC_CONTEXTS)
+        return;
 
-    for (UINT32 index = 0; index < MAXIMUM_APC_CONTEXTS; index++) {
-        header = GetApcContextArray()[index];
+    GetApcContextByIndex(Context, ContextIdentifier);
+}
 
-        if (!header)
-            continue;
+/*
+ * Returns the context in the slot if this thread claimed it, in which case
+ * the claim must be released or the context freed. The context is not
+ * dereferenced before the claim, as another claimant may be freeing it.
+ */
+STATIC
+PAPC_CONTEXT_HEADER
+ApcpClaimContextSlot(_In_ UINT32 Index)
+{
+    PVOID volatile* slot = &GetApcContextSlots()[Index];
+    PVOID           context = ReadPointerAcquire(slot);
 
-        if (header->context_id != ContextIdentifier)
-            continue;
+    if (!context || (ULONG_PTR)context & APC_CONTEXT_SLOT_CLAIMED)
+        return NULL;
 
-        *Context = header;
-        goto unlock;
-    }
-unlock:
-    ReleaseDriverConfigLock();
+    if (InterlockedCompareExchangePointer(
+            slot,
+            (PVOID)((ULONG_PTR)context | APC_CONTEXT_SLOT_CLAIMED),
+            context) != context)
+        return NULL;
+
+    return (PAPC_CONTEXT_HEADER)context;
+}
+
+FORCEINLINE
+STATIC
+VOID
+ApcpReleaseContextSlot(_In_ PAPC_CONTEXT_HEADER Context)
+{
+    InterlockedExchangePointer(&GetApcContextSlots()[Context->context_id],
+                               Context);
 }
 
 /*
- * No need to hold the lock here as the thread freeing the APCs will
- * already hold the configuration lock. We also dont want to release and
- * reclaim the lock before calling this function since we need to ensure
- * we hold the lock during the entire decrement and free process.
+ * allocation_in_progress is read first. Once it is seen clear, every count
+ * taken by the allocating thread before clearing it is visible.
  */
+FORCEINLINE
+STATIC
 BOOLEAN
-FreeApcContextStructure(_Inout_ PAPC_CONTEXT_HEADER Context)
+ApcpIsContextIdle(_In_ PAPC_CONTEXT_HEADER Context)
 {
-    NT_ASSERT(Context <= MAXIMUM_APC_CONTEXTS);
+    if (ReadAcquire((volatile LONG*)&Context->allocation_in_progress))
+        return FALSE;
 
-    PUINT64 entry = NULL;
-
-    for (UINT32 index = 0; index < MAXIMUM_APC_CONTEXTS; index++) {
-        entry = GetApcContextArray();
-
-        if (entry[index] != (UINT64)Context)
-            continue;
+    return ReadAcquire((volatile LONG*)&Context->count) == 0;
+}
 
-        if (Context->count > 0)
-            return FALSE;
+/*
+ * Context must have been claimed via ApcpClaimContextSlot. If it is still in
+ * use the claim is released and FALSE returned, otherwise the slot is cleared
+ * and the context freed.
+ */
+BOOLEAN
+FreeApcContextStructure(_Inout_ PAPC_CONTEXT_HEADER Context)
+{
+    NT_ASSERT(Context != NULL);
+    NT_ASSERT((UINT32)Context->context_id < MAXIMUM_APC_CONTEXTS);
 
-        ImpExFreePoolWithTag(Context, POOL_TAG_APC);
-        entry[index] = NULL;
-        return TRUE;
+    if (!ApcpIsContextIdle(Context)) {
+        ApcpReleaseContextSlot(Context);
+        return FALSE;
     }
 
-    return FALSE;
+    InterlockedExchangePointer(&GetApcContextSlots()[Context->context_id],
+                               NULL);
+
+    ExDeleteLookasideListEx(&Context->apc_pool);
+    ImpExFreePoolWithTag(Context, POOL_TAG_APC);
+    return TRUE;
 }
 
+/*
+ * Only the thread that inserted the context may take a count, and only
+ * while allocation_in_progress is set, which keeps the context from being
+ * freed between the lookup and the increment.
+ */
 VOID
 IncrementApcCount(_In_ UINT32 ContextId)
 {
-    NT_ASSERT(ContextId <= MAXIMUM_APC_CONTEXTS);
+    NT_ASSERT(ContextId < MAXIMUM_APC_CONTEXTS);
 
     PAPC_CONTEXT_HEADER header = NULL;
 
@@ -80,16 +140,50 @@ IncrementApcCount(_In_ UINT32 ContextId)
     if (!header)
         return;
 
-    AcquireDriverConfigLock();
-    header->count += 1;
-    ReleaseDriverConfigLock();
+    NT_ASSERT(header->allocation_in_progress);
+    InterlockedIncrement((volatile LONG*)&header->count);
 }
 
+/*
+ * Allocates a KAPC from the contexts lookaside list and counts it as queued,
+ * under the same conditions as IncrementApcCount. If the APC is not queued,
+ * it must still be released via ReleaseApcAndDecrementApcCount, never
+ * FreeApcAndDecrementApcCount.
+ */
+PKAPC
+AllocateApcAndIncrementApcCount(_In_ UINT32 ContextId)
+{
+    NT_ASSERT(ContextId < MAXIMUM_APC_CONTEXTS);
+
+    PAPC_CONTEXT_HEADER header = NULL;
+    PKAPC               apc = NULL;
+
+    GetApcContext(&header, ContextId);
+
+    if (!header)
+        return NULL;
+
+    NT_ASSERT(header->allocation_in_progress);
+
+    apc = ExAllocateFromLookasideListEx(&header->apc_pool);
+
+    if (!apc)
+        return NULL;
+
+    InterlockedIncrement((volatile LONG*)&header->count);
+    return apc;
+}
+
+/*
+ * For APCs allocated directly with ExAllocatePool2 and counted with
+ * IncrementApcCount. The decrement is the last access to the context, after
+ * which it may be freed.
+ */
 VOID
 FreeApcAndDecrementApcCount(_Inout_ PRKAPC Apc, _In_ UINT32 ContextId)
 {
     NT_ASSERT(Apc != NULL);
-    NT_ASSERT(ContextId <= MAXIMUM_APC_CONTEXTS);
+    NT_ASSERT(ContextId < MAXIMUM_APC_CONTEXTS);
 
     PAPC_CONTEXT_HEADER context = NULL;
 
@@ -99,9 +193,33 @@ FreeApcAndDecrementApcCount(_Inout_ PRKAPC Apc, _In_ UINT32 ContextId)
     if (!context)
         return;
 
-    AcquireDriverConfigLock();
-    context->count -= 1;
-    ReleaseDriverConfigLock();
+    InterlockedDecrement((volatile LONG*)&context->count);
+}
+
+/*
+ * For APCs allocated via AllocateApcAndIncrementApcCount, which are returned
+ * to the contexts lookaside list. The outstanding count keeps the context
+ * alive until the decrement, which is the last access to it.
+ */
+VOID
+ReleaseApcAndDecrementApcCount(_Inout_ PRKAPC Apc, _In_ UINT32 ContextId)
+{
+    NT_ASSERT(Apc != NULL);
+    NT_ASSERT(ContextId < MAXIMUM_APC_CONTEXTS);
+
+    PAPC_CONTEXT_HEADER context = NULL;
+
+    GetApcContext(&context, ContextId);
+
+    if (!context) {
+        /* lookaside entries are allocated from pool with the same tag */
+        NT_ASSERT(FALSE);
+        ImpExFreePoolWithTag(Apc, POOL_TAG_APC);
+        return;
+    }
+
+    ExFreeToLookasideListEx(&context->apc_pool, Apc);
+    InterlockedDecrement((volatile LONG*)&context->count);
 }
 
 /*
@@ -130,57 +248,78 @@ FreeApcAndDecrementApcCount(_Inout_ PRKAPC Apc, _In_ UINT32 ContextId)
  * context structure until the count is 0 and allocation_in_progress is 0. We
  * can then call this function alongside other query callbacks via IOCTL to
  * constantly monitor the status of open APC contexts.
+ *
+ * Neither freeing threads nor this query take a lock any more. Counts are
+ * updated with interlocked operations, so the convoy described above cannot
+ * form, and claiming a slot serialises freeing against unload and concurrent
+ * queries.
  */
 NTSTATUS
 QueryActiveApcContextsForCompletion()
 {
     PAPC_CONTEXT_HEADER entry = NULL;
 
-    AcquireDriverConfigLock();
-
     for (UINT32 index = 0; index < MAXIMUM_APC_CONTEXTS; index++) {
-        GetApcContextByIndex(&entry, index);
+        entry = ApcpClaimContextSlot(index);
 
         if (!entry)
             continue;
 
-        if (entry->count > 0 || entry->allocation_in_progress == TRUE)
+        if (entry->context_id != APC_CONTEXT_ID_STACKWALK ||
+            !ApcpIsContextIdle(entry)) {
+            ApcpReleaseContextSlot(entry);
             continue;
-
-        switch (entry->context_id) {
-        case APC_CONTEXT_ID_STACKWALK:
-            FreeApcStackwalkApcContextInformation(entry);
-            FreeApcContextStructure(entry);
-            break;
         }
+
+        /* an idle context can never be counted again, so stays idle */
+        FreeApcStackwalkApcContextInformation(entry);
+        FreeApcContextStructure(entry);
     }
 
-    ReleaseDriverConfigLock();
     return STATUS_SUCCESS;
 }
 
-VOID
+/*
+ * Fails if the context id is out of range or a context with the same id is
+ * already active, in which case the caller still owns Context. The caller
+ * sets allocation_in_progress beforehand if it will count APCs against it.
+ */
+NTSTATUS
 InsertApcContext(_In_ PVOID Context)
 {
     NT_ASSERT(Context != NULL);
 
-    PUINT64 entry = NULL;
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    PAPC_CONTEXT_HEADER header = (PAPC_CONTEXT_HEADER)Context;
 
     if (IsDriverUnloading())
-        return;
-
-    AcquireDriverConfigLock();
-
-    for (UINT32 index = 0; index < MAXIMUM_APC_CONTEXTS; index++) {
-        entry = GetApcContextArray();
+        return STATUS_UNSUCCESSFUL;
+
+    if ((UINT32)header->context_id >= MAXIMUM_APC_CONTEXTS)
+        return STATUS_INVALID_PARAMETER;
+
+    status = ExInitializeLookasideListEx(&header->apc_pool,
+                                         NULL,
+                                         NULL,
+                                         NonPagedPoolNx,
+                                         0,
+                                         sizeof(KAPC),
+                                         POOL_TAG_APC,
+                                         0);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ExInitializeLookasideListEx: %x", status);
+        return status;
+    }
 
-        if (entry[index] == NULL) {
-            entry[index] = (UINT64)Context;
-            goto end;
-        }
+    if (InterlockedCompareExchangePointer(
+            &GetApcContextSlots()[header->context_id], Context, NULL)) {
+        DEBUG_ERROR("Apc context already active: %lx", header->context_id);
+        ExDeleteLookasideListEx(&header->apc_pool);
+        return STATUS_ALREADY_REGISTERED;
     }
-end:
-    ReleaseDriverConfigLock();
+
+    return STATUS_SUCCESS;
 }
 
 /*
@@ -213,33 +352,36 @@ end:
 BOOLEAN
 DrvUnloadFreeAllApcContextStructures()
 {
-    PUINT64 entry = NULL;
     PAPC_CONTEXT_HEADER context = NULL;
     LARGE_INTEGER delay = {.QuadPart = -ABSOLUTE(SECONDS(1))};
 
-    AcquireDriverConfigLock();
-
     for (UINT32 index = 0; index < MAXIMUM_APC_CONTEXTS; index++) {
-        entry = GetApcContextArray();
+        context = ApcpClaimContextSlot(index);
 
-        if (entry[index] == NULL)
-            continue;
+        if (!context) {
+            /* claimed by a query which may yet release it */
+            if (!ReadPointerAcquire(&GetApcContextSlots()[index]))
+                continue;
 
-        context = entry[index];
+            DEBUG_VERBOSE("Apc context claimed: Index: %lx", index);
+            KeDelayExecutionThread(KernelMode, FALSE, &delay);
+            return FALSE;
+        }
 
-        if (context->count > 0) {
+        if (ReadAcquire((volatile LONG*)&context->count) > 0) {
             DEBUG_VERBOSE(
                 "Still active APCs: Index: %lx, Count: %lx",
                 index,
                 context->count);
+            ApcpReleaseContextSlot(context);
             KeDelayExecutionThread(KernelMode, FALSE, &delay);
-            ReleaseDriverConfigLock();
             return FALSE;
         }
 
+        InterlockedExchangePointer(&GetApcContextSlots()[index], NULL);
+        ExDeleteLookasideListEx(&context->apc_pool);
         ImpExFreePoolWithTag(context, POOL_TAG_APC);
     }
 
-    ReleaseDriverConfigLock();
     return TRUE;
 }
@@ -0,0 +1,379 @@
+#include "baseline.h"
+
+#include "crypt.h"
+#include "imports.h"
+#include "io.h"
+#include "lib/stdlib.h"
+#include "report.h"
+#include "types/types.h"
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, BaselineCreateModulePageHashes)
+#    pragma alloc_text(PAGE, BaselineVerifyModulePages)
+#    pragma alloc_text(PAGE, BaselineVerifyModulePageList)
+#endif
+
+STATIC
+UINT32
+BaselinepGreatestCommonDivisor(_In_ UINT32 A, _In_ UINT32 B)
+{
+    UINT32 temp = 0;
+
+    while (B) {
+        temp = A % B;
+        A = B;
+        B = temp;
+    }
+
+    return A;
+}
+
+STATIC
+VOID
+BaselinepRandomiseVisitOrder(_Inout_ PMODULE_PAGE_BASELINE Baseline)
+{
+    UINT32 seed = (UINT32)__rdtsc();
+
+    Baseline->start = RtlRandomEx(&seed) % Baseline->page_count;
+    Baseline->stride = RtlRandomEx(&seed) % Baseline->page_count + 1;
+
+    while (BaselinepGreatestCommonDivisor(
+               Baseline->stride, Baseline->page_count) != 1)
+        Baseline->stride = Baseline->stride % Baseline->page_count + 1;
+}
+
+FORCEINLINE
+STATIC
+UINT32
+BaselinepGetPageLength(_In_ PMODULE_PAGE_BASELINE Baseline, _In_ UINT32 Page)
+{
+    UINT32 offset = Page * BASELINE_PAGE_SIZE;
+
+    return Baseline->text_size - offset < BASELINE_PAGE_SIZE
+               ? Baseline->text_size - offset
+               : BASELINE_PAGE_SIZE;
+}
+
+/*
+ * Pages are copied out with MmCopyMemory before being hashed, so a page that
+ * is not resident results in an error rather than a fault. Any copy failure
+ * is returned as STATUS_PARTIAL_COPY, which only concerns this page.
+ */
+STATIC
+NTSTATUS
+BaselinepHashPage(_In_ PCRYPT_HASH_CONTEXT Context,
+                  _In_ PVOID               Page,
+                  _In_ UINT32              Length,
+                  _In_ PVOID               Scratch,
+                  _Out_ PUCHAR             Hash)
+{
+    NTSTATUS        status = STATUS_UNSUCCESSFUL;
+    MM_COPY_ADDRESS address = {0};
+    SIZE_T          bytes_copied = 0;
+
+    address.VirtualAddress = Page;
+
+    status = ImpMmCopyMemory(
+        Scratch, address, Length, MM_COPY_MEMORY_VIRTUAL, &bytes_copied);
+
+    if (!NT_SUCCESS(status) || bytes_copied != Length) {
+        DEBUG_ERROR("MmCopyMemory failed with status %x", status);
+        return STATUS_PARTIAL_COPY;
+    }
+
+    status = CryptHashUpdate(Context, Scratch, Length);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    return CryptHashFinal(Context, Hash, SHA_256_HASH_LENGTH);
+}
+
+/*
+ * Takes the baseline of a modules .text section. This should be done once the
+ * module has been validated against its on disk image i.e during the first
+ * full sweep. A PagesPerSweep of 0 selects BASELINE_DEFAULT_PAGES_PER_SWEEP.
+ */
+NTSTATUS
+BaselineCreateModulePageHashes(_In_ PVOID                   TextBase,
+                               _In_ UINT32                  TextSize,
+                               _In_ UINT32                  PagesPerSweep,
+                               _Out_ PMODULE_PAGE_BASELINE* Baseline)
+{
+    PAGED_CODE();
+
+    NTSTATUS              status = STATUS_UNSUCCESSFUL;
+    PMODULE_PAGE_BASELINE baseline = NULL;
+    PCRYPT_HASH_CONTEXT   context = NULL;
+    PVOID                 scratch = NULL;
+    UINT32                page_count = 0;
+
+    *Baseline = NULL;
+
+    if (!TextBase || !TextSize)
+        return STATUS_INVALID_PARAMETER;
+
+    page_count = (TextSize + BASELINE_PAGE_SIZE - 1) / BASELINE_PAGE_SIZE;
+
+    baseline = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(MODULE_PAGE_BASELINE) +
+            (SIZE_T)page_count * SHA_256_HASH_LENGTH,
+        POOL_TAG_BASELINE);
+
+    if (!baseline)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    scratch = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, BASELINE_PAGE_SIZE, POOL_TAG_BASELINE);
+
+    if (!scratch) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    context = CryptAcquireHashContext();
+
+    if (!context) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    baseline->text_size = TextSize;
+    baseline->page_count = page_count;
+    baseline->pages_per_sweep =
+        PagesPerSweep ? PagesPerSweep : BASELINE_DEFAULT_PAGES_PER_SWEEP;
+
+    if (baseline->pages_per_sweep > page_count)
+        baseline->pages_per_sweep = page_count;
+
+    BaselinepRandomiseVisitOrder(baseline);
+
+    for (UINT32 page = 0; page < page_count; page++) {
+        status = BaselinepHashPage(
+            context,
+            (PVOID)((UINT64)TextBase + (UINT64)page * BASELINE_PAGE_SIZE),
+            BaselinepGetPageLength(baseline, page),
+            scratch,
+            baseline->hashes[page]);
+
+        if (!NT_SUCCESS(status))
+            goto end;
+    }
+
+    *Baseline = baseline;
+
+end:
+    if (context)
+        CryptReleaseHashContext(context);
+
+    if (scratch)
+        ImpExFreePoolWithTag(scratch, POOL_TAG_BASELINE);
+
+    if (!NT_SUCCESS(status))
+        ImpExFreePoolWithTag(baseline, POOL_TAG_BASELINE);
+
+    return status;
+}
+
+VOID
+BaselineFreeModulePageHashes(_In_ PMODULE_PAGE_BASELINE Baseline)
+{
+    ImpExFreePoolWithTag(Baseline, POOL_TAG_BASELINE);
+}
+
+/*
+ * Verifies the next pages_per_sweep pages against the baseline. On return
+ * MismatchOffset is either the offset within .text of the first modified
+ * page, or BASELINE_NO_MISMATCH. A page that cannot be copied is counted and
+ * skipped, so it is retried when the cursor next comes round to it. The
+ * caller is responsible for ensuring the module is not unloaded for the
+ * duration.
+ */
+NTSTATUS
+BaselineVerifyModulePages(_Inout_ PMODULE_PAGE_BASELINE Baseline,
+                          _In_ PVOID                    TextBase,
+                          _Out_ PUINT32                 MismatchOffset)
+{
+    PAGED_CODE();
+
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    PCRYPT_HASH_CONTEXT context = NULL;
+    PVOID               scratch = NULL;
+    UINT32              page = 0;
+    UCHAR               hash[SHA_256_HASH_LENGTH] = {0};
+
+    *MismatchOffset = BASELINE_NO_MISMATCH;
+
+    scratch = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, BASELINE_PAGE_SIZE, POOL_TAG_BASELINE);
+
+    if (!scratch)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    context = CryptAcquireHashContext();
+
+    if (!context) {
+        ImpExFreePoolWithTag(scratch, POOL_TAG_BASELINE);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (UINT32 index = 0; index < Baseline->pages_per_sweep; index++) {
+        page = (UINT32)(((UINT64)Baseline->cursor * Baseline->stride +
+                         Baseline->start) %
+                        Baseline->page_count);
+
+        status = BaselinepHashPage(
+            context,
+            (PVOID)((UINT64)TextBase + (UINT64)page * BASELINE_PAGE_SIZE),
+            BaselinepGetPageLength(Baseline, page),
+            scratch,
+            hash);
+
+        if (!NT_SUCCESS(status) && status != STATUS_PARTIAL_COPY)
+            goto end;
+
+        Baseline->cursor = (Baseline->cursor + 1) % Baseline->page_count;
+
+        if (status == STATUS_PARTIAL_COPY) {
+            Baseline->unreadable_pages++;
+            continue;
+        }
+
+        if (IntCompareMemory(hash, Baseline->hashes[page], sizeof(hash)) !=
+            sizeof(hash)) {
+            *MismatchOffset = page * BASELINE_PAGE_SIZE;
+            DEBUG_WARNING("Modified .text page at offset %lx", *MismatchOffset);
+            break;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+end:
+    CryptReleaseHashContext(context);
+    ImpExFreePoolWithTag(scratch, POOL_TAG_BASELINE);
+    return status;
+}
+
+/*
+ * Verifies the given pages against the baseline, independent of the sweep
+ * cursor. Used when the caller can tell which pages may have changed. On
+ * return MismatchOffset is either the offset of the first modified page, or
+ * BASELINE_NO_MISMATCH.
+ */
+NTSTATUS
+BaselineVerifyModulePageList(_In_ PMODULE_PAGE_BASELINE Baseline,
+                             _In_ PVOID                 TextBase,
+                             _In_reads_(Count) PUINT32  Pages,
+                             _In_ UINT32                Count,
+                             _Out_ PUINT32              MismatchOffset)
+{
+    PAGED_CODE();
+
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    PCRYPT_HASH_CONTEXT context = NULL;
+    PVOID               scratch = NULL;
+    UINT32              page = 0;
+    UCHAR               hash[SHA_256_HASH_LENGTH] = {0};
+
+    *MismatchOffset = BASELINE_NO_MISMATCH;
+
+    if (!Count)
+        return STATUS_SUCCESS;
+
+    scratch = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, BASELINE_PAGE_SIZE, POOL_TAG_BASELINE);
+
+    if (!scratch)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    context = CryptAcquireHashContext();
+
+    if (!context) {
+        ImpExFreePoolWithTag(scratch, POOL_TAG_BASELINE);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (UINT32 index = 0; index < Count; index++) {
+        page = Pages[index];
+
+        if (page >= Baseline->page_count) {
+            status = STATUS_INVALID_PARAMETER;
+            goto end;
+        }
+
+        status = BaselinepHashPage(
+            context,
+            (PVOID)((UINT64)TextBase + (UINT64)page * BASELINE_PAGE_SIZE),
+            BaselinepGetPageLength(Baseline, page),
+            scratch,
+            hash);
+
+        if (!NT_SUCCESS(status))
+            goto end;
+
+        if (IntCompareMemory(hash, Baseline->hashes[page], sizeof(hash)) !=
+            sizeof(hash)) {
+            *MismatchOffset = page * BASELINE_PAGE_SIZE;
+            DEBUG_WARNING("Modified page at offset %lx", *MismatchOffset);
+            break;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+end:
+    CryptReleaseHashContext(context);
+    ImpExFreePoolWithTag(scratch, POOL_TAG_BASELINE);
+    return status;
+}
+
+VOID
+BaselineReportModifiedPage(_In_ PVOID  ImageBase,
+                           _In_ UINT32 ImageSize,
+                           _In_ PCHAR  ModulePath,
+                           _In_ UINT32 TextOffset,
+                           _In_ UINT32 PageOffset)
+{
+    NTSTATUS                             status = STATUS_UNSUCCESSFUL;
+    PSYSTEM_MODULE_PAGE_INTEGRITY_REPORT report = NULL;
+    UINT32                               packet_size =
+        CryptRequestRequiredBufferLength(
+            sizeof(SYSTEM_MODULE_PAGE_INTEGRITY_REPORT));
+
+    /* a patched page is found again on every sweep until it is restored */
+    if (!ReportShouldSchedule(REPORT_PATCHED_SYSTEM_MODULE,
+                              REPORT_SUBTYPE_PATCHED_PAGE,
+                              (UINT64)ImageBase,
+                              PageOffset))
+        return;
+
+    report = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, packet_size, REPORT_POOL_TAG);
+
+    if (!report)
+        return;
+
+    INIT_REPORT_PACKET(
+        report, REPORT_PATCHED_SYSTEM_MODULE, REPORT_SUBTYPE_PATCHED_PAGE);
+
+    report->image_base = (UINT64)ImageBase;
+    report->image_size = ImageSize;
+    report->text_offset = TextOffset;
+    report->page_offset = PageOffset;
+
+    IntCopyMemory(report->path_name,
+                  ModulePath,
+                  IntStringLength(ModulePath, sizeof(report->path_name) - 1));
+
+    status = CryptEncryptBuffer(report, packet_size);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("CryptEncryptBuffer: %lx", status);
+        ImpExFreePoolWithTag(report, REPORT_POOL_TAG);
+        return;
+    }
+
+    IrpQueueSchedulePacket(report, packet_size);
+}
@@ -39,127 +39,36 @@ CryptXorKeyGenerate_uint64()
     return CryptGenerateRandomKey64(&seed);
 }
 
+/*
+ * Each entry is encrypted with its own key derived from the imports key, so
+ * an entry can be decrypted with a single rotate and xor without touching
+ * the rest of its block.
+ */
 VOID
 CryptEncryptImportsArray(_In_ PUINT64 Array, _In_ UINT32 Entries)
 {
     __m256i* imports_key = GetDriverImportsKey();
-    UINT32 block_size = sizeof(__m256i) / sizeof(UINT64);
-    UINT32 block_count = Entries / block_size;
 
     *imports_key = CryptXorKeyGenerate_m256i();
 
-    /*
-     * Here we break down the import array into blocks of 32 bytes. Each
-     * block is loaded into an SSE register, xored with the key, and then
-     * copied back into the array.
-     */
-    for (UINT32 block_index = 0; block_index < block_count; block_index++) {
-        __m256i current_block = {0};
-        __m256i load_block = {0};
-        __m256i xored_block = {0};
-
-        IntCopyMemory(
-            &current_block,
-            &Array[block_index * block_size],
-            sizeof(__m256i));
-
-        load_block = _mm256_loadu_si256(&current_block);
-        xored_block = _mm256_xor_si256(load_block, *imports_key);
-
-        IntCopyMemory(
-            &Array[block_index * block_size],
-            &xored_block,
-            sizeof(__m256i));
-    }
-}
-
-STATIC
-INLINE
-__m256i
-CryptDecryptImportBlock(_In_ PUINT64 Array, _In_ UINT32 BlockIndex)
-{
-    __m256i load_block = {0};
-    __m256i* imports_key = GetDriverImportsKey();
-    UINT32 block_size = sizeof(__m256i) / sizeof(UINT64);
-
-    IntCopyMemory(
-        &load_block,
-        &Array[BlockIndex * block_size],
-        sizeof(__m256i));
-
-    return _mm256_xor_si256(load_block, *imports_key);
-}
-
-FORCEINLINE
-INLINE
-VOID
-CryptFindContainingBlockForArrayIndex(
-    _In_ UINT32 EntryIndex,
-    _In_ UINT32 BlockSize,
-    _Out_ PUINT32 ContainingBlockIndex,
-    _Out_ PUINT32 BlockSubIndex)
-{
-    UINT32 containing_block = EntryIndex;
-    UINT32 block_index = 0;
-
-    if (EntryIndex < BlockSize) {
-        *ContainingBlockIndex = 0;
-        *BlockSubIndex = EntryIndex;
-        return;
-    }
-
-    if (EntryIndex == BlockSize) {
-        *ContainingBlockIndex = 1;
-        *BlockSubIndex = 0;
-        return;
-    }
-
-    while (containing_block % BlockSize != 0) {
-        containing_block--;
-        block_index++;
-    }
-
-    *ContainingBlockIndex = containing_block / BlockSize;
-    *BlockSubIndex = block_index;
+    for (UINT32 index = 0; index < Entries; index++)
+        CryptEncryptPointer64(
+            &Array[index],
+            CryptDeriveImportEntryKey((PUINT64)imports_key, index));
 }
 
+/*
+ * Out of line variant of CryptDecryptImportEntry, for callers without access
+ * to the imports key.
+ */
 UINT64
 CryptDecryptImportsArrayEntry(
     _In_ PUINT64 Array, _In_ UINT32 Entries, _In_ UINT32 EntryIndex)
 {
-    __m256i original_block = {0};
-    __m128i original_half = {0};
-    UINT32 block_size = sizeof(__m256i) / sizeof(UINT64);
-    UINT32 containing_block_index = 0;
-    UINT32 block_sub_index = 0;
-    UINT64 pointer = 0;
-
-    CryptFindContainingBlockForArrayIndex(
-        EntryIndex,
-        block_size,
-        &containing_block_index,
-        &block_sub_index);
-
-    original_block = CryptDecryptImportBlock(Array, containing_block_index);
-
-    if (block_sub_index < 2) {
-        original_half = _mm256_extracti128_si256(original_block, 0);
-
-        if (block_sub_index < 1)
-            pointer = _mm_extract_epi64(original_half, 0);
-        else
-            pointer = _mm_extract_epi64(original_half, 1);
-    }
-    else {
-        original_half = _mm256_extracti128_si256(original_block, 1);
+    UNREFERENCED_PARAMETER(Entries);
 
-        if (block_sub_index == 2)
-            pointer = _mm_extract_epi64(original_half, 0);
-        else
-            pointer = _mm_extract_epi64(original_half, 1);
-    }
-
-    return pointer;
+    return CryptDecryptImportEntry(
+        Array, (PUINT64)GetDriverImportsKey(), EntryIndex);
 }
 
 STATIC
@@ -210,27 +119,195 @@ CryptRequestRequiredBufferLength(_In_ UINT32 BufferLength)
            AES_256_BLOCK_SIZE;
 }
 
-/* Encrypts in place! */
+/*
+ * CBC encryption is serial within a packet, but every packet is encrypted
+ * independently starting from the session IV. With AES-NI we exploit this by
+ * encrypting CRYPT_AES_NI_LANES packets at once, interleaving the rounds of
+ * each so the latency of one aesenc is hidden behind the others. The output
+ * is identical to encrypting each packet with BCryptEncrypt.
+ */
+#define CRYPT_AES_256_ROUNDS 14
+#define CRYPT_AES_NI_LANES   4
+
+#define CryptpAesNiExpandKey256Odd(t1, t3, rcon)                \
+    {                                                           \
+        __m128i t2 = _mm_aeskeygenassist_si128((t3), (rcon));   \
+        t2 = _mm_shuffle_epi32(t2, 0xFF);                       \
+        t1 = _mm_xor_si128(t1, _mm_slli_si128(t1, 4));          \
+        t1 = _mm_xor_si128(t1, _mm_slli_si128(t1, 8));          \
+        t1 = _mm_xor_si128(t1, t2);                             \
+    }
+
+#define CryptpAesNiExpandKey256Even(t1, t3)                     \
+    {                                                           \
+        __m128i t2 = _mm_aeskeygenassist_si128((t1), 0x00);     \
+        t2 = _mm_shuffle_epi32(t2, 0xAA);                       \
+        t3 = _mm_xor_si128(t3, _mm_slli_si128(t3, 4));          \
+        t3 = _mm_xor_si128(t3, _mm_slli_si128(t3, 8));          \
+        t3 = _mm_xor_si128(t3, t2);                             \
+    }
+
+STATIC
+VOID
+CryptpAesNiExpandKey256(_In_ PUCHAR Key, _Out_ __m128i* RoundKeys)
+{
+    __m128i t1 = _mm_loadu_si128((__m128i*)Key);
+    __m128i t3 = _mm_loadu_si128((__m128i*)(Key + 16));
+
+    RoundKeys[0] = t1;
+    RoundKeys[1] = t3;
+
+    CryptpAesNiExpandKey256Odd(t1, t3, 0x01);
+    RoundKeys[2] = t1;
+    CryptpAesNiExpandKey256Even(t1, t3);
+    RoundKeys[3] = t3;
+    CryptpAesNiExpandKey256Odd(t1, t3, 0x02);
+    RoundKeys[4] = t1;
+    CryptpAesNiExpandKey256Even(t1, t3);
+    RoundKeys[5] = t3;
+    CryptpAesNiExpandKey256Odd(t1, t3, 0x04);
+    RoundKeys[6] = t1;
+    CryptpAesNiExpandKey256Even(t1, t3);
+    RoundKeys[7] = t3;
+    CryptpAesNiExpandKey256Odd(t1, t3, 0x08);
+    RoundKeys[8] = t1;
+    CryptpAesNiExpandKey256Even(t1, t3);
+    RoundKeys[9] = t3;
+    CryptpAesNiExpandKey256Odd(t1, t3, 0x10);
+    RoundKeys[10] = t1;
+    CryptpAesNiExpandKey256Even(t1, t3);
+    RoundKeys[11] = t3;
+    CryptpAesNiExpandKey256Odd(t1, t3, 0x20);
+    RoundKeys[12] = t1;
+    CryptpAesNiExpandKey256Even(t1, t3);
+    RoundKeys[13] = t3;
+    CryptpAesNiExpandKey256Odd(t1, t3, 0x40);
+    RoundKeys[14] = t1;
+}
+
+typedef struct _CRYPT_AES_NI_LANE {
+    PUCHAR  block;
+    UINT32  remaining;
+    __m128i chain;
+
+} CRYPT_AES_NI_LANE, *PCRYPT_AES_NI_LANE;
+
+/* Returns FALSE once there are no packets left to assign to the lane. */
+FORCEINLINE
+STATIC
+BOOLEAN
+CryptpAesNiAssignLane(_Out_ PCRYPT_AES_NI_LANE Lane,
+                      _In_ PVOID*              Buffers,
+                      _In_ PUINT32             Lengths,
+                      _In_ UINT32              Count,
+                      _Inout_ PUINT32          Next,
+                      _In_ __m128i             Iv)
+{
+    while (*Next < Count) {
+        Lane->block = (PUCHAR)Buffers[*Next] + AES_256_BLOCK_SIZE;
+        Lane->remaining = Lengths[*Next] / AES_256_BLOCK_SIZE - 1;
+        Lane->chain = Iv;
+        (*Next)++;
+
+        if (Lane->remaining)
+            return TRUE;
+    }
+
+    Lane->remaining = 0;
+    return FALSE;
+}
+
+/*
+ * Lengths must each be a non zero multiple of AES_256_BLOCK_SIZE, which is
+ * guaranteed for buffers sized via CryptRequestRequiredBufferLength.
+ */
+STATIC
+VOID
+CryptpAesNiEncryptPackets(_In_ PACTIVE_SESSION   Session,
+                          _Inout_ PVOID*         Buffers,
+                          _In_ PUINT32           Lengths,
+                          _In_ UINT32            Count)
+{
+    __m128i*          keys = (__m128i*)Session->round_keys;
+    __m128i           iv = _mm_loadu_si128((__m128i*)Session->iv);
+    CRYPT_AES_NI_LANE lanes[CRYPT_AES_NI_LANES] = {0};
+    __m128i           state[CRYPT_AES_NI_LANES] = {0};
+    UINT32            next = 0;
+    UINT32            active = 0;
+
+    for (UINT32 lane = 0; lane < CRYPT_AES_NI_LANES; lane++) {
+        if (CryptpAesNiAssignLane(
+                &lanes[lane], Buffers, Lengths, Count, &next, iv))
+            active++;
+    }
+
+    while (active) {
+        /* idle lanes encrypt a zero block whose result is discarded, this
+         * keeps the round loop free of branches */
+        for (UINT32 lane = 0; lane < CRYPT_AES_NI_LANES; lane++) {
+            state[lane] =
+                lanes[lane].remaining
+                    ? _mm_xor_si128(
+                          _mm_loadu_si128((__m128i*)lanes[lane].block),
+                          lanes[lane].chain)
+                    : _mm_setzero_si128();
+
+            state[lane] = _mm_xor_si128(state[lane], keys[0]);
+        }
+
+        for (UINT32 round = 1; round < CRYPT_AES_256_ROUNDS; round++) {
+            state[0] = _mm_aesenc_si128(state[0], keys[round]);
+            state[1] = _mm_aesenc_si128(state[1], keys[round]);
+            state[2] = _mm_aesenc_si128(state[2], keys[round]);
+            state[3] = _mm_aesenc_si128(state[3], keys[round]);
+        }
+
+        state[0] = _mm_aesenclast_si128(state[0], keys[CRYPT_AES_256_ROUNDS]);
+        state[1] = _mm_aesenclast_si128(state[1], keys[CRYPT_AES_256_ROUNDS]);
+        state[2] = _mm_aesenclast_si128(state[2], keys[CRYPT_AES_256_ROUNDS]);
+        state[3] = _mm_aesenclast_si128(state[3], keys[CRYPT_AES_256_ROUNDS]);
+
+        for (UINT32 lane = 0; lane < CRYPT_AES_NI_LANES; lane++) {
+            if (!lanes[lane].remaining)
+                continue;
+
+            _mm_storeu_si128((__m128i*)lanes[lane].block, state[lane]);
+            lanes[lane].chain = state[lane];
+            lanes[lane].block += AES_256_BLOCK_SIZE;
+
+            if (--lanes[lane].remaining)
+                continue;
+
+            if (!CryptpAesNiAssignLane(
+                    &lanes[lane], Buffers, Lengths, Count, &next, iv))
+                active--;
+        }
+    }
+}
+
+STATIC
 NTSTATUS
-CryptEncryptBuffer(_In_ PVOID Buffer, _In_ UINT32 BufferLength)
+CryptpBCryptEncryptBuffer(_In_ PACTIVE_SESSION Session,
+                          _In_ PVOID           Buffer,
+                          _In_ UINT32          BufferLength)
 {
     NTSTATUS status = STATUS_UNSUCCESSFUL;
     UINT32 data_copied = 0;
-    PACTIVE_SESSION session = GetActiveSession();
-    UCHAR local_iv[sizeof(session->iv)] = {0};
+    UCHAR local_iv[sizeof(Session->iv)] = {0};
     UINT64 buffer = (UINT64)Buffer;
     UINT32 length = BufferLength;
 
     /* The IV is consumed during every encrypt / decrypt procedure, so to ensure
      * we have access to the iv we need to create a local copy.*/
-    IntCopyMemory(local_iv, session->iv, sizeof(session->iv));
+    _mm_storeu_si128(
+        (__m128i*)local_iv, _mm_loadu_si128((__m128i*)Session->iv));
 
     /* We arent encrypting the first 16 bytes */
     buffer = buffer + AES_256_BLOCK_SIZE;
     length = length - AES_256_BLOCK_SIZE;
 
     status = BCryptEncrypt(
-        session->key_handle,
+        Session->key_handle,
         buffer,
         length,
         NULL,
@@ -247,6 +324,63 @@ CryptEncryptBuffer(_In_ PVOID Buffer, _In_ UINT32 BufferLength)
     return status;
 }
 
+FORCEINLINE
+STATIC
+BOOLEAN
+CryptpIsValidPacketLength(_In_ UINT32 Length)
+{
+    return Length >= AES_256_BLOCK_SIZE && !(Length % AES_256_BLOCK_SIZE);
+}
+
+/* Encrypts in place! */
+NTSTATUS
+CryptEncryptBuffer(_In_ PVOID Buffer, _In_ UINT32 BufferLength)
+{
+    PACTIVE_SESSION session = GetActiveSession();
+
+    if (session->aes_ni && CryptpIsValidPacketLength(BufferLength)) {
+        CryptpAesNiEncryptPackets(session, &Buffer, &BufferLength, 1);
+        return STATUS_SUCCESS;
+    }
+
+    return CryptpBCryptEncryptBuffer(session, Buffer, BufferLength);
+}
+
+/*
+ * Encrypts Count packets in place, leaving each 16 byte header in cleartext.
+ * Equivalent to calling CryptEncryptBuffer on each, but when AES-NI is
+ * available the packets are encrypted together with no CNG calls at all.
+ */
+NTSTATUS
+CryptEncryptBufferBatch(_Inout_updates_(Count) PVOID* Buffers,
+                        _In_reads_(Count) PUINT32     Lengths,
+                        _In_ UINT32                   Count)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PACTIVE_SESSION session = GetActiveSession();
+
+    if (session->aes_ni) {
+        for (UINT32 index = 0; index < Count; index++) {
+            if (!CryptpIsValidPacketLength(Lengths[index]))
+                goto fallback;
+        }
+
+        CryptpAesNiEncryptPackets(session, Buffers, Lengths, Count);
+        return STATUS_SUCCESS;
+    }
+
+fallback:
+    for (UINT32 index = 0; index < Count; index++) {
+        status = CryptpBCryptEncryptBuffer(
+            session, Buffers[index], Lengths[index]);
+
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    return status;
+}
+
 /* Lock is held */
 VOID
 CryptCloseSessionCryptObjects()
@@ -264,6 +398,11 @@ CryptCloseSessionCryptObjects()
     }
 
     session->key_object_length = 0;
+
+    if (session->aes_ni) {
+        RtlSecureZeroMemory(session->round_keys, sizeof(session->round_keys));
+        session->aes_ni = FALSE;
+    }
 }
 
 NTSTATUS
@@ -325,6 +464,12 @@ CryptInitialiseSessionCryptObjects()
         goto end;
     }
 
+    /* the CNG key is retained for packets the AES-NI path cannot handle */
+    if (IntIsAesNiSupported()) {
+        CryptpAesNiExpandKey256(session->aes_key, (__m128i*)session->round_keys);
+        session->aes_ni = TRUE;
+    }
+
 end:
     if (blob)
         ExFreePoolWithTag(blob, POOL_TAG_CRYPT);
@@ -519,137 +664,296 @@ TpmExtractEndorsementKey()
     return status;
 }
 
+STATIC CRYPT_HASH_CONTEXT_CACHE g_HashContextCache = {0};
+
 NTSTATUS
-CryptHashBuffer_sha256(
-    _In_ PVOID Buffer,
-    _In_ ULONG BufferSize,
-    _Out_ PVOID* HashResult,
-    _Out_ PULONG HashResultSize)
+CryptCreateHashContext(_Out_ PCRYPT_HASH_CONTEXT Context)
 {
-    PAGED_CODE();
-
     NTSTATUS status = STATUS_UNSUCCESSFUL;
     BCRYPT_ALG_HANDLE* algo_handle = GetCryptHandle_Sha256();
-    BCRYPT_HASH_HANDLE hash_handle = NULL;
     ULONG bytes_copied = 0;
-    ULONG resulting_hash_size = 0;
-    ULONG hash_object_size = 0;
-    PCHAR hash_object = NULL;
-    PCHAR resulting_hash = NULL;
 
-    *HashResult = NULL;
-    *HashResultSize = 0;
+    Context->handle = NULL;
+    Context->object = NULL;
+    Context->object_size = 0;
+    Context->dirty = FALSE;
+    Context->cache_index = CRYPT_HASH_CONTEXT_NOT_CACHED;
 
-    /*
-     * Request the size of the hash object buffer, this is different then
-     * the buffer that will store the resulting hash, instead this will be
-     * used to store the hash object used to create the hash.
-     */
     status = BCryptGetProperty(
         *algo_handle,
         BCRYPT_OBJECT_LENGTH,
-        (PCHAR)&hash_object_size,
+        (PCHAR)&Context->object_size,
         sizeof(ULONG),
         &bytes_copied,
         NULL);
 
     if (!NT_SUCCESS(status)) {
         DEBUG_ERROR("BCryptGetProperty failed with status %x", status);
-        goto end;
+        return status;
     }
 
-    hash_object = ImpExAllocatePool2(
+    Context->object = ImpExAllocatePool2(
         POOL_FLAG_NON_PAGED,
-        hash_object_size,
-        POOL_TAG_INTEGRITY);
+        Context->object_size,
+        POOL_TAG_HASH_OBJECT);
 
-    if (!hash_object) {
-        status = STATUS_MEMORY_NOT_ALLOCATED;
-        goto end;
-    }
+    if (!Context->object)
+        return STATUS_INSUFFICIENT_RESOURCES;
 
-    /*
-     * This call gets the size of the resulting hash, which we will use to
-     * allocate the resulting hash buffer.
-     */
-    status = BCryptGetProperty(
+    status = BCryptCreateHash(
         *algo_handle,
-        BCRYPT_HASH_LENGTH,
-        (PCHAR)&resulting_hash_size,
-        sizeof(ULONG),
-        &bytes_copied,
-        NULL);
+        &Context->handle,
+        Context->object,
+        Context->object_size,
+        NULL,
+        0,
+        BCRYPT_HASH_REUSABLE_FLAG);
 
     if (!NT_SUCCESS(status)) {
-        DEBUG_ERROR("BCryptGetProperty failed with status %x", status);
-        goto end;
+        DEBUG_ERROR("BCryptCreateHash failed with status %x", status);
+        ImpExFreePoolWithTag(Context->object, POOL_TAG_HASH_OBJECT);
+        Context->object = NULL;
+        Context->handle = NULL;
+        return status;
     }
 
-    resulting_hash = ImpExAllocatePool2(
-        POOL_FLAG_NON_PAGED,
-        resulting_hash_size,
-        POOL_TAG_INTEGRITY);
+    return STATUS_SUCCESS;
+}
 
-    if (!resulting_hash) {
-        status = STATUS_MEMORY_NOT_ALLOCATED;
-        goto end;
+VOID
+CryptDestroyHashContext(_Inout_ PCRYPT_HASH_CONTEXT Context)
+{
+    if (Context->handle) {
+        BCryptDestroyHash(Context->handle);
+        Context->handle = NULL;
     }
 
-    /*
-     * Here we create our hash object and store it in the hash_object
-     * buffer.
-     */
-    status = BCryptCreateHash(
-        *algo_handle,
-        &hash_handle,
-        hash_object,
-        hash_object_size,
-        NULL,
-        NULL,
-        NULL);
+    if (Context->object) {
+        ImpExFreePoolWithTag(Context->object, POOL_TAG_HASH_OBJECT);
+        Context->object = NULL;
+    }
+}
 
-    if (!NT_SUCCESS(status)) {
-        DEBUG_ERROR("BCryptCreateHash failed with status %x", status);
-        goto end;
+/* Must be called after the SHA256 provider has been opened. */
+NTSTATUS
+CryptInitialiseHashContextCache()
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    PCRYPT_HASH_CONTEXT_CACHE cache = &g_HashContextCache;
+    LONG free_mask = 0;
+
+    for (UINT32 index = 0; index < CRYPT_HASH_CONTEXT_CACHE_SIZE; index++) {
+        status = CryptCreateHashContext(&cache->contexts[index]);
+
+        if (!NT_SUCCESS(status)) {
+            DEBUG_ERROR("CryptCreateHashContext: %x", status);
+            break;
+        }
+
+        cache->contexts[index].cache_index = index;
+        free_mask |= 1l << index;
     }
 
-    /*
-     * This function hashes the buffer, but does NOT store it in our
-     * resulting buffer yet, we need to call BCryptFinishHash to retrieve
-     * the final hash.
-     */
-    status = BCryptHashData(hash_handle, Buffer, BufferSize, NULL);
+    /* a partially populated cache is still usable */
+    InterlockedExchange(&cache->free_mask, free_mask);
+    return free_mask ? STATUS_SUCCESS : status;
+}
 
-    if (!NT_SUCCESS(status)) {
-        DEBUG_ERROR("BCryptHashData failed with status %x", status);
-        goto end;
+/* All contexts must have been released. */
+VOID
+CryptFreeHashContextCache()
+{
+    PCRYPT_HASH_CONTEXT_CACHE cache = &g_HashContextCache;
+
+    InterlockedExchange(&cache->free_mask, 0);
+
+    for (UINT32 index = 0; index < CRYPT_HASH_CONTEXT_CACHE_SIZE; index++)
+        CryptDestroyHashContext(&cache->contexts[index]);
+}
+
+/*
+ * Returns a free cached context, or if all are in use (or the cache has not
+ * been initialised) a newly created one which is destroyed on release.
+ * Returns NULL on failure.
+ */
+PCRYPT_HASH_CONTEXT
+CryptAcquireHashContext()
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    PCRYPT_HASH_CONTEXT_CACHE cache = &g_HashContextCache;
+    PCRYPT_HASH_CONTEXT context = NULL;
+    LONG free_mask = 0;
+    ULONG index = 0;
+
+    while ((free_mask = cache->free_mask) != 0) {
+        _BitScanForward(&index, (ULONG)free_mask);
+
+        if (InterlockedCompareExchange(
+                &cache->free_mask, free_mask & ~(1l << index), free_mask) ==
+            free_mask)
+            return &cache->contexts[index];
     }
 
-    /*
-     * As said in the previous comment, this is where we retrieve the final
-     * hash and store it in our output buffer.
-     */
-    status = BCryptFinishHash(
-        hash_handle,
-        resulting_hash,
-        resulting_hash_size,
-        NULL);
+    context = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(CRYPT_HASH_CONTEXT),
+        POOL_TAG_HASH_OBJECT);
+
+    if (!context)
+        return NULL;
+
+    status = CryptCreateHashContext(context);
 
     if (!NT_SUCCESS(status)) {
-        DEBUG_ERROR("BCryptFinishHash failed with status %x", status);
-        goto end;
+        ImpExFreePoolWithTag(context, POOL_TAG_HASH_OBJECT);
+        return NULL;
     }
 
-    *HashResult = resulting_hash;
-    *HashResultSize = resulting_hash_size;
+    return context;
+}
 
-end:
+VOID
+CryptReleaseHashContext(_In_ PCRYPT_HASH_CONTEXT Context)
+{
+    /* leave the context ready for the next user */
+    if (Context->dirty)
+        CryptHashInit(Context);
+
+    if (Context->cache_index != CRYPT_HASH_CONTEXT_NOT_CACHED) {
+        InterlockedOr(
+            &g_HashContextCache.free_mask, 1l << Context->cache_index);
+        return;
+    }
 
-    if (hash_handle)
-        BCryptDestroyHash(hash_handle);
+    CryptDestroyHashContext(Context);
+    ImpExFreePoolWithTag(Context, POOL_TAG_HASH_OBJECT);
+}
+
+/*
+ * Reusable hash objects are reset by BCryptFinishHash, so this only has work
+ * to do if a previous hash was abandoned part way through.
+ */
+NTSTATUS
+CryptHashInit(_Inout_ PCRYPT_HASH_CONTEXT Context)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    UCHAR discard[SHA_256_HASH_LENGTH] = {0};
 
-    if (hash_object)
-        ImpExFreePoolWithTag(hash_object, POOL_TAG_INTEGRITY);
+    if (Context->dirty) {
+        status = BCryptFinishHash(
+            Context->handle, discard, sizeof(discard), 0);
+        Context->dirty = FALSE;
+    }
 
     return status;
-}
\ No newline at end of file
+}
+
+NTSTATUS
+CryptHashUpdate(
+    _Inout_ PCRYPT_HASH_CONTEXT Context,
+    _In_ PVOID Buffer,
+    _In_ ULONG BufferSize)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    Context->dirty = TRUE;
+    status = BCryptHashData(Context->handle, Buffer, BufferSize, 0);
+
+    if (!NT_SUCCESS(status))
+        DEBUG_ERROR("BCryptHashData failed with status %x", status);
+
+    return status;
+}
+
+NTSTATUS
+CryptHashFinal(
+    _Inout_ PCRYPT_HASH_CONTEXT Context,
+    _Out_ PVOID Hash,
+    _In_ ULONG HashSize)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    if (HashSize < SHA_256_HASH_LENGTH)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    status = BCryptFinishHash(Context->handle, Hash, SHA_256_HASH_LENGTH, 0);
+    Context->dirty = FALSE;
+
+    if (!NT_SUCCESS(status))
+        DEBUG_ERROR("BCryptFinishHash failed with status %x", status);
+
+    return status;
+}
+
+/* Hashes Buffer into the caller supplied Hash of at least
+ * SHA_256_HASH_LENGTH bytes. */
+NTSTATUS
+CryptHashBufferEx_sha256(
+    _In_ PVOID Buffer,
+    _In_ ULONG BufferSize,
+    _Out_ PVOID Hash,
+    _In_ ULONG HashSize)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    PCRYPT_HASH_CONTEXT context = NULL;
+
+    if (HashSize < SHA_256_HASH_LENGTH)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    context = CryptAcquireHashContext();
+
+    if (!context)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    status = CryptHashUpdate(context, Buffer, BufferSize);
+
+    if (NT_SUCCESS(status))
+        status = CryptHashFinal(context, Hash, HashSize);
+
+    CryptReleaseHashContext(context);
+    return status;
+}
+
+/*
+ * Retained for existing callers, the resulting hash is allocated from pool
+ * and must be freed by the caller. New code should prefer
+ * CryptHashBufferEx_sha256.
+ */
+NTSTATUS
+CryptHashBuffer_sha256(
+    _In_ PVOID Buffer,
+    _In_ ULONG BufferSize,
+    _Out_ PVOID* HashResult,
+    _Out_ PULONG HashResultSize)
+{
+    PAGED_CODE();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    PCHAR resulting_hash = NULL;
+
+    *HashResult = NULL;
+    *HashResultSize = 0;
+
+    resulting_hash = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        SHA_256_HASH_LENGTH,
+        POOL_TAG_INTEGRITY);
+
+    if (!resulting_hash)
+        return STATUS_MEMORY_NOT_ALLOCATED;
+
+    status = CryptHashBufferEx_sha256(
+        Buffer,
+        BufferSize,
+        resulting_hash,
+        SHA_256_HASH_LENGTH);
+
+    if (!NT_SUCCESS(status)) {
+        ImpExFreePoolWithTag(resulting_hash, POOL_TAG_INTEGRITY);
+        return status;
+    }
+
+    *HashResult = resulting_hash;
+    *HashResultSize = SHA_256_HASH_LENGTH;
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,317 @@
+#include "deferred.h"
+
+#include "imports.h"
+#include "integrity.h"
+#include "perf.h"
+#include "lib/stdlib.h"
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, DeferredHashInitialise)
+#    pragma alloc_text(PAGE, DeferredHashFree)
+#endif
+
+STATIC DEFERRED_HASH_QUEUE g_DeferredHashQueue = {0};
+
+STATIC
+VOID
+DeferredHashpWorkerRoutine(_In_ PDEVICE_OBJECT DeviceObject,
+                           _In_opt_ PVOID      Context);
+
+FORCEINLINE
+STATIC
+VOID
+DeferredHashpQueueSlice(_In_ PDEFERRED_HASH_QUEUE Queue)
+{
+    ImpIoQueueWorkItem(Queue->list->work_item,
+                       DeferredHashpWorkerRoutine,
+                       BackgroundWorkQueue,
+                       NULL);
+}
+
+/* May be called at IRQL <= DISPATCH_LEVEL. */
+STATIC
+VOID
+DeferredHashpKick(_In_ PDEFERRED_HASH_QUEUE Queue)
+{
+    if (!Queue->active || !ReadAcquire(&Queue->list->can_hash_x86))
+        return;
+
+    if (InterlockedCompareExchange(&Queue->state, 1, 0))
+        return;
+
+    DeferredHashpQueueSlice(Queue);
+}
+
+STATIC
+VOID
+DeferredHashpTimerDpc(_In_ PKDPC     Dpc,
+                      _In_opt_ PVOID DeferredContext,
+                      _In_opt_ PVOID SystemArgument1,
+                      _In_opt_ PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    /* the slice checks whether the queue is still active */
+    DeferredHashpQueueSlice((PDEFERRED_HASH_QUEUE)DeferredContext);
+}
+
+/*
+ * Records the result of hashing an entry taken off the queue. A failed entry
+ * is requeued at the tail, marked with the slice so it is not retried until
+ * the next one.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+STATIC
+VOID
+DeferredHashpRecordResult(_In_ PDRIVER_LIST_HEAD  List,
+                          _In_ PDRIVER_LIST_ENTRY Entry,
+                          _In_ UINT64             Slice,
+                          _In_ NTSTATUS           Status,
+                          _In_ PCHAR              Hash)
+{
+    PDEFERRED_HASH_STATISTICS statistics = &List->deferred_statistics;
+    UINT64                    latency = 0;
+
+    if (!NT_SUCCESS(Status)) {
+        DEBUG_ERROR("HashModule failed with status %x", Status);
+        statistics->failed++;
+
+        if (++Entry->deferred_attempts >= DEFERRED_HASH_MAX_ATTEMPTS) {
+            statistics->abandoned++;
+            return;
+        }
+
+        Entry->deferred_slice = Slice;
+        InsertTailList(&List->deferred_list, &Entry->deferred_entry);
+        List->deferred_count++;
+        return;
+    }
+
+    IntCopyMemory(Entry->text_hash, Hash, sizeof(Entry->text_hash));
+    Entry->hashed = TRUE;
+
+    latency = KeQueryInterruptTime() - Entry->deferred_time;
+
+    statistics->hashed++;
+    statistics->last_latency = latency;
+    statistics->max_latency = max(statistics->max_latency, latency);
+    statistics->total_latency += latency;
+}
+
+/*
+ * Hashes modules until the slice budget is spent, then yields to the timer.
+ * At least one module is hashed per slice so the queue always progresses.
+ * The slice also yields once it reaches a module it already failed to hash,
+ * so each retry is at least yield_interval after the last.
+ *
+ * Each module is taken off the queue and hashed without the list lock held.
+ * Driver list entries are only freed once DeferredHashFree has returned, so
+ * the entry remains valid until the lock is reacquired to record the result.
+ */
+STATIC
+VOID
+DeferredHashpWorkerRoutine(_In_ PDEVICE_OBJECT DeviceObject,
+                           _In_opt_ PVOID      Context)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Context);
+
+    NTSTATUS                 status = STATUS_UNSUCCESSFUL;
+    PDEFERRED_HASH_QUEUE     queue = &g_DeferredHashQueue;
+    PDRIVER_LIST_HEAD        list = queue->list;
+    PDRIVER_LIST_ENTRY       entry = NULL;
+    RTL_MODULE_EXTENDED_INFO module = {0};
+    CHAR                     hash[SHA_256_HASH_LENGTH] = {0};
+    LARGE_INTEGER            due = {0};
+    UINT64                   deadline = 0;
+    UINT64                   slice = 0;
+    UINT64                   start = 0;
+    BOOLEAN                  empty = FALSE;
+
+    /* microseconds to 100ns units */
+    deadline = KeQueryInterruptTime() + (UINT64)queue->slice_budget_us * 10;
+
+    ImpKeAcquireGuardedMutex(&list->lock);
+    slice = ++list->deferred_statistics.slices;
+    ImpKeReleaseGuardedMutex(&list->lock);
+
+    while (queue->active) {
+        ImpKeAcquireGuardedMutex(&list->lock);
+
+        if (IsListEmpty(&list->deferred_list)) {
+            list->deferred_complete = TRUE;
+
+            /* cleared under the lock, so a module deferred once it is
+             * released sees the state clear and queues the next slice */
+            InterlockedExchange(&queue->state, 0);
+            ImpKeReleaseGuardedMutex(&list->lock);
+            return;
+        }
+
+        entry = CONTAINING_RECORD(
+            list->deferred_list.Flink, DRIVER_LIST_ENTRY, deferred_entry);
+
+        /* every module left has been tried in this slice */
+        if (entry->deferred_slice == slice) {
+            ImpKeReleaseGuardedMutex(&list->lock);
+            goto yield;
+        }
+
+        RemoveHeadList(&list->deferred_list);
+        list->deferred_count--;
+        DriverListEntryToExtendedModuleInfo(entry, &module);
+        ImpKeReleaseGuardedMutex(&list->lock);
+
+        start = PerfBegin();
+        status = HashModule(&module, hash);
+        PerfRecord(PerfCounterDeferredModuleHash, start, module.ImageSize);
+
+        ImpKeAcquireGuardedMutex(&list->lock);
+        DeferredHashpRecordResult(list, entry, slice, status, hash);
+        empty = IsListEmpty(&list->deferred_list);
+        ImpKeReleaseGuardedMutex(&list->lock);
+
+        if (empty || KeQueryInterruptTime() < deadline)
+            continue;
+
+        goto yield;
+    }
+
+    /* unloading, DeferredHashFree may free the list once this is read */
+    InterlockedExchange(&queue->state, 0);
+    return;
+
+yield:
+    /* the state remains set, the timer queues the next slice */
+    due.QuadPart = RELATIVE(MILLISECONDS(queue->yield_interval_ms));
+    KeSetTimer(&queue->timer, due, &queue->dpc);
+}
+
+/*
+ * To be called from InitialiseDriverList once the list and its work item are
+ * initialised.
+ */
+NTSTATUS
+DeferredHashInitialise(_In_ PDRIVER_LIST_HEAD List)
+{
+    PAGED_CODE();
+
+    PDEFERRED_HASH_QUEUE queue = &g_DeferredHashQueue;
+
+    if (!List->work_item)
+        return STATUS_INVALID_PARAMETER;
+
+    queue->list = List;
+    queue->state = 0;
+
+    if (!queue->slice_budget_us)
+        queue->slice_budget_us = DEFERRED_HASH_DEFAULT_SLICE_BUDGET_US;
+
+    if (!queue->yield_interval_ms)
+        queue->yield_interval_ms = DEFERRED_HASH_DEFAULT_YIELD_INTERVAL_MS;
+
+    RtlZeroMemory(&List->deferred_statistics,
+                  sizeof(DEFERRED_HASH_STATISTICS));
+
+    KeInitializeTimer(&queue->timer);
+    KeInitializeDpc(&queue->dpc, DeferredHashpTimerDpc, queue);
+
+    queue->active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Waits for a scheduled slice to finish. To be called before the driver
+ * list's work item is freed.
+ */
+VOID
+DeferredHashFree()
+{
+    PAGED_CODE();
+
+    PDEFERRED_HASH_QUEUE queue = &g_DeferredHashQueue;
+    LARGE_INTEGER        delay = {.QuadPart = RELATIVE(
+                               DEFERRED_HASH_UNLOAD_POLL_INTERVAL)};
+
+    if (!queue->active)
+        return;
+
+    queue->active = FALSE;
+
+    /* a cancelled timer will never queue its slice */
+    if (KeCancelTimer(&queue->timer))
+        InterlockedExchange(&queue->state, 0);
+
+    KeFlushQueuedDpcs();
+
+    while (ReadAcquire(&queue->state))
+        ImpKeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+    /* a slice finding the list empty clears the state before releasing the
+     * lock, wait for it to do so */
+    ImpKeAcquireGuardedMutex(&queue->list->lock);
+    ImpKeReleaseGuardedMutex(&queue->list->lock);
+}
+
+/* A budget of 0 hashes a single module per slice. */
+VOID
+DeferredHashConfigure(_In_ UINT32 SliceBudgetUs, _In_ UINT32 YieldIntervalMs)
+{
+    g_DeferredHashQueue.slice_budget_us = SliceBudgetUs;
+    g_DeferredHashQueue.yield_interval_ms = YieldIntervalMs;
+}
+
+/*
+ * Queues a module loaded before it could be hashed. ASSUMES THE DRIVER LIST
+ * LOCK IS HELD!
+ */
+VOID
+DeferredHashEnqueue(_In_ PDRIVER_LIST_ENTRY Entry)
+{
+    PDEFERRED_HASH_QUEUE queue = &g_DeferredHashQueue;
+    PDRIVER_LIST_HEAD    list = queue->list;
+
+    Entry->deferred_time = KeQueryInterruptTime();
+    Entry->deferred_attempts = 0;
+    Entry->deferred_slice = 0;
+    InsertTailList(&list->deferred_list, &Entry->deferred_entry);
+    list->deferred_count++;
+
+    list->deferred_complete = FALSE;
+
+    DeferredHashpKick(queue);
+}
+
+/*
+ * Replaces queuing DeferredModuleHashingCallback, to be called once x86
+ * modules can be hashed.
+ */
+VOID
+DeferredHashStart()
+{
+    PDEFERRED_HASH_QUEUE queue = &g_DeferredHashQueue;
+
+    InterlockedExchange(&queue->list->can_hash_x86, TRUE);
+    DeferredHashpKick(queue);
+}
+
+VOID
+DeferredHashQueryStatistics(_Out_ PULONG                    Depth,
+                            _Out_ PDEFERRED_HASH_STATISTICS Statistics)
+{
+    PDRIVER_LIST_HEAD list = g_DeferredHashQueue.list;
+
+    *Depth = 0;
+    RtlZeroMemory(Statistics, sizeof(DEFERRED_HASH_STATISTICS));
+
+    if (!g_DeferredHashQueue.active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&list->lock);
+    *Depth = list->deferred_count;
+    *Statistics = list->deferred_statistics;
+    ImpKeReleaseGuardedMutex(&list->lock);
+}
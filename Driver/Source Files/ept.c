@@ -0,0 +1,638 @@
+#include "ept.h"
+
+#include "crypt.h"
+#include "imports.h"
+#include "io.h"
+#include "lib/stdlib.h"
+#include "pe.h"
+#include "perf.h"
+#include "report.h"
+#include "types/types.h"
+
+#include <intrin.h>
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, EptDetectionInitialise)
+#    pragma alloc_text(PAGE, EptDetectHooks)
+#endif
+
+/*
+ * Targets are functions commonly hooked to hide memory accesses or objects.
+ * New entries only add to the cost of a check if they lie on a page not
+ * already covered, and only until the page budget of a check is reached.
+ */
+STATIC EPT_TARGET g_EptTargets[] = {{L"RtlCompareMemory", TRUE},
+                                    {L"RtlInitUnicodeString", TRUE},
+                                    {L"KeQueryTimeIncrement", TRUE},
+                                    {L"RtlRandomEx", TRUE},
+                                    {L"MmCopyMemory", FALSE},
+                                    {L"MmGetPhysicalAddress", FALSE},
+                                    {L"MmMapIoSpace", FALSE},
+                                    {L"MmGetVirtualForPhysical", FALSE},
+                                    {L"KeStackAttachProcess", FALSE},
+                                    {L"PsLookupProcessByProcessId", FALSE},
+                                    {L"PsLookupThreadByThreadId", FALSE},
+                                    {L"ObReferenceObjectByHandle", FALSE},
+                                    {L"ZwQuerySystemInformation", FALSE},
+                                    {L"ExEnumHandleTable", FALSE},
+                                    {L"KeIpiGenericCall", FALSE},
+                                    {L"IoGetCurrentProcess", FALSE}};
+
+STATIC EPT_DETECTION g_EptDetection = {0};
+
+typedef struct _EPT_DPC_CONTEXT {
+    PEPT_DETECTION detection;
+    BOOLEAN        calibrate;
+
+    /* EPT_CALIBRATION_ROUNDS reads of each control per processor */
+    PUINT64 samples;
+
+} EPT_DPC_CONTEXT, *PEPT_DPC_CONTEXT;
+
+/* Must be called with interrupts disabled. */
+FORCEINLINE
+STATIC
+UINT64
+EptpTimeRead(_In_ PVOID Address)
+{
+    UINT64 before = 0;
+
+    _mm_clflush(Address);
+    _mm_mfence();
+    _mm_lfence();
+    before = __rdtsc();
+    _mm_lfence();
+    *(volatile UCHAR*)Address;
+    _mm_lfence();
+
+    return __rdtsc() - before;
+}
+
+STATIC
+VOID
+EptpSortSamples(_Inout_ PUINT64 Samples, _In_ UINT32 Count)
+{
+    UINT64 value = 0;
+    UINT32 index = 0;
+
+    for (UINT32 next = 1; next < Count; next++) {
+        value = Samples[next];
+
+        for (index = next; index > 0 && Samples[index - 1] > value; index--)
+            Samples[index] = Samples[index - 1];
+
+        Samples[index] = value;
+    }
+}
+
+STATIC
+VOID
+EptpCalibrate(_In_ PEPT_DETECTION Detection,
+              _In_ PUINT64        Samples,
+              _In_ UINT32         Processor)
+{
+    UINT32 count = EPT_CALIBRATION_ROUNDS * Detection->control_count;
+    UINT32 sample = 0;
+
+    Samples = &Samples[(UINT64)Processor * count];
+
+    /* each round is its own window, as is each check */
+    for (UINT32 round = 0; round < EPT_CALIBRATION_ROUNDS; round++) {
+        _disable();
+
+        for (UINT32 index = 0; index < Detection->control_count; index++)
+            Samples[sample++] = EptpTimeRead(Detection->controls[index]);
+
+        _enable();
+    }
+
+    EptpSortSamples(Samples, count);
+
+    Detection->baselines[Processor].median = Samples[count / 2];
+    Detection->baselines[Processor].p90 =
+        Samples[min(count - 1, (UINT64)count * 90 / 100)];
+}
+
+STATIC
+VOID
+EptpReadBatch(_In_ PEPT_DETECTION Detection, _In_ UINT32 Processor)
+{
+    PUINT64 timings =
+        &Detection->timings[(UINT64)Processor * EPT_MAX_PAGES_PER_CHECK];
+    PEPT_PAGE page = NULL;
+
+    _disable();
+
+    for (UINT32 index = 0; index < Detection->batch_count; index++) {
+        page = &Detection->pages[(Detection->batch_start + index) %
+                                 Detection->page_count];
+        timings[index] = EptpTimeRead(page->address);
+    }
+
+    _enable();
+}
+
+STATIC
+VOID
+EptpDpcRoutine(_In_ PKDPC     Dpc,
+               _In_opt_ PVOID DeferredContext,
+               _In_opt_ PVOID SystemArgument1,
+               _In_opt_ PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    PEPT_DPC_CONTEXT context = (PEPT_DPC_CONTEXT)DeferredContext;
+    UINT32           processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (processor >= context->detection->processor_count)
+        goto end;
+
+    if (context->calibrate)
+        EptpCalibrate(context->detection, context->samples, processor);
+    else
+        EptpReadBatch(context->detection, processor);
+
+end:
+    ImpKeSignalCallDpcDone(SystemArgument1);
+}
+
+STATIC
+VOID
+EptpNarrowCopy(_Out_ PCHAR Destination, _In_ PCWSTR Source, _In_ SIZE_T Size)
+{
+    SIZE_T index = 0;
+
+    for (; index < Size - 1 && Source[index]; index++)
+        Destination[index] = (CHAR)Source[index];
+
+    Destination[index] = '\0';
+}
+
+STATIC
+VOID
+EptpReportHook(_In_ PEPT_RESOLVED_TARGET Target,
+               _In_ UINT64               ControlAverage,
+               _In_ UINT64               ReadAverage)
+{
+    NTSTATUS         status = STATUS_UNSUCCESSFUL;
+    PEPT_HOOK_REPORT report = NULL;
+    UINT32           packet_size =
+        CryptRequestRequiredBufferLength(sizeof(EPT_HOOK_REPORT));
+
+    if (!ReportShouldSchedule(REPORT_EPT_HOOK, 0, (UINT64)Target->address, 0))
+        return;
+
+    report = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, packet_size, REPORT_POOL_TAG);
+
+    if (!report)
+        return;
+
+    INIT_REPORT_PACKET(report, REPORT_EPT_HOOK, 0);
+
+    report->control_average = ControlAverage;
+    report->read_average = ReadAverage;
+
+    EptpNarrowCopy(report->function_name,
+                   g_EptTargets[Target->target].name,
+                   sizeof(report->function_name));
+
+    status = CryptEncryptBuffer(report, packet_size);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("CryptEncryptBuffer: %lx", status);
+        ImpExFreePoolWithTag(report, REPORT_POOL_TAG);
+        return;
+    }
+
+    IrpQueueSchedulePacket(report, packet_size);
+}
+
+typedef PVOID(NTAPI* PRTL_PC_TO_FILE_HEADER)(_In_ PVOID   PcValue,
+                                             _Out_ PVOID* BaseOfImage);
+
+/*
+ * Targets are read with interrupts disabled, where touching a page that has
+ * been paged out bugchecks. Only addresses within a non pageable section of
+ * their image are accepted, the kernel pages sections named PAGE* and
+ * discards INIT once booted.
+ */
+STATIC
+BOOLEAN
+EptpIsNonPagedAddress(_In_ PRTL_PC_TO_FILE_HEADER PcToFileHeader,
+                      _In_ PVOID                  Address)
+{
+    PVOID                 base = NULL;
+    PNT_HEADER_64         nt = NULL;
+    PIMAGE_SECTION_HEADER section = NULL;
+    UINT64                rva = 0;
+    UINT32                size = 0;
+
+    if (!PcToFileHeader(Address, &base) || !base)
+        return FALSE;
+
+    nt = PeGetNtHeader(base);
+
+    if (!nt)
+        return FALSE;
+
+    rva = (UINT64)Address - (UINT64)base;
+    section = IMAGE_FIRST_SECTION(nt);
+
+    for (UINT32 index = 0; index < nt->FileHeader.NumberOfSections; index++) {
+        size = max(section[index].Misc.VirtualSize,
+                   section[index].SizeOfRawData);
+
+        if (rva < section[index].VirtualAddress ||
+            rva >= (UINT64)section[index].VirtualAddress + size)
+            continue;
+
+        if (section[index].Characteristics & IMAGE_SCN_MEM_DISCARDABLE)
+            return FALSE;
+
+        if (IntCompareMemory(section[index].Name, "PAGE", 4) == 4)
+            return FALSE;
+
+        return ImpMmIsAddressValid(Address);
+    }
+
+    return FALSE;
+}
+
+/*
+ * Resolves the table, keeping the targets sorted by address so those
+ * sharing a page are adjacent. Targets that may be paged out are skipped.
+ */
+STATIC
+NTSTATUS
+EptpResolveTargets(_Inout_ PEPT_DETECTION Detection)
+{
+    UNICODE_STRING         name = {0};
+    EPT_RESOLVED_TARGET    target = {0};
+    PEPT_PAGE              page = NULL;
+    PRTL_PC_TO_FILE_HEADER pc_to_file_header = NULL;
+    UINT32                 count = ARRAYSIZE(g_EptTargets);
+    UINT32                 index = 0;
+
+    ImpRtlInitUnicodeString(&name, L"RtlPcToFileHeader");
+    pc_to_file_header = ImpMmGetSystemRoutineAddress(&name);
+
+    if (!pc_to_file_header)
+        return STATUS_NOT_FOUND;
+
+    Detection->targets = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                            count * sizeof(EPT_RESOLVED_TARGET),
+                                            POOL_TAG_EPT);
+    Detection->pages = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, count * sizeof(EPT_PAGE), POOL_TAG_EPT);
+    Detection->controls = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, count * sizeof(PVOID), POOL_TAG_EPT);
+
+    if (!Detection->targets || !Detection->pages || !Detection->controls)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (UINT32 next = 0; next < count; next++) {
+        ImpRtlInitUnicodeString(&name, g_EptTargets[next].name);
+        target.address = ImpMmGetSystemRoutineAddress(&name);
+        target.target = next;
+
+        if (!target.address) {
+            DEBUG_WARNING("Failed to resolve EPT target %ls",
+                          g_EptTargets[next].name);
+            continue;
+        }
+
+        if (!EptpIsNonPagedAddress(pc_to_file_header, target.address)) {
+            DEBUG_WARNING("EPT target %ls is pageable, skipping.",
+                          g_EptTargets[next].name);
+            continue;
+        }
+
+        if (g_EptTargets[next].control) {
+            Detection->controls[Detection->control_count++] = target.address;
+            continue;
+        }
+
+        for (index = Detection->target_count;
+             index > 0 && Detection->targets[index - 1].address >
+                              target.address;
+             index--)
+            Detection->targets[index] = Detection->targets[index - 1];
+
+        Detection->targets[index] = target;
+        Detection->target_count++;
+    }
+
+    if (!Detection->control_count || !Detection->target_count)
+        return STATUS_NOT_FOUND;
+
+    for (index = 0; index < Detection->target_count; index++) {
+        if (page && PAGE_ALIGN(page->address) ==
+                        PAGE_ALIGN(Detection->targets[index].address)) {
+            page->target_count++;
+            continue;
+        }
+
+        page = &Detection->pages[Detection->page_count++];
+        page->address = Detection->targets[index].address;
+        page->first_target = index;
+        page->target_count = 1;
+        page->strikes = 0;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+VOID
+EptpFreeDetection(_Inout_ PEPT_DETECTION Detection)
+{
+    if (Detection->baselines)
+        ImpExFreePoolWithTag(Detection->baselines, POOL_TAG_EPT);
+
+    if (Detection->targets)
+        ImpExFreePoolWithTag(Detection->targets, POOL_TAG_EPT);
+
+    if (Detection->pages)
+        ImpExFreePoolWithTag(Detection->pages, POOL_TAG_EPT);
+
+    if (Detection->controls)
+        ImpExFreePoolWithTag(Detection->controls, POOL_TAG_EPT);
+
+    if (Detection->timings)
+        ImpExFreePoolWithTag(Detection->timings, POOL_TAG_EPT);
+
+    Detection->baselines = NULL;
+    Detection->targets = NULL;
+    Detection->pages = NULL;
+    Detection->controls = NULL;
+    Detection->timings = NULL;
+    Detection->target_count = 0;
+    Detection->page_count = 0;
+    Detection->control_count = 0;
+    Detection->calibrated = FALSE;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+NTSTATUS
+EptpCalibrateAllProcessors(_Inout_ PEPT_DETECTION Detection)
+{
+    EPT_DPC_CONTEXT context = {0};
+
+    context.detection = Detection;
+    context.calibrate = TRUE;
+    context.samples = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)Detection->processor_count * EPT_CALIBRATION_ROUNDS *
+            Detection->control_count * sizeof(UINT64),
+        POOL_TAG_EPT);
+
+    if (!context.samples)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    ImpKeGenericCallDpc(EptpDpcRoutine, &context);
+
+    ImpExFreePoolWithTag(context.samples, POOL_TAG_EPT);
+    Detection->calibrated = TRUE;
+    return STATUS_SUCCESS;
+}
+
+/* To be called once from DriverEntry. */
+VOID
+EptDetectionInitialiseLock()
+{
+    ImpKeInitializeGuardedMutex(&g_EptDetection.lock);
+}
+
+/*
+ * To be called at session start. The targets are resolved and the baseline
+ * calibrated only on the first call after the driver loads, later sessions
+ * reusing them.
+ */
+NTSTATUS
+EptDetectionInitialise()
+{
+    PAGED_CODE();
+
+    NTSTATUS       status = STATUS_UNSUCCESSFUL;
+    PEPT_DETECTION detection = &g_EptDetection;
+
+    if (detection->active)
+        return STATUS_SUCCESS;
+
+    ImpKeAcquireGuardedMutex(&detection->lock);
+
+    /* another caller may have initialised it while we waited */
+    if (detection->active) {
+        ImpKeReleaseGuardedMutex(&detection->lock);
+        return STATUS_SUCCESS;
+    }
+
+    RtlZeroMemory(&detection->statistics, sizeof(EPT_STATISTICS));
+
+    if (!detection->threshold_percent)
+        detection->threshold_percent = EPT_DEFAULT_THRESHOLD_PERCENT;
+
+    detection->processor_count =
+        KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    detection->baselines = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        detection->processor_count * sizeof(EPT_BASELINE),
+        POOL_TAG_EPT);
+
+    detection->timings = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)detection->processor_count * EPT_MAX_PAGES_PER_CHECK *
+            sizeof(UINT64),
+        POOL_TAG_EPT);
+
+    if (!detection->baselines || !detection->timings) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    status = EptpResolveTargets(detection);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("EptpResolveTargets failed with status %x", status);
+        goto end;
+    }
+
+    status = EptpCalibrateAllProcessors(detection);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("EptpCalibrateAllProcessors failed with status %x",
+                    status);
+        goto end;
+    }
+
+    detection->cursor = 0;
+    detection->active = TRUE;
+
+end:
+    if (!NT_SUCCESS(status))
+        EptpFreeDetection(detection);
+
+    ImpKeReleaseGuardedMutex(&detection->lock);
+    return status;
+}
+
+/* To be called on driver unload. */
+VOID
+EptDetectionFree()
+{
+    PEPT_DETECTION detection = &g_EptDetection;
+
+    if (!detection->active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&detection->lock);
+    detection->active = FALSE;
+    EptpFreeDetection(detection);
+    ImpKeReleaseGuardedMutex(&detection->lock);
+}
+
+/* Takes effect from the next check. */
+NTSTATUS
+EptDetectionSetThreshold(_In_ UINT32 ThresholdPercent)
+{
+    PEPT_DETECTION detection = &g_EptDetection;
+
+    if (ThresholdPercent < EPT_MIN_THRESHOLD_PERCENT)
+        return STATUS_INVALID_PARAMETER;
+
+    ImpKeAcquireGuardedMutex(&detection->lock);
+    detection->threshold_percent = ThresholdPercent;
+    ImpKeReleaseGuardedMutex(&detection->lock);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Returns the processor on which the read of the page at Index in the batch
+ * exceeded its baseline by the most, or MAXUINT32 if it exceeded none.
+ */
+STATIC
+UINT32
+EptpFindFlaggedProcessor(_In_ PEPT_DETECTION Detection, _In_ UINT32 Index)
+{
+    UINT32 flagged = MAXUINT32;
+    UINT64 timing = 0;
+    UINT64 worst = 0;
+    UINT64 threshold = 0;
+
+    for (UINT32 processor = 0; processor < Detection->processor_count;
+         processor++) {
+        timing = Detection->timings[(UINT64)processor *
+                                        EPT_MAX_PAGES_PER_CHECK +
+                                    Index];
+        threshold = Detection->baselines[processor].p90 *
+                    Detection->threshold_percent / 100;
+
+        if (timing > threshold && timing - threshold > worst) {
+            worst = timing - threshold;
+            flagged = processor;
+        }
+    }
+
+    return flagged;
+}
+
+/*
+ * Reads the next batch of pages on every processor and reports the targets
+ * on any page that has exceeded the baseline for EPT_REQUIRED_STRIKES
+ * consecutive checks. Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS
+EptDetectHooks()
+{
+    PAGED_CODE();
+
+    NTSTATUS        status = STATUS_SUCCESS;
+    PEPT_DETECTION  detection = &g_EptDetection;
+    EPT_DPC_CONTEXT context = {0};
+    PEPT_PAGE       page = NULL;
+    UINT32          processor = 0;
+    UINT64          timing = 0;
+    UINT64          start = PerfBegin();
+
+    if (!detection->active)
+        return STATUS_DEVICE_NOT_READY;
+
+    ImpKeAcquireGuardedMutex(&detection->lock);
+
+    if (!detection->active) {
+        status = STATUS_DEVICE_NOT_READY;
+        goto end;
+    }
+
+    detection->batch_start = detection->cursor;
+    detection->batch_count =
+        min(detection->page_count, EPT_MAX_PAGES_PER_CHECK);
+    detection->cursor = (detection->cursor + detection->batch_count) %
+                        detection->page_count;
+
+    context.detection = detection;
+    context.calibrate = FALSE;
+
+    ImpKeGenericCallDpc(EptpDpcRoutine, &context);
+
+    detection->statistics.checks++;
+    detection->statistics.pages_read +=
+        (UINT64)detection->batch_count * detection->processor_count;
+
+    for (UINT32 index = 0; index < detection->batch_count; index++) {
+        page = &detection->pages[(detection->batch_start + index) %
+                                 detection->page_count];
+        processor = EptpFindFlaggedProcessor(detection, index);
+
+        if (processor == MAXUINT32) {
+            page->strikes = 0;
+            continue;
+        }
+
+        detection->statistics.pages_flagged++;
+
+        if (++page->strikes < EPT_REQUIRED_STRIKES)
+            continue;
+
+        timing = detection->timings[(UINT64)processor *
+                                        EPT_MAX_PAGES_PER_CHECK +
+                                    index];
+
+        DEBUG_WARNING("EPT hook suspected at %p, read: %llx baseline: %llx",
+                      page->address,
+                      timing,
+                      detection->baselines[processor].median);
+
+        for (UINT32 target = 0; target < page->target_count; target++) {
+            EptpReportHook(&detection->targets[page->first_target + target],
+                           detection->baselines[processor].median,
+                           timing);
+            detection->statistics.hooks_reported++;
+        }
+    }
+
+end:
+    ImpKeReleaseGuardedMutex(&detection->lock);
+    PerfRecord(PerfCounterScanForEptHooks, start, 0);
+    return status;
+}
+
+VOID
+EptDetectionQueryStatistics(_Out_ PEPT_STATISTICS Statistics)
+{
+    PEPT_DETECTION detection = &g_EptDetection;
+
+    RtlZeroMemory(Statistics, sizeof(EPT_STATISTICS));
+
+    if (!detection->active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&detection->lock);
+    *Statistics = detection->statistics;
+    ImpKeReleaseGuardedMutex(&detection->lock);
+}
@@ -0,0 +1,502 @@
+#include "handles.h"
+
+#include "callbacks.h"
+#include "imports.h"
+#include "lib/stdlib.h"
+#include "perf.h"
+
+#define GET_OBJECT_HEADER_FROM_HANDLE(x) ((x << 4) | 0xffff000000000000)
+
+typedef struct _HANDLE_CACHE_PROCESS {
+    HANDLE    process_id;
+    PEPROCESS process;
+
+} HANDLE_CACHE_PROCESS, *PHANDLE_CACHE_PROCESS;
+
+typedef struct _HANDLE_CACHE_COLLECT_CONTEXT {
+    PHANDLE_CACHE_PROCESS processes;
+    UINT32                capacity;
+    UINT32                count;
+    UINT32                dropped;
+
+} HANDLE_CACHE_COLLECT_CONTEXT, *PHANDLE_CACHE_COLLECT_CONTEXT;
+
+typedef struct _HANDLE_CACHE_PASS_CONTEXT {
+    UINT64                     pass;
+    PEPROCESS                  protected_process;
+    HANDLE_CACHE_ENTRY_ROUTINE routine;
+    PVOID                      context;
+    volatile LONG              walked;
+    volatile LONG              skipped;
+    volatile LONG              changed;
+
+} HANDLE_CACHE_PASS_CONTEXT, *PHANDLE_CACHE_PASS_CONTEXT;
+
+typedef struct _HANDLE_CACHE_WALK_CONTEXT {
+    PHANDLE_CACHE_PASS_CONTEXT pass;
+    PEPROCESS                  owner;
+    UINT32                     protected_count;
+    UINT64                     protected_hash;
+
+} HANDLE_CACHE_WALK_CONTEXT, *PHANDLE_CACHE_WALK_CONTEXT;
+
+typedef struct _HANDLE_CACHE_PRUNE_CONTEXT {
+    UINT64  pass;
+    PHANDLE stale;
+    UINT32  capacity;
+    UINT32  count;
+
+} HANDLE_CACHE_PRUNE_CONTEXT, *PHANDLE_CACHE_PRUNE_CONTEXT;
+
+STATIC HANDLE_CACHE g_HandleCache = {0};
+
+STATIC
+UINT32
+HandleCachepHashProcessId(_In_ UINT64 ProcessId)
+{
+    return (UINT32)ProcessId;
+}
+
+STATIC
+BOOLEAN
+HandleCachepCompareProcessId(_In_ PVOID Struct1, _In_ PVOID Struct2)
+{
+    HANDLE id1 = *(PHANDLE)Struct1;
+    HANDLE id2 = *(PHANDLE)Struct2;
+
+    return id1 == id2 ? TRUE : FALSE;
+}
+
+FORCEINLINE
+STATIC
+UINT64
+HandleCachepMixEntry(_In_ HANDLE Handle, _In_ UINT32 GrantedAccess)
+{
+    UINT64 value = ((UINT64)Handle << 32) ^ GrantedAccess;
+
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+FORCEINLINE
+STATIC
+PHANDLE_TABLE
+HandleCachepGetHandleTable(_In_ PEPROCESS Process)
+{
+    return *(PHANDLE_TABLE*)((UINT64)Process + EPROCESS_HANDLE_TABLE_OFFSET);
+}
+
+FORCEINLINE
+STATIC
+VOID
+HandleCachepReadSignature(_In_ PHANDLE_TABLE            Table,
+                          _Out_ PHANDLE_TABLE_SIGNATURE Signature)
+{
+    Signature->handle_count = ReadNoFence(&Table->FreeLists[0].HandleCount);
+    Signature->high_water_mark = Table->FreeLists[0].HighWaterMark;
+    Signature->next_handle_needing_pool = Table->NextHandleNeedingPool;
+}
+
+NTSTATUS
+HandleCacheInitialise()
+{
+    NTSTATUS                  status = STATUS_UNSUCCESSFUL;
+    PHANDLE_CACHE             cache = &g_HandleCache;
+    RTL_HASHMAP_CONFIGURATION config = {0};
+
+    config.storage = HashmapStorageChained;
+    config.resizable = TRUE;
+
+    ImpKeInitializeGuardedMutex(&cache->lock);
+    ExInitializeRundownProtection(&cache->rundown);
+    cache->pass = 0;
+
+    status = RtlHashmapCreateEx(HANDLE_CACHE_BUCKET_COUNT,
+                                sizeof(HANDLE_TABLE_SUMMARY),
+                                HandleCachepHashProcessId,
+                                HandleCachepCompareProcessId,
+                                NULL,
+                                &config,
+                                &cache->summaries);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("RtlHashmapCreateEx failed with status %x", status);
+        return status;
+    }
+
+    cache->active = TRUE;
+    return status;
+}
+
+VOID
+HandleCacheFree()
+{
+    PHANDLE_CACHE cache = &g_HandleCache;
+
+    if (!cache->active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+    cache->active = FALSE;
+    ImpKeReleaseGuardedMutex(&cache->lock);
+
+    /* a removal that saw the cache active finishes before the map goes */
+    ExWaitForRundownProtectionRelease(&cache->rundown);
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+    RtlHashmapDelete(&cache->summaries);
+    ImpKeReleaseGuardedMutex(&cache->lock);
+}
+
+/* Intended to be called from the process notify routine on process exit. */
+VOID
+HandleCacheRemoveProcess(_In_ HANDLE ProcessId)
+{
+    PHANDLE_CACHE cache = &g_HandleCache;
+    INT32         index = 0;
+
+    if (!ExAcquireRundownProtection(&cache->rundown))
+        return;
+
+    if (!cache->active)
+        goto end;
+
+    index = RtlHashmapHashKeyAndAcquireBucket(&cache->summaries,
+                                              (UINT64)ProcessId);
+
+    if (index == STATUS_INVALID_HASHMAP_INDEX)
+        goto end;
+
+    RtlHashmapEntryDelete(&cache->summaries, index, &ProcessId);
+    RtlHashmapReleaseBucket(&cache->summaries, index);
+
+end:
+    ExReleaseRundownProtection(&cache->rundown);
+}
+
+/*
+ * Called with the bucket lock of the process map held, so the process is
+ * referenced here to keep it alive once the lock is released.
+ */
+STATIC
+VOID
+HandleCachepCollectProcess(_In_ PPROCESS_LIST_ENTRY Entry,
+                           _In_opt_ PVOID           Context)
+{
+    PHANDLE_CACHE_COLLECT_CONTEXT context =
+        (PHANDLE_CACHE_COLLECT_CONTEXT)Context;
+    PHANDLE_CACHE_PROCESS process = NULL;
+
+    if (!context || !Entry->process)
+        return;
+
+    if (context->count == context->capacity) {
+        context->dropped++;
+        return;
+    }
+
+    process = &context->processes[context->count++];
+    process->process_id = Entry->process_id;
+    process->process = Entry->process;
+
+    ImpObfReferenceObject(process->process);
+}
+
+/*
+ * Each entry passed to the callback is locked and must be unlocked before
+ * returning. Returning FALSE continues the enumeration.
+ */
+STATIC
+BOOLEAN
+HandleCachepWalkHandle(_In_ PHANDLE_TABLE       HandleTable,
+                       _In_ PHANDLE_TABLE_ENTRY Entry,
+                       _In_ HANDLE              Handle,
+                       _In_ PVOID               Context)
+{
+    PHANDLE_CACHE_WALK_CONTEXT walk = (PHANDLE_CACHE_WALK_CONTEXT)Context;
+    PHANDLE_CACHE_PASS_CONTEXT pass = walk->pass;
+    POBJECT_HEADER             header = NULL;
+    PVOID                      object = NULL;
+
+    header = (POBJECT_HEADER)GET_OBJECT_HEADER_FROM_HANDLE(
+        Entry->ObjectPointerBits);
+    object = &header->Body;
+
+    if (object == pass->protected_process) {
+        pass->routine(Entry, Handle, walk->owner, pass->context);
+
+        walk->protected_count++;
+        walk->protected_hash +=
+            HandleCachepMixEntry(Handle, Entry->GrantedAccessBits);
+    }
+
+    ExUnlockHandleTableEntry(HandleTable, Entry);
+    return FALSE;
+}
+
+STATIC
+VOID
+HandleCachepWalkProcess(_In_ PWORK_POOL_TASK Task, _In_opt_ PVOID Context)
+{
+    PHANDLE_CACHE              cache = &g_HandleCache;
+    PHANDLE_CACHE_PASS_CONTEXT pass = (PHANDLE_CACHE_PASS_CONTEXT)Context;
+    PHANDLE_CACHE_PROCESS      process = (PHANDLE_CACHE_PROCESS)Task->item;
+    PHANDLE_TABLE_SUMMARY      summary = NULL;
+    PHANDLE_TABLE              table = NULL;
+    HANDLE_TABLE_SIGNATURE     signature = {0};
+    HANDLE_CACHE_WALK_CONTEXT  walk = {0};
+    BOOLEAN                    changed = FALSE;
+    INT32                      index = 0;
+
+    if (!pass || process->process == pass->protected_process)
+        return;
+
+    table = HandleCachepGetHandleTable(process->process);
+
+    /* the process is exiting, its summary is pruned at the end of the pass */
+    if (!table)
+        return;
+
+    HandleCachepReadSignature(table, &signature);
+
+    index = RtlHashmapHashKeyAndAcquireBucket(
+        &cache->summaries, (UINT64)process->process_id);
+
+    if (index == STATUS_INVALID_HASHMAP_INDEX)
+        return;
+
+    summary = RtlHashmapEntryLookup(
+        &cache->summaries, index, &process->process_id);
+
+    /* a recycled process id shows up as a different EPROCESS */
+    if (summary && summary->process == process->process &&
+        !summary->protected_count &&
+        pass->pass - summary->walked < HANDLE_CACHE_FULL_WALK_INTERVAL &&
+        IntCompareMemory(&summary->signature,
+                         &signature,
+                         sizeof(HANDLE_TABLE_SIGNATURE)) ==
+            sizeof(HANDLE_TABLE_SIGNATURE)) {
+        summary->seen = pass->pass;
+        RtlHashmapReleaseBucket(&cache->summaries, index);
+        InterlockedIncrement(&pass->skipped);
+        return;
+    }
+
+    RtlHashmapReleaseBucket(&cache->summaries, index);
+
+    walk.pass = pass;
+    walk.owner = process->process;
+
+    ImpExEnumHandleTable(table, HandleCachepWalkHandle, &walk, NULL);
+    InterlockedIncrement(&pass->walked);
+
+    index = RtlHashmapHashKeyAndAcquireBucket(
+        &cache->summaries, (UINT64)process->process_id);
+
+    if (index == STATUS_INVALID_HASHMAP_INDEX)
+        return;
+
+    summary = RtlHashmapEntryLookup(
+        &cache->summaries, index, &process->process_id);
+
+    if (!summary) {
+        summary = RtlHashmapEntryInsert(&cache->summaries, index);
+
+        if (!summary) {
+            RtlHashmapReleaseBucket(&cache->summaries, index);
+            return;
+        }
+
+        summary->process_id = process->process_id;
+        changed = walk.protected_count ? TRUE : FALSE;
+    }
+    else {
+        changed = summary->process != process->process ||
+                          summary->protected_count != walk.protected_count ||
+                          summary->protected_hash != walk.protected_hash
+                      ? TRUE
+                      : FALSE;
+    }
+
+    summary->process = process->process;
+    summary->signature = signature;
+    summary->protected_count = walk.protected_count;
+    summary->protected_hash = walk.protected_hash;
+    summary->walked = pass->pass;
+    summary->seen = pass->pass;
+
+    RtlHashmapReleaseBucket(&cache->summaries, index);
+
+    if (changed)
+        InterlockedIncrement(&pass->changed);
+}
+
+STATIC
+VOID
+HandleCachepCollectStaleSummary(_In_ PHANDLE_TABLE_SUMMARY Summary,
+                                _In_opt_ PVOID             Context)
+{
+    PHANDLE_CACHE_PRUNE_CONTEXT context = (PHANDLE_CACHE_PRUNE_CONTEXT)Context;
+
+    if (!context || Summary->seen == context->pass)
+        return;
+
+    if (context->count < context->capacity)
+        context->stale[context->count++] = Summary->process_id;
+}
+
+/* Removes the summaries of processes that were not seen by the pass. */
+STATIC
+UINT32
+HandleCachepPruneSummaries(_In_ UINT64 Pass)
+{
+    PHANDLE_CACHE              cache = &g_HandleCache;
+    HANDLE_CACHE_PRUNE_CONTEXT context = {0};
+
+    context.pass = Pass;
+    context.capacity = (UINT32)ReadAcquire(&cache->summaries.entry_count);
+
+    if (!context.capacity)
+        return 0;
+
+    context.stale = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                       context.capacity * sizeof(HANDLE),
+                                       POOL_TAG_HANDLE_CACHE);
+
+    if (!context.stale)
+        return 0;
+
+    RtlHashmapEnumerate(&cache->summaries,
+                        (ENUMERATE_HASHMAP)HandleCachepCollectStaleSummary,
+                        &context);
+
+    for (UINT32 index = 0; index < context.count; index++)
+        HandleCacheRemoveProcess(context.stale[index]);
+
+    ImpExFreePoolWithTag(context.stale, POOL_TAG_HANDLE_CACHE);
+    return context.count;
+}
+
+/*
+ * Runs a pass over the handle tables of each process in the process map,
+ * invoking Routine for every handle to the protected process found in the
+ * tables that are walked. Tables that are skipped were last walked by an
+ * earlier pass, whose routine has already seen their handles.
+ */
+NTSTATUS
+HandleCacheRun(_In_ PRTL_HASHMAP                 ProcessMap,
+               _In_ PEPROCESS                    Protected,
+               _In_ HANDLE_CACHE_ENTRY_ROUTINE   Routine,
+               _In_opt_ PVOID                    Context,
+               _In_ PWORK_POOL_CONFIGURATION     Configuration,
+               _Out_opt_ PHANDLE_CACHE_STATISTICS Statistics)
+{
+    NTSTATUS                     status = STATUS_UNSUCCESSFUL;
+    PHANDLE_CACHE                cache = &g_HandleCache;
+    HANDLE_CACHE_COLLECT_CONTEXT collect = {0};
+    HANDLE_CACHE_PASS_CONTEXT    pass = {0};
+    PWORK_POOL_TASK              tasks = NULL;
+    UINT32                       pruned = 0;
+    UINT64                       start = PerfBegin();
+
+    if (Statistics)
+        RtlZeroMemory(Statistics, sizeof(HANDLE_CACHE_STATISTICS));
+
+    if (!cache->active)
+        return STATUS_UNSUCCESSFUL;
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+
+    /* freed while waiting on the lock */
+    if (!cache->active) {
+        ImpKeReleaseGuardedMutex(&cache->lock);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    collect.capacity = (UINT32)ReadAcquire(&ProcessMap->entry_count) +
+                       HANDLE_CACHE_COLLECT_SLACK;
+
+    collect.processes =
+        ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                           collect.capacity * sizeof(HANDLE_CACHE_PROCESS),
+                           POOL_TAG_HANDLE_CACHE);
+
+    if (!collect.processes) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    tasks = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                               collect.capacity * sizeof(WORK_POOL_TASK),
+                               POOL_TAG_HANDLE_CACHE);
+
+    if (!tasks) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    RtlHashmapEnumerate(
+        ProcessMap, (ENUMERATE_HASHMAP)HandleCachepCollectProcess, &collect);
+
+    if (collect.dropped)
+        DEBUG_WARNING("Handle cache dropped %lx processes", collect.dropped);
+
+    for (UINT32 index = 0; index < collect.count; index++)
+        tasks[index].item = &collect.processes[index];
+
+    pass.pass = ++cache->pass;
+    pass.protected_process = Protected;
+    pass.routine = Routine;
+    pass.context = Context;
+
+    status = WorkPoolRun(tasks,
+                         collect.count,
+                         HandleCachepWalkProcess,
+                         &pass,
+                         Configuration,
+                         NULL);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("WorkPoolRun failed with status %x", status);
+        goto end;
+    }
+
+    /* an incomplete collection may have missed live processes */
+    if (!collect.dropped)
+        pruned = HandleCachepPruneSummaries(pass.pass);
+
+    DEBUG_VERBOSE("Handle cache pass %llx: walked %lx, skipped %lx",
+                  pass.pass,
+                  pass.walked,
+                  pass.skipped);
+
+end:
+
+    if (collect.processes) {
+        for (UINT32 index = 0; index < collect.count; index++)
+            ImpObDereferenceObject(collect.processes[index].process);
+
+        ImpExFreePoolWithTag(collect.processes, POOL_TAG_HANDLE_CACHE);
+    }
+
+    if (tasks)
+        ImpExFreePoolWithTag(tasks, POOL_TAG_HANDLE_CACHE);
+
+    ImpKeReleaseGuardedMutex(&cache->lock);
+
+    if (Statistics) {
+        Statistics->processes = collect.count;
+        Statistics->walked = (UINT32)pass.walked;
+        Statistics->skipped = (UINT32)pass.skipped;
+        Statistics->changed = (UINT32)pass.changed;
+        Statistics->pruned = pruned;
+        Statistics->dropped = collect.dropped;
+    }
+
+    PerfRecord(PerfCounterEnumerateHandleTables, start, 0);
+    return status;
+}
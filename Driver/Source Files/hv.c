@@ -9,82 +9,387 @@
 
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(PAGE, PerformVirtualizationDetection)
+#    pragma alloc_text(PAGE, HvMeasureTimingDistribution)
 #endif
 
-#define TOTAL_ITERATION_COUNT 20
-
 /*
- * TODO: Perform the test in a loop and average the delta out, then compare it
- * to an instruction such as FYL2XP1 (source: secret.club) which has an average
- * execution time slightly higher then the CPUID instruction then compare the
- * two. If the average time for the CPUID instruction is higher then the average
- * time for the FYL2XP1 instruction it is a dead giveaway we are running on a
- * virtualized system.
+ * The reference for cpuid was intended to be FYL2XP1 (source: secret.club),
+ * which natively costs slightly more than cpuid. x87 instructions cannot be
+ * emitted without inline assembly on x64, so a short chain of dependent 64
+ * bit divisions of a similar native cost is used instead. If the median time
+ * of cpuid is several times that of the reference, it is a dead giveaway we
+ * are running on a virtualized system.
  *
  * reference: https://secret.club/2020/01/12/battleye-hypervisor-detection.html
  */
+FORCEINLINE
+STATIC
+UINT64
+HvpReferenceWorkload(_In_ UINT64 Seed)
+{
+    UINT64 remainder = Seed;
+
+    for (UINT32 index = 0; index < HV_TIMING_REFERENCE_DIVISIONS; index++)
+        _udiv128(1, remainder, HV_TIMING_REFERENCE_DIVISOR, &remainder);
+
+    return remainder;
+}
 
+FORCEINLINE
+STATIC
+UINT64
+HvpTimeCpuid()
+{
+    INT    cpuid_result[4];
+    UINT64 before = 0;
+
+    _mm_lfence();
+    before = __rdtsc();
+    __cpuid(cpuid_result, 0);
+    _mm_lfence();
+
+    return __rdtsc() - before;
+}
+
+FORCEINLINE
+STATIC
+UINT64
+HvpTimeReference(_Inout_ PUINT64 Sink)
+{
+    UINT64 before = 0;
+
+    _mm_lfence();
+    before = __rdtsc();
+    *Sink += HvpReferenceWorkload(before);
+    _mm_lfence();
+
+    return __rdtsc() - before;
+}
+
+/*
+ * On some VMs such as VMWARE the APERF counter is not virtualised, so it does
+ * not advance across the cpuid. It is read separately from the timed samples,
+ * as reading an MSR may itself exit.
+ */
+FORCEINLINE
+STATIC
 BOOLEAN
-APERFMsrTimingCheck()
+HvpIsAperfStalled()
 {
-    KAFFINITY new_affinity = {0};
-    KAFFINITY old_affinity = {0};
-    UINT64 old_irql = 0;
-    UINT64 aperf_delta = 0;
+    INT    cpuid_result[4];
     UINT64 aperf_before = 0;
-    UINT64 aperf_after = 0;
-    INT cpuid_result[4];
-
-    /*
-     * First thing we do is we lock the current thread to the logical
-     * processor its executing on.
-     */
-    new_affinity = (KAFFINITY)(1ull << KeGetCurrentProcessorNumber());
-    old_affinity = ImpKeSetSystemAffinityThreadEx(new_affinity);
-
-    /*
-     * Once we've locked our thread to the current core, we save the old
-     * irql and raise to HIGH_LEVEL to ensure the chance our thread is
-     * preempted by a thread with a higher IRQL is extremely low.
-     */
-    old_irql = __readcr8();
-    __writecr8(HIGH_LEVEL);
-
-    /*
-     * Then we also disable interrupts, once again making sure our thread
-     * is not preempted.
-     */
-    _disable();
-
-    /*
-     * Once our thread is ready for the test, we read the APERF from the
-     * MSR register and store it. We then execute a CPUID instruction
-     * which we don't really care about and immediately after read the APERF
-     * counter once again and store it in a seperate variable.
-     */
-    aperf_before = __readmsr(IA32_APERF_MSR) << 32;
+
+    aperf_before = __readmsr(IA32_APERF_MSR);
     __cpuid(cpuid_result, 1);
-    aperf_after = __readmsr(IA32_APERF_MSR) << 32;
-
-    /*
-     * Once we have performed our test, we want to make sure we are not
-     * hogging the cpu time from other threads, so we reverse the initial
-     * preparation process. i.e we first enable interrupts, lower our irql
-     * to the threads previous irql before it was raised and then restore
-     * the threads affinity back to its original affinity.
-     */
-    _enable();
-    __writecr8(old_irql);
-    ImpKeRevertToUserAffinityThreadEx(old_affinity);
-
-    /*
-     * Now the only thing left to do is calculate the change. Now, on some
-     * VMs such as VMWARE the aperf value will be 0, meaning the change will
-     * be 0. This is a dead giveaway we are executing in a VM.
-     */
-    aperf_delta = aperf_after - aperf_before;
-
-    return aperf_delta == 0 ? TRUE : FALSE;
+
+    return __readmsr(IA32_APERF_MSR) == aperf_before;
+}
+
+STATIC
+VOID
+HvpTimingDpcRoutine(_In_ PKDPC     Dpc,
+                    _In_opt_ PVOID DeferredContext,
+                    _In_opt_ PVOID SystemArgument1,
+                    _In_opt_ PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+
+    PHV_TIMING_CONTEXT context = (PHV_TIMING_CONTEXT)DeferredContext;
+    PHV_TIMING_PROCESSOR processor = NULL;
+    UINT32               index = KeGetCurrentProcessorNumberEx(NULL);
+    UINT64               sink = 0;
+
+    if (index >= context->processor_count)
+        goto end;
+
+    processor = &context->processors[index];
+
+    for (UINT32 burst = 0; burst < context->configuration.burst_count;
+         burst++) {
+        /*
+         * We are already at DISPATCH_LEVEL, so disabling interrupts ensures
+         * the burst is not preempted. They are enabled again between bursts
+         * so pending interrupts are serviced.
+         */
+        _disable();
+
+        for (UINT32 sample = 0;
+             sample < context->configuration.samples_per_burst;
+             sample++) {
+            processor->cpuid[processor->count] = HvpTimeCpuid();
+            processor->reference[processor->count] = HvpTimeReference(&sink);
+            processor->count++;
+        }
+
+        if (HvpIsAperfStalled())
+            processor->aperf_zero_count++;
+
+        _enable();
+    }
+
+    /* keeps the reference workload from being optimised out */
+    processor->sink = sink;
+    processor->sampled = TRUE;
+
+end:
+    ImpKeSignalCallDpcDone(SystemArgument1);
+}
+
+STATIC
+VOID
+HvpSiftDown(_Inout_ PUINT64 Samples, _In_ UINT32 Root, _In_ UINT32 Count)
+{
+    UINT32 child = 0;
+    UINT64 value = 0;
+
+    while ((child = Root * 2 + 1) < Count) {
+        if (child + 1 < Count && Samples[child + 1] > Samples[child])
+            child++;
+
+        if (Samples[Root] >= Samples[child])
+            return;
+
+        value = Samples[Root];
+        Samples[Root] = Samples[child];
+        Samples[child] = value;
+        Root = child;
+    }
+}
+
+/* Heapsort, as the combined samples of every processor can be large. */
+STATIC
+VOID
+HvpSortSamples(_Inout_ PUINT64 Samples, _In_ UINT32 Count)
+{
+    UINT64 value = 0;
+
+    for (UINT32 index = Count / 2; index > 0; index--)
+        HvpSiftDown(Samples, index - 1, Count);
+
+    for (UINT32 end = Count; end > 1; end--) {
+        value = Samples[0];
+        Samples[0] = Samples[end - 1];
+        Samples[end - 1] = value;
+        HvpSiftDown(Samples, 0, end - 1);
+    }
+}
+
+FORCEINLINE
+STATIC
+UINT64
+HvpPercentile(_In_ PUINT64 Sorted, _In_ UINT32 Count, _In_ UINT32 Percent)
+{
+    return Sorted[min(Count - 1, (UINT64)Count * Percent / 100)];
+}
+
+STATIC
+VOID
+HvpNormaliseConfiguration(
+    _In_opt_ PHYPERVISOR_TIMING_CONFIGURATION Configuration,
+    _Out_ PHYPERVISOR_TIMING_CONFIGURATION    Normalised)
+{
+    HYPERVISOR_TIMING_CONFIGURATION config = {0};
+
+    if (Configuration)
+        config = *Configuration;
+
+    if (!config.burst_count)
+        config.burst_count = HV_TIMING_DEFAULT_BURST_COUNT;
+
+    if (!config.samples_per_burst)
+        config.samples_per_burst = HV_TIMING_DEFAULT_SAMPLES_PER_BURST;
+
+    if (!config.threshold_percent)
+        config.threshold_percent = HV_TIMING_DEFAULT_THRESHOLD_PERCENT;
+
+    config.burst_count = min(config.burst_count, HV_TIMING_MAX_BURST_COUNT);
+    config.samples_per_burst =
+        min(config.samples_per_burst, HV_TIMING_MAX_SAMPLES_PER_BURST);
+
+    *Normalised = config;
+}
+
+/*
+ * Each processor's cpuid median is compared against its own reference median,
+ * so differing clock speeds between cores do not matter. The distribution
+ * returned is over the samples of every processor.
+ */
+STATIC
+VOID
+HvpCalculateDistribution(_In_ PHV_TIMING_CONTEXT               Context,
+                         _Inout_ PUINT64                       Combined,
+                         _Out_ PHYPERVISOR_TIMING_DISTRIBUTION Distribution)
+{
+    PHV_TIMING_PROCESSOR processor = NULL;
+    UINT32               per_processor = Context->configuration.burst_count *
+                           Context->configuration.samples_per_burst;
+    UINT32               total = 0;
+    UINT64               cpuid_median = 0;
+    UINT64               reference_median = 0;
+
+    for (UINT32 index = 0; index < Context->processor_count; index++) {
+        processor = &Context->processors[index];
+
+        if (!processor->sampled || processor->count != per_processor)
+            continue;
+
+        HvpSortSamples(processor->cpuid, per_processor);
+        HvpSortSamples(processor->reference, per_processor);
+
+        cpuid_median = HvpPercentile(processor->cpuid, per_processor, 50);
+        reference_median =
+            HvpPercentile(processor->reference, per_processor, 50);
+
+        if (cpuid_median * 100 >
+            reference_median * Context->configuration.threshold_percent)
+            Distribution->flagged_processor_count++;
+
+        Distribution->aperf_zero_count += processor->aperf_zero_count;
+        Distribution->burst_count += Context->configuration.burst_count;
+        Distribution->processor_count++;
+        total += per_processor;
+    }
+
+    Distribution->samples_per_processor = per_processor;
+
+    if (!total)
+        return;
+
+    for (UINT32 pass = 0; pass < 2; pass++) {
+        total = 0;
+
+        for (UINT32 index = 0; index < Context->processor_count; index++) {
+            processor = &Context->processors[index];
+
+            if (!processor->sampled || processor->count != per_processor)
+                continue;
+
+            IntCopyMemory(&Combined[total],
+                          pass ? processor->reference : processor->cpuid,
+                          per_processor * sizeof(UINT64));
+            total += per_processor;
+        }
+
+        HvpSortSamples(Combined, total);
+
+        if (pass) {
+            Distribution->reference_min = Combined[0];
+            Distribution->reference_median =
+                HvpPercentile(Combined, total, 50);
+            Distribution->reference_p90 = HvpPercentile(Combined, total, 90);
+        }
+        else {
+            Distribution->cpuid_min = Combined[0];
+            Distribution->cpuid_median = HvpPercentile(Combined, total, 50);
+            Distribution->cpuid_p90 = HvpPercentile(Combined, total, 90);
+        }
+    }
+}
+
+/*
+ * Samples cpuid against the reference workload on every processor in
+ * parallel. Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS
+HvMeasureTimingDistribution(
+    _In_opt_ PHYPERVISOR_TIMING_CONFIGURATION Configuration,
+    _Out_ PHYPERVISOR_TIMING_DISTRIBUTION     Distribution)
+{
+    PAGED_CODE();
+
+    NTSTATUS          status = STATUS_UNSUCCESSFUL;
+    HV_TIMING_CONTEXT context = {0};
+    PUINT64           samples = NULL;
+    PUINT64           combined = NULL;
+    UINT32            per_processor = 0;
+    SIZE_T            samples_size = 0;
+
+    RtlZeroMemory(Distribution, sizeof(HYPERVISOR_TIMING_DISTRIBUTION));
+
+    HvpNormaliseConfiguration(Configuration, &context.configuration);
+
+    context.processor_count =
+        KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    per_processor = context.configuration.burst_count *
+                    context.configuration.samples_per_burst;
+    samples_size =
+        (SIZE_T)context.processor_count * per_processor * sizeof(UINT64);
+
+    context.processors = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        context.processor_count * sizeof(HV_TIMING_PROCESSOR),
+        POOL_TAG_HV_TIMING);
+
+    if (!context.processors)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    /* the cpuid and reference samples of each processor, with the combined
+     * samples of a single instruction after them */
+    samples = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, samples_size * 3, POOL_TAG_HV_TIMING);
+
+    if (!samples) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    for (UINT32 index = 0; index < context.processor_count; index++) {
+        context.processors[index].cpuid =
+            &samples[(UINT64)index * 2 * per_processor];
+        context.processors[index].reference =
+            &samples[((UINT64)index * 2 + 1) * per_processor];
+    }
+
+    combined = &samples[(UINT64)context.processor_count * 2 * per_processor];
+
+    ImpKeGenericCallDpc(HvpTimingDpcRoutine, &context);
+
+    HvpCalculateDistribution(&context, combined, Distribution);
+
+    status = Distribution->processor_count ? STATUS_SUCCESS
+                                           : STATUS_UNSUCCESSFUL;
+
+end:
+    if (samples)
+        ImpExFreePoolWithTag(samples, POOL_TAG_HV_TIMING);
+
+    ImpExFreePoolWithTag(context.processors, POOL_TAG_HV_TIMING);
+    return status;
+}
+
+/* A majority of bursts is required, so a single stalled read is ignored. */
+FORCEINLINE
+STATIC
+BOOLEAN
+HvpIsAperfCheckFlagged(_In_ PHYPERVISOR_TIMING_DISTRIBUTION Distribution)
+{
+    return Distribution->aperf_zero_count * 2 > Distribution->burst_count;
+}
+
+FORCEINLINE
+STATIC
+BOOLEAN
+HvpIsCpuidCheckFlagged(_In_ PHYPERVISOR_TIMING_DISTRIBUTION Distribution)
+{
+    return Distribution->flagged_processor_count * 2 >
+           Distribution->processor_count;
+}
+
+BOOLEAN
+APERFMsrTimingCheck()
+{
+    NTSTATUS                       status = STATUS_UNSUCCESSFUL;
+    HYPERVISOR_TIMING_DISTRIBUTION distribution = {0};
+
+    status = HvMeasureTimingDistribution(NULL, &distribution);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("HvMeasureTimingDistribution failed with status %x",
+                    status);
+        return FALSE;
+    }
+
+    return HvpIsAperfCheckFlagged(&distribution);
 }
 
 NTSTATUS
@@ -92,8 +397,19 @@ PerformVirtualizationDetection(_Inout_ PIRP Irp)
 {
     PAGED_CODE();
 
-    NTSTATUS status = STATUS_UNSUCCESSFUL;
-    HYPERVISOR_DETECTION_REPORT report = {0};
+    NTSTATUS                         status = STATUS_UNSUCCESSFUL;
+    HYPERVISOR_DETECTION_REPORT      report = {0};
+    HYPERVISOR_TIMING_CONFIGURATION  config = {0};
+    PHYPERVISOR_TIMING_CONFIGURATION input = NULL;
+
+    /* the configuration is optional, and shares the system buffer with the
+     * report so must be copied out first */
+    if (NT_SUCCESS(ValidateIrpInputBuffer(
+            Irp, sizeof(HYPERVISOR_TIMING_CONFIGURATION)))) {
+        config = *(PHYPERVISOR_TIMING_CONFIGURATION)
+                      Irp->AssociatedIrp.SystemBuffer;
+        input = &config;
+    }
 
     status = ValidateIrpOutputBuffer(Irp, sizeof(HYPERVISOR_DETECTION_REPORT));
 
@@ -102,7 +418,16 @@ PerformVirtualizationDetection(_Inout_ PIRP Irp)
         return status;
     }
 
-    report.aperf_msr_timing_check = APERFMsrTimingCheck();
+    status = HvMeasureTimingDistribution(input, &report.distribution);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("HvMeasureTimingDistribution failed with status %x",
+                    status);
+        return status;
+    }
+
+    report.aperf_msr_timing_check = HvpIsAperfCheckFlagged(&report.distribution);
+    report.cpuid_timing_check = HvpIsCpuidCheckFlagged(&report.distribution);
     report.invd_emulation_check = TestINVDEmulation();
 
     Irp->IoStatus.Information = sizeof(HYPERVISOR_DETECTION_REPORT);
@@ -113,4 +438,4 @@ PerformVirtualizationDetection(_Inout_ PIRP Irp)
         sizeof(HYPERVISOR_DETECTION_REPORT));
 
     return STATUS_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,365 @@
+#include "hwid.h"
+
+#include "crypt.h"
+#include "driver.h"
+#include "hw.h"
+#include "imports.h"
+#include "integrity.h"
+#include "pcidev.h"
+#include "lib/stdlib.h"
+
+#include <initguid.h>
+#include <ndisguid.h>
+#include <ntddstor.h>
+#include <ntddvdeo.h>
+#include <usbiodef.h>
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, HwIdCacheInitialise)
+#    pragma alloc_text(PAGE, HwIdCacheFree)
+#    pragma alloc_text(PAGE, HwIdCacheQuery)
+#endif
+
+STATIC HW_ID_CACHE g_HwIdCache = {0};
+
+STATIC CONST GUID* HwIdpNotificationClasses[] = {
+    &GUID_DEVINTERFACE_DISK,
+    &GUID_DEVINTERFACE_STORAGEPORT,
+    &GUID_DEVINTERFACE_DISPLAY_ADAPTER,
+    &GUID_DEVINTERFACE_NET,
+    &GUID_DEVINTERFACE_USB_HOST_CONTROLLER};
+
+C_ASSERT(ARRAYSIZE(HwIdpNotificationClasses) ==
+         HW_ID_NOTIFICATION_CLASS_COUNT);
+
+STATIC
+VOID
+HwIdpGatherSmbios(_Inout_ PHW_ID_SNAPSHOT Snapshot)
+{
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    PSYSTEM_INFORMATION info = &Snapshot->information;
+
+    status = ParseSMBIOSTable(info->vendor,
+                              VENDOR_STRING_MAX_LENGTH,
+                              SmbiosInformation,
+                              SMBIOS_VENDOR_STRING_SUB_INDEX);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ParseSMBIOSTable vendor failed with status %x", status);
+        return;
+    }
+
+    Snapshot->flags |= HW_ID_FLAG_VENDOR;
+
+    /* vmware stores the serial in its vendor specific table */
+    if (IntFindSubstring(info->vendor, "VMware")) {
+        info->environment = Vmware;
+        status = ParseSMBIOSTable(info->motherboard_serial,
+                                  MOTHERBOARD_SERIAL_CODE_LENGTH,
+                                  VendorSpecificInformation,
+                                  SMBIOS_VMWARE_SERIAL_NUMBER_SUB_INDEX);
+    }
+    else {
+        info->environment = IntFindSubstring(info->vendor, "innotek")
+                                ? VirtualBox
+                                : NativeWindows;
+        status = ParseSMBIOSTable(info->motherboard_serial,
+                                  MOTHERBOARD_SERIAL_CODE_LENGTH,
+                                  SystemInformation,
+                                  SMBIOS_NATIVE_SERIAL_NUMBER_SUB_INDEX);
+    }
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ParseSMBIOSTable serial failed with status %x", status);
+        return;
+    }
+
+    Snapshot->flags |= HW_ID_FLAG_MOTHERBOARD_SERIAL;
+}
+
+/*
+ * Each identifier is gathered independently, so one failing does not prevent
+ * the others from being cached.
+ */
+STATIC
+VOID
+HwIdpGather(_Out_ PHW_ID_SNAPSHOT Snapshot)
+{
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    PSYSTEM_INFORMATION info = &Snapshot->information;
+
+    RtlZeroMemory(Snapshot, sizeof(HW_ID_SNAPSHOT));
+
+    HwIdpGatherSmbios(Snapshot);
+
+    status = GetHardDiskDriveSerialNumber(info->drive_0_serial,
+                                          DEVICE_DRIVE_0_SERIAL_CODE_LENGTH);
+
+    if (NT_SUCCESS(status))
+        Snapshot->flags |= HW_ID_FLAG_DRIVE_SERIAL;
+    else
+        DEBUG_ERROR("GetHardDiskDriveSerialNumber failed with status %x",
+                    status);
+
+    status = GetOsVersionInformation(&info->os_information);
+
+    if (NT_SUCCESS(status))
+        Snapshot->flags |= HW_ID_FLAG_OS_VERSION;
+    else
+        DEBUG_ERROR("GetOsVersionInformation failed with status %x", status);
+
+    Snapshot->tpm_status = TpmExtractEndorsementKey();
+
+    if (!NT_SUCCESS(Snapshot->tpm_status))
+        DEBUG_WARNING("TpmExtractEndorsementKey failed with status %x",
+                      Snapshot->tpm_status);
+
+    Snapshot->pci_status = ValidatePciDevices();
+
+    if (!NT_SUCCESS(Snapshot->pci_status))
+        DEBUG_WARNING("ValidatePciDevices failed with status %x",
+                      Snapshot->pci_status);
+}
+
+/*
+ * The driver config keeps a copy of the identifiers for the existing
+ * consumers of GetDriverConfigSystemInformation. Only the fields gathered
+ * here are replaced.
+ */
+STATIC
+VOID
+HwIdpPublishToDriverConfig(_In_ PHW_ID_SNAPSHOT Snapshot)
+{
+    PSYSTEM_INFORMATION source = &Snapshot->information;
+    PSYSTEM_INFORMATION config = GetDriverConfigSystemInformation();
+
+    AcquireDriverConfigLock();
+
+    if (Snapshot->flags & HW_ID_FLAG_VENDOR) {
+        IntCopyMemory(config->vendor, source->vendor, sizeof(config->vendor));
+        config->environment = source->environment;
+    }
+
+    if (Snapshot->flags & HW_ID_FLAG_MOTHERBOARD_SERIAL)
+        IntCopyMemory(config->motherboard_serial,
+                      source->motherboard_serial,
+                      sizeof(config->motherboard_serial));
+
+    if (Snapshot->flags & HW_ID_FLAG_DRIVE_SERIAL)
+        IntCopyMemory(config->drive_0_serial,
+                      source->drive_0_serial,
+                      sizeof(config->drive_0_serial));
+
+    if (Snapshot->flags & HW_ID_FLAG_OS_VERSION)
+        config->os_information = source->os_information;
+
+    ReleaseDriverConfigLock();
+}
+
+STATIC
+VOID
+HwIdpWorkerRoutine(_In_ PDEVICE_OBJECT DeviceObject, _In_opt_ PVOID Context)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Context);
+
+    PHW_ID_CACHE   cache = &g_HwIdCache;
+    HW_ID_SNAPSHOT snapshot = {0};
+    LARGE_INTEGER  delay = {.QuadPart = RELATIVE(HW_ID_REFRESH_COALESCE_DELAY)};
+
+    for (;;) {
+        /* the first gather is not delayed, it is what sessions wait on */
+        if (cache->snapshot.version)
+            ImpKeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+        InterlockedExchange(&cache->refresh_requested, FALSE);
+
+        HwIdpGather(&snapshot);
+        HwIdpPublishToDriverConfig(&snapshot);
+
+        ImpKeAcquireGuardedMutex(&cache->lock);
+        snapshot.version = cache->snapshot.version + 1;
+        cache->snapshot = snapshot;
+        ImpKeReleaseGuardedMutex(&cache->lock);
+
+        ImpKeSetEvent(&cache->ready, IO_NO_INCREMENT, FALSE);
+
+        DEBUG_VERBOSE("Hardware identifiers gathered, version: %llx",
+                      snapshot.version);
+
+        InterlockedExchange(&cache->queued, FALSE);
+
+        /* a notification raised after refresh_requested was cleared could
+         * have seen queued still set, so it is picked up here */
+        if (!ReadAcquire(&cache->refresh_requested) ||
+            !cache->active ||
+            InterlockedCompareExchange(&cache->queued, TRUE, FALSE))
+            break;
+    }
+}
+
+STATIC
+VOID
+HwIdpQueueWorkItem(_In_ PHW_ID_CACHE Cache)
+{
+    if (InterlockedCompareExchange(&Cache->queued, TRUE, FALSE))
+        return;
+
+    ImpIoQueueWorkItem(
+        Cache->work_item, HwIdpWorkerRoutine, DelayedWorkQueue, NULL);
+}
+
+/* May be called at IRQL <= DISPATCH_LEVEL. */
+VOID
+HwIdCacheRequestRefresh()
+{
+    PHW_ID_CACHE cache = &g_HwIdCache;
+
+    if (!cache->active)
+        return;
+
+    InterlockedExchange(&cache->refresh_requested, TRUE);
+    HwIdpQueueWorkItem(cache);
+}
+
+STATIC
+NTSTATUS
+HwIdpDeviceInterfaceNotification(_In_ PVOID       NotificationStructure,
+                                 _Inout_opt_ PVOID Context)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    PDEVICE_INTERFACE_CHANGE_NOTIFICATION notification =
+        (PDEVICE_INTERFACE_CHANGE_NOTIFICATION)NotificationStructure;
+
+    if (IsEqualGUID(&notification->Event, &GUID_DEVICE_INTERFACE_ARRIVAL) ||
+        IsEqualGUID(&notification->Event, &GUID_DEVICE_INTERFACE_REMOVAL)) {
+        /* the refresh revalidates the pci devices, which must rescan */
+        PciDeviceTableRequestRescan();
+        HwIdCacheRequestRefresh();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* No notification callback is running once this returns. */
+STATIC
+VOID
+HwIdpUnregisterNotifications(_Inout_ PHW_ID_CACHE Cache)
+{
+    for (UINT32 index = 0; index < HW_ID_NOTIFICATION_CLASS_COUNT; index++) {
+        if (!Cache->notification_entries[index])
+            continue;
+
+        ImpIoUnregisterPlugPlayNotificationEx(
+            Cache->notification_entries[index]);
+        Cache->notification_entries[index] = NULL;
+    }
+}
+
+/*
+ * To be called at the end of DriverEntry, once the driver config and crypt
+ * provider are initialised. Returns once the first gather is queued, so does
+ * not add to the time taken to load the driver.
+ */
+NTSTATUS
+HwIdCacheInitialise()
+{
+    PAGED_CODE();
+
+    NTSTATUS     status = STATUS_UNSUCCESSFUL;
+    PHW_ID_CACHE cache = &g_HwIdCache;
+
+    RtlZeroMemory(cache, sizeof(HW_ID_CACHE));
+    ImpKeInitializeGuardedMutex(&cache->lock);
+    KeInitializeEvent(&cache->ready, NotificationEvent, FALSE);
+
+    cache->work_item = ImpIoAllocateWorkItem(GetDriverDeviceObject());
+
+    if (!cache->work_item)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    /* arrivals of interfaces present at registration are not reported, the
+     * initial gather covers them */
+    for (UINT32 index = 0; index < HW_ID_NOTIFICATION_CLASS_COUNT; index++) {
+        status = ImpIoRegisterPlugPlayNotification(
+            EventCategoryDeviceInterfaceChange,
+            0,
+            (PVOID)HwIdpNotificationClasses[index],
+            GetDriverObject(),
+            HwIdpDeviceInterfaceNotification,
+            NULL,
+            &cache->notification_entries[index]);
+
+        if (!NT_SUCCESS(status)) {
+            DEBUG_ERROR(
+                "IoRegisterPlugPlayNotification failed with status %x",
+                status);
+            HwIdpUnregisterNotifications(cache);
+            ImpIoFreeWorkItem(cache->work_item);
+            cache->work_item = NULL;
+            return status;
+        }
+    }
+
+    cache->active = TRUE;
+    HwIdpQueueWorkItem(cache);
+    return STATUS_SUCCESS;
+}
+
+/* Waits for a queued or running gather to finish. */
+VOID
+HwIdCacheFree()
+{
+    PAGED_CODE();
+
+    PHW_ID_CACHE  cache = &g_HwIdCache;
+    LARGE_INTEGER delay = {.QuadPart = RELATIVE(HW_ID_UNLOAD_POLL_INTERVAL)};
+
+    if (!cache->work_item)
+        return;
+
+    cache->active = FALSE;
+
+    HwIdpUnregisterNotifications(cache);
+
+    while (ReadAcquire(&cache->queued))
+        ImpKeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+    ImpIoFreeWorkItem(cache->work_item);
+    cache->work_item = NULL;
+}
+
+/*
+ * Copies the latest snapshot, waiting at most TimeoutMs for the first gather
+ * to complete. Callers compare the version against one previously seen to
+ * tell whether the identifiers were refreshed.
+ */
+NTSTATUS
+HwIdCacheQuery(_In_ UINT32 TimeoutMs, _Out_ PHW_ID_SNAPSHOT Snapshot)
+{
+    PAGED_CODE();
+
+    NTSTATUS      status = STATUS_UNSUCCESSFUL;
+    PHW_ID_CACHE  cache = &g_HwIdCache;
+    LARGE_INTEGER timeout = {.QuadPart = RELATIVE(MILLISECONDS(TimeoutMs))};
+
+    RtlZeroMemory(Snapshot, sizeof(HW_ID_SNAPSHOT));
+
+    if (!cache->work_item)
+        return STATUS_DEVICE_NOT_READY;
+
+    status = ImpKeWaitForSingleObject(
+        &cache->ready, Executive, KernelMode, FALSE, &timeout);
+
+    if (status != STATUS_SUCCESS) {
+        DEBUG_WARNING("Hardware identifiers not yet gathered");
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+    *Snapshot = cache->snapshot;
+    ImpKeReleaseGuardedMutex(&cache->lock);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,371 @@
+#include "irpbatch.h"
+
+#include "imports.h"
+#include "lib/stdlib.h"
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, IrpBatchInitialise)
+#    pragma alloc_text(PAGE, IrpBatchFree)
+#endif
+
+STATIC IRP_BATCH_QUEUE g_IrpBatchQueue = {0};
+
+FORCEINLINE
+STATIC
+UINT32
+IrpBatchpGetRecordSize(_In_ UINT32 PacketLength)
+{
+    return (sizeof(SHARED_REPORT_RECORD) + PacketLength +
+            SHARED_REPORT_RECORD_ALIGNMENT - 1) &
+           ~(SHARED_REPORT_RECORD_ALIGNMENT - 1);
+}
+
+FORCEINLINE
+STATIC
+PIRP_BATCH_QUEUE
+IrpBatchpGetQueue(_In_ PIO_CSQ Csq)
+{
+    return CONTAINING_RECORD(Csq, IRP_BATCH_QUEUE, csq);
+}
+
+STATIC
+VOID
+IrpBatchpCsqInsertIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    PIRP_BATCH_QUEUE queue = IrpBatchpGetQueue(Csq);
+
+    /* the oldest request is kept at the head */
+    InsertTailList(&queue->irps, &Irp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&queue->irp_count);
+}
+
+STATIC
+VOID
+IrpBatchpCsqRemoveIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    PIRP_BATCH_QUEUE queue = IrpBatchpGetQueue(Csq);
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    InterlockedDecrement(&queue->irp_count);
+}
+
+STATIC
+PIRP
+IrpBatchpCsqPeekNextIrp(_In_ PIO_CSQ   Csq,
+                        _In_opt_ PIRP  Irp,
+                        _In_opt_ PVOID PeekContext)
+{
+    UNREFERENCED_PARAMETER(PeekContext);
+
+    PIRP_BATCH_QUEUE queue = IrpBatchpGetQueue(Csq);
+    PLIST_ENTRY      entry =
+        Irp ? Irp->Tail.Overlay.ListEntry.Flink : queue->irps.Flink;
+
+    if (entry == &queue->irps)
+        return NULL;
+
+    return CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(Csq, IRP_BATCH_QUEUE, csq)->lock)
+STATIC
+VOID
+IrpBatchpCsqAcquireLock(_In_ PIO_CSQ                            Csq,
+                        _Out_ _At_(*Irql, _IRQL_saves_) PKIRQL  Irql)
+{
+    KeAcquireSpinLock(&IrpBatchpGetQueue(Csq)->lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(Csq, IRP_BATCH_QUEUE, csq)->lock)
+STATIC
+VOID
+IrpBatchpCsqReleaseLock(_In_ PIO_CSQ                    Csq,
+                        _In_ _IRQL_restores_ KIRQL      Irql)
+{
+    KeReleaseSpinLock(&IrpBatchpGetQueue(Csq)->lock, Irql);
+}
+
+STATIC
+VOID
+IrpBatchpCsqCompleteCanceledIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    ImpIofCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+NTSTATUS
+IrpBatchInitialise()
+{
+    PAGED_CODE();
+
+    NTSTATUS         status = STATUS_UNSUCCESSFUL;
+    PIRP_BATCH_QUEUE queue = &g_IrpBatchQueue;
+
+    RtlZeroMemory(queue, sizeof(IRP_BATCH_QUEUE));
+
+    InitializeListHead(&queue->irps);
+    KeInitializeSpinLock(&queue->lock);
+
+    status = RtlRingCreate(IRP_BATCH_RING_CAPACITY, &queue->reports);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("RtlRingCreate failed with status %x", status);
+        return status;
+    }
+
+    status = IoCsqInitialize(&queue->csq,
+                             IrpBatchpCsqInsertIrp,
+                             IrpBatchpCsqRemoveIrp,
+                             IrpBatchpCsqPeekNextIrp,
+                             IrpBatchpCsqAcquireLock,
+                             IrpBatchpCsqReleaseLock,
+                             IrpBatchpCsqCompleteCanceledIrp);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("IoCsqInitialize failed with status %x", status);
+        RtlRingDelete(&queue->reports);
+        return status;
+    }
+
+    queue->active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Cancels every pending request and frees the reports that were never
+ * returned. Must only be called once nothing can schedule a report.
+ */
+VOID
+IrpBatchFree()
+{
+    PAGED_CODE();
+
+    PIRP_BATCH_QUEUE queue = &g_IrpBatchQueue;
+    PIRP             irp = NULL;
+    RTL_RING_ENTRY   entry = {0};
+
+    if (!queue->active)
+        return;
+
+    queue->active = FALSE;
+
+    /* wait out the current drainer, then keep draining claimed for good */
+    while (InterlockedCompareExchange(&queue->draining, TRUE, FALSE))
+        YieldProcessor();
+
+    while ((irp = IoCsqRemoveNextIrp(&queue->csq, NULL)) != NULL)
+        IrpBatchpCsqCompleteCanceledIrp(&queue->csq, irp);
+
+    if (queue->carry.buffer) {
+        ImpExFreePoolWithTag(queue->carry.buffer, REPORT_POOL_TAG);
+        queue->carry.buffer = NULL;
+    }
+
+    while (RtlRingPopBatch(&queue->reports, &entry, 1))
+        ImpExFreePoolWithTag(entry.buffer, REPORT_POOL_TAG);
+
+    RtlRingDelete(&queue->reports);
+}
+
+/*
+ * Ensures carry holds the next report to be returned. ASSUMES DRAINING IS
+ * HELD!
+ */
+STATIC
+BOOLEAN
+IrpBatchpLoadCarry(_Inout_ PIRP_BATCH_QUEUE Queue)
+{
+    if (Queue->carry.buffer)
+        return TRUE;
+
+    return RtlRingPopBatch(&Queue->reports, &Queue->carry, 1) == 1;
+}
+
+STATIC
+VOID
+IrpBatchpDropReport(_Inout_ PIRP_BATCH_QUEUE Queue, _In_ PVOID Buffer)
+{
+    ImpExFreePoolWithTag(Buffer, REPORT_POOL_TAG);
+    InterlockedIncrement64(&Queue->reports_dropped);
+}
+
+/*
+ * Fills Irp with the carried report followed by as many queued reports as
+ * fit, then completes it. The batch is only empty if every report left was
+ * too large for the request. ASSUMES DRAINING IS HELD!
+ */
+STATIC
+VOID
+IrpBatchpCompleteIrp(_Inout_ PIRP_BATCH_QUEUE Queue, _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION    io = IoGetCurrentIrpStackLocation(Irp);
+    PUCHAR                buffer = Irp->AssociatedIrp.SystemBuffer;
+    PREPORT_BATCH_HEADER  header = (PREPORT_BATCH_HEADER)buffer;
+    PSHARED_REPORT_RECORD record = NULL;
+    UINT32                capacity =
+        io->Parameters.DeviceIoControl.OutputBufferLength;
+    UINT32 offset = sizeof(REPORT_BATCH_HEADER);
+    UINT32 record_size = 0;
+    UINT32 count = 0;
+
+    while (IrpBatchpLoadCarry(Queue)) {
+        record_size = IrpBatchpGetRecordSize(Queue->carry.buffer_size);
+
+        if (record_size > capacity - sizeof(REPORT_BATCH_HEADER)) {
+            DEBUG_ERROR("Report of size %lx exceeds the request buffer",
+                        Queue->carry.buffer_size);
+
+            IrpBatchpDropReport(Queue, Queue->carry.buffer);
+            Queue->carry.buffer = NULL;
+            continue;
+        }
+
+        /* leave it for the next request */
+        if (record_size > capacity - offset)
+            break;
+
+        record = (PSHARED_REPORT_RECORD)&buffer[offset];
+        record->length = Queue->carry.buffer_size;
+        record->type = SHARED_REPORT_RECORD_DATA;
+        record->sequence = Queue->sequence++;
+
+        IntCopyMemory(record + 1, Queue->carry.buffer, record->length);
+
+        /* the padding would otherwise return whatever the buffer held */
+        RtlZeroMemory((PUCHAR)(record + 1) + record->length,
+                      record_size - sizeof(SHARED_REPORT_RECORD) -
+                          record->length);
+
+        ImpExFreePoolWithTag(Queue->carry.buffer, REPORT_POOL_TAG);
+        Queue->carry.buffer = NULL;
+
+        offset += record_size;
+        count++;
+    }
+
+    header->count = count;
+    header->length = offset - sizeof(REPORT_BATCH_HEADER);
+    header->queued = RtlRingCount(&Queue->reports) + !!Queue->carry.buffer;
+    header->dropped = (UINT32)Queue->reports_dropped;
+
+    InterlockedAdd64(&Queue->reports_completed, count);
+    InterlockedIncrement64(&Queue->irps_completed);
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = offset;
+    ImpIofCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+FORCEINLINE
+STATIC
+BOOLEAN
+IrpBatchpHasWork(_In_ PIRP_BATCH_QUEUE Queue)
+{
+    return (Queue->carry.buffer || RtlRingCount(&Queue->reports)) &&
+           Queue->irp_count;
+}
+
+/*
+ * Completes the oldest pending requests while there are reports to return.
+ * If another caller is already draining, it is left to that caller.
+ */
+STATIC
+VOID
+IrpBatchpDrain(_Inout_ PIRP_BATCH_QUEUE Queue)
+{
+    PIRP irp = NULL;
+
+    do {
+        if (InterlockedCompareExchange(&Queue->draining, TRUE, FALSE))
+            return;
+
+        /* a request is only removed once there is a report to return */
+        while (IrpBatchpLoadCarry(Queue)) {
+            irp = IoCsqRemoveNextIrp(&Queue->csq, NULL);
+
+            if (!irp)
+                break;
+
+            IrpBatchpCompleteIrp(Queue, irp);
+        }
+
+        InterlockedExchange(&Queue->draining, FALSE);
+
+        /*
+         * A report or request arriving after the loop above but before
+         * draining was cleared was left to us by its caller, so check again.
+         */
+    } while (IrpBatchpHasWork(Queue));
+}
+
+/*
+ * Called from DeviceControl for IOCTL_RETRIEVE_REPORT_BATCH. On
+ * STATUS_PENDING the request is owned by the queue and must not be completed
+ * by the caller.
+ */
+NTSTATUS
+IrpBatchQueueIrp(_Inout_ PIRP Irp)
+{
+    NTSTATUS         status = STATUS_UNSUCCESSFUL;
+    PIRP_BATCH_QUEUE queue = &g_IrpBatchQueue;
+
+    if (!queue->active)
+        return STATUS_DEVICE_NOT_READY;
+
+    status = ValidateIrpOutputBuffer(Irp, REPORT_BATCH_MIN_BUFFER_SIZE);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ValidateIrpOutputBuffer failed with status %x", status);
+        return status;
+    }
+
+    IoCsqInsertIrp(&queue->csq, Irp, NULL);
+    IrpBatchpDrain(queue);
+
+    return STATUS_PENDING;
+}
+
+/*
+ * Takes ownership of Buffer, an encrypted packet allocated with
+ * REPORT_POOL_TAG.
+ */
+VOID
+IrpBatchSchedulePacket(_In_ PVOID Buffer, _In_ UINT32 BufferLength)
+{
+    PIRP_BATCH_QUEUE queue = &g_IrpBatchQueue;
+
+    if (!queue->active) {
+        ImpExFreePoolWithTag(Buffer, REPORT_POOL_TAG);
+        return;
+    }
+
+    if (!queue->irp_count)
+        InterlockedIncrement64(&queue->reports_deferred);
+
+    if (!RtlRingPush(&queue->reports, Buffer, BufferLength)) {
+        DEBUG_WARNING("Report ring is full, dropping report.");
+        IrpBatchpDropReport(queue, Buffer);
+        return;
+    }
+
+    IrpBatchpDrain(queue);
+}
+
+VOID
+IrpBatchQueryStatistics(_Out_ PIRP_BATCH_STATISTICS Statistics)
+{
+    PIRP_BATCH_QUEUE queue = &g_IrpBatchQueue;
+
+    Statistics->irps_pending = queue->irp_count;
+    Statistics->reports_queued =
+        RtlRingCount(&queue->reports) + !!queue->carry.buffer;
+    Statistics->reports_completed = queue->reports_completed;
+    Statistics->irps_completed = queue->irps_completed;
+    Statistics->reports_deferred = queue->reports_deferred;
+    Statistics->reports_dropped = queue->reports_dropped;
+}
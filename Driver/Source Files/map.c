@@ -1,12 +1,162 @@
 #include "map.h"
 
 #include "../lib/stdlib.h"
+#include "../perf.h"
+
+/* Mask must be non zero */
+FORCEINLINE
+STATIC
+UINT32
+RtlpHashmapFindFirstSetBit(_In_ UINT32 Mask)
+{
+    ULONG index = 0;
+    _BitScanForward(&index, Mask);
+    return index;
+}
+
+FORCEINLINE
+STATIC
+PRTL_HASHMAP_GROUP
+RtlpHashmapGetGroup(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    return (PRTL_HASHMAP_GROUP)((UINT64)Hashmap->groups +
+                                (UINT64)Index * Hashmap->group_size);
+}
+
+FORCEINLINE
+STATIC
+PVOID
+RtlpHashmapGetGroupSlot(_In_ PRTL_HASHMAP       Hashmap,
+                        _In_ PRTL_HASHMAP_GROUP Group,
+                        _In_ UINT32             Slot)
+{
+    return (PVOID)((UINT64)Group->slots + (UINT64)Slot * Hashmap->slot_size);
+}
+
+FORCEINLINE
+STATIC
+PLIST_ENTRY
+RtlpHashmapGetListHead(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    if (Hashmap->storage == HashmapStorageOpenAddressed)
+        return &RtlpHashmapGetGroup(Hashmap, Index)->overflow;
+
+    return &Hashmap->buckets[Index].entry;
+}
+
+FORCEINLINE
+STATIC
+PKGUARDED_MUTEX
+RtlpHashmapGetBucketLock(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    return &Hashmap->locks[Index % Hashmap->lock_stripes].lock;
+}
+
+/*
+ * Resizable maps are indexed by the mixed hash of the key so that the index
+ * returned by RtlHashmapHashKeyAndAcquireBucket remains valid while the
+ * table grows. Since the bucket count is always a multiple of the stripe
+ * count, Index % lock_stripes == bucket % lock_stripes.
+ */
+FORCEINLINE
+STATIC
+UINT32
+RtlpHashmapGetBucketIndex(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    return Hashmap->resizable ? Index & (Hashmap->bucket_count - 1) : Index;
+}
+
+FORCEINLINE
+STATIC
+UINT32
+RtlpHashmapGetOccupancyWordCount(_In_ UINT32 BucketCount)
+{
+    return (BucketCount + RTL_HASHMAP_BITMAP_BITS - 1) /
+           RTL_HASHMAP_BITMAP_BITS;
+}
+
+/* ASSUMES LOCK IS HELD! */
+FORCEINLINE
+STATIC
+BOOLEAN
+RtlpHashmapIsBucketEmpty(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    if (Hashmap->storage == HashmapStorageOpenAddressed &&
+        RtlpHashmapGetGroup(Hashmap, Index)->occupied)
+        return FALSE;
+
+    return IsListEmpty(RtlpHashmapGetListHead(Hashmap, Index));
+}
+
+/* ASSUMES LOCK IS HELD! */
+FORCEINLINE
+STATIC
+VOID
+RtlpHashmapMarkBucketOccupied(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    LONG bit = 1l << (Index % RTL_HASHMAP_BITMAP_BITS);
+    volatile LONG* word =
+        &Hashmap->occupancy[Index / RTL_HASHMAP_BITMAP_BITS];
+
+    if (!(*word & bit))
+        InterlockedOr(word, bit);
+}
+
+/* ASSUMES LOCK IS HELD! */
+FORCEINLINE
+STATIC
+VOID
+RtlpHashmapUpdateBucketOccupancy(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    LONG bit = 1l << (Index % RTL_HASHMAP_BITMAP_BITS);
+
+    if (RtlpHashmapIsBucketEmpty(Hashmap, Index))
+        InterlockedAnd(
+            &Hashmap->occupancy[Index / RTL_HASHMAP_BITMAP_BITS], ~bit);
+}
+
+/*
+ * Bucket heads act purely as list sentinels, the entries themselves are
+ * allocated from the lookaside list.
+ */
+STATIC
+VOID
+RtlpHashmapFreeChain(_In_ PRTL_HASHMAP Hashmap, _In_ PLIST_ENTRY Head)
+{
+    PLIST_ENTRY        list_entry = NULL;
+    PRTL_HASHMAP_ENTRY entry = NULL;
+
+    while (!IsListEmpty(Head)) {
+        list_entry = RemoveHeadList(Head);
+        entry = CONTAINING_RECORD(list_entry, RTL_HASHMAP_ENTRY, entry);
+        ExFreeToLookasideListEx(&Hashmap->pool, entry);
+    }
+}
 
 VOID
 RtlHashmapDelete(_In_ PRTL_HASHMAP Hashmap)
 {
-    ExFreePoolWithTag(Hashmap->buckets, POOL_TAG_HASHMAP);
+    for (UINT32 index = 0; index < Hashmap->bucket_count; index++)
+        RtlpHashmapFreeChain(Hashmap, RtlpHashmapGetListHead(Hashmap, index));
+
+    if (Hashmap->old_buckets) {
+        for (UINT32 index = 0; index < Hashmap->old_bucket_count; index++)
+            RtlpHashmapFreeChain(Hashmap, &Hashmap->old_buckets[index].entry);
+
+        ExFreePoolWithTag(Hashmap->old_buckets, POOL_TAG_HASHMAP);
+        ExFreePoolWithTag((PVOID)Hashmap->old_occupancy, POOL_TAG_HASHMAP);
+    }
+
+    if (Hashmap->migration_cursors)
+        ExFreePoolWithTag(Hashmap->migration_cursors, POOL_TAG_HASHMAP);
+
+    if (Hashmap->storage == HashmapStorageOpenAddressed)
+        ExFreePoolWithTag(Hashmap->groups, POOL_TAG_HASHMAP);
+    else
+        ExFreePoolWithTag(Hashmap->buckets, POOL_TAG_HASHMAP);
+
     ExFreePoolWithTag(Hashmap->locks, POOL_TAG_HASHMAP);
+    ExFreePoolWithTag((PVOID)Hashmap->occupancy, POOL_TAG_HASHMAP);
     ExDeleteLookasideListEx(&Hashmap->pool);
 }
 
@@ -24,37 +174,176 @@ RtlHashmapCreate(
     _In_ COMPARE_FUNCTION CompareFunction,
     _In_opt_ PVOID Context,
     _Out_ PRTL_HASHMAP Hashmap)
+{
+    return RtlHashmapCreateEx(
+        BucketCount,
+        EntryObjectSize,
+        HashFunction,
+        CompareFunction,
+        Context,
+        NULL,
+        Hashmap);
+}
+
+STATIC
+PVOID
+RtlpHashmapAllocateBuckets(
+    _Inout_ PRTL_HASHMAP Hashmap, _In_ UINT32 BucketCount)
+{
+    PRTL_HASHMAP_GROUP group = NULL;
+
+    if (Hashmap->storage == HashmapStorageChained) {
+        Hashmap->buckets = ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            (UINT64)BucketCount * sizeof(RTL_HASHMAP_ENTRY),
+            POOL_TAG_HASHMAP);
+
+        if (!Hashmap->buckets)
+            return NULL;
+
+        for (UINT32 index = 0; index < BucketCount; index++)
+            InitializeListHead(&Hashmap->buckets[index].entry);
+
+        return Hashmap->buckets;
+    }
+
+    Hashmap->groups = ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (UINT64)BucketCount * Hashmap->group_size,
+        POOL_TAG_HASHMAP);
+
+    if (!Hashmap->groups)
+        return NULL;
+
+    for (UINT32 index = 0; index < BucketCount; index++) {
+        group = RtlpHashmapGetGroup(Hashmap, index);
+        group->occupied = 0;
+        InitializeListHead(&group->overflow);
+    }
+
+    return Hashmap->groups;
+}
+
+FORCEINLINE
+STATIC
+UINT32
+RtlpHashmapRoundUpToPowerOfTwo(_In_ UINT32 Value)
+{
+    ULONG index = 0;
+
+    if (Value <= 1)
+        return 1;
+
+    _BitScanReverse(&index, Value - 1);
+    return 1ul << (index + 1);
+}
+
+FORCEINLINE
+STATIC
+UINT32
+RtlpHashmapRoundDownToPowerOfTwo(_In_ UINT32 Value)
+{
+    ULONG index = 0;
+    _BitScanReverse(&index, Value);
+    return 1ul << index;
+}
+
+NTSTATUS
+RtlHashmapCreateEx(
+    _In_ UINT32 BucketCount,
+    _In_ UINT32 EntryObjectSize,
+    _In_ HASH_FUNCTION HashFunction,
+    _In_ COMPARE_FUNCTION CompareFunction,
+    _In_opt_ PVOID Context,
+    _In_opt_ PRTL_HASHMAP_CONFIGURATION Configuration,
+    _Out_ PRTL_HASHMAP Hashmap)
 {
     NTSTATUS status = STATUS_UNSUCCESSFUL;
     UINT32 entry_size = sizeof(RTL_HASHMAP_ENTRY) + EntryObjectSize;
-    PRTL_HASHMAP_ENTRY entry = NULL;
+    PVOID buckets = NULL;
 
-    if (!CompareFunction || !HashFunction)
+    if (!CompareFunction || !HashFunction || !BucketCount)
         return STATUS_INVALID_PARAMETER;
 
-    Hashmap->buckets = ExAllocatePool2(
-        POOL_FLAG_NON_PAGED,
-        BucketCount * entry_size,
-        POOL_TAG_HASHMAP);
+    RtlZeroMemory(Hashmap, sizeof(RTL_HASHMAP));
+
+    if (Configuration) {
+        Hashmap->storage = Configuration->storage;
+        Hashmap->lock_stripes = Configuration->lock_stripes;
+        Hashmap->resizable = Configuration->resizable;
+        Hashmap->max_load_factor = Configuration->max_load_factor;
+    }
+
+    if (Hashmap->storage != HashmapStorageChained &&
+        Hashmap->storage != HashmapStorageOpenAddressed)
+        return STATUS_INVALID_PARAMETER;
+
+    if (Hashmap->resizable) {
+        if (Hashmap->storage != HashmapStorageChained ||
+            BucketCount > RTL_HASHMAP_MAX_BUCKET_COUNT)
+            return STATUS_INVALID_PARAMETER;
+
+        BucketCount = RtlpHashmapRoundUpToPowerOfTwo(BucketCount);
+    }
+
+    if (!Hashmap->lock_stripes)
+        Hashmap->lock_stripes = BucketCount < RTL_HASHMAP_DEFAULT_LOCK_STRIPES
+                                    ? BucketCount
+                                    : RTL_HASHMAP_DEFAULT_LOCK_STRIPES;
+
+    if (Hashmap->lock_stripes > BucketCount)
+        Hashmap->lock_stripes = BucketCount;
+
+    if (Hashmap->resizable)
+        Hashmap->lock_stripes =
+            RtlpHashmapRoundDownToPowerOfTwo(Hashmap->lock_stripes);
+
+    if (!Hashmap->max_load_factor)
+        Hashmap->max_load_factor = RTL_HASHMAP_DEFAULT_MAX_LOAD_FACTOR;
 
-    if (!Hashmap->buckets)
+    /* keep inline objects naturally aligned */
+    Hashmap->slot_size = (EntryObjectSize + 7) & ~7ul;
+    Hashmap->group_size = sizeof(RTL_HASHMAP_GROUP) +
+                          RTL_HASHMAP_GROUP_SLOTS * Hashmap->slot_size;
+
+    buckets = RtlpHashmapAllocateBuckets(Hashmap, BucketCount);
+
+    if (!buckets)
         return STATUS_INSUFFICIENT_RESOURCES;
 
     Hashmap->locks = ExAllocatePool2(
         POOL_FLAG_NON_PAGED,
-        sizeof(KGUARDED_MUTEX) * BucketCount,
+        sizeof(RTL_HASHMAP_LOCK) * Hashmap->lock_stripes,
         POOL_TAG_HASHMAP);
 
     if (!Hashmap->locks) {
-        ExFreePoolWithTag(Hashmap->buckets, POOL_TAG_HASHMAP);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto error;
     }
 
-    for (UINT32 index = 0; index < BucketCount; index++) {
-        entry = &Hashmap->buckets[index];
-        entry->in_use = FALSE;
-        InitializeListHead(&entry->entry);
-        KeInitializeGuardedMutex(&Hashmap->locks[index]);
+    for (UINT32 index = 0; index < Hashmap->lock_stripes; index++)
+        KeInitializeGuardedMutex(&Hashmap->locks[index].lock);
+
+    Hashmap->occupancy = ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        RtlpHashmapGetOccupancyWordCount(BucketCount) * sizeof(LONG),
+        POOL_TAG_HASHMAP);
+
+    if (!Hashmap->occupancy) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto error;
+    }
+
+    if (Hashmap->resizable) {
+        Hashmap->migration_cursors = ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            sizeof(UINT32) * Hashmap->lock_stripes,
+            POOL_TAG_HASHMAP);
+
+        if (!Hashmap->migration_cursors) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto error;
+        }
     }
 
     status = ExInitializeLookasideListEx(
@@ -69,11 +358,11 @@ RtlHashmapCreate(
 
     if (!NT_SUCCESS(status)) {
         DEBUG_ERROR("ExInitializeLookasideListEx: %x", status);
-        ExFreePoolWithTag(Hashmap->buckets, POOL_TAG_HASHMAP);
-        ExFreePoolWithTag(Hashmap->locks, POOL_TAG_HASHMAP);
-        return status;
+        goto error;
     }
 
+    ExInitializePushLock(&Hashmap->resize_lock);
+
     Hashmap->bucket_count = BucketCount;
     Hashmap->hash_function = HashFunction;
     Hashmap->compare_function = CompareFunction;
@@ -82,50 +371,283 @@ RtlHashmapCreate(
     Hashmap->context = Context;
 
     return STATUS_SUCCESS;
+
+error:
+    ExFreePoolWithTag(buckets, POOL_TAG_HASHMAP);
+
+    if (Hashmap->locks)
+        ExFreePoolWithTag(Hashmap->locks, POOL_TAG_HASHMAP);
+
+    if (Hashmap->occupancy)
+        ExFreePoolWithTag((PVOID)Hashmap->occupancy, POOL_TAG_HASHMAP);
+
+    if (Hashmap->migration_cursors)
+        ExFreePoolWithTag(Hashmap->migration_cursors, POOL_TAG_HASHMAP);
+
+    return status;
+}
+
+FORCEINLINE
+STATIC
+BOOLEAN
+RtlpHashmapIsIndexInRange(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    /* resizable maps are indexed by hash, see RtlpHashmapGetBucketIndex */
+    if (Hashmap->resizable)
+        return Index <= MAXLONG ? TRUE : FALSE;
+
+    return Index < Hashmap->bucket_count ? TRUE : FALSE;
+}
+
+FORCEINLINE
+STATIC
+BOOLEAN
+RtlpHashmapIsOverloaded(_In_ PRTL_HASHMAP Hashmap)
+{
+    return (UINT64)Hashmap->entry_count * 100 >
+                   (UINT64)Hashmap->bucket_count * Hashmap->max_load_factor
+               ? TRUE
+               : FALSE;
 }
 
+/* ASSUMES LOCK IS HELD! */
 FORCEINLINE
 STATIC
-PRTL_HASHMAP_ENTRY
-RtlpHashmapFindUnusedEntry(_In_ PLIST_ENTRY Head)
+VOID
+RtlpHashmapOnEntryInserted(_In_ PRTL_HASHMAP Hashmap)
+{
+    InterlockedIncrement(&Hashmap->entry_count);
+
+    /* The resize itself is started by RtlHashmapReleaseBucket once the bucket
+     * lock has been dropped, since it must acquire every stripe. */
+    if (Hashmap->resizable && !Hashmap->old_buckets &&
+        Hashmap->bucket_count < RTL_HASHMAP_MAX_BUCKET_COUNT &&
+        RtlpHashmapIsOverloaded(Hashmap))
+        InterlockedExchange(&Hashmap->resize_pending, TRUE);
+}
+
+/*
+ * Moves each entry of the old bucket into the current table. Entries are
+ * relinked rather than copied, so object pointers remain valid.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+STATIC
+VOID
+RtlpHashmapMigrateBucket(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 OldIndex)
 {
+    UINT32 bucket = 0;
+    PLIST_ENTRY list_head = &Hashmap->old_buckets[OldIndex].entry;
+    PLIST_ENTRY list_entry = NULL;
     PRTL_HASHMAP_ENTRY entry = NULL;
-    PLIST_ENTRY list_entry = Head->Flink;
 
-    while (list_entry != Head) {
+    while (!IsListEmpty(list_head)) {
+        list_entry = RemoveHeadList(list_head);
         entry = CONTAINING_RECORD(list_entry, RTL_HASHMAP_ENTRY, entry);
+        bucket = RtlpHashmapGetBucketIndex(Hashmap, entry->hash);
 
-        if (entry->in_use == FALSE) {
-            entry->in_use = TRUE;
-            return entry;
-        }
+        InsertHeadList(&Hashmap->buckets[bucket].entry, &entry->entry);
+        RtlpHashmapMarkBucketOccupied(Hashmap, bucket);
+    }
+}
 
-        list_entry = list_entry->Flink;
+/*
+ * Called by whoever migrates the final old bucket. Other stripes may still
+ * observe a non NULL old_buckets, however their cursors are complete so they
+ * never dereference it.
+ */
+STATIC
+VOID
+RtlpHashmapFinishResize(_In_ PRTL_HASHMAP Hashmap)
+{
+    PVOID buckets = Hashmap->old_buckets;
+    PVOID occupancy = (PVOID)Hashmap->old_occupancy;
+
+    InterlockedExchangePointer((PVOID*)&Hashmap->old_buckets, NULL);
+    Hashmap->old_occupancy = NULL;
+
+    ExFreePoolWithTag(buckets, POOL_TAG_HASHMAP);
+    ExFreePoolWithTag(occupancy, POOL_TAG_HASHMAP);
+
+    DEBUG_VERBOSE("Hashmap %llx resized to %lx buckets",
+                  (UINT64)Hashmap,
+                  Hashmap->bucket_count);
+}
+
+/*
+ * Migrates up to Count of the old buckets belonging to Stripe, being old
+ * buckets Stripe, Stripe + lock_stripes, Stripe + 2 * lock_stripes and so on.
+ *
+ * ASSUMES LOCK IS HELD FOR STRIPE!
+ */
+STATIC
+VOID
+RtlpHashmapMigrateStripe(
+    _In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Stripe, _In_ UINT32 Count)
+{
+    UINT32 per_stripe = 0;
+    PUINT32 cursor = &Hashmap->migration_cursors[Stripe];
+
+    if (!Hashmap->old_buckets)
+        return;
+
+    per_stripe = Hashmap->old_bucket_count / Hashmap->lock_stripes;
+
+    for (; Count && *cursor < per_stripe; Count--) {
+        RtlpHashmapMigrateBucket(
+            Hashmap, Stripe + *cursor * Hashmap->lock_stripes);
+        (*cursor)++;
+
+        if (!InterlockedDecrement(&Hashmap->migration_remaining)) {
+            RtlpHashmapFinishResize(Hashmap);
+            return;
+        }
     }
+}
 
-    return NULL;
+/*
+ * Ensures the keys old bucket has been migrated before the caller touches the
+ * current table, then advances the stripes cursor.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+FORCEINLINE
+STATIC
+VOID
+RtlpHashmapMigrateOnAcquire(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    UINT32 stripe = Index % Hashmap->lock_stripes;
+    UINT32 old_index = 0;
+
+    if (!Hashmap->old_buckets)
+        return;
+
+    old_index = Index & (Hashmap->old_bucket_count - 1);
+
+    /* if the cursor has passed it, the old bucket may no longer exist */
+    if (old_index / Hashmap->lock_stripes >=
+        Hashmap->migration_cursors[stripe])
+        RtlpHashmapMigrateBucket(Hashmap, old_index);
+
+    RtlpHashmapMigrateStripe(Hashmap, stripe, RTL_HASHMAP_MIGRATION_BATCH);
 }
 
 FORCEINLINE
 STATIC
-PRTL_HASHMAP_ENTRY
-RtlpHashmapAllocateBucketEntry(_In_ PRTL_HASHMAP Hashmap)
+VOID
+RtlpHashmapAcquireAllStripes(_In_ PRTL_HASHMAP Hashmap)
 {
-    PRTL_HASHMAP_ENTRY entry = ExAllocateFromLookasideListEx(&Hashmap->pool);
+    for (UINT32 index = 0; index < Hashmap->lock_stripes; index++)
+        KeAcquireGuardedMutex(&Hashmap->locks[index].lock);
+}
 
-    if (!entry)
-        return NULL;
+FORCEINLINE
+STATIC
+VOID
+RtlpHashmapReleaseAllStripes(_In_ PRTL_HASHMAP Hashmap)
+{
+    for (UINT32 index = Hashmap->lock_stripes; index > 0; index--)
+        KeReleaseGuardedMutex(&Hashmap->locks[index - 1].lock);
+}
+
+/*
+ * Doubles the bucket count. Only the table swap happens here, with every
+ * stripe held. The entries are migrated incrementally afterwards.
+ *
+ * Must be called without any bucket lock held.
+ */
+STATIC
+VOID
+RtlpHashmapBeginResize(_In_ PRTL_HASHMAP Hashmap)
+{
+    UINT32 count = Hashmap->bucket_count * 2;
+    PRTL_HASHMAP_ENTRY buckets = NULL;
+    volatile LONG* occupancy = NULL;
+
+    buckets = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                              (UINT64)count * sizeof(RTL_HASHMAP_ENTRY),
+                              POOL_TAG_HASHMAP);
 
-    entry->in_use = TRUE;
-    return entry;
+    if (!buckets)
+        return;
+
+    occupancy = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                RtlpHashmapGetOccupancyWordCount(count) *
+                                    sizeof(LONG),
+                                POOL_TAG_HASHMAP);
+
+    if (!occupancy) {
+        ExFreePoolWithTag(buckets, POOL_TAG_HASHMAP);
+        return;
+    }
+
+    for (UINT32 index = 0; index < count; index++)
+        InitializeListHead(&buckets[index].entry);
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&Hashmap->resize_lock, 0);
+    RtlpHashmapAcquireAllStripes(Hashmap);
+
+    /* someone may have beaten us to it */
+    if (Hashmap->old_buckets || count != Hashmap->bucket_count * 2 ||
+        !RtlpHashmapIsOverloaded(Hashmap)) {
+        RtlpHashmapReleaseAllStripes(Hashmap);
+        ExReleasePushLockExclusiveEx(&Hashmap->resize_lock, 0);
+        KeLeaveCriticalRegion();
+        ExFreePoolWithTag(buckets, POOL_TAG_HASHMAP);
+        ExFreePoolWithTag((PVOID)occupancy, POOL_TAG_HASHMAP);
+        return;
+    }
+
+    Hashmap->old_buckets = Hashmap->buckets;
+    Hashmap->old_occupancy = Hashmap->occupancy;
+    Hashmap->old_bucket_count = Hashmap->bucket_count;
+    Hashmap->buckets = buckets;
+    Hashmap->occupancy = occupancy;
+    Hashmap->bucket_count = count;
+    Hashmap->migration_remaining = Hashmap->old_bucket_count;
+    Hashmap->resize_count++;
+
+    for (UINT32 index = 0; index < Hashmap->lock_stripes; index++)
+        Hashmap->migration_cursors[index] = 0;
+
+    RtlpHashmapReleaseAllStripes(Hashmap);
+    ExReleasePushLockExclusiveEx(&Hashmap->resize_lock, 0);
+    KeLeaveCriticalRegion();
 }
 
+/*
+ * Migrates the remaining old buckets of every stripe. The caller must hold
+ * resize_lock so that no new resize can begin, and no bucket lock.
+ */
+STATIC
+VOID
+RtlpHashmapCompleteResize(_In_ PRTL_HASHMAP Hashmap)
+{
+    PKGUARDED_MUTEX lock = NULL;
+
+    for (UINT32 index = 0;
+         index < Hashmap->lock_stripes && Hashmap->old_buckets;
+         index++) {
+        lock = &Hashmap->locks[index].lock;
+        KeAcquireGuardedMutex(lock);
+        RtlpHashmapMigrateStripe(Hashmap, index, MAXULONG);
+        KeReleaseGuardedMutex(lock);
+    }
+}
+
+/* murmur3 finaliser, process ids and addresses have few entropic low bits */
 FORCEINLINE
 STATIC
-BOOLEAN
-RtlpHashmapIsIndexInRange(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+UINT32
+RtlpHashmapMixHash(_In_ UINT32 Hash)
 {
-    return Index < Hashmap->bucket_count ? TRUE : FALSE;
+    Hash ^= Hash >> 16;
+    Hash *= 0x85ebca6b;
+    Hash ^= Hash >> 13;
+    Hash *= 0xc2b2ae35;
+    Hash ^= Hash >> 16;
+    return Hash;
 }
 
 INT32
@@ -133,111 +655,236 @@ RtlHashmapHashKeyAndAcquireBucket(_Inout_ PRTL_HASHMAP Hashmap, _In_ UINT64 Key)
 {
     UINT32 index = Hashmap->hash_function(Key);
 
+    if (Hashmap->resizable)
+        index = RtlpHashmapMixHash(index) & MAXLONG;
+
     if (!RtlpHashmapIsIndexInRange(Hashmap, index))
         return -1;
 
-    KeAcquireGuardedMutex(&Hashmap->locks[index]);
+    KeAcquireGuardedMutex(RtlpHashmapGetBucketLock(Hashmap, index));
+
+    if (Hashmap->resizable)
+        RtlpHashmapMigrateOnAcquire(Hashmap, index);
+
     return index;
 }
 
 VOID
 RtlHashmapReleaseBucket(_Inout_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
 {
+    UINT32 stripe = 0;
+    PKGUARDED_MUTEX lock = NULL;
+
     /* No index check here, assuming we exit the caller early if we fail on
      * acquisition */
-    KeReleaseGuardedMutex(&Hashmap->locks[Index]);
+    KeReleaseGuardedMutex(RtlpHashmapGetBucketLock(Hashmap, Index));
+
+    if (!Hashmap->resizable)
+        return;
+
+    if (InterlockedCompareExchange(&Hashmap->resize_pending, FALSE, TRUE)) {
+        RtlpHashmapBeginResize(Hashmap);
+        return;
+    }
+
+    /* Help along a stripe that may otherwise see little traffic. Never block
+     * here, the stripe will be visited again by a later release. */
+    if (!Hashmap->old_buckets)
+        return;
+
+    stripe = (UINT32)InterlockedIncrement(&Hashmap->helper_stripe) %
+             Hashmap->lock_stripes;
+    lock = &Hashmap->locks[stripe].lock;
+
+    if (!KeTryToAcquireGuardedMutex(lock))
+        return;
+
+    RtlpHashmapMigrateStripe(Hashmap, stripe, RTL_HASHMAP_MIGRATION_BATCH);
+    KeReleaseGuardedMutex(lock);
+}
+
+/* Returns the first free inline slot of the group, ASSUMES LOCK IS HELD! */
+FORCEINLINE
+STATIC
+PVOID
+RtlpHashmapClaimGroupSlot(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    UINT32 slot = 0;
+    PRTL_HASHMAP_GROUP group = RtlpHashmapGetGroup(Hashmap, Index);
+    UINT32 free_mask = ~group->occupied & RTL_HASHMAP_GROUP_FULL_MASK;
+
+    if (!free_mask)
+        return NULL;
+
+    slot = RtlpHashmapFindFirstSetBit(free_mask);
+    group->occupied |= 1ul << slot;
+    return RtlpHashmapGetGroupSlot(Hashmap, group, slot);
 }
 
 /* assumes map lock is held */
+STATIC
 PVOID
-RtlHashmapEntryInsert(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+RtlpHashmapEntryInsert(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
 {
-    UINT32 index = 0;
+    UINT32 bucket = 0;
+    PVOID object = NULL;
     PLIST_ENTRY list_head = NULL;
-    PRTL_HASHMAP_ENTRY entry = NULL;
     PRTL_HASHMAP_ENTRY new_entry = NULL;
 
-    if (!Hashmap->active)
+    if (!Hashmap->active || !RtlpHashmapIsIndexInRange(Hashmap, Index))
         return NULL;
 
-    list_head = &(&Hashmap->buckets[index])->entry;
-    entry = RtlpHashmapFindUnusedEntry(list_head);
+    bucket = RtlpHashmapGetBucketIndex(Hashmap, Index);
 
-    if (entry)
-        return entry;
+    if (Hashmap->storage == HashmapStorageOpenAddressed) {
+        object = RtlpHashmapClaimGroupSlot(Hashmap, bucket);
+
+        if (object) {
+            RtlpHashmapMarkBucketOccupied(Hashmap, bucket);
+            RtlpHashmapOnEntryInserted(Hashmap);
+            return object;
+        }
+    }
 
-    new_entry = RtlpHashmapAllocateBucketEntry(Hashmap);
+    list_head = RtlpHashmapGetListHead(Hashmap, bucket);
+    new_entry = ExAllocateFromLookasideListEx(&Hashmap->pool);
 
     if (!new_entry) {
         DEBUG_ERROR("Failed to allocate new entry");
         return NULL;
     }
 
+    new_entry->hash = Index;
     InsertHeadList(list_head, &new_entry->entry);
+    RtlpHashmapMarkBucketOccupied(Hashmap, bucket);
+    RtlpHashmapOnEntryInserted(Hashmap);
     return new_entry->object;
 }
 
+PVOID
+RtlHashmapEntryInsert(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    UINT64 start = PerfBegin();
+    PVOID object = RtlpHashmapEntryInsert(Hashmap, Index);
+
+    PerfRecord(PerfCounterHashmapInsert, start, 0);
+    return object;
+}
+
 /* Returns a pointer to the start of the entries caller defined data. i.e
  * &PRTL_HASHMAP_ENTRY->Object
  *
  * Also assumes lock is held.
  */
+STATIC
 PVOID
-RtlHashmapEntryLookup(
+RtlpHashmapEntryLookup(
     _In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index, _In_ PVOID Compare)
 {
-    UINT32 index = 0;
+    UINT32 bucket = 0;
+    UINT32 slot = 0;
+    UINT32 occupied = 0;
+    PVOID object = NULL;
+    PLIST_ENTRY list_head = NULL;
+    PLIST_ENTRY list_entry = NULL;
     PRTL_HASHMAP_ENTRY entry = NULL;
+    PRTL_HASHMAP_GROUP group = NULL;
 
-    if (!Hashmap->active)
+    if (!Hashmap->active || !RtlpHashmapIsIndexInRange(Hashmap, Index))
         return NULL;
 
-    entry = &Hashmap->buckets[index];
+    bucket = RtlpHashmapGetBucketIndex(Hashmap, Index);
+
+    if (Hashmap->storage == HashmapStorageOpenAddressed) {
+        group = RtlpHashmapGetGroup(Hashmap, bucket);
+        occupied = group->occupied;
 
-    while (entry) {
-        if (entry->in_use == FALSE)
-            goto increment;
+        while (occupied) {
+            slot = RtlpHashmapFindFirstSetBit(occupied);
+            object = RtlpHashmapGetGroupSlot(Hashmap, group, slot);
+
+            if (Hashmap->compare_function(object, Compare))
+                return object;
+
+            occupied &= occupied - 1;
+        }
+    }
+
+    list_head = RtlpHashmapGetListHead(Hashmap, bucket);
+    list_entry = list_head->Flink;
+
+    while (list_entry != list_head) {
+        entry = CONTAINING_RECORD(list_entry, RTL_HASHMAP_ENTRY, entry);
 
         if (Hashmap->compare_function(entry->object, Compare))
             return entry->object;
 
-    increment:
-        entry = CONTAINING_RECORD(entry->entry.Flink, RTL_HASHMAP_ENTRY, entry);
+        list_entry = list_entry->Flink;
     }
 
-    DEBUG_ERROR("Unable to find entry in hashmap.");
     return NULL;
 }
 
+PVOID
+RtlHashmapEntryLookup(
+    _In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index, _In_ PVOID Compare)
+{
+    UINT64 start = PerfBegin();
+    PVOID object = RtlpHashmapEntryLookup(Hashmap, Index, Compare);
+
+    PerfRecord(PerfCounterHashmapLookup, start, 0);
+    return object;
+}
+
 /* Assumes lock is held */
+STATIC
 BOOLEAN
-RtlHashmapEntryDelete(
+RtlpHashmapEntryDelete(
     _Inout_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index, _In_ PVOID Compare)
 {
-    UINT32 index = 0;
+    UINT32 bucket = 0;
+    UINT32 slot = 0;
+    UINT32 occupied = 0;
     PLIST_ENTRY list_head = NULL;
     PLIST_ENTRY list_entry = NULL;
     PRTL_HASHMAP_ENTRY entry = NULL;
+    PRTL_HASHMAP_GROUP group = NULL;
 
-    if (!Hashmap->active)
+    if (!Hashmap->active || !RtlpHashmapIsIndexInRange(Hashmap, Index))
         return FALSE;
 
-    list_head = &(&Hashmap->buckets[index])->entry;
+    bucket = RtlpHashmapGetBucketIndex(Hashmap, Index);
+
+    if (Hashmap->storage == HashmapStorageOpenAddressed) {
+        group = RtlpHashmapGetGroup(Hashmap, bucket);
+        occupied = group->occupied;
+
+        while (occupied) {
+            slot = RtlpHashmapFindFirstSetBit(occupied);
+
+            if (Hashmap->compare_function(
+                    RtlpHashmapGetGroupSlot(Hashmap, group, slot), Compare)) {
+                group->occupied &= ~(1ul << slot);
+                RtlpHashmapUpdateBucketOccupancy(Hashmap, bucket);
+                InterlockedDecrement(&Hashmap->entry_count);
+                return TRUE;
+            }
+
+            occupied &= occupied - 1;
+        }
+    }
+
+    list_head = RtlpHashmapGetListHead(Hashmap, bucket);
     list_entry = list_head->Flink;
 
     while (list_entry != list_head) {
         entry = CONTAINING_RECORD(list_entry, RTL_HASHMAP_ENTRY, entry);
 
-        if (entry->in_use &&
-            Hashmap->compare_function(entry->object, Compare)) {
-            if (entry == list_head) {
-                entry->in_use = FALSE;
-            }
-            else {
-                RemoveEntryList(&entry->entry);
-                ExFreeToLookasideListEx(&Hashmap->pool, entry);
-            }
-
+        if (Hashmap->compare_function(entry->object, Compare)) {
+            RemoveEntryList(&entry->entry);
+            ExFreeToLookasideListEx(&Hashmap->pool, entry);
+            RtlpHashmapUpdateBucketOccupancy(Hashmap, bucket);
+            InterlockedDecrement(&Hashmap->entry_count);
             return TRUE;
         }
 
@@ -247,32 +894,191 @@ RtlHashmapEntryDelete(
     return FALSE;
 }
 
-/* assumes lock is held */
+BOOLEAN
+RtlHashmapEntryDelete(
+    _Inout_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index, _In_ PVOID Compare)
+{
+    UINT64 start = PerfBegin();
+    BOOLEAN result = RtlpHashmapEntryDelete(Hashmap, Index, Compare);
+
+    PerfRecord(PerfCounterHashmapDelete, start, 0);
+    return result;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
 VOID
-RtlHashmapEnumerate(
+RtlpHashmapEnumerateBucket(
     _In_ PRTL_HASHMAP Hashmap,
+    _In_ UINT32 Index,
     _In_ ENUMERATE_HASHMAP EnumerationCallback,
     _In_opt_ PVOID Context)
 {
+    UINT32 slot = 0;
+    UINT32 occupied = 0;
     PLIST_ENTRY list_head = NULL;
     PLIST_ENTRY list_entry = NULL;
     PRTL_HASHMAP_ENTRY entry = NULL;
+    PRTL_HASHMAP_GROUP group = NULL;
+
+    if (Hashmap->storage == HashmapStorageOpenAddressed) {
+        group = RtlpHashmapGetGroup(Hashmap, Index);
+        occupied = group->occupied;
+
+        while (occupied) {
+            slot = RtlpHashmapFindFirstSetBit(occupied);
+            EnumerationCallback(
+                RtlpHashmapGetGroupSlot(Hashmap, group, slot), Context);
+            occupied &= occupied - 1;
+        }
+    }
+
+    list_head = RtlpHashmapGetListHead(Hashmap, Index);
+    list_entry = list_head->Flink;
+
+    while (list_entry != list_head) {
+        entry = CONTAINING_RECORD(list_entry, RTL_HASHMAP_ENTRY, entry);
+
+        EnumerationCallback(entry->object, Context);
+
+        list_entry = list_entry->Flink;
+    }
+}
+
+/*
+ * Acquires each occupied buckets lock in turn, so must be called without any
+ * held. Empty buckets are skipped using the occupancy bitmap without touching
+ * their lock. A bucket that becomes occupied after its word has been read may
+ * be missed, as with any entry inserted into an already visited bucket.
+ */
+VOID
+RtlHashmapEnumerate(
+    _In_ PRTL_HASHMAP Hashmap,
+    _In_ ENUMERATE_HASHMAP EnumerationCallback,
+    _In_opt_ PVOID Context)
+{
+    UINT32 index = 0;
+    UINT32 bits = 0;
+    PKGUARDED_MUTEX lock = NULL;
+    UINT32 words = 0;
 
-    for (UINT32 index = 0; index < Hashmap->bucket_count; index++) {
-        KeAcquireGuardedMutex(&Hashmap->locks[index]);
+    /* Hold off any new resize for the duration, and finish the current one
+     * so only the current table needs visiting. */
+    KeEnterCriticalRegion();
+    ExAcquirePushLockSharedEx(&Hashmap->resize_lock, 0);
 
-        list_head = &Hashmap->buckets[index];
-        list_entry = list_head->Flink;
+    if (Hashmap->resizable)
+        RtlpHashmapCompleteResize(Hashmap);
 
-        while (list_entry != list_head) {
-            entry = CONTAINING_RECORD(list_entry, RTL_HASHMAP_ENTRY, entry);
+    words = RtlpHashmapGetOccupancyWordCount(Hashmap->bucket_count);
 
-            if (entry->in_use == TRUE)
-                EnumerationCallback(entry->object, Context);
+    for (UINT32 word = 0; word < words; word++) {
+        bits = (UINT32)Hashmap->occupancy[word];
 
-            list_entry = list_entry->Flink;
+        while (bits) {
+            index = word * RTL_HASHMAP_BITMAP_BITS +
+                    RtlpHashmapFindFirstSetBit(bits);
+            bits &= bits - 1;
+
+            lock = RtlpHashmapGetBucketLock(Hashmap, index);
+            KeAcquireGuardedMutex(lock);
+            RtlpHashmapEnumerateBucket(
+                Hashmap, index, EnumerationCallback, Context);
+            KeReleaseGuardedMutex(lock);
         }
+    }
+    ExReleasePushLockSharedEx(&Hashmap->resize_lock, 0);
+    KeLeaveCriticalRegion();
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+UINT32
+RtlpHashmapGetBucketLength(_In_ PRTL_HASHMAP Hashmap, _In_ UINT32 Index)
+{
+    UINT32 length = 0;
+    UINT32 occupied = 0;
+    PLIST_ENTRY list_head = RtlpHashmapGetListHead(Hashmap, Index);
+    PLIST_ENTRY list_entry = list_head->Flink;
+
+    if (Hashmap->storage == HashmapStorageOpenAddressed) {
+        for (occupied = RtlpHashmapGetGroup(Hashmap, Index)->occupied;
+             occupied;
+             occupied &= occupied - 1)
+            length++;
+    }
+
+    for (; list_entry != list_head; list_entry = list_entry->Flink)
+        length++;
 
-        KeReleaseGuardedMutex(&Hashmap->locks[index]);
+    return length;
+}
+
+/*
+ * Load factor is reported as entries per 100 buckets. The longest chain
+ * counts both inline and overflow entries for open addressed maps. Like
+ * RtlHashmapEnumerate, this acquires each occupied buckets lock in turn.
+ */
+VOID
+RtlHashmapQueryStatistics(
+    _In_ PRTL_HASHMAP Hashmap, _Out_ PRTL_HASHMAP_STATISTICS Statistics)
+{
+    UINT32 index = 0;
+    UINT32 bits = 0;
+    UINT32 length = 0;
+    UINT32 words = 0;
+    PKGUARDED_MUTEX lock = NULL;
+
+    RtlZeroMemory(Statistics, sizeof(RTL_HASHMAP_STATISTICS));
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockSharedEx(&Hashmap->resize_lock, 0);
+
+    if (Hashmap->resizable)
+        RtlpHashmapCompleteResize(Hashmap);
+
+    words = RtlpHashmapGetOccupancyWordCount(Hashmap->bucket_count);
+
+    for (UINT32 word = 0; word < words; word++) {
+        bits = (UINT32)Hashmap->occupancy[word];
+
+        while (bits) {
+            index = word * RTL_HASHMAP_BITMAP_BITS +
+                    RtlpHashmapFindFirstSetBit(bits);
+            bits &= bits - 1;
+
+            lock = RtlpHashmapGetBucketLock(Hashmap, index);
+            KeAcquireGuardedMutex(lock);
+            length = RtlpHashmapGetBucketLength(Hashmap, index);
+            KeReleaseGuardedMutex(lock);
+
+            if (length > Statistics->longest_chain)
+                Statistics->longest_chain = length;
+        }
     }
-}
\ No newline at end of file
+
+    Statistics->bucket_count = Hashmap->bucket_count;
+    Statistics->entry_count = (UINT32)Hashmap->entry_count;
+    Statistics->load_factor = (UINT32)(
+        (UINT64)Statistics->entry_count * 100 / Statistics->bucket_count);
+    Statistics->resize_count = Hashmap->resize_count;
+    Statistics->resizable = Hashmap->resizable;
+
+    ExReleasePushLockSharedEx(&Hashmap->resize_lock, 0);
+    KeLeaveCriticalRegion();
+}
+
+VOID
+RtlHashmapPrintCurrentStatistics(_In_ PRTL_HASHMAP Hashmap)
+{
+    RTL_HASHMAP_STATISTICS statistics = {0};
+
+    RtlHashmapQueryStatistics(Hashmap, &statistics);
+
+    DEBUG_VERBOSE("Hashmap: %llx", (UINT64)Hashmap);
+    DEBUG_VERBOSE("Bucket count: %lx", statistics.bucket_count);
+    DEBUG_VERBOSE("Entry count: %lx", statistics.entry_count);
+    DEBUG_VERBOSE("Load factor: %lu%%", statistics.load_factor);
+    DEBUG_VERBOSE("Longest chain: %lx", statistics.longest_chain);
+    DEBUG_VERBOSE("Resize count: %lx", statistics.resize_count);
+}
@@ -0,0 +1,392 @@
+#include "modindex.h"
+
+#include "imports.h"
+#include "lib/stdlib.h"
+
+#define MODULE_INDEX_GROWTH 32
+
+STATIC MODULE_INDEX g_ModuleIndex = {0};
+
+STATIC
+PMODULE_INDEX_SNAPSHOT
+ModuleIndexpAllocateSnapshot(_In_ UINT32 Capacity)
+{
+    PMODULE_INDEX_SNAPSHOT snapshot = NULL;
+
+    snapshot = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                  sizeof(MODULE_INDEX_SNAPSHOT) +
+                                      Capacity * sizeof(MODULE_INDEX_RANGE),
+                                  POOL_TAG_MODULE_INDEX);
+
+    if (!snapshot)
+        return NULL;
+
+    snapshot->capacity = Capacity;
+    return snapshot;
+}
+
+/*
+ * The module list is ordered by load rather than by address. With only a few
+ * hundred modules an insertion sort is sufficient, and is only done when a
+ * snapshot is rebuilt.
+ */
+STATIC
+VOID
+ModuleIndexpSortRanges(_Inout_ PMODULE_INDEX_RANGE Ranges, _In_ UINT32 Count)
+{
+    MODULE_INDEX_RANGE range = {0};
+    UINT32             index = 0;
+
+    for (UINT32 next = 1; next < Count; next++) {
+        range = Ranges[next];
+
+        for (index = next; index && Ranges[index - 1].base > range.base;
+             index--)
+            Ranges[index] = Ranges[index - 1];
+
+        Ranges[index] = range;
+    }
+}
+
+/* Returns the index of the first range whose base is above Address. */
+FORCEINLINE
+STATIC
+UINT32
+ModuleIndexpUpperBound(_In_ PMODULE_INDEX_SNAPSHOT Snapshot,
+                       _In_ UINT64                 Address)
+{
+    UINT32 low = 0;
+    UINT32 high = Snapshot->count;
+    UINT32 middle = 0;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (Snapshot->ranges[middle].base <= Address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/*
+ * Publishes Snapshot in place of the current snapshot, which is retired to be
+ * freed by ModuleIndexpReclaimSnapshots once the lock is released.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+STATIC
+VOID
+ModuleIndexpPublishSnapshot(_In_ PMODULE_INDEX          Index,
+                            _In_opt_ PMODULE_INDEX_SNAPSHOT Snapshot)
+{
+    PMODULE_INDEX_SNAPSHOT previous = NULL;
+
+    previous = InterlockedExchangePointer(&Index->current, Snapshot);
+    InterlockedIncrement64(&Index->generation);
+
+    if (previous) {
+        previous->retired = Index->retired;
+        Index->retired = previous;
+    }
+}
+
+/*
+ * Frees the retired snapshots once every reader that may have observed them
+ * has released them. Must be called without the lock held, at IRQL <=
+ * APC_LEVEL.
+ *
+ * Only snapshots retired before the epoch advances are freed. Any retired
+ * after are left to the writer that retired them.
+ */
+STATIC
+VOID
+ModuleIndexpReclaimSnapshots(_In_ PMODULE_INDEX Index)
+{
+    PMODULE_INDEX_SNAPSHOT retired = NULL;
+    PMODULE_INDEX_SNAPSHOT next = NULL;
+    LONG                   epoch = 0;
+    LARGE_INTEGER delay = {.QuadPart = RELATIVE(MODULE_INDEX_DRAIN_INTERVAL)};
+
+    ImpKeAcquireGuardedMutex(&Index->reclaim_lock);
+
+    ImpKeAcquireGuardedMutex(&Index->lock);
+    retired = Index->retired;
+    Index->retired = NULL;
+    ImpKeReleaseGuardedMutex(&Index->lock);
+
+    /* already freed by another writer */
+    if (!retired)
+        goto end;
+
+    epoch = InterlockedIncrement(&Index->epoch) - 1;
+
+    while (ReadAcquire(&Index->readers[epoch & 1]))
+        ImpKeDelayExecutionThread(KernelMode, FALSE, &delay);
+
+    while (retired) {
+        next = retired->retired;
+        ImpExFreePoolWithTag(retired, POOL_TAG_MODULE_INDEX);
+        retired = next;
+    }
+
+end:
+    ImpKeReleaseGuardedMutex(&Index->reclaim_lock);
+}
+
+STATIC
+NTSTATUS
+ModuleIndexpBuildSnapshot(_In_ PSYSTEM_MODULES          Modules,
+                          _Out_ PMODULE_INDEX_SNAPSHOT* Snapshot)
+{
+    PMODULE_INDEX_SNAPSHOT    snapshot = NULL;
+    PRTL_MODULE_EXTENDED_INFO module = NULL;
+    UINT32                    count = (UINT32)Modules->module_count;
+
+    *Snapshot = NULL;
+
+    snapshot = ModuleIndexpAllocateSnapshot(count + MODULE_INDEX_GROWTH);
+
+    if (!snapshot)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (UINT32 index = 0; index < count; index++) {
+        module = &((PRTL_MODULE_EXTENDED_INFO)Modules->address)[index];
+
+        if (!module->ImageBase || !module->ImageSize)
+            continue;
+
+        snapshot->ranges[snapshot->count].base = (UINT64)module->ImageBase;
+        snapshot->ranges[snapshot->count].end =
+            (UINT64)module->ImageBase + module->ImageSize;
+        snapshot->count++;
+    }
+
+    ModuleIndexpSortRanges(snapshot->ranges, snapshot->count);
+
+    *Snapshot = snapshot;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ModuleIndexInitialise(_In_ PSYSTEM_MODULES Modules)
+{
+    NTSTATUS               status = STATUS_UNSUCCESSFUL;
+    PMODULE_INDEX          index = &g_ModuleIndex;
+    PMODULE_INDEX_SNAPSHOT snapshot = NULL;
+
+    RtlZeroMemory(index, sizeof(MODULE_INDEX));
+    ImpKeInitializeGuardedMutex(&index->lock);
+    ImpKeInitializeGuardedMutex(&index->reclaim_lock);
+
+    status = ModuleIndexpBuildSnapshot(Modules, &snapshot);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ModuleIndexpBuildSnapshot: %x", status);
+        return status;
+    }
+
+    InterlockedExchangePointer(&index->current, snapshot);
+    index->active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID
+ModuleIndexFree()
+{
+    PMODULE_INDEX index = &g_ModuleIndex;
+
+    ImpKeAcquireGuardedMutex(&index->lock);
+
+    if (index->active) {
+        index->active = FALSE;
+        ModuleIndexpPublishSnapshot(index, NULL);
+    }
+
+    ImpKeReleaseGuardedMutex(&index->lock);
+    ModuleIndexpReclaimSnapshots(index);
+}
+
+/*
+ * Replaces the index with the given module list. Images are only ever added
+ * from the image load callback, so this should be called periodically to
+ * drop the ranges of unloaded drivers.
+ */
+NTSTATUS
+ModuleIndexRebuild(_In_ PSYSTEM_MODULES Modules)
+{
+    NTSTATUS               status = STATUS_UNSUCCESSFUL;
+    PMODULE_INDEX          index = &g_ModuleIndex;
+    PMODULE_INDEX_SNAPSHOT snapshot = NULL;
+
+    status = ModuleIndexpBuildSnapshot(Modules, &snapshot);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ModuleIndexpBuildSnapshot: %x", status);
+        return status;
+    }
+
+    ImpKeAcquireGuardedMutex(&index->lock);
+
+    if (!index->active) {
+        ImpKeReleaseGuardedMutex(&index->lock);
+        ImpExFreePoolWithTag(snapshot, POOL_TAG_MODULE_INDEX);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    ModuleIndexpPublishSnapshot(index, snapshot);
+    ImpKeReleaseGuardedMutex(&index->lock);
+    ModuleIndexpReclaimSnapshots(index);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Intended to be called from ImageLoadNotifyRoutineCallback for each system
+ * image. An image reloaded at the base of an existing range replaces it.
+ * Must be called at IRQL <= APC_LEVEL.
+ */
+NTSTATUS
+ModuleIndexInsertModule(_In_ PVOID ImageBase, _In_ UINT32 ImageSize)
+{
+    NTSTATUS               status = STATUS_SUCCESS;
+    PMODULE_INDEX          index = &g_ModuleIndex;
+    PMODULE_INDEX_SNAPSHOT current = NULL;
+    PMODULE_INDEX_SNAPSHOT snapshot = NULL;
+    UINT64                 base = (UINT64)ImageBase;
+    UINT32                 position = 0;
+    UINT32                 capacity = 0;
+
+    if (!ImageBase || !ImageSize)
+        return STATUS_INVALID_PARAMETER;
+
+    ImpKeAcquireGuardedMutex(&index->lock);
+
+    current = index->current;
+
+    if (!index->active || !current) {
+        status = STATUS_UNSUCCESSFUL;
+        goto end;
+    }
+
+    capacity = current->count < current->capacity
+                   ? current->capacity
+                   : current->capacity + MODULE_INDEX_GROWTH;
+
+    snapshot = ModuleIndexpAllocateSnapshot(capacity);
+
+    if (!snapshot) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    position = ModuleIndexpUpperBound(current, base);
+
+    IntCopyMemory(snapshot->ranges,
+                  current->ranges,
+                  position * sizeof(MODULE_INDEX_RANGE));
+
+    if (position && current->ranges[position - 1].base == base) {
+        /* replace, rather than duplicate, the existing range */
+        IntCopyMemory(&snapshot->ranges[position],
+                      &current->ranges[position],
+                      (current->count - position) * sizeof(MODULE_INDEX_RANGE));
+
+        snapshot->ranges[position - 1].end = base + ImageSize;
+        snapshot->count = current->count;
+    }
+    else {
+        IntCopyMemory(&snapshot->ranges[position + 1],
+                      &current->ranges[position],
+                      (current->count - position) * sizeof(MODULE_INDEX_RANGE));
+
+        snapshot->ranges[position].base = base;
+        snapshot->ranges[position].end = base + ImageSize;
+        snapshot->count = current->count + 1;
+    }
+
+    ModuleIndexpPublishSnapshot(index, snapshot);
+
+end:
+    ImpKeReleaseGuardedMutex(&index->lock);
+
+    if (NT_SUCCESS(status))
+        ModuleIndexpReclaimSnapshots(index);
+
+    return status;
+}
+
+/*
+ * Returns the current snapshot, or NULL if the index is not active. The
+ * snapshot remains valid until the token is released, so many lookups can be
+ * made against it. Hold it only briefly, as writers wait for it.
+ */
+PMODULE_INDEX_SNAPSHOT
+ModuleIndexAcquireSnapshot(_Out_ PMODULE_INDEX_READ_TOKEN Token)
+{
+    PMODULE_INDEX index = &g_ModuleIndex;
+    LONG          epoch = 0;
+
+    for (;;) {
+        epoch = ReadAcquire(&index->epoch);
+        InterlockedIncrement(&index->readers[epoch & 1]);
+
+        /* if the epoch advanced before we registered, the writer may not
+         * be waiting on our slot */
+        if (ReadAcquire(&index->epoch) == epoch)
+            break;
+
+        InterlockedDecrement(&index->readers[epoch & 1]);
+    }
+
+    *Token = epoch & 1;
+    return ReadPointerAcquire(&index->current);
+}
+
+VOID
+ModuleIndexReleaseSnapshot(_In_ MODULE_INDEX_READ_TOKEN Token)
+{
+    InterlockedDecrement(&g_ModuleIndex.readers[Token]);
+}
+
+PMODULE_INDEX_RANGE
+ModuleIndexSnapshotFindRange(_In_ PMODULE_INDEX_SNAPSHOT Snapshot,
+                             _In_ UINT64                 Address)
+{
+    UINT32 position = ModuleIndexpUpperBound(Snapshot, Address);
+
+    /* the only candidate is the range beginning at or below the address */
+    if (!position || Address >= Snapshot->ranges[position - 1].end)
+        return NULL;
+
+    return &Snapshot->ranges[position - 1];
+}
+
+/* Returns FALSE if the address is not within a module, or the index is not
+ * active. */
+BOOLEAN
+ModuleIndexFindModule(_In_ UINT64                   Address,
+                      _Out_opt_ PMODULE_INDEX_RANGE Range)
+{
+    PMODULE_INDEX_SNAPSHOT  snapshot = NULL;
+    PMODULE_INDEX_RANGE     range = NULL;
+    MODULE_INDEX_READ_TOKEN token = 0;
+
+    snapshot = ModuleIndexAcquireSnapshot(&token);
+
+    if (snapshot)
+        range = ModuleIndexSnapshotFindRange(snapshot, Address);
+
+    if (range && Range)
+        *Range = *range;
+
+    ModuleIndexReleaseSnapshot(token);
+    return range ? TRUE : FALSE;
+}
+
+BOOLEAN
+ModuleIndexIsAddressBacked(_In_ UINT64 Address)
+{
+    return ModuleIndexFindModule(Address, NULL);
+}
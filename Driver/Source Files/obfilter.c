@@ -0,0 +1,281 @@
+#include "obfilter.h"
+
+#include "imports.h"
+#include "lib/stdlib.h"
+
+STATIC OB_FILTER g_ObFilter = {0};
+
+FORCEINLINE
+STATIC
+UINT32
+ObFilterpHashRequester(_In_ PEPROCESS Requester)
+{
+    /* EPROCESS allocations are aligned, the low bits carry nothing */
+    return (UINT32)(((UINT64)Requester >> 6) * 0x9E3779B97F4A7C15ull >> 32) &
+           (OB_FILTER_CACHE_ENTRIES - 1);
+}
+
+NTSTATUS
+ObFilterInitialise()
+{
+    POB_FILTER filter = &g_ObFilter;
+
+    RtlZeroMemory(filter, sizeof(OB_FILTER));
+    ImpKeInitializeGuardedMutex(&filter->lock);
+
+    /* sized for every processor that can ever be added, not just those
+     * active now */
+    filter->processor_count =
+        KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    filter->caches = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        filter->processor_count * sizeof(OB_FILTER_CPU_CACHE),
+        POOL_TAG_OB_FILTER);
+
+    if (!filter->caches)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    filter->active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+/* Must only be called once the handle operation callbacks are unregistered. */
+VOID
+ObFilterFree()
+{
+    POB_FILTER filter = &g_ObFilter;
+
+    filter->active = FALSE;
+
+    if (filter->caches) {
+        ImpExFreePoolWithTag(filter->caches, POOL_TAG_OB_FILTER);
+        filter->caches = NULL;
+    }
+}
+
+/*
+ * ASSUMES LOCK IS HELD! Readers spin while the sequence is odd, so the write
+ * is done at DISPATCH_LEVEL where the writer cannot be preempted by them.
+ */
+FORCEINLINE
+STATIC
+KIRQL
+ObFilterpBeginWrite(_In_ POB_FILTER_SNAPSHOT Snapshot)
+{
+    KIRQL irql = KeRaiseIrqlToDpcLevel();
+    InterlockedIncrement64(&Snapshot->sequence);
+    return irql;
+}
+
+/* ASSUMES LOCK IS HELD! */
+FORCEINLINE
+STATIC
+VOID
+ObFilterpEndWrite(_In_ POB_FILTER_SNAPSHOT Snapshot, _In_ KIRQL Irql)
+{
+    InterlockedIncrement64(&Snapshot->sequence);
+    KeLowerIrql(Irql);
+}
+
+/*
+ * Publishes the protected process and the requesters allowed full access to
+ * it. A NULL ProtectedProcess, i.e once the session ends, allows every
+ * operation. The caller must keep the processes referenced until they are
+ * replaced by a later publish.
+ */
+NTSTATUS
+ObFilterPublish(_In_opt_ PEPROCESS                     ProtectedProcess,
+                _In_reads_opt_(AllowedCount) PEPROCESS* Allowed,
+                _In_ UINT32                             AllowedCount)
+{
+    POB_FILTER          filter = &g_ObFilter;
+    POB_FILTER_SNAPSHOT snapshot = &filter->snapshot;
+    KIRQL               irql = 0;
+
+    if (AllowedCount > OB_FILTER_MAX_ALLOWED || (AllowedCount && !Allowed))
+        return STATUS_INVALID_PARAMETER;
+
+    ImpKeAcquireGuardedMutex(&filter->lock);
+    irql = ObFilterpBeginWrite(snapshot);
+
+    snapshot->protected_process = ProtectedProcess;
+    snapshot->allowed_count = AllowedCount;
+
+    for (UINT32 index = 0; index < AllowedCount; index++)
+        snapshot->allowed[index] = Allowed[index];
+
+    ObFilterpEndWrite(snapshot, irql);
+    ImpKeReleaseGuardedMutex(&filter->lock);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Discards every cached verdict. Intended to be called from the process
+ * notify routine when a process exits, as its EPROCESS address may be reused.
+ */
+VOID
+ObFilterInvalidateCache()
+{
+    POB_FILTER filter = &g_ObFilter;
+    KIRQL      irql = 0;
+
+    ImpKeAcquireGuardedMutex(&filter->lock);
+    irql = ObFilterpBeginWrite(&filter->snapshot);
+    ObFilterpEndWrite(&filter->snapshot, irql);
+    ImpKeReleaseGuardedMutex(&filter->lock);
+}
+
+/*
+ * Returns TRUE and the sequence of a consistent read if the requester is in
+ * the allowed set of the snapshot.
+ */
+STATIC
+BOOLEAN
+ObFilterpIsAllowedRequester(_In_ POB_FILTER_SNAPSHOT Snapshot,
+                            _In_ PEPROCESS           Requester,
+                            _In_ PEPROCESS           Target,
+                            _Out_ PLONG64            Sequence,
+                            _Out_ PBOOLEAN           Protected)
+{
+    LONG64  sequence = 0;
+    BOOLEAN allowed = FALSE;
+    UINT32  count = 0;
+
+    for (;;) {
+        sequence = ReadAcquire64(&Snapshot->sequence);
+
+        if (sequence & 1) {
+            YieldProcessor();
+            continue;
+        }
+
+        *Protected = Snapshot->protected_process == Target ? TRUE : FALSE;
+        allowed = FALSE;
+        count = min(Snapshot->allowed_count, OB_FILTER_MAX_ALLOWED);
+
+        for (UINT32 index = 0; index < count; index++) {
+            if (Snapshot->allowed[index] == Requester) {
+                allowed = TRUE;
+                break;
+            }
+        }
+
+        /* order the reads of the snapshot before the recheck */
+        KeMemoryBarrier();
+
+        if (ReadAcquire64(&Snapshot->sequence) == sequence)
+            break;
+    }
+
+    *Sequence = sequence;
+    return allowed;
+}
+
+/*
+ * Returns the verdict for a handle operation by Requester on Target. The
+ * slow path is only invoked for the protected process, when the requester is
+ * not in the allowed set and has no cached verdict. Must be called at IRQL
+ * <= APC_LEVEL.
+ */
+OB_FILTER_VERDICT
+ObFilterQuery(_In_ PEPROCESS           Requester,
+              _In_ PEPROCESS           Target,
+              _In_ OB_FILTER_SLOW_PATH SlowPath)
+{
+    POB_FILTER             filter = &g_ObFilter;
+    POB_FILTER_CPU_CACHE   cache = NULL;
+    POB_FILTER_CACHE_ENTRY entry = NULL;
+    OB_FILTER_VERDICT      verdict = ObFilterAllow;
+    HANDLE                 requester_id = NULL;
+    BOOLEAN                is_protected = FALSE;
+    BOOLEAN                hit = FALSE;
+    LONG64                 sequence = 0;
+    UINT32                 index = 0;
+    UINT32                 processor = 0;
+    KIRQL                  irql = 0;
+
+    /* the fast path, a torn read only delays the verdict to the recheck */
+    if (ReadPointerAcquire(&filter->snapshot.protected_process) != Target)
+        return ObFilterAllow;
+
+    if (!filter->active || Requester == Target)
+        return ObFilterAllow;
+
+    if (ObFilterpIsAllowedRequester(
+            &filter->snapshot, Requester, Target, &sequence, &is_protected))
+        return ObFilterAllow;
+
+    if (!is_protected)
+        return ObFilterAllow;
+
+    requester_id = ImpPsGetProcessId(Requester);
+    index = ObFilterpHashRequester(Requester);
+
+    irql = KeRaiseIrqlToDpcLevel();
+
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    /* a processor beyond the caches is never cached, it takes the slow path */
+    if (processor >= filter->processor_count) {
+        KeLowerIrql(irql);
+        return SlowPath(Requester, Target);
+    }
+
+    cache = &filter->caches[processor];
+    entry = &cache->entries[index];
+
+    if (entry->requester == Requester &&
+        entry->requester_id == requester_id && entry->sequence == sequence) {
+        verdict = entry->verdict;
+        hit = TRUE;
+        cache->hits++;
+    }
+    else {
+        cache->misses++;
+    }
+
+    KeLowerIrql(irql);
+
+    if (hit)
+        return verdict;
+
+    verdict = SlowPath(Requester, Target);
+
+    /* the thread may have moved processor, the verdict is cached on
+     * whichever processor it has reached */
+    irql = KeRaiseIrqlToDpcLevel();
+
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (processor < filter->processor_count) {
+        cache = &filter->caches[processor];
+        entry = &cache->entries[index];
+
+        entry->requester = Requester;
+        entry->requester_id = requester_id;
+        entry->sequence = sequence;
+        entry->verdict = verdict;
+    }
+
+    KeLowerIrql(irql);
+    return verdict;
+}
+
+VOID
+ObFilterQueryStatistics(_Out_ POB_FILTER_STATISTICS Statistics)
+{
+    POB_FILTER filter = &g_ObFilter;
+
+    RtlZeroMemory(Statistics, sizeof(OB_FILTER_STATISTICS));
+
+    Statistics->sequence = (UINT64)ReadAcquire64(&filter->snapshot.sequence);
+
+    if (!filter->caches)
+        return;
+
+    /* approximate, the counters of each processor are not read atomically */
+    for (UINT32 index = 0; index < filter->processor_count; index++) {
+        Statistics->hits += filter->caches[index].hits;
+        Statistics->misses += filter->caches[index].misses;
+    }
+}
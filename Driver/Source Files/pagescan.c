@@ -0,0 +1,289 @@
+#include "pagescan.h"
+
+#include "driver.h"
+#include "ia32.h"
+#include "imports.h"
+#include "lib/stdlib.h"
+#include "perf.h"
+
+#include <intrin.h>
+
+#define PAGE_SCAN_2MB_PAGE_SIZE   0x200000
+#define PAGE_SCAN_1GB_PAGE_SIZE   0x40000000
+#define PAGE_SCAN_ENTRIES_PER_TABLE 512
+#define PAGE_SCAN_KERNEL_PML4_BASE  256
+#define PAGE_SCAN_CR3_PFN_MASK      0x000FFFFFFFFFF000ull
+
+/* unit bits [26:18] are the PML4 index less 256, [17:9] the PDPT index and
+ * [8:0] the PD index */
+#define PAGE_SCAN_UNIT_PML4_INDEX(unit) \
+    (PAGE_SCAN_KERNEL_PML4_BASE + ((unit) >> 18))
+#define PAGE_SCAN_UNIT_PDPT_INDEX(unit) (((unit) >> 9) & 0x1ff)
+#define PAGE_SCAN_UNIT_PD_INDEX(unit)   ((unit) & 0x1ff)
+
+FORCEINLINE
+STATIC
+UINT64
+PageScanpUnitToVirtual(_In_ UINT64 Unit)
+{
+    /* the upper half is canonical with bits 63:48 set */
+    return 0xFFFF000000000000ull |
+           (UINT64)PAGE_SCAN_UNIT_PML4_INDEX(Unit) << 39 |
+           (UINT64)PAGE_SCAN_UNIT_PDPT_INDEX(Unit) << 30 |
+           (UINT64)PAGE_SCAN_UNIT_PD_INDEX(Unit) << 21;
+}
+
+FORCEINLINE
+STATIC
+PVOID
+PageScanpMapTable(_In_ UINT64 PageFrameNumber)
+{
+    PHYSICAL_ADDRESS address = {.QuadPart = PageFrameNumber << PAGE_SHIFT};
+    return ImpMmGetVirtualForPhysical(address);
+}
+
+/*
+ * Moves the cursor past a region found not to be present. Other threads may
+ * have claimed units since ours, but every unit between the cursor and the
+ * boundary lies within the same region, so the cursor is raised to the
+ * boundary unless it is already past it.
+ */
+FORCEINLINE
+STATIC
+VOID
+PageScanpSkipTo(_In_ PPAGE_SCAN_CONTEXT Context,
+                _In_ UINT64             Claimed,
+                _In_ UINT64             Boundary)
+{
+    LONG64 cursor = ReadAcquire64(&Context->cursor);
+    LONG64 previous = 0;
+
+    NT_ASSERT(Boundary > Claimed);
+    UNREFERENCED_PARAMETER(Claimed);
+
+    while (cursor < (LONG64)Boundary) {
+        previous = InterlockedCompareExchange64(
+            &Context->cursor, (LONG64)Boundary, cursor);
+
+        if (previous == cursor)
+            break;
+
+        cursor = previous;
+    }
+}
+
+/* Returns FALSE if the callback ended the sweep. */
+STATIC
+BOOLEAN
+PageScanpScanUnit(_In_ PPAGE_SCAN_CONTEXT Context, _In_ UINT64 Unit)
+{
+    PML4E_64* pml4 = NULL;
+    PDPTE_64* pdpt = NULL;
+    PDE_64*   pd = NULL;
+    PTE_64*   pt = NULL;
+    PML4E_64  pml4e = {0};
+    PDPTE_64  pdpte = {0};
+    PDE_64    pde = {0};
+    UINT64    address = PageScanpUnitToVirtual(Unit);
+
+    pml4 = PageScanpMapTable(Context->pml4 >> PAGE_SHIFT);
+
+    if (!pml4)
+        return TRUE;
+
+    pml4e = pml4[PAGE_SCAN_UNIT_PML4_INDEX(Unit)];
+
+    if (!pml4e.Present) {
+        PageScanpSkipTo(Context,
+                        Unit,
+                        (Unit / PAGE_SCAN_UNITS_PER_PML4E + 1) *
+                            PAGE_SCAN_UNITS_PER_PML4E);
+        return TRUE;
+    }
+
+    pdpt = PageScanpMapTable(pml4e.PageFrameNumber);
+
+    if (!pdpt)
+        return TRUE;
+
+    pdpte = pdpt[PAGE_SCAN_UNIT_PDPT_INDEX(Unit)];
+
+    if (!pdpte.Present || pdpte.LargePage)
+        PageScanpSkipTo(Context,
+                        Unit,
+                        (Unit / PAGE_SCAN_UNITS_PER_PDPTE + 1) *
+                            PAGE_SCAN_UNITS_PER_PDPTE);
+
+    if (!pdpte.Present)
+        return TRUE;
+
+    /* a 1 GiB page is only passed on by the first unit it covers */
+    if (pdpte.LargePage) {
+        if (PAGE_SCAN_UNIT_PD_INDEX(Unit))
+            return TRUE;
+
+        InterlockedIncrement64(&Context->pages);
+        return Context->callback(
+            address, PAGE_SCAN_1GB_PAGE_SIZE, Context->callback_context);
+    }
+
+    pd = PageScanpMapTable(pdpte.PageFrameNumber);
+
+    if (!pd)
+        return TRUE;
+
+    pde = pd[PAGE_SCAN_UNIT_PD_INDEX(Unit)];
+
+    if (!pde.Present)
+        return TRUE;
+
+    InterlockedIncrement64(&Context->units);
+
+    if (pde.LargePage) {
+        InterlockedIncrement64(&Context->pages);
+        return Context->callback(
+            address, PAGE_SCAN_2MB_PAGE_SIZE, Context->callback_context);
+    }
+
+    pt = PageScanpMapTable(pde.PageFrameNumber);
+
+    if (!pt)
+        return TRUE;
+
+    for (UINT32 index = 0; index < PAGE_SCAN_ENTRIES_PER_TABLE; index++) {
+        if (!pt[index].Present)
+            continue;
+
+        InterlockedIncrement64(&Context->pages);
+
+        if (!Context->callback(address + (UINT64)index * PAGE_SIZE,
+                               PAGE_SIZE,
+                               Context->callback_context))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Units are claimed until the sweep is complete or the budget has elapsed. A
+ * claimed unit is always scanned in full, so no unit is lost between runs.
+ */
+STATIC
+VOID
+PageScanpScan(_In_ PPAGE_SCAN_CONTEXT Context)
+{
+    UINT64 unit = 0;
+
+    while (!ReadAcquire(&Context->stop)) {
+        if (KeQueryInterruptTime() > Context->deadline)
+            break;
+
+        unit = InterlockedIncrement64(&Context->cursor) - 1;
+
+        if (unit >= PAGE_SCAN_UNIT_COUNT)
+            break;
+
+        if (!PageScanpScanUnit(Context, unit))
+            InterlockedExchange(&Context->stop, TRUE);
+    }
+}
+
+STATIC
+VOID
+PageScanpWorkerRoutine(_In_ PDEVICE_OBJECT DeviceObject, _In_opt_ PVOID Context)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    PPAGE_SCAN_CONTEXT context = (PPAGE_SCAN_CONTEXT)Context;
+
+    PageScanpScan(context);
+
+    if (!InterlockedDecrement(&context->active_thread_count))
+        KeSetEvent(&context->workers_complete, IO_NO_INCREMENT, FALSE);
+}
+
+VOID
+PageScanInitialise(_Out_ PPAGE_SCAN_CONTEXT Context)
+{
+    RtlZeroMemory(Context, sizeof(PAGE_SCAN_CONTEXT));
+    KeInitializeEvent(&Context->workers_complete, NotificationEvent, FALSE);
+}
+
+/*
+ * Continues the current sweep for at most Budget (in 100ns units, 0 meaning
+ * no limit), starting a new sweep if the previous completed. Complete is set
+ * once the sweep has reached the end of system space. Must be called at
+ * PASSIVE_LEVEL, and runs of the same context must not overlap.
+ */
+NTSTATUS
+PageScanRun(_Inout_ PPAGE_SCAN_CONTEXT Context,
+            _In_ PAGE_CALLBACK         Callback,
+            _In_opt_ PVOID             CallbackContext,
+            _In_ UINT64                Budget,
+            _Out_ PBOOLEAN             Complete)
+{
+    UINT64 now = KeQueryInterruptTime();
+    UINT64 start = PerfBegin();
+
+    *Complete = FALSE;
+
+    if (Context->cursor >= PAGE_SCAN_UNIT_COUNT) {
+        InterlockedExchange64(&Context->cursor, 0);
+        InterlockedExchange(&Context->stop, FALSE);
+    }
+
+    Context->callback = Callback;
+    Context->callback_context = CallbackContext;
+    Context->deadline = Budget ? now + Budget : MAXULONG64;
+    Context->pml4 = __readcr3() & PAGE_SCAN_CR3_PFN_MASK;
+
+    KeClearEvent(&Context->workers_complete);
+
+    /* the calling thread holds a count of its own until it has finished its
+     * share, so the event cannot be set before every worker is queued */
+    InterlockedExchange(&Context->active_thread_count, 1);
+
+    for (UINT32 index = 0; index < PAGE_SCAN_THREAD_COUNT; index++) {
+        Context->work_items[index] =
+            ImpIoAllocateWorkItem(GetDriverDeviceObject());
+
+        /* the sweep simply proceeds with fewer threads */
+        if (!Context->work_items[index])
+            continue;
+
+        InterlockedIncrement(&Context->active_thread_count);
+        ImpIoQueueWorkItem(Context->work_items[index],
+                           PageScanpWorkerRoutine,
+                           NormalWorkQueue,
+                           Context);
+    }
+
+    PageScanpScan(Context);
+
+    if (InterlockedDecrement(&Context->active_thread_count))
+        ImpKeWaitForSingleObject(&Context->workers_complete,
+                                 Executive,
+                                 KernelMode,
+                                 FALSE,
+                                 NULL);
+
+    for (UINT32 index = 0; index < PAGE_SCAN_THREAD_COUNT; index++) {
+        if (!Context->work_items[index])
+            continue;
+
+        ImpIoFreeWorkItem(Context->work_items[index]);
+        Context->work_items[index] = NULL;
+    }
+
+    if (Context->stop)
+        InterlockedExchange64(&Context->cursor, PAGE_SCAN_UNIT_COUNT);
+
+    if (Context->cursor >= PAGE_SCAN_UNIT_COUNT) {
+        Context->sweeps++;
+        *Complete = TRUE;
+    }
+
+    PerfRecord(PerfCounterPageTableScan, start, 0);
+    return STATUS_SUCCESS;
+}
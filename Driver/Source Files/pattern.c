@@ -0,0 +1,288 @@
+#include "pattern.h"
+
+#include "stdlib.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+
+#define PATTERN_NOT_FOUND ((SIZE_T)-1)
+
+/*
+ * Rough ranking of the bytes most common in x64 code, higher being more
+ * common. Anything not listed is considered rare.
+ */
+STATIC
+UINT32
+IntpPatternByteFrequency(_In_ UCHAR Byte)
+{
+    switch (Byte) {
+    case 0x00: return 32;
+    case 0xCC: return 31;
+    case 0xFF: return 30;
+    case 0x48: return 29;
+    case 0x8B: return 28;
+    case 0x89: return 27;
+    case 0x24: return 26;
+    case 0x4C: return 25;
+    case 0x0F: return 24;
+    case 0xE8: return 23;
+    case 0x83: return 22;
+    case 0x44: return 21;
+    case 0x8D: return 20;
+    case 0x85: return 19;
+    case 0xC0: return 18;
+    case 0x01: return 17;
+    case 0x49: return 16;
+    case 0x41: return 15;
+    case 0x74: return 14;
+    case 0x75: return 13;
+    case 0x33: return 12;
+    case 0x45: return 11;
+    case 0x4D: return 10;
+    case 0xC3: return 9;
+    case 0x90: return 8;
+    case 0x08: return 7;
+    case 0x10: return 6;
+    case 0x20: return 5;
+    case 0x28: return 4;
+    case 0x40: return 3;
+    case 0x50: return 2;
+    case 0x30: return 1;
+    default: return 0;
+    }
+}
+
+NTSTATUS
+IntCompilePattern(_In_ PCHAR              Signature,
+                  _In_ SIZE_T             SignatureLength,
+                  _In_opt_ PCHAR          Mask,
+                  _Out_ PCOMPILED_PATTERN Pattern)
+{
+    UINT32 exact_count = 0;
+    UINT32 frequency = 0;
+    UINT32 best[2] = {MAXULONG, MAXULONG};
+
+    if (!Signature || !SignatureLength ||
+        SignatureLength > PATTERN_MAX_LENGTH)
+        return STATUS_INVALID_PARAMETER;
+
+    IntZeroMemory(Pattern, sizeof(COMPILED_PATTERN));
+    Pattern->length = (UINT32)SignatureLength;
+
+    for (UINT32 index = 0; index < Pattern->length; index++) {
+        Pattern->bytes[index] = (UCHAR)Signature[index];
+
+        if (Mask)
+            Pattern->mask[index] =
+                Mask[index] == PATTERN_MASK_WILDCARD ? 0x00 : 0xFF;
+        else
+            Pattern->mask[index] = Signature[index] == 0x00 ? 0x00 : 0xFF;
+
+        if (!Pattern->mask[index])
+            continue;
+
+        frequency = IntpPatternByteFrequency(Pattern->bytes[index]);
+
+        if (!exact_count || frequency < best[0]) {
+            Pattern->anchor_offset[1] = Pattern->anchor_offset[0];
+            best[1] = best[0];
+            Pattern->anchor_offset[0] = index;
+            best[0] = frequency;
+        }
+        else if (exact_count == 1 || frequency < best[1]) {
+            Pattern->anchor_offset[1] = index;
+            best[1] = frequency;
+        }
+
+        exact_count++;
+    }
+
+    /* a pattern of wildcards matches everywhere and is almost certainly a
+     * mistake */
+    if (!exact_count)
+        return STATUS_INVALID_PARAMETER;
+
+    if (exact_count == 1)
+        Pattern->anchor_offset[1] = Pattern->anchor_offset[0];
+
+    Pattern->anchor_byte[0] = Pattern->bytes[Pattern->anchor_offset[0]];
+    Pattern->anchor_byte[1] = Pattern->bytes[Pattern->anchor_offset[1]];
+
+    return STATUS_SUCCESS;
+}
+
+FORCEINLINE
+STATIC
+BOOLEAN
+IntpPatternMatches(_In_ PCOMPILED_PATTERN Pattern, _In_ PUCHAR Address)
+{
+    UINT32  index = 0;
+    __m128i difference;
+
+    for (; index + 16 <= Pattern->length; index += 16) {
+        difference = _mm_and_si128(
+            _mm_xor_si128(_mm_loadu_si128((__m128i*)(Address + index)),
+                          _mm_loadu_si128((__m128i*)(Pattern->bytes + index))),
+            _mm_loadu_si128((__m128i*)(Pattern->mask + index)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+                difference, _mm_setzero_si128())) != 0xFFFF)
+            return FALSE;
+    }
+
+    for (; index < Pattern->length; index++) {
+        if ((Address[index] ^ Pattern->bytes[index]) & Pattern->mask[index])
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns the offset of the first match starting within [Start, End), or
+ * PATTERN_NOT_FOUND. The pattern must fit entirely within Length bytes of
+ * Base, and no byte beyond Length is ever read.
+ */
+STATIC
+SIZE_T
+IntpScanRegion(_In_ PUCHAR            Base,
+               _In_ SIZE_T            Length,
+               _In_ SIZE_T            Start,
+               _In_ SIZE_T            End,
+               _In_ PCOMPILED_PATTERN Pattern,
+               _In_ BOOLEAN           Avx2)
+{
+    SIZE_T  index = Start;
+    UINT32  candidates = 0;
+    ULONG   bit = 0;
+    PUCHAR  anchor_1 = Base + Pattern->anchor_offset[0];
+    PUCHAR  anchor_2 = Base + Pattern->anchor_offset[1];
+    __m256i byte_1_256;
+    __m256i byte_2_256;
+    __m128i byte_1_128 = _mm_set1_epi8((CHAR)Pattern->anchor_byte[0]);
+    __m128i byte_2_128 = _mm_set1_epi8((CHAR)Pattern->anchor_byte[1]);
+
+    if (Length < Pattern->length)
+        return PATTERN_NOT_FOUND;
+
+    /* last position at which the whole pattern still fits */
+    if (End > Length - Pattern->length + 1)
+        End = Length - Pattern->length + 1;
+
+    /* A vector of candidates at index reads up to index + width - 1 + the
+     * pattern length, which must remain within the buffer. */
+    if (Avx2) {
+        byte_1_256 = _mm256_set1_epi8((CHAR)Pattern->anchor_byte[0]);
+        byte_2_256 = _mm256_set1_epi8((CHAR)Pattern->anchor_byte[1]);
+
+        for (; index + 32 <= End && index + 31 + Pattern->length <= Length;
+             index += 32) {
+            candidates = (UINT32)_mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((__m256i*)(anchor_1 + index)),
+                    byte_1_256),
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((__m256i*)(anchor_2 + index)),
+                    byte_2_256)));
+
+            while (candidates) {
+                _BitScanForward(&bit, candidates);
+                candidates &= candidates - 1;
+
+                if (IntpPatternMatches(Pattern, Base + index + bit))
+                    return index + bit;
+            }
+        }
+    }
+
+    for (; index + 16 <= End && index + 15 + Pattern->length <= Length;
+         index += 16) {
+        candidates = (UINT32)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(anchor_1 + index)),
+                           byte_1_128),
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(anchor_2 + index)),
+                           byte_2_128)));
+
+        while (candidates) {
+            _BitScanForward(&bit, candidates);
+            candidates &= candidates - 1;
+
+            if (IntpPatternMatches(Pattern, Base + index + bit))
+                return index + bit;
+        }
+    }
+
+    for (; index < End; index++) {
+        if (anchor_1[index] == Pattern->anchor_byte[0] &&
+            IntpPatternMatches(Pattern, Base + index))
+            return index;
+    }
+
+    return PATTERN_NOT_FOUND;
+}
+
+PVOID
+IntScanForPattern(_In_ PVOID             BaseAddress,
+                  _In_ SIZE_T            Length,
+                  _In_ PCOMPILED_PATTERN Pattern)
+{
+    SIZE_T      offset = 0;
+    BOOLEAN     avx2 = FALSE;
+    XSTATE_SAVE state = {0};
+
+    avx2 = IntBeginAvx2(Length, &state);
+
+    offset = IntpScanRegion(
+        (PUCHAR)BaseAddress, Length, 0, Length, Pattern, avx2);
+
+    if (avx2)
+        IntEndAvx2(&state);
+
+    return offset == PATTERN_NOT_FOUND
+               ? NULL
+               : (PVOID)((UINT64)BaseAddress + offset);
+}
+
+UINT32
+IntScanForPatterns(_In_ PVOID                          BaseAddress,
+                   _In_ SIZE_T                         Length,
+                   _In_reads_(Count) PCOMPILED_PATTERN Patterns,
+                   _In_ UINT32                         Count,
+                   _Out_writes_(Count) PVOID*          Results)
+{
+    SIZE_T      offset = 0;
+    UINT32      found = 0;
+    BOOLEAN     avx2 = FALSE;
+    XSTATE_SAVE state = {0};
+
+    for (UINT32 index = 0; index < Count; index++)
+        Results[index] = NULL;
+
+    avx2 = IntBeginAvx2(Length, &state);
+
+    for (SIZE_T start = 0; start < Length && found < Count;
+         start += PATTERN_SCAN_STEP) {
+        for (UINT32 index = 0; index < Count; index++) {
+            if (Results[index])
+                continue;
+
+            offset = IntpScanRegion((PUCHAR)BaseAddress,
+                                    Length,
+                                    start,
+                                    start + PATTERN_SCAN_STEP,
+                                    &Patterns[index],
+                                    avx2);
+
+            if (offset == PATTERN_NOT_FOUND)
+                continue;
+
+            Results[index] = (PVOID)((UINT64)BaseAddress + offset);
+            found++;
+        }
+    }
+
+    if (avx2)
+        IntEndAvx2(&state);
+
+    return found;
+}
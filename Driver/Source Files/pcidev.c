@@ -0,0 +1,594 @@
+#include "pcidev.h"
+
+#include "crypt.h"
+#include "imports.h"
+#include "io.h"
+#include "lib/stdlib.h"
+#include "report.h"
+#include "types/types.h"
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, PciDeviceTableInitialise)
+#    pragma alloc_text(PAGE, PciDeviceTableValidate)
+#endif
+
+typedef struct _PCI_DEVICE_ID {
+    UINT16 vendor_id;
+    UINT16 device_id;
+
+} PCI_DEVICE_ID, *PPCI_DEVICE_ID;
+
+/* default identifiers of the xilinx 7 series cores used by pcileech based
+ * dma firmware */
+STATIC CONST PCI_DEVICE_ID g_BlacklistedDevices[] = {{0x10EE, 0x0666},
+                                                     {0x10EE, 0x7011}};
+
+STATIC PCI_DEVICE_TABLE g_PciDeviceTable = {0};
+
+STATIC
+VOID
+PciDevicepArrayFree(_Inout_ PPCI_DEVICE_ARRAY Array)
+{
+    if (Array->entries)
+        ImpExFreePoolWithTag(Array->entries, POOL_TAG_PCI_DEVICE);
+
+    Array->entries = NULL;
+    Array->count = 0;
+    Array->capacity = 0;
+}
+
+STATIC
+NTSTATUS
+PciDevicepArrayAppend(_Inout_ PPCI_DEVICE_ARRAY Array,
+                      _In_ PPCI_DEVICE_ENTRY    Entry)
+{
+    PPCI_DEVICE_ENTRY entries = NULL;
+    UINT32            capacity = 0;
+
+    if (Array->count == Array->capacity) {
+        capacity = Array->capacity ? Array->capacity * 2
+                                   : PCI_DEVICE_TABLE_INITIAL_CAPACITY;
+
+        entries = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                     capacity * sizeof(PCI_DEVICE_ENTRY),
+                                     POOL_TAG_PCI_DEVICE);
+
+        if (!entries)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        if (Array->entries) {
+            IntCopyMemory(entries,
+                          Array->entries,
+                          Array->count * sizeof(PCI_DEVICE_ENTRY));
+            ImpExFreePoolWithTag(Array->entries, POOL_TAG_PCI_DEVICE);
+        }
+
+        Array->entries = entries;
+        Array->capacity = capacity;
+    }
+
+    Array->entries[Array->count++] = *Entry;
+    return STATUS_SUCCESS;
+}
+
+STATIC
+PCI_DEVICE_VERDICT
+PciDevicepEvaluate(_In_ PPCI_DEVICE_ENTRY Entry)
+{
+    for (UINT32 index = 0; index < ARRAYSIZE(g_BlacklistedDevices); index++) {
+        if (Entry->vendor_id == g_BlacklistedDevices[index].vendor_id &&
+            Entry->device_id == g_BlacklistedDevices[index].device_id)
+            return PciDeviceVerdictBlacklisted;
+    }
+
+    return PciDeviceVerdictClean;
+}
+
+FORCEINLINE
+STATIC
+UINT32
+PciDevicepReadConfig(_In_ PUCHAR Function, _In_ UINT32 Offset)
+{
+    return READ_REGISTER_ULONG((PULONG)(Function + Offset));
+}
+
+/*
+ * Reads the header of each function present on the bus from its mapped ecam
+ * region. Bridges found mark their secondary bus as pending.
+ */
+STATIC
+NTSTATUS
+PciDevicepScanBus(_In_ PPCI_DEVICE_TABLE    Table,
+                  _In_ PPCI_MCFG_ALLOCATION Allocation,
+                  _In_ UINT32               Bus,
+                  _Inout_ PBOOLEAN          PendingBuses,
+                  _Inout_ PPCI_DEVICE_ARRAY Devices)
+{
+    NTSTATUS         status = STATUS_SUCCESS;
+    PHYSICAL_ADDRESS address = {0};
+    PUCHAR           region = NULL;
+    PUCHAR           function = NULL;
+    PCI_DEVICE_ENTRY entry = {0};
+    UINT32           id = 0;
+    UINT32           buses = 0;
+    UINT32           secondary = 0;
+
+    address.QuadPart =
+        Allocation->base_address +
+        ((UINT64)(Bus - Allocation->start_bus) << PCI_ECAM_BUS_SHIFT);
+
+    region = ImpMmMapIoSpaceEx(
+        address, PCI_ECAM_BUS_SIZE, PAGE_READONLY | PAGE_NOCACHE);
+
+    if (!region) {
+        DEBUG_ERROR("MmMapIoSpaceEx failed for bus %lx", Bus);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Table->statistics.buses_mapped++;
+
+    for (UINT32 device = 0; device < PCI_MAX_DEVICES; device++) {
+        for (UINT32 index = 0; index < PCI_MAX_FUNCTIONS; index++) {
+            function = region + (device << PCI_ECAM_DEVICE_SHIFT) +
+                       (index << PCI_ECAM_FUNCTION_SHIFT);
+
+            id = PciDevicepReadConfig(function, PCI_CONFIG_ID_OFFSET);
+            Table->statistics.functions_read++;
+
+            if ((UINT16)id == PCI_INVALID_VENDOR_ID) {
+                /* functions other than 0 may be absent */
+                if (index == 0)
+                    break;
+
+                continue;
+            }
+
+            entry.key =
+                PCI_DEVICE_KEY(Allocation->segment, Bus, device, index);
+            entry.vendor_id = (UINT16)id;
+            entry.device_id = (UINT16)(id >> 16);
+            entry.class_revision =
+                PciDevicepReadConfig(function, PCI_CONFIG_CLASS_OFFSET);
+            entry.header_type = (UINT8)(
+                PciDevicepReadConfig(function, PCI_CONFIG_HEADER_OFFSET) >>
+                16);
+            entry.verdict = PciDeviceVerdictClean;
+
+            status = PciDevicepArrayAppend(Devices, &entry);
+
+            if (!NT_SUCCESS(status))
+                goto end;
+
+            if ((entry.header_type & PCI_HEADER_TYPE_MASK) ==
+                PCI_HEADER_TYPE_BRIDGE) {
+                buses = PciDevicepReadConfig(function,
+                                             PCI_CONFIG_BRIDGE_BUS_OFFSET);
+                secondary = (buses >> 8) & 0xFF;
+
+                /* a secondary bus is always numbered above its bridge, so
+                 * is visited later in the same ascending walk */
+                if (secondary > Bus && secondary <= Allocation->end_bus)
+                    PendingBuses[secondary] = TRUE;
+            }
+
+            if (index == 0 &&
+                !(entry.header_type & PCI_HEADER_TYPE_MULTIFUNCTION))
+                break;
+        }
+    }
+
+end:
+    ImpMmUnmapIoSpace(region, PCI_ECAM_BUS_SIZE);
+    return status;
+}
+
+/*
+ * Builds a new device table in key order. An incremental scan starts from the
+ * buses populated in the previous table, which include every root bus, and
+ * follows bridges from there.
+ */
+STATIC
+NTSTATUS
+PciDevicepScan(_In_ PPCI_DEVICE_TABLE  Table,
+               _In_ BOOLEAN            Full,
+               _Out_ PPCI_DEVICE_ARRAY Devices)
+{
+    NTSTATUS             status = STATUS_SUCCESS;
+    PPCI_MCFG_ALLOCATION allocation = NULL;
+    PPCI_DEVICE_ENTRY    entry = NULL;
+    BOOLEAN              pending[PCI_MAX_BUSES] = {0};
+
+    RtlZeroMemory(Devices, sizeof(PCI_DEVICE_ARRAY));
+
+    for (UINT32 index = 0; index < Table->allocation_count; index++) {
+        allocation = &Table->allocations[index];
+
+        RtlZeroMemory(pending, sizeof(pending));
+        pending[allocation->start_bus] = TRUE;
+
+        for (UINT32 device = 0; device < Table->devices.count; device++) {
+            entry = &Table->devices.entries[device];
+
+            if (entry->key >> 16 == allocation->segment)
+                pending[PCI_DEVICE_KEY_BUS(entry->key)] = TRUE;
+        }
+
+        for (UINT32 bus = allocation->start_bus; bus <= allocation->end_bus;
+             bus++) {
+            if (!Full && !pending[bus])
+                continue;
+
+            status =
+                PciDevicepScanBus(Table, allocation, bus, pending, Devices);
+
+            if (!NT_SUCCESS(status)) {
+                PciDevicepArrayFree(Devices);
+                return status;
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Both tables are in key order, so verdicts are carried over in a single
+ * pass. Only functions that are new or whose identifiers changed are
+ * evaluated.
+ */
+STATIC
+VOID
+PciDevicepMergeVerdicts(_In_ PPCI_DEVICE_TABLE    Table,
+                        _Inout_ PPCI_DEVICE_ARRAY Devices)
+{
+    PPCI_DEVICE_ARRAY previous = &Table->devices;
+    PPCI_DEVICE_ENTRY entry = NULL;
+    PPCI_DEVICE_ENTRY old = NULL;
+    UINT32            cursor = 0;
+
+    Table->statistics.blacklisted_count = 0;
+
+    for (UINT32 index = 0; index < Devices->count; index++) {
+        entry = &Devices->entries[index];
+
+        while (cursor < previous->count &&
+               previous->entries[cursor].key < entry->key)
+            cursor++;
+
+        old = cursor < previous->count ? &previous->entries[cursor] : NULL;
+
+        if (old && old->key == entry->key &&
+            old->vendor_id == entry->vendor_id &&
+            old->device_id == entry->device_id &&
+            old->class_revision == entry->class_revision) {
+            entry->verdict = old->verdict;
+            Table->statistics.verdicts_reused++;
+        }
+        else {
+            entry->verdict = PciDevicepEvaluate(entry);
+        }
+
+        if (entry->verdict == PciDeviceVerdictBlacklisted)
+            Table->statistics.blacklisted_count++;
+    }
+
+    Table->statistics.device_count = Devices->count;
+}
+
+/*
+ * The report's device_object holds the device key, as devices found through
+ * configuration space are not associated with a device object.
+ */
+STATIC
+VOID
+PciDevicepReportBlacklistedDevice(_In_ PPCI_DEVICE_ENTRY Entry)
+{
+    NTSTATUS                        status = STATUS_UNSUCCESSFUL;
+    PBLACKLISTED_PCIE_DEVICE_REPORT report = NULL;
+    UINT32                          packet_size =
+        CryptRequestRequiredBufferLength(
+            sizeof(BLACKLISTED_PCIE_DEVICE_REPORT));
+
+    if (!ReportShouldSchedule(
+            REPORT_BLACKLISTED_PCIE_DEVICE, 0, Entry->key, Entry->vendor_id))
+        return;
+
+    report = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, packet_size, REPORT_POOL_TAG);
+
+    if (!report)
+        return;
+
+    INIT_REPORT_PACKET(report, REPORT_BLACKLISTED_PCIE_DEVICE, 0);
+
+    report->device_object = Entry->key;
+    report->device_id = Entry->device_id;
+    report->vendor_id = Entry->vendor_id;
+
+    status = CryptEncryptBuffer(report, packet_size);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("CryptEncryptBuffer: %lx", status);
+        ImpExFreePoolWithTag(report, REPORT_POOL_TAG);
+        return;
+    }
+
+    IrpQueueSchedulePacket(report, packet_size);
+}
+
+STATIC
+NTSTATUS
+PciDevicepQueryAllocations(_In_ PPCI_DEVICE_TABLE Table)
+{
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    PPCI_MCFG_TABLE     mcfg = NULL;
+    PCI_MCFG_ALLOCATION allocation = {0};
+    ULONG               length = 0;
+    UINT32              count = 0;
+    UINT32              index = 0;
+
+    status = ImpExGetSystemFirmwareTable(PCI_ACPI_PROVIDER_SIGNATURE,
+                                         PCI_MCFG_TABLE_SIGNATURE,
+                                         NULL,
+                                         0,
+                                         &length);
+
+    if (status != STATUS_BUFFER_TOO_SMALL || length < sizeof(PCI_MCFG_TABLE)) {
+        DEBUG_ERROR("ExGetSystemFirmwareTable MCFG failed with status %x",
+                    status);
+        return STATUS_NOT_FOUND;
+    }
+
+    mcfg = ImpExAllocatePool2(POOL_FLAG_NON_PAGED, length, POOL_TAG_PCI_DEVICE);
+
+    if (!mcfg)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    status = ImpExGetSystemFirmwareTable(PCI_ACPI_PROVIDER_SIGNATURE,
+                                         PCI_MCFG_TABLE_SIGNATURE,
+                                         mcfg,
+                                         length,
+                                         &length);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ExGetSystemFirmwareTable MCFG failed with status %x",
+                    status);
+        goto end;
+    }
+
+    /* the firmware reported length may be shorter than the header */
+    if (mcfg->length < sizeof(PCI_MCFG_TABLE) ||
+        length < sizeof(PCI_MCFG_TABLE)) {
+        DEBUG_ERROR("MCFG length %x is below the header", mcfg->length);
+        status = STATUS_NOT_FOUND;
+        goto end;
+    }
+
+    count = (min(mcfg->length, length) - sizeof(PCI_MCFG_TABLE)) /
+            sizeof(PCI_MCFG_ALLOCATION);
+
+    if (!count) {
+        status = STATUS_NOT_FOUND;
+        goto end;
+    }
+
+    Table->allocations =
+        ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                           count * sizeof(PCI_MCFG_ALLOCATION),
+                           POOL_TAG_PCI_DEVICE);
+
+    if (!Table->allocations) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    /* keeping the allocations in segment and bus order keeps the scanned
+     * table in key order */
+    for (UINT32 next = 0; next < count; next++) {
+        allocation = mcfg->allocations[next];
+
+        for (index = next; index > 0; index--) {
+            if (Table->allocations[index - 1].segment < allocation.segment ||
+                (Table->allocations[index - 1].segment == allocation.segment &&
+                 Table->allocations[index - 1].start_bus <=
+                     allocation.start_bus))
+                break;
+
+            Table->allocations[index] = Table->allocations[index - 1];
+        }
+
+        Table->allocations[index] = allocation;
+    }
+
+    Table->allocation_count = count;
+    status = STATUS_SUCCESS;
+
+end:
+    ImpExFreePoolWithTag(mcfg, POOL_TAG_PCI_DEVICE);
+    return status;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+VOID
+PciDevicepFreeTable(_Inout_ PPCI_DEVICE_TABLE Table)
+{
+    PciDevicepArrayFree(&Table->devices);
+
+    if (Table->allocations)
+        ImpExFreePoolWithTag(Table->allocations, POOL_TAG_PCI_DEVICE);
+
+    Table->allocations = NULL;
+    Table->allocation_count = 0;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+NTSTATUS
+PciDevicepRescan(_Inout_ PPCI_DEVICE_TABLE Table, _In_ BOOLEAN Full)
+{
+    NTSTATUS         status = STATUS_UNSUCCESSFUL;
+    PCI_DEVICE_ARRAY devices = {0};
+
+    status = PciDevicepScan(Table, Full, &devices);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("PciDevicepScan failed with status %x", status);
+        /* the next validation tries again */
+        InterlockedExchange(&Table->rescan_pending, TRUE);
+        return status;
+    }
+
+    PciDevicepMergeVerdicts(Table, &devices);
+    PciDevicepArrayFree(&Table->devices);
+    Table->devices = devices;
+
+    Table->statistics.scans++;
+
+    if (Full) {
+        Table->statistics.full_scans++;
+        Table->last_full_scan = KeQueryInterruptTime();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* To be called once from DriverEntry, before PciDeviceTableInitialise. */
+VOID
+PciDeviceTableInitialiseLock()
+{
+    ImpKeInitializeGuardedMutex(&g_PciDeviceTable.lock);
+}
+
+/*
+ * Reads the MCFG table and performs the first full scan. To be called from
+ * DriverEntry before the hardware identifier cache is initialised.
+ */
+NTSTATUS
+PciDeviceTableInitialise()
+{
+    PAGED_CODE();
+
+    NTSTATUS          status = STATUS_UNSUCCESSFUL;
+    PPCI_DEVICE_TABLE table = &g_PciDeviceTable;
+
+    PciDeviceTableFree();
+
+    ImpKeAcquireGuardedMutex(&table->lock);
+
+    RtlZeroMemory(&table->statistics, sizeof(PCI_DEVICE_STATISTICS));
+    table->rescan_pending = FALSE;
+
+    if (!table->full_interval)
+        table->full_interval = PCI_DEVICE_DEFAULT_FULL_INTERVAL;
+
+    status = PciDevicepQueryAllocations(table);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("PciDevicepQueryAllocations failed with status %x",
+                    status);
+        goto end;
+    }
+
+    status = PciDevicepRescan(table, TRUE);
+
+    if (!NT_SUCCESS(status))
+        goto end;
+
+    table->active = TRUE;
+
+end:
+    if (!NT_SUCCESS(status))
+        PciDevicepFreeTable(table);
+
+    ImpKeReleaseGuardedMutex(&table->lock);
+    return status;
+}
+
+VOID
+PciDeviceTableFree()
+{
+    PPCI_DEVICE_TABLE table = &g_PciDeviceTable;
+
+    if (!table->active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&table->lock);
+    table->active = FALSE;
+    PciDevicepFreeTable(table);
+    ImpKeReleaseGuardedMutex(&table->lock);
+}
+
+/* May be called at IRQL <= DISPATCH_LEVEL, such as from a PnP notification. */
+VOID
+PciDeviceTableRequestRescan()
+{
+    InterlockedExchange(&g_PciDeviceTable.rescan_pending, TRUE);
+}
+
+/* An interval of 0 walks every bus on every validation. */
+VOID
+PciDeviceTableSetFullInterval(_In_ UINT64 Interval)
+{
+    g_PciDeviceTable.full_interval = Interval;
+}
+
+/*
+ * Rescans the table if a PnP notification was received or the full interval
+ * has elapsed, then reports every blacklisted device. A device is reported
+ * on each validation while it remains present, duplicates being coalesced by
+ * the report coalescer.
+ */
+NTSTATUS
+PciDeviceTableValidate()
+{
+    PAGED_CODE();
+
+    NTSTATUS          status = STATUS_SUCCESS;
+    PPCI_DEVICE_TABLE table = &g_PciDeviceTable;
+    PPCI_DEVICE_ENTRY entry = NULL;
+    BOOLEAN           full = FALSE;
+
+    if (!table->active)
+        return STATUS_DEVICE_NOT_READY;
+
+    ImpKeAcquireGuardedMutex(&table->lock);
+
+    if (!table->active) {
+        status = STATUS_DEVICE_NOT_READY;
+        goto end;
+    }
+
+    table->statistics.validations++;
+
+    full = KeQueryInterruptTime() - table->last_full_scan >=
+           table->full_interval;
+
+    if (full || InterlockedExchange(&table->rescan_pending, FALSE))
+        status = PciDevicepRescan(table, full);
+
+    /* a failed rescan leaves the previous table in place */
+    for (UINT32 index = 0; index < table->devices.count; index++) {
+        entry = &table->devices.entries[index];
+
+        if (entry->verdict == PciDeviceVerdictBlacklisted)
+            PciDevicepReportBlacklistedDevice(entry);
+    }
+
+end:
+    ImpKeReleaseGuardedMutex(&table->lock);
+    return status;
+}
+
+VOID
+PciDeviceTableQueryStatistics(_Out_ PPCI_DEVICE_STATISTICS Statistics)
+{
+    RtlZeroMemory(Statistics, sizeof(PCI_DEVICE_STATISTICS));
+
+    if (!g_PciDeviceTable.active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&g_PciDeviceTable.lock);
+    *Statistics = g_PciDeviceTable.statistics;
+    ImpKeReleaseGuardedMutex(&g_PciDeviceTable.lock);
+}
@@ -0,0 +1,258 @@
+#include "perf.h"
+
+#include "imports.h"
+#include "io.h"
+#include "lib/stdlib.h"
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, PerfCountersInitialise)
+#    pragma alloc_text(PAGE, PerfCountersFree)
+#    pragma alloc_text(PAGE, PerfQueryStatisticsIrp)
+#endif
+
+static_assert(PerfCounterValidateWin32kDispatchTables ==
+                  ssValidateWin32kDispatchTables,
+              "perf counters out of sync with SHARED_STATE_OPERATION_ID");
+
+STATIC PERF_COUNTERS g_PerfCounters = {0};
+
+NTSTATUS
+PerfCountersInitialise()
+{
+    PAGED_CODE();
+
+    PPERF_COUNTERS perf = &g_PerfCounters;
+    PPERF_COUNTER  counter = NULL;
+
+    perf->processor_count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    perf->processors = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        perf->processor_count * sizeof(PERF_CPU_COUNTERS),
+        POOL_TAG_PERF);
+
+    if (!perf->processors)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (UINT32 processor = 0; processor < perf->processor_count;
+         processor++) {
+        for (UINT32 index = 0; index < PerfCounterMax; index++) {
+            counter = &perf->processors[processor].counters[index];
+            counter->min_ticks = MAXUINT64;
+        }
+    }
+
+    perf->start_tsc = __rdtsc();
+    perf->start_interrupt_time = KeQueryInterruptTime();
+    perf->active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+/* Must only be called once nothing can record, i.e last during unload. */
+VOID
+PerfCountersFree()
+{
+    PAGED_CODE();
+
+    PPERF_COUNTERS perf = &g_PerfCounters;
+
+    perf->active = FALSE;
+
+    if (perf->processors) {
+        ImpExFreePoolWithTag(perf->processors, POOL_TAG_PERF);
+        perf->processors = NULL;
+    }
+}
+
+FORCEINLINE
+STATIC
+UINT32
+PerfpGetHistogramBucket(_In_ UINT64 Ticks)
+{
+    ULONG  msb = 0;
+    UINT32 bucket = 0;
+
+    if (Ticks < PERF_HISTOGRAM_SUB_BUCKETS)
+        return (UINT32)Ticks;
+
+    _BitScanReverse64(&msb, Ticks);
+
+    /* the bits following the most significant select the sub bucket */
+    bucket = (msb - PERF_HISTOGRAM_SUB_BUCKET_SHIFT + 1) *
+                 PERF_HISTOGRAM_SUB_BUCKETS +
+             (UINT32)(Ticks >> (msb - PERF_HISTOGRAM_SUB_BUCKET_SHIFT)) -
+             PERF_HISTOGRAM_SUB_BUCKETS;
+
+    return min(bucket, PERF_HISTOGRAM_BUCKETS - 1);
+}
+
+/* The largest duration counted in the bucket. */
+STATIC
+UINT64
+PerfpGetHistogramBucketLimit(_In_ UINT32 Bucket)
+{
+    UINT32 shift = 0;
+    UINT64 sub = 0;
+
+    if (Bucket < PERF_HISTOGRAM_SUB_BUCKETS)
+        return Bucket;
+
+    shift = Bucket / PERF_HISTOGRAM_SUB_BUCKETS - 1;
+    sub = Bucket % PERF_HISTOGRAM_SUB_BUCKETS;
+
+    return ((PERF_HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/*
+ * Records a duration begun by PerfBegin. May be called at IRQL <=
+ * DISPATCH_LEVEL, durations recorded above it are discarded as they could
+ * interrupt an update on the same processor.
+ */
+VOID
+PerfRecord(_In_ PERF_COUNTER_ID Id, _In_ UINT64 Start, _In_ UINT64 Bytes)
+{
+    PPERF_COUNTERS perf = &g_PerfCounters;
+    PPERF_COUNTER  counter = NULL;
+    UINT64         ticks = __rdtsc() - Start;
+    UINT32         processor = 0;
+    KIRQL          irql = 0;
+
+    if (!perf->active || (UINT32)Id >= PerfCounterMax)
+        return;
+
+    if (KeGetCurrentIrql() > DISPATCH_LEVEL)
+        return;
+
+    irql = KeRaiseIrqlToDpcLevel();
+
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    /* a processor added since initialisation is not counted */
+    if (processor >= perf->processor_count)
+        goto end;
+
+    counter = &perf->processors[processor].counters[Id];
+
+    counter->invocations++;
+    counter->total_ticks += ticks;
+    counter->bytes += Bytes;
+    counter->histogram[PerfpGetHistogramBucket(ticks)]++;
+
+    if (ticks < counter->min_ticks)
+        counter->min_ticks = ticks;
+
+    if (ticks > counter->max_ticks)
+        counter->max_ticks = ticks;
+
+end:
+    KeLowerIrql(irql);
+}
+
+STATIC
+UINT64
+PerfpEstimateP99(_In_ PUINT64 Histogram, _In_ UINT64 Count)
+{
+    UINT64 rank = 0;
+    UINT64 seen = 0;
+
+    if (!Count)
+        return 0;
+
+    rank = (Count * 99 + 99) / 100;
+
+    for (UINT32 index = 0; index < PERF_HISTOGRAM_BUCKETS; index++) {
+        seen += Histogram[index];
+
+        if (seen >= rank)
+            return PerfpGetHistogramBucketLimit(index);
+    }
+
+    return PerfpGetHistogramBucketLimit(PERF_HISTOGRAM_BUCKETS - 1);
+}
+
+/*
+ * Merges the counters of every processor. Counters are read while they may
+ * be updated, so a counter's fields may disagree by the few durations being
+ * recorded at the time.
+ */
+STATIC
+VOID
+PerfpMergeCounter(_In_ PPERF_COUNTERS            Perf,
+                  _In_ UINT32                    Id,
+                  _In_ PUINT64                   Histogram,
+                  _Out_ PPERF_COUNTER_STATISTICS Statistics)
+{
+    PPERF_COUNTER counter = NULL;
+    UINT64        min_ticks = MAXUINT64;
+    UINT64        histogram_count = 0;
+
+    RtlZeroMemory(Statistics, sizeof(PERF_COUNTER_STATISTICS));
+    RtlZeroMemory(Histogram, PERF_HISTOGRAM_BUCKETS * sizeof(UINT64));
+
+    for (UINT32 processor = 0; processor < Perf->processor_count;
+         processor++) {
+        counter = &Perf->processors[processor].counters[Id];
+
+        Statistics->invocations += counter->invocations;
+        Statistics->total_ticks += counter->total_ticks;
+        Statistics->bytes += counter->bytes;
+        min_ticks = min(min_ticks, counter->min_ticks);
+        Statistics->max_ticks = max(Statistics->max_ticks, counter->max_ticks);
+
+        for (UINT32 index = 0; index < PERF_HISTOGRAM_BUCKETS; index++) {
+            Histogram[index] += counter->histogram[index];
+            histogram_count += counter->histogram[index];
+        }
+    }
+
+    if (!Statistics->invocations)
+        return;
+
+    Statistics->min_ticks = min_ticks;
+    Statistics->p99_ticks = min(PerfpEstimateP99(Histogram, histogram_count),
+                                Statistics->max_ticks);
+}
+
+VOID
+PerfQueryStatistics(_Out_ PPERF_STATISTICS Statistics)
+{
+    PPERF_COUNTERS perf = &g_PerfCounters;
+    UINT64         histogram[PERF_HISTOGRAM_BUCKETS] = {0};
+
+    RtlZeroMemory(Statistics, sizeof(PERF_STATISTICS));
+
+    Statistics->version = PERF_STATISTICS_VERSION;
+    Statistics->size = sizeof(PERF_STATISTICS);
+    Statistics->counter_count = PerfCounterMax;
+    Statistics->query_tsc = __rdtsc();
+    Statistics->query_interrupt_time = KeQueryInterruptTime();
+
+    if (!perf->active)
+        return;
+
+    Statistics->processor_count = perf->processor_count;
+    Statistics->start_tsc = perf->start_tsc;
+    Statistics->start_interrupt_time = perf->start_interrupt_time;
+
+    for (UINT32 index = 0; index < PerfCounterMax; index++)
+        PerfpMergeCounter(
+            perf, index, histogram, &Statistics->counters[index]);
+}
+
+NTSTATUS
+PerfQueryStatisticsIrp(_Inout_ PIRP Irp)
+{
+    PAGED_CODE();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    status = ValidateIrpOutputBuffer(Irp, sizeof(PERF_STATISTICS));
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("ValidateIrpOutputBuffer failed with status %x", status);
+        return status;
+    }
+
+    PerfQueryStatistics(Irp->AssociatedIrp.SystemBuffer);
+    Irp->IoStatus.Information = sizeof(PERF_STATISTICS);
+    return STATUS_SUCCESS;
+}
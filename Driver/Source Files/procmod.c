@@ -0,0 +1,544 @@
+#include "procmod.h"
+
+#include "imports.h"
+#include "lib/stdlib.h"
+
+STATIC PROCESS_MODULE_PATH_TABLE g_PathTable = {0};
+
+FORCEINLINE
+STATIC
+UINT32
+ProcessModulepHashPath(_In_ PCHAR Path, _In_ UINT32 Length)
+{
+    UINT32 hash = 0x811c9dc5;
+
+    for (UINT32 index = 0; index < Length; index++) {
+        hash ^= (UCHAR)Path[index];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+FORCEINLINE
+STATIC
+PPROCESS_MODULE_PATH
+ProcessModulepGetPathEntry(_In_ PPROCESS_MODULE_PATH_TABLE Table,
+                           _In_ UINT32                     PathId)
+{
+    PPROCESS_MODULE_PATH* chunk =
+        ReadPointerAcquire(&Table->chunks[PathId / PROCESS_MODULE_PATH_CHUNK_SIZE]);
+
+    return chunk[PathId % PROCESS_MODULE_PATH_CHUNK_SIZE];
+}
+
+NTSTATUS
+ProcessModulePathTableInitialise()
+{
+    PPROCESS_MODULE_PATH_TABLE table = &g_PathTable;
+
+    RtlZeroMemory(table, sizeof(PROCESS_MODULE_PATH_TABLE));
+    ImpKeInitializeGuardedMutex(&table->lock);
+
+    table->index_capacity = PROCESS_MODULE_PATH_INDEX_INITIAL;
+    table->index = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                      table->index_capacity * sizeof(UINT32),
+                                      POOL_TAG_PROCESS_MODULE);
+
+    if (!table->index)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    table->active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+/* Must only be called once no process module array refers to the table. */
+VOID
+ProcessModulePathTableFree()
+{
+    PPROCESS_MODULE_PATH_TABLE table = &g_PathTable;
+    PPROCESS_MODULE_PATH_ARENA arena = NULL;
+
+    table->active = FALSE;
+
+    for (UINT32 index = 0; index < PROCESS_MODULE_PATH_CHUNK_COUNT; index++) {
+        if (table->chunks[index])
+            ImpExFreePoolWithTag(table->chunks[index], POOL_TAG_PROCESS_MODULE);
+
+        table->chunks[index] = NULL;
+    }
+
+    while (table->arenas) {
+        arena = table->arenas;
+        table->arenas = arena->next;
+        ImpExFreePoolWithTag(arena, POOL_TAG_PROCESS_MODULE);
+    }
+
+    if (table->index) {
+        ImpExFreePoolWithTag(table->index, POOL_TAG_PROCESS_MODULE);
+        table->index = NULL;
+    }
+
+    table->count = 0;
+}
+
+/*
+ * Returns the index slot holding the path, or the empty slot it would be
+ * stored in.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+STATIC
+PUINT32
+ProcessModulepFindIndexSlot(_In_ PPROCESS_MODULE_PATH_TABLE Table,
+                            _In_ PCHAR                      Path,
+                            _In_ UINT32                     Length,
+                            _In_ UINT32                     Hash)
+{
+    PPROCESS_MODULE_PATH entry = NULL;
+    UINT32               mask = Table->index_capacity - 1;
+    UINT32               slot = Hash & mask;
+
+    for (;;) {
+        if (!Table->index[slot])
+            return &Table->index[slot];
+
+        entry = ProcessModulepGetPathEntry(Table, Table->index[slot] - 1);
+
+        if (entry->hash == Hash && entry->length == Length &&
+            IntCompareMemory(entry->string, Path, Length) == Length)
+            return &Table->index[slot];
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+NTSTATUS
+ProcessModulepGrowIndex(_In_ PPROCESS_MODULE_PATH_TABLE Table)
+{
+    PPROCESS_MODULE_PATH entry = NULL;
+    PUINT32              index = NULL;
+    UINT32               capacity = Table->index_capacity * 2;
+    UINT32               mask = capacity - 1;
+    UINT32               slot = 0;
+
+    index = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                               capacity * sizeof(UINT32),
+                               POOL_TAG_PROCESS_MODULE);
+
+    if (!index)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (UINT32 id = 0; id < (UINT32)Table->count; id++) {
+        entry = ProcessModulepGetPathEntry(Table, id);
+        slot = entry->hash & mask;
+
+        while (index[slot])
+            slot = (slot + 1) & mask;
+
+        index[slot] = id + 1;
+    }
+
+    ImpExFreePoolWithTag(Table->index, POOL_TAG_PROCESS_MODULE);
+
+    Table->index = index;
+    Table->index_capacity = capacity;
+    return STATUS_SUCCESS;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+PPROCESS_MODULE_PATH
+ProcessModulepAllocatePathEntry(_In_ PPROCESS_MODULE_PATH_TABLE Table,
+                                _In_ UINT32                     Length)
+{
+    PPROCESS_MODULE_PATH_ARENA arena = Table->arenas;
+    PPROCESS_MODULE_PATH       entry = NULL;
+    UINT32 size = ALIGN_UP_BY(sizeof(PROCESS_MODULE_PATH) + Length + 1, 8);
+
+    if (!arena || arena->used + size > PROCESS_MODULE_PATH_ARENA_SIZE) {
+        arena = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                   sizeof(PROCESS_MODULE_PATH_ARENA) +
+                                       PROCESS_MODULE_PATH_ARENA_SIZE,
+                                   POOL_TAG_PROCESS_MODULE);
+
+        if (!arena)
+            return NULL;
+
+        arena->next = Table->arenas;
+        Table->arenas = arena;
+    }
+
+    entry = (PPROCESS_MODULE_PATH)&arena->data[arena->used];
+    arena->used += size;
+    return entry;
+}
+
+/*
+ * Returns the id of the path, adding it to the table if it is not already
+ * present. The path is truncated to MAX_MODULE_PATH - 1 characters.
+ */
+NTSTATUS
+ProcessModuleInternPath(_In_ PCHAR Path, _Out_ PUINT32 PathId)
+{
+    NTSTATUS                   status = STATUS_SUCCESS;
+    PPROCESS_MODULE_PATH_TABLE table = &g_PathTable;
+    PPROCESS_MODULE_PATH       entry = NULL;
+    PPROCESS_MODULE_PATH*      chunk = NULL;
+    PUINT32                    slot = NULL;
+    UINT32                     length = 0;
+    UINT32                     hash = 0;
+    UINT32                     id = 0;
+
+    *PathId = PROCESS_MODULE_PATH_INVALID;
+
+    if (!table->active)
+        return STATUS_UNSUCCESSFUL;
+
+    length = (UINT32)IntStringLength(Path, MAX_MODULE_PATH - 1);
+    hash = ProcessModulepHashPath(Path, length);
+
+    ImpKeAcquireGuardedMutex(&table->lock);
+
+    slot = ProcessModulepFindIndexSlot(table, Path, length, hash);
+
+    if (*slot) {
+        *PathId = *slot - 1;
+        goto end;
+    }
+
+    id = (UINT32)table->count;
+
+    if (id == PROCESS_MODULE_PATH_MAX_COUNT) {
+        status = STATUS_QUOTA_EXCEEDED;
+        goto end;
+    }
+
+    /* keep the load factor at or below one half */
+    if ((id + 1) * 2 > table->index_capacity) {
+        status = ProcessModulepGrowIndex(table);
+
+        if (!NT_SUCCESS(status))
+            goto end;
+
+        slot = ProcessModulepFindIndexSlot(table, Path, length, hash);
+    }
+
+    chunk = table->chunks[id / PROCESS_MODULE_PATH_CHUNK_SIZE];
+
+    if (!chunk) {
+        chunk = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                   PROCESS_MODULE_PATH_CHUNK_SIZE *
+                                       sizeof(PPROCESS_MODULE_PATH),
+                                   POOL_TAG_PROCESS_MODULE);
+
+        if (!chunk) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        InterlockedExchangePointer(
+            &table->chunks[id / PROCESS_MODULE_PATH_CHUNK_SIZE], chunk);
+    }
+
+    entry = ProcessModulepAllocatePathEntry(table, length);
+
+    if (!entry) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    entry->hash = hash;
+    entry->length = (UINT16)length;
+    IntCopyMemory(entry->string, Path, length);
+    entry->string[length] = '\0';
+
+    chunk[id % PROCESS_MODULE_PATH_CHUNK_SIZE] = entry;
+    *slot = id + 1;
+
+    /* publishes the entry to lock free readers */
+    InterlockedIncrement(&table->count);
+    *PathId = id;
+
+end:
+    ImpKeReleaseGuardedMutex(&table->lock);
+    return status;
+}
+
+/* Returns the interned path, or NULL if the id is not valid. */
+PCHAR
+ProcessModuleGetPath(_In_ UINT32 PathId)
+{
+    PPROCESS_MODULE_PATH_TABLE table = &g_PathTable;
+
+    if (!table->active || PathId >= (UINT32)ReadAcquire(&table->count))
+        return NULL;
+
+    return ProcessModulepGetPathEntry(table, PathId)->string;
+}
+
+/* Returns the path of the module, whether interned or private. */
+PCHAR
+ProcessModuleGetModulePath(_In_ PPROCESS_MODULE Module)
+{
+    return Module->path ? Module->path : ProcessModuleGetPath(Module->path_id);
+}
+
+/* Returns the id of the path if it has been interned, without adding it. */
+STATIC
+UINT32
+ProcessModulepLookupPath(_In_ PCHAR Path)
+{
+    PPROCESS_MODULE_PATH_TABLE table = &g_PathTable;
+    PUINT32                    slot = NULL;
+    UINT32                     length = 0;
+    UINT32                     id = PROCESS_MODULE_PATH_INVALID;
+
+    if (!table->active)
+        return PROCESS_MODULE_PATH_INVALID;
+
+    length = (UINT32)IntStringLength(Path, MAX_MODULE_PATH - 1);
+
+    ImpKeAcquireGuardedMutex(&table->lock);
+
+    slot = ProcessModulepFindIndexSlot(
+        table, Path, length, ProcessModulepHashPath(Path, length));
+
+    if (*slot)
+        id = *slot - 1;
+
+    ImpKeReleaseGuardedMutex(&table->lock);
+    return id;
+}
+
+VOID
+ProcessModuleArrayInitialise(_Out_ PPROCESS_MODULE_ARRAY Array)
+{
+    Array->modules = NULL;
+    Array->count = 0;
+    Array->capacity = 0;
+}
+
+/* ASSUMES LOCK IS HELD! */
+VOID
+ProcessModuleArrayFree(_Inout_ PPROCESS_MODULE_ARRAY Array)
+{
+    for (UINT32 index = 0; index < Array->count; index++) {
+        if (Array->modules[index].path)
+            ImpExFreePoolWithTag(Array->modules[index].path,
+                                 POOL_TAG_PROCESS_MODULE);
+    }
+
+    if (Array->modules)
+        ImpExFreePoolWithTag(Array->modules, POOL_TAG_PROCESS_MODULE);
+
+    ProcessModuleArrayInitialise(Array);
+}
+
+/*
+ * Returns the index of the first module whose base is greater than Address.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+STATIC
+UINT32
+ProcessModulepUpperBound(_In_ PPROCESS_MODULE_ARRAY Array, _In_ UINT64 Address)
+{
+    UINT32 low = 0;
+    UINT32 high = Array->count;
+    UINT32 middle = 0;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (Array->modules[middle].base <= Address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+NTSTATUS
+ProcessModulepGrowArray(_Inout_ PPROCESS_MODULE_ARRAY Array)
+{
+    PPROCESS_MODULE modules = NULL;
+    UINT32          capacity = Array->capacity
+                                   ? Array->capacity * 2
+                                   : PROCESS_MODULE_ARRAY_INITIAL_CAPACITY;
+
+    modules = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                 capacity * sizeof(PROCESS_MODULE),
+                                 POOL_TAG_PROCESS_MODULE);
+
+    if (!modules)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    if (Array->modules) {
+        IntCopyMemory(
+            modules, Array->modules, Array->count * sizeof(PROCESS_MODULE));
+        ImpExFreePoolWithTag(Array->modules, POOL_TAG_PROCESS_MODULE);
+    }
+
+    Array->modules = modules;
+    Array->capacity = capacity;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Returns a private copy of the path for a module whose path could not be
+ * interned, truncated as an interned path would be.
+ */
+STATIC
+PCHAR
+ProcessModulepCopyPath(_In_ PCHAR Path)
+{
+    PCHAR  copy = NULL;
+    UINT32 length = (UINT32)IntStringLength(Path, MAX_MODULE_PATH - 1);
+
+    copy = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, length + 1, POOL_TAG_PROCESS_MODULE);
+
+    if (!copy)
+        return NULL;
+
+    IntCopyMemory(copy, Path, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/*
+ * Inserts the module in base order. A module loaded at the base of an
+ * existing entry replaces it, as the previous module must have been unloaded.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+NTSTATUS
+ProcessModuleArrayInsert(_Inout_ PPROCESS_MODULE_ARRAY Array,
+                         _In_ UINT64                   Base,
+                         _In_ UINT32                   Size,
+                         _In_ PCHAR                    Path)
+{
+    NTSTATUS        status = STATUS_UNSUCCESSFUL;
+    PPROCESS_MODULE module = NULL;
+    PCHAR           path = NULL;
+    UINT32          path_id = 0;
+    UINT32          index = 0;
+
+    status = ProcessModuleInternPath(Path, &path_id);
+
+    if (!NT_SUCCESS(status)) {
+        path = ProcessModulepCopyPath(Path);
+
+        if (!path)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    index = ProcessModulepUpperBound(Array, Base);
+
+    if (index && Array->modules[index - 1].base == Base) {
+        module = &Array->modules[index - 1];
+
+        if (module->path)
+            ImpExFreePoolWithTag(module->path, POOL_TAG_PROCESS_MODULE);
+
+        module->size = Size;
+        module->path_id = path_id;
+        module->path = path;
+        return STATUS_SUCCESS;
+    }
+
+    if (Array->count == Array->capacity) {
+        status = ProcessModulepGrowArray(Array);
+
+        if (!NT_SUCCESS(status)) {
+            if (path)
+                ImpExFreePoolWithTag(path, POOL_TAG_PROCESS_MODULE);
+
+            return status;
+        }
+    }
+
+    RtlMoveMemory(&Array->modules[index + 1],
+                  &Array->modules[index],
+                  (Array->count - index) * sizeof(PROCESS_MODULE));
+
+    module = &Array->modules[index];
+    module->base = Base;
+    module->size = Size;
+    module->path_id = path_id;
+    module->path = path;
+
+    Array->count++;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Returns the module containing Address, or NULL if the address is not
+ * backed by a module of the process.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+PPROCESS_MODULE
+ProcessModuleArrayFind(_In_ PPROCESS_MODULE_ARRAY Array, _In_ UINT64 Address)
+{
+    PPROCESS_MODULE module = NULL;
+    UINT32          index = ProcessModulepUpperBound(Array, Address);
+
+    if (!index)
+        return NULL;
+
+    module = &Array->modules[index - 1];
+
+    return Address - module->base < module->size ? module : NULL;
+}
+
+/*
+ * The path is only hashed once, modules are matched by comparing path
+ * ids. Only modules holding a private path are compared by string.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+PPROCESS_MODULE
+ProcessModuleArrayFindByPath(_In_ PPROCESS_MODULE_ARRAY Array,
+                             _In_ PCHAR                 Path)
+{
+    PPROCESS_MODULE module = NULL;
+    UINT32          path_id = ProcessModulepLookupPath(Path);
+    UINT32          length = (UINT32)IntStringLength(Path, MAX_MODULE_PATH - 1);
+
+    for (UINT32 index = 0; index < Array->count; index++) {
+        module = &Array->modules[index];
+
+        if (module->path) {
+            if (IntStringLength(module->path, MAX_MODULE_PATH - 1) == length &&
+                IntCompareMemory(module->path, Path, length) == length)
+                return module;
+
+            continue;
+        }
+
+        if (path_id != PROCESS_MODULE_PATH_INVALID &&
+            module->path_id == path_id)
+            return module;
+    }
+
+    return NULL;
+}
+
+/* ASSUMES LOCK IS HELD! */
+VOID
+ProcessModuleArrayEnumerate(_In_ PPROCESS_MODULE_ARRAY         Array,
+                            _In_ PROCESS_MODULE_ARRAY_CALLBACK Callback,
+                            _In_opt_ PVOID                     Context)
+{
+    for (UINT32 index = 0; index < Array->count; index++) {
+        if (Callback(&Array->modules[index], Context))
+            return;
+    }
+}
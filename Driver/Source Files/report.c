@@ -0,0 +1,300 @@
+#include "report.h"
+
+#include "crypt.h"
+#include "imports.h"
+#include "io.h"
+#include "lib/stdlib.h"
+#include "types/types.h"
+
+#define REPORT_COALESCE_MAX_PENDING_SUMMARIES 8
+
+STATIC REPORT_COALESCER g_ReportCoalescer = {0};
+
+FORCEINLINE
+STATIC
+UINT32
+ReportpHashCoalesceKey(_In_ PREPORT_COALESCE_KEY Key)
+{
+    UINT64 hash = ((UINT64)Key->report_code << 32 | Key->report_sub_type) ^
+                  Key->subject[0] * 0x9E3779B97F4A7C15ull ^
+                  Key->subject[1] * 0xC2B2AE3D27D4EB4Full;
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+
+    return (UINT32)hash & (REPORT_COALESCE_BUCKET_COUNT - 1);
+}
+
+FORCEINLINE
+STATIC
+BOOLEAN
+ReportpCompareCoalesceKey(_In_ PREPORT_COALESCE_KEY Key1,
+                          _In_ PREPORT_COALESCE_KEY Key2)
+{
+    return Key1->report_code == Key2->report_code &&
+                   Key1->report_sub_type == Key2->report_sub_type &&
+                   Key1->subject[0] == Key2->subject[0] &&
+                   Key1->subject[1] == Key2->subject[1]
+               ? TRUE
+               : FALSE;
+}
+
+VOID
+ReportInitialiseCoalescer()
+{
+    PREPORT_COALESCER coalescer = &g_ReportCoalescer;
+
+    RtlZeroMemory(coalescer, sizeof(REPORT_COALESCER));
+    ImpKeInitializeGuardedMutex(&coalescer->lock);
+    InitializeListHead(&coalescer->lru);
+
+    /* every entry starts on the lru, unused entries being at the tail */
+    for (UINT32 index = 0; index < REPORT_COALESCE_ENTRY_COUNT; index++)
+        InsertTailList(&coalescer->lru, &coalescer->entries[index].lru_entry);
+
+    coalescer->active = TRUE;
+}
+
+/* Summaries still pending are discarded, call ReportFlushCoalescedReports
+ * first if they are wanted. */
+VOID
+ReportFreeCoalescer()
+{
+    PREPORT_COALESCER coalescer = &g_ReportCoalescer;
+
+    ImpKeAcquireGuardedMutex(&coalescer->lock);
+    coalescer->active = FALSE;
+    ImpKeReleaseGuardedMutex(&coalescer->lock);
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+PREPORT_COALESCE_ENTRY
+ReportpLookupCoalesceEntry(_In_ PREPORT_COALESCER   Coalescer,
+                           _In_ PREPORT_COALESCE_KEY Key,
+                           _In_ UINT32               Bucket)
+{
+    PREPORT_COALESCE_ENTRY entry = Coalescer->buckets[Bucket];
+
+    for (; entry; entry = entry->bucket_next) {
+        if (ReportpCompareCoalesceKey(&entry->key, Key))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+VOID
+ReportpUnlinkCoalesceEntry(_In_ PREPORT_COALESCER    Coalescer,
+                           _In_ PREPORT_COALESCE_ENTRY Entry)
+{
+    PREPORT_COALESCE_ENTRY* link =
+        &Coalescer->buckets[ReportpHashCoalesceKey(&Entry->key)];
+
+    for (; *link; link = &(*link)->bucket_next) {
+        if (*link == Entry) {
+            *link = Entry->bucket_next;
+            break;
+        }
+    }
+
+    Entry->bucket_next = NULL;
+    Entry->in_use = FALSE;
+}
+
+STATIC
+VOID
+ReportpScheduleSummary(_In_ PREPORT_COALESCE_ENTRY Entry)
+{
+    NTSTATUS          status = STATUS_UNSUCCESSFUL;
+    PCOALESCED_REPORT report = NULL;
+    UINT32            packet_size =
+        CryptRequestRequiredBufferLength(sizeof(COALESCED_REPORT));
+
+    report = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, packet_size, REPORT_POOL_TAG);
+
+    if (!report)
+        return;
+
+    INIT_REPORT_PACKET(report, REPORT_COALESCED, 0);
+
+    report->report_code = Entry->key.report_code;
+    report->report_sub_type = Entry->key.report_sub_type;
+    report->subject[0] = Entry->key.subject[0];
+    report->subject[1] = Entry->key.subject[1];
+    report->suppressed_count = Entry->suppressed_count;
+    report->first_seen = Entry->first_seen;
+    report->last_seen = Entry->last_seen;
+
+    status = CryptEncryptBuffer(report, packet_size);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("CryptEncryptBuffer: %lx", status);
+        ImpExFreePoolWithTag(report, REPORT_POOL_TAG);
+        return;
+    }
+
+    InterlockedIncrement64(&g_ReportCoalescer.summaries);
+    IrpQueueSchedulePacket(report, packet_size);
+}
+
+/*
+ * Returns TRUE if the report identified by the key should be built and
+ * scheduled, otherwise the occurrence has been counted against an earlier
+ * report. If the coalescer is not active every report is scheduled. Must be
+ * called at IRQL <= APC_LEVEL.
+ */
+BOOLEAN
+ReportShouldSchedule(_In_ UINT32 ReportCode,
+                     _In_ UINT32 ReportSubType,
+                     _In_ UINT64 Subject1,
+                     _In_ UINT64 Subject2)
+{
+    PREPORT_COALESCER      coalescer = &g_ReportCoalescer;
+    PREPORT_COALESCE_ENTRY entry = NULL;
+    REPORT_COALESCE_ENTRY  summary = {0};
+    BOOLEAN                schedule_summary = FALSE;
+    BOOLEAN                schedule = TRUE;
+    REPORT_COALESCE_KEY    key = {0};
+    LARGE_INTEGER          system_time = {0};
+    UINT64                 now = KeQueryInterruptTime();
+    UINT32                 bucket = 0;
+
+    if (!coalescer->active)
+        return TRUE;
+
+    key.report_code = ReportCode;
+    key.report_sub_type = ReportSubType;
+    key.subject[0] = Subject1;
+    key.subject[1] = Subject2;
+    bucket = ReportpHashCoalesceKey(&key);
+
+    KeQuerySystemTime(&system_time);
+    ImpKeAcquireGuardedMutex(&coalescer->lock);
+
+    if (!coalescer->active)
+        goto end;
+
+    entry = ReportpLookupCoalesceEntry(coalescer, &key, bucket);
+
+    if (entry && now - entry->window_start < REPORT_COALESCE_WINDOW) {
+        entry->suppressed_count++;
+        entry->last_seen = system_time.QuadPart;
+        schedule = FALSE;
+        goto touch;
+    }
+
+    /* either the window of this key has closed, or we evict the least
+     * recently seen key to make room for it */
+    if (!entry) {
+        entry = CONTAINING_RECORD(
+            coalescer->lru.Blink, REPORT_COALESCE_ENTRY, lru_entry);
+
+        if (entry->in_use)
+            ReportpUnlinkCoalesceEntry(coalescer, entry);
+    }
+
+    if (entry->suppressed_count) {
+        summary = *entry;
+        schedule_summary = TRUE;
+    }
+
+    if (!entry->in_use) {
+        entry->key = key;
+        entry->in_use = TRUE;
+        entry->bucket_next = coalescer->buckets[bucket];
+        coalescer->buckets[bucket] = entry;
+    }
+
+    entry->suppressed_count = 0;
+    entry->window_start = now;
+    entry->first_seen = system_time.QuadPart;
+    entry->last_seen = system_time.QuadPart;
+
+touch:
+    RemoveEntryList(&entry->lru_entry);
+    InsertHeadList(&coalescer->lru, &entry->lru_entry);
+
+end:
+    ImpKeReleaseGuardedMutex(&coalescer->lock);
+
+    if (schedule_summary)
+        ReportpScheduleSummary(&summary);
+
+    if (schedule)
+        InterlockedIncrement64(&coalescer->reported);
+    else
+        InterlockedIncrement64(&coalescer->suppressed);
+
+    return schedule;
+}
+
+/*
+ * Sends the summary of every key whose window has closed with suppressed
+ * repeats. Intended to be called periodically, i.e alongside the heartbeat,
+ * so summaries are not held back until the key next occurs.
+ */
+VOID
+ReportFlushCoalescedReports()
+{
+    PREPORT_COALESCER      coalescer = &g_ReportCoalescer;
+    PREPORT_COALESCE_ENTRY entry = NULL;
+    PLIST_ENTRY            list_entry = NULL;
+    REPORT_COALESCE_ENTRY  pending[REPORT_COALESCE_MAX_PENDING_SUMMARIES];
+    UINT32                 count = 0;
+    BOOLEAN                remaining = TRUE;
+    UINT64                 now = 0;
+
+    if (!coalescer->active)
+        return;
+
+    /* summaries are scheduled outside of the lock, a bounded number at a
+     * time to keep the stack usage fixed */
+    while (remaining) {
+        remaining = FALSE;
+        count = 0;
+        now = KeQueryInterruptTime();
+
+        ImpKeAcquireGuardedMutex(&coalescer->lock);
+
+        for (list_entry = coalescer->lru.Flink; list_entry != &coalescer->lru;
+             list_entry = list_entry->Flink) {
+            entry = CONTAINING_RECORD(
+                list_entry, REPORT_COALESCE_ENTRY, lru_entry);
+
+            if (!entry->in_use)
+                break;
+
+            if (!entry->suppressed_count ||
+                now - entry->window_start < REPORT_COALESCE_WINDOW)
+                continue;
+
+            if (count == REPORT_COALESCE_MAX_PENDING_SUMMARIES) {
+                remaining = TRUE;
+                break;
+            }
+
+            /* the key remains, its next occurrence opens a new window */
+            pending[count++] = *entry;
+            entry->suppressed_count = 0;
+        }
+
+        ImpKeReleaseGuardedMutex(&coalescer->lock);
+
+        for (UINT32 index = 0; index < count; index++)
+            ReportpScheduleSummary(&pending[index]);
+    }
+}
+
+VOID
+ReportQueryCoalescerStatistics(
+    _Out_ PREPORT_COALESCER_STATISTICS Statistics)
+{
+    Statistics->reported = (UINT64)g_ReportCoalescer.reported;
+    Statistics->suppressed = (UINT64)g_ReportCoalescer.suppressed;
+    Statistics->summaries = (UINT64)g_ReportCoalescer.summaries;
+}
@@ -0,0 +1,179 @@
+#include "ring.h"
+
+#include "../lib/stdlib.h"
+
+#define RTL_RING_MAX_CAPACITY 0x10000
+
+FORCEINLINE
+STATIC
+UINT32
+RtlpRingRoundUpToPowerOfTwo(_In_ UINT32 Value)
+{
+    ULONG index = 0;
+
+    if (Value <= 1)
+        return 1;
+
+    _BitScanReverse(&index, Value - 1);
+    return 1ul << (index + 1);
+}
+
+FORCEINLINE
+STATIC
+PRTL_RING_SLOT
+RtlpRingGetSlot(_In_ PRTL_RING Ring, _In_ LONG64 Position)
+{
+    return &Ring->slots[(UINT64)Position & Ring->mask];
+}
+
+NTSTATUS
+RtlRingCreate(_In_ UINT32 Capacity, _Out_ PRTL_RING Ring)
+{
+    if (Capacity > RTL_RING_MAX_CAPACITY)
+        return STATUS_INVALID_PARAMETER;
+
+    RtlZeroMemory(Ring, sizeof(RTL_RING));
+
+    Ring->capacity = RtlpRingRoundUpToPowerOfTwo(
+        Capacity ? Capacity : RTL_RING_DEFAULT_CAPACITY);
+    Ring->mask = Ring->capacity - 1;
+
+    Ring->slots = ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)Ring->capacity * sizeof(RTL_RING_SLOT),
+        POOL_TAG_RING);
+
+    if (!Ring->slots)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    /* slot n is free for the producer arriving at position n */
+    for (UINT32 index = 0; index < Ring->capacity; index++)
+        Ring->slots[index].sequence = index;
+
+    Ring->active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID
+RtlRingDelete(_In_ PRTL_RING Ring)
+{
+    Ring->active = FALSE;
+
+    if (Ring->slots) {
+        ExFreePoolWithTag(Ring->slots, POOL_TAG_RING);
+        Ring->slots = NULL;
+    }
+}
+
+/*
+ * Returns FALSE if the ring is full or inactive, in which case ownership of
+ * Buffer remains with the caller.
+ */
+BOOLEAN
+RtlRingPush(_In_ PRTL_RING Ring, _In_ PVOID Buffer, _In_ UINT32 BufferSize)
+{
+    PRTL_RING_SLOT slot = NULL;
+    LONG64 position = 0;
+    LONG64 current = 0;
+    LONG64 difference = 0;
+
+    if (!Ring->active) {
+        InterlockedIncrement64(&Ring->dropped);
+        return FALSE;
+    }
+
+    position = Ring->tail;
+
+    for (;;) {
+        slot = RtlpRingGetSlot(Ring, position);
+        difference = ReadAcquire64(&slot->sequence) - position;
+
+        /* the consumer has not yet released this slot from the last lap */
+        if (difference < 0) {
+            InterlockedIncrement64(&Ring->dropped);
+            return FALSE;
+        }
+
+        /* another producer claimed this position, retry at the new tail */
+        if (difference > 0) {
+            position = Ring->tail;
+            continue;
+        }
+
+        current = InterlockedCompareExchange64(
+            &Ring->tail, position + 1, position);
+
+        if (current == position)
+            break;
+
+        position = current;
+    }
+
+    slot->entry.buffer = Buffer;
+    slot->entry.buffer_size = BufferSize;
+
+    /* publish the entry to the consumer */
+    InterlockedExchange64(&slot->sequence, position + 1);
+    InterlockedIncrement64(&Ring->pushed);
+    return TRUE;
+}
+
+/*
+ * Removes up to Count entries in the order they were pushed and returns the
+ * number removed. Only one consumer may drain the ring at a time, if another
+ * is already draining this returns 0 rather than waiting.
+ */
+UINT32
+RtlRingPopBatch(
+    _In_ PRTL_RING Ring,
+    _Out_writes_(Count) PRTL_RING_ENTRY Entries,
+    _In_ UINT32 Count)
+{
+    PRTL_RING_SLOT slot = NULL;
+    LONG64 position = 0;
+    UINT32 popped = 0;
+
+    if (InterlockedCompareExchange(&Ring->consumer_active, TRUE, FALSE))
+        return 0;
+
+    position = Ring->head;
+
+    for (; popped < Count; popped++, position++) {
+        slot = RtlpRingGetSlot(Ring, position);
+
+        /* not yet published, either empty or a producer is mid push */
+        if (ReadAcquire64(&slot->sequence) != position + 1)
+            break;
+
+        Entries[popped] = slot->entry;
+
+        /* free the slot for the producer arriving on the next lap */
+        InterlockedExchange64(&slot->sequence, position + Ring->capacity);
+    }
+
+    InterlockedExchange64(&Ring->head, position);
+    InterlockedAdd64(&Ring->popped, popped);
+    InterlockedExchange(&Ring->consumer_active, FALSE);
+    return popped;
+}
+
+/* Approximate if producers or the consumer are active. */
+UINT32
+RtlRingCount(_In_ PRTL_RING Ring)
+{
+    LONG64 head = ReadAcquire64(&Ring->head);
+    LONG64 tail = ReadAcquire64(&Ring->tail);
+
+    return tail > head ? (UINT32)(tail - head) : 0;
+}
+
+VOID
+RtlRingQueryStatistics(
+    _In_ PRTL_RING Ring, _Out_ PRTL_RING_STATISTICS Statistics)
+{
+    Statistics->capacity = Ring->capacity;
+    Statistics->count = RtlRingCount(Ring);
+    Statistics->pushed = (UINT64)ReadAcquire64(&Ring->pushed);
+    Statistics->dropped = (UINT64)ReadAcquire64(&Ring->dropped);
+    Statistics->popped = (UINT64)ReadAcquire64(&Ring->popped);
+}
@@ -0,0 +1,350 @@
+#include "sched.h"
+
+#include "imports.h"
+#include "lib/stdlib.h"
+
+/* 1 millisecond in 100ns units */
+#define SCHED_UNREGISTER_POLL_INTERVAL (1ull * 1000 * 10)
+
+STATIC SCHED_SCHEDULER g_Scheduler = {0};
+
+FORCEINLINE
+STATIC
+INT64
+SchedpEffectivePriority(_In_ PSCHED_CHECK Check)
+{
+    return (INT64)Check->priority - (INT64)Check->age;
+}
+
+/*
+ * Orders the due checks by effective priority, then by how long they have
+ * been due. There are only SCHED_CHECK_COUNT checks.
+ *
+ * ASSUMES LOCK IS HELD!
+ */
+STATIC
+VOID
+SchedpSortDueChecks(_Inout_ PUINT32 Order, _In_ UINT32 Count)
+{
+    PSCHED_CHECK checks = g_Scheduler.checks;
+    PSCHED_CHECK check = NULL;
+    PSCHED_CHECK previous = NULL;
+    UINT32       id = 0;
+    UINT32       index = 0;
+
+    for (UINT32 next = 1; next < Count; next++) {
+        id = Order[next];
+        check = &checks[id];
+
+        for (index = next; index; index--) {
+            previous = &checks[Order[index - 1]];
+
+            if (SchedpEffectivePriority(previous) <
+                SchedpEffectivePriority(check))
+                break;
+
+            if (SchedpEffectivePriority(previous) ==
+                    SchedpEffectivePriority(check) &&
+                previous->next_due <= check->next_due)
+                break;
+
+            Order[index] = Order[index - 1];
+        }
+
+        Order[index] = id;
+    }
+}
+
+VOID
+SchedInitialise()
+{
+    PSCHED_SCHEDULER scheduler = &g_Scheduler;
+
+    RtlZeroMemory(scheduler, sizeof(SCHED_SCHEDULER));
+    ImpKeInitializeGuardedMutex(&scheduler->lock);
+
+    scheduler->tick_budget_us = SCHED_DEFAULT_TICK_BUDGET_US;
+    scheduler->active = TRUE;
+}
+
+/* Waits for a running tick to finish. Must not be called from a slice. */
+VOID
+SchedFree()
+{
+    PSCHED_SCHEDULER scheduler = &g_Scheduler;
+    LARGE_INTEGER    delay = {.QuadPart =
+                                  RELATIVE(SCHED_UNREGISTER_POLL_INTERVAL)};
+
+    ImpKeAcquireGuardedMutex(&scheduler->lock);
+    scheduler->active = FALSE;
+    ImpKeReleaseGuardedMutex(&scheduler->lock);
+
+    while (ReadAcquire(&scheduler->running))
+        ImpKeDelayExecutionThread(KernelMode, FALSE, &delay);
+}
+
+/*
+ * The check is registered with the default priority, cadence and slice
+ * budget, and is first due on the next tick.
+ */
+NTSTATUS
+SchedRegisterCheck(_In_ SHARED_STATE_OPERATION_ID Id,
+                   _In_ SCHED_SLICE_ROUTINE       Routine,
+                   _In_opt_ PVOID                 Context)
+{
+    PSCHED_SCHEDULER scheduler = &g_Scheduler;
+    PSCHED_CHECK     check = NULL;
+    NTSTATUS         status = STATUS_SUCCESS;
+
+    if ((UINT32)Id >= SCHED_CHECK_COUNT)
+        return STATUS_INVALID_PARAMETER;
+
+    ImpKeAcquireGuardedMutex(&scheduler->lock);
+
+    check = &scheduler->checks[Id];
+
+    if (check->routine) {
+        status = STATUS_ALREADY_REGISTERED;
+        goto end;
+    }
+
+    RtlZeroMemory(check, sizeof(SCHED_CHECK));
+
+    check->routine = Routine;
+    check->context = Context;
+    check->priority = SCHED_DEFAULT_PRIORITY;
+    check->slice_budget_us = SCHED_DEFAULT_SLICE_BUDGET_US;
+    check->cadence = SCHED_DEFAULT_CADENCE;
+
+end:
+    ImpKeReleaseGuardedMutex(&scheduler->lock);
+    return status;
+}
+
+/*
+ * Once this returns no slice of the check is running, so its context can be
+ * freed. Must not be called from a slice.
+ */
+VOID
+SchedUnregisterCheck(_In_ SHARED_STATE_OPERATION_ID Id)
+{
+    PSCHED_SCHEDULER scheduler = &g_Scheduler;
+    LARGE_INTEGER    delay = {.QuadPart =
+                                  RELATIVE(SCHED_UNREGISTER_POLL_INTERVAL)};
+
+    if ((UINT32)Id >= SCHED_CHECK_COUNT)
+        return;
+
+    ImpKeAcquireGuardedMutex(&scheduler->lock);
+    scheduler->checks[Id].routine = NULL;
+    scheduler->checks[Id].context = NULL;
+    ImpKeReleaseGuardedMutex(&scheduler->lock);
+
+    while (ReadAcquire(&scheduler->running))
+        ImpKeDelayExecutionThread(KernelMode, FALSE, &delay);
+}
+
+NTSTATUS
+SchedConfigureCheck(_In_ SHARED_STATE_OPERATION_ID Id,
+                    _In_ UINT32                    Priority,
+                    _In_ UINT64                    Cadence,
+                    _In_ UINT32                    SliceBudgetUs)
+{
+    PSCHED_SCHEDULER scheduler = &g_Scheduler;
+    PSCHED_CHECK     check = NULL;
+
+    if ((UINT32)Id >= SCHED_CHECK_COUNT || !SliceBudgetUs)
+        return STATUS_INVALID_PARAMETER;
+
+    ImpKeAcquireGuardedMutex(&scheduler->lock);
+
+    check = &scheduler->checks[Id];
+
+    /* a check waiting on its cadence is rebased onto the new cadence,
+     * measured from when its last cycle ended */
+    if (!check->in_progress && check->next_due)
+        check->next_due = check->next_due - check->cadence + Cadence;
+
+    check->priority = Priority;
+    check->cadence = Cadence;
+    check->slice_budget_us = SliceBudgetUs;
+
+    ImpKeReleaseGuardedMutex(&scheduler->lock);
+    return STATUS_SUCCESS;
+}
+
+VOID
+SchedSetTickBudget(_In_ UINT32 TickBudgetUs)
+{
+    ImpKeAcquireGuardedMutex(&g_Scheduler.lock);
+    g_Scheduler.tick_budget_us = TickBudgetUs;
+    ImpKeReleaseGuardedMutex(&g_Scheduler.lock);
+}
+
+/*
+ * Makes the check due on the next tick, i.e when it is requested by user
+ * mode. A cycle already in progress simply continues.
+ */
+NTSTATUS
+SchedRequestCheck(_In_ SHARED_STATE_OPERATION_ID Id)
+{
+    PSCHED_SCHEDULER scheduler = &g_Scheduler;
+    NTSTATUS         status = STATUS_SUCCESS;
+
+    if ((UINT32)Id >= SCHED_CHECK_COUNT)
+        return STATUS_INVALID_PARAMETER;
+
+    ImpKeAcquireGuardedMutex(&scheduler->lock);
+
+    if (scheduler->checks[Id].routine)
+        scheduler->checks[Id].next_due = 0;
+    else
+        status = STATUS_NOT_FOUND;
+
+    ImpKeReleaseGuardedMutex(&scheduler->lock);
+    return status;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+VOID
+SchedpRecordSlice(_In_ PSCHED_CHECK Check,
+                  _In_ NTSTATUS     Status,
+                  _In_ BOOLEAN      Complete,
+                  _In_ UINT64       Start,
+                  _In_ UINT64       End,
+                  _In_ UINT64       Deadline)
+{
+    PSCHED_CHECK_STATISTICS statistics = &Check->statistics;
+    UINT64                  elapsed = End - Start;
+
+    statistics->slices++;
+    statistics->total_time += elapsed;
+    statistics->max_slice_time = max(statistics->max_slice_time, elapsed);
+
+    if (End > Deadline)
+        statistics->overruns++;
+
+    Check->age = 0;
+    Check->cycle_time += elapsed;
+
+    /* a failed slice abandons the cycle, the next begins at the cadence */
+    if (!NT_SUCCESS(Status))
+        statistics->failures++;
+    else if (!Complete) {
+        Check->in_progress = TRUE;
+        return;
+    }
+    else
+        statistics->cycles++;
+
+    statistics->last_cycle_time = Check->cycle_time;
+    Check->cycle_time = 0;
+    Check->in_progress = FALSE;
+    Check->next_due = End + Check->cadence;
+}
+
+/*
+ * Intended to be called from the heartbeat work item at PASSIVE_LEVEL. The
+ * lock is not held while a slice runs, so checks can be configured from an
+ * IOCTL without waiting on a slice.
+ */
+VOID
+SchedRunTick()
+{
+    PSCHED_SCHEDULER    scheduler = &g_Scheduler;
+    PSCHED_CHECK        check = NULL;
+    SCHED_SLICE_ROUTINE routine = NULL;
+    PVOID               context = NULL;
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    BOOLEAN             complete = FALSE;
+    UINT32              order[SCHED_CHECK_COUNT] = {0};
+    UINT32              count = 0;
+    UINT32              index = 0;
+    UINT64              now = 0;
+    UINT64              end = 0;
+    UINT64              deadline = 0;
+    UINT64              tick_deadline = 0;
+
+    if (!scheduler->active)
+        return;
+
+    if (InterlockedExchange(&scheduler->running, TRUE))
+        return;
+
+    now = KeQueryInterruptTime();
+
+    ImpKeAcquireGuardedMutex(&scheduler->lock);
+
+    tick_deadline = now + SCHED_US_TO_100NS(scheduler->tick_budget_us);
+
+    for (UINT32 id = 0; id < SCHED_CHECK_COUNT; id++) {
+        check = &scheduler->checks[id];
+
+        if (check->routine && (check->in_progress || now >= check->next_due))
+            order[count++] = id;
+    }
+
+    SchedpSortDueChecks(order, count);
+    ImpKeReleaseGuardedMutex(&scheduler->lock);
+
+    for (index = 0; index < count; index++) {
+        now = KeQueryInterruptTime();
+
+        if (now >= tick_deadline)
+            break;
+
+        check = &scheduler->checks[order[index]];
+
+        ImpKeAcquireGuardedMutex(&scheduler->lock);
+        routine = scheduler->active ? check->routine : NULL;
+        context = check->context;
+        deadline = now + min(SCHED_US_TO_100NS(check->slice_budget_us),
+                             tick_deadline - now);
+        ImpKeReleaseGuardedMutex(&scheduler->lock);
+
+        if (!routine)
+            continue;
+
+        complete = FALSE;
+        status = routine(deadline, context, &complete);
+        end = KeQueryInterruptTime();
+
+        if (!NT_SUCCESS(status))
+            DEBUG_WARNING("Scheduled check %lx failed: %x", order[index], status);
+
+        ImpKeAcquireGuardedMutex(&scheduler->lock);
+        SchedpRecordSlice(check, status, complete, now, end, deadline);
+        ImpKeReleaseGuardedMutex(&scheduler->lock);
+    }
+
+    /* checks that did not fit are aged, so they run ahead of their priority
+     * on a later tick */
+    if (index < count) {
+        ImpKeAcquireGuardedMutex(&scheduler->lock);
+
+        for (; index < count; index++) {
+            check = &scheduler->checks[order[index]];
+            check->age++;
+            check->statistics.deferred++;
+        }
+
+        ImpKeReleaseGuardedMutex(&scheduler->lock);
+    }
+
+    InterlockedExchange(&scheduler->running, FALSE);
+}
+
+NTSTATUS
+SchedQueryCheckStatistics(_In_ SHARED_STATE_OPERATION_ID Id,
+                          _Out_ PSCHED_CHECK_STATISTICS  Statistics)
+{
+    if ((UINT32)Id >= SCHED_CHECK_COUNT)
+        return STATUS_INVALID_PARAMETER;
+
+    ImpKeAcquireGuardedMutex(&g_Scheduler.lock);
+    *Statistics = g_Scheduler.checks[Id].statistics;
+    ImpKeReleaseGuardedMutex(&g_Scheduler.lock);
+
+    return STATUS_SUCCESS;
+}
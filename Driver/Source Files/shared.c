@@ -0,0 +1,239 @@
+#include "shared.h"
+
+#include "imports.h"
+#include "lib/stdlib.h"
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, SharedRingInitialise)
+#    pragma alloc_text(PAGE, SharedRingFree)
+#endif
+
+#define SHARED_RING_DRAIN_BATCH MAX_REPORTS_PER_IRP
+
+/* the data area is rounded down to a power of two */
+C_ASSERT((SHARED_REPORT_RING_DATA_SIZE & (SHARED_REPORT_RING_DATA_SIZE - 1)) ==
+         0);
+C_ASSERT(SHARED_REPORT_RING_DATA_SIZE >= SHARED_REPORT_RING_MIN_SIZE);
+
+FORCEINLINE
+STATIC
+UINT32
+SharedpRoundDownToPowerOfTwo(_In_ UINT32 Value)
+{
+    ULONG index = 0;
+
+    if (!Value)
+        return 0;
+
+    _BitScanReverse(&index, Value);
+    return 1ul << index;
+}
+
+FORCEINLINE
+STATIC
+UINT32
+SharedpGetRecordSize(_In_ UINT32 PacketLength)
+{
+    return (sizeof(SHARED_REPORT_RECORD) + PacketLength +
+            SHARED_REPORT_RECORD_ALIGNMENT - 1) &
+           ~(SHARED_REPORT_RECORD_ALIGNMENT - 1);
+}
+
+/*
+ * Must be called once the shared mapping has been created and before it is
+ * returned to user mode. If the mapping is too small to hold a ring, reports
+ * continue to be delivered via IRPs only.
+ */
+NTSTATUS
+SharedRingInitialise(_Inout_ PSHARED_MAPPING Mapping,
+                     _In_opt_ HANDLE         EventHandle)
+{
+    PAGED_CODE();
+
+    NTSTATUS            status = STATUS_UNSUCCESSFUL;
+    PSHARED_REPORT_RING ring = NULL;
+    UINT32              size = 0;
+
+    Mapping->ring = NULL;
+    Mapping->ring_size = 0;
+    Mapping->ring_tail = 0;
+    Mapping->ring_sequence = 0;
+    Mapping->ring_draining = FALSE;
+    Mapping->ring_event = NULL;
+
+    if (Mapping->size <
+        SHARED_REPORT_RING_OFFSET + sizeof(SHARED_REPORT_RING))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    size = SharedpRoundDownToPowerOfTwo(
+        (UINT32)(Mapping->size - SHARED_REPORT_RING_OFFSET -
+                 sizeof(SHARED_REPORT_RING)));
+
+    if (size < SHARED_REPORT_RING_MIN_SIZE)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    if (EventHandle) {
+        status = ImpObReferenceObjectByHandle(EventHandle,
+                                              EVENT_MODIFY_STATE,
+                                              *ExEventObjectType,
+                                              UserMode,
+                                              (PVOID*)&Mapping->ring_event,
+                                              NULL);
+
+        if (!NT_SUCCESS(status)) {
+            DEBUG_ERROR("ObReferenceObjectByHandle failed with status %x",
+                        status);
+            Mapping->ring_event = NULL;
+            return status;
+        }
+    }
+
+    ring = (PSHARED_REPORT_RING)((UINT64)Mapping->kernel_buffer +
+                                 SHARED_REPORT_RING_OFFSET);
+
+    RtlZeroMemory(ring, sizeof(SHARED_REPORT_RING));
+    ring->size = size;
+    ring->magic = SHARED_REPORT_RING_MAGIC;
+
+    Mapping->ring_size = size;
+    Mapping->ring = ring;
+
+    DEBUG_VERBOSE("Shared report ring initialised with size: %lx", size);
+    return STATUS_SUCCESS;
+}
+
+/* Must be called before the shared mapping is unmapped. */
+VOID
+SharedRingFree(_Inout_ PSHARED_MAPPING Mapping)
+{
+    PAGED_CODE();
+
+    Mapping->ring = NULL;
+
+    if (Mapping->ring_event) {
+        ImpObDereferenceObject(Mapping->ring_event);
+        Mapping->ring_event = NULL;
+    }
+}
+
+/*
+ * Copies an encrypted packet into the ring, the caller retains ownership of
+ * Packet. There must only ever be a single producer, which is guaranteed when
+ * called via SharedRingDrainReports since it holds ring_draining for the
+ * whole drain. Returns FALSE if the ring is full or user mode has corrupted
+ * the head it owns.
+ */
+BOOLEAN
+SharedRingWritePacket(_Inout_ PSHARED_MAPPING Mapping,
+                      _In_ PVOID              Packet,
+                      _In_ UINT32             PacketLength)
+{
+    PSHARED_REPORT_RING   ring = Mapping->ring;
+    PSHARED_REPORT_RECORD record = NULL;
+    UINT32                tail = Mapping->ring_tail;
+    UINT32                head = 0;
+    UINT32                used = 0;
+    UINT32                offset = 0;
+    UINT32                contiguous = 0;
+    UINT32                record_size = SharedpGetRecordSize(PacketLength);
+
+    if (!ring)
+        return FALSE;
+
+    if (record_size > Mapping->ring_size / 2 || record_size < PacketLength)
+        goto dropped;
+
+    /* head is owned by user mode, read it once and never trust it */
+    head = ring->head;
+    used = tail - head;
+
+    if (used > Mapping->ring_size)
+        goto dropped;
+
+    offset = tail & (Mapping->ring_size - 1);
+    contiguous = Mapping->ring_size - offset;
+
+    if (record_size > contiguous) {
+        if (used + contiguous + record_size > Mapping->ring_size)
+            goto dropped;
+
+        record = (PSHARED_REPORT_RECORD)&ring->data[offset];
+        record->length = contiguous - sizeof(SHARED_REPORT_RECORD);
+        record->type = SHARED_REPORT_RECORD_PADDING;
+        record->sequence = Mapping->ring_sequence;
+
+        tail += contiguous;
+        used += contiguous;
+        offset = 0;
+    }
+    else if (used + record_size > Mapping->ring_size) {
+        goto dropped;
+    }
+
+    record = (PSHARED_REPORT_RECORD)&ring->data[offset];
+    record->length = PacketLength;
+    record->type = SHARED_REPORT_RECORD_DATA;
+    record->sequence = Mapping->ring_sequence++;
+    IntCopyMemory(record + 1, Packet, PacketLength);
+
+    Mapping->ring_tail = tail + record_size;
+
+    /* publish the record only once it has been written */
+    InterlockedExchange((volatile LONG*)&ring->tail, (LONG)Mapping->ring_tail);
+    return TRUE;
+
+dropped:
+    InterlockedIncrement((volatile LONG*)&ring->dropped);
+    return FALSE;
+}
+
+/*
+ * Moves reports queued in Reports into the shared ring, freeing each report
+ * whether or not it fit. Returns the number of reports delivered by this
+ * caller. If another caller is already draining, the reports are left to that
+ * caller. Safe to call at IRQL <= DISPATCH_LEVEL since the mapping is backed
+ * by locked pages.
+ */
+UINT32
+SharedRingDrainReports(_Inout_ PSHARED_MAPPING Mapping,
+                       _In_ PRTL_RING          Reports)
+{
+    RTL_RING_ENTRY entries[SHARED_RING_DRAIN_BATCH] = {0};
+    UINT32         count = 0;
+    UINT32         delivered = 0;
+
+    if (!Mapping->ring || !Mapping->active)
+        return 0;
+
+    do {
+        /* popping and writing must both happen under the same claim, since
+         * the ring only serialises the pop and ring_tail is ours alone */
+        if (InterlockedCompareExchange(&Mapping->ring_draining, TRUE, FALSE))
+            break;
+
+        while ((count = RtlRingPopBatch(
+                    Reports, entries, SHARED_RING_DRAIN_BATCH)) != 0) {
+            for (UINT32 index = 0; index < count; index++) {
+                if (SharedRingWritePacket(Mapping,
+                                          entries[index].buffer,
+                                          entries[index].buffer_size))
+                    delivered++;
+
+                ImpExFreePoolWithTag(entries[index].buffer, REPORT_POOL_TAG);
+            }
+        }
+
+        InterlockedExchange(&Mapping->ring_draining, FALSE);
+
+        /*
+         * A report pushed after the loop above but before ring_draining was
+         * cleared was left to us by its caller, so check again.
+         */
+    } while (RtlRingCount(Reports));
+
+    if (delivered && Mapping->ring_event &&
+        InterlockedExchange((volatile LONG*)&Mapping->ring->waiting, FALSE))
+        KeSetEvent(Mapping->ring_event, IO_NO_INCREMENT, FALSE);
+
+    return delivered;
+}
@@ -0,0 +1,517 @@
+#include "stackwalk.h"
+
+#include "crypt.h"
+#include "imports.h"
+#include "io.h"
+#include "lib/stdlib.h"
+#include "modindex.h"
+#include "perf.h"
+#include "report.h"
+#include "types/types.h"
+
+/* bytes copied into the report from before the invalid address */
+#define STACKWALK_REPORT_COPY_OFFSET 0x50
+
+/* 1 millisecond in 100ns units */
+#define STACKWALK_NMI_POLL_INTERVAL (1ull * 1000 * 10)
+
+typedef struct _STACKWALK_INVALID_FRAME {
+    UINT64 address;
+    UINT64 kthread;
+
+} STACKWALK_INVALID_FRAME, *PSTACKWALK_INVALID_FRAME;
+
+/*
+ * Counts a capture against the group of the given generation, returning TRUE
+ * if it was the last of its group. Captures of a group that has since been
+ * abandoned are not counted.
+ */
+STATIC
+BOOLEAN
+StackwalkpCompleteCapture(_In_ PSTACKWALK_SCHEDULER Scheduler,
+                          _In_ UINT32               Generation)
+{
+    LONG64 remaining = 0;
+    LONG64 previous = ReadAcquire64(&Scheduler->remaining);
+
+    do {
+        remaining = previous;
+
+        if (STACKWALK_REMAINING_GENERATION(remaining) != Generation ||
+            !STACKWALK_REMAINING_COUNT(remaining))
+            return FALSE;
+
+        previous = InterlockedCompareExchange64(
+            &Scheduler->remaining, remaining - 1, remaining);
+    } while (previous != remaining);
+
+    return STACKWALK_REMAINING_COUNT(remaining) == 1;
+}
+
+STATIC
+VOID
+StackwalkpDpcRoutine(_In_ PKDPC     Dpc,
+                     _In_opt_ PVOID DeferredContext,
+                     _In_opt_ PVOID SystemArgument1,
+                     _In_opt_ PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    PSTACKWALK_SCHEDULER  scheduler = (PSTACKWALK_SCHEDULER)DeferredContext;
+    PSTACKWALK_CPU_BUFFER buffer =
+        &scheduler->buffers[(UINT32)(UINT64)SystemArgument1];
+    UINT32 generation = (UINT32)InterlockedExchange(&buffer->armed, 0);
+
+    if (!generation)
+        return;
+
+    buffer->kthread = (UINT64)KeGetCurrentThread();
+    buffer->frame_count = ImpRtlCaptureStackBackTrace(
+        0, STACKWALK_MAX_FRAMES, (PVOID*)buffer->frames, NULL);
+
+    if (StackwalkpCompleteCapture(scheduler, generation))
+        KeSetEvent(&scheduler->group_complete, IO_NO_INCREMENT, FALSE);
+}
+
+/*
+ * NMIs are received for reasons other than our own, so only processors armed
+ * as part of the group in flight are captured. Nothing here may wait or take
+ * a lock, so the scheduler polls remaining rather than waiting on the event.
+ */
+STATIC
+BOOLEAN
+StackwalkpNmiCallback(_In_opt_ PVOID Context, _In_ BOOLEAN Handled)
+{
+    PSTACKWALK_SCHEDULER  scheduler = (PSTACKWALK_SCHEDULER)Context;
+    PSTACKWALK_CPU_BUFFER buffer = NULL;
+    PMACHINE_FRAME        machine_frame = NULL;
+    UINT64                kpcr = 0;
+    UINT64                tss = 0;
+    UINT64                nmi_stack = 0;
+    UINT32                generation = 0;
+    UINT32                index = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (index >= scheduler->processor_count)
+        return Handled;
+
+    buffer = &scheduler->buffers[index];
+    generation = (UINT32)InterlockedExchange(&buffer->armed, 0);
+
+    if (!generation)
+        return Handled;
+
+    /* the interrupted context is pushed to the top of the NMI stack */
+    kpcr = __readmsr(IA32_GS_BASE);
+    tss = *(UINT64*)(kpcr + KPCR_TSS_BASE_OFFSET);
+    nmi_stack = *(UINT64*)(tss + TSS_IST_OFFSET);
+    machine_frame = (PMACHINE_FRAME)(nmi_stack - sizeof(MACHINE_FRAME));
+
+    buffer->kthread = (UINT64)KeGetCurrentThread();
+    buffer->frames[0] = machine_frame->rip;
+    buffer->frame_count = 1;
+
+    StackwalkpCompleteCapture(scheduler, generation);
+    return TRUE;
+}
+
+NTSTATUS
+StackwalkInitialiseScheduler(_In_ UINT32                 GroupSize,
+                             _Out_ PSTACKWALK_SCHEDULER* Scheduler)
+{
+    NTSTATUS             status = STATUS_UNSUCCESSFUL;
+    PSTACKWALK_SCHEDULER scheduler = NULL;
+    PROCESSOR_NUMBER     number = {0};
+    UINT32               count = 0;
+
+    *Scheduler = NULL;
+    count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    scheduler = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, sizeof(STACKWALK_SCHEDULER), POOL_TAG_STACKWALK);
+
+    if (!scheduler)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    scheduler->processor_count = count;
+    scheduler->group_size = GroupSize ? GroupSize : STACKWALK_DEFAULT_GROUP_SIZE;
+
+    scheduler->dpcs = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED, count * sizeof(KDPC), POOL_TAG_DPC);
+
+    if (!scheduler->dpcs) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    scheduler->buffers = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                            count * sizeof(STACKWALK_CPU_BUFFER),
+                                            STACK_FRAMES_POOL);
+
+    if (!scheduler->buffers) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    for (UINT32 index = 0; index < count; index++) {
+        status = KeGetProcessorNumberFromIndex(index, &number);
+
+        if (!NT_SUCCESS(status)) {
+            DEBUG_ERROR("KeGetProcessorNumberFromIndex: %x", status);
+            goto end;
+        }
+
+        KeInitializeDpc(&scheduler->dpcs[index], StackwalkpDpcRoutine, scheduler);
+        KeSetImportanceDpc(&scheduler->dpcs[index], HighImportance);
+
+        status = KeSetTargetProcessorDpcEx(&scheduler->dpcs[index], &number);
+
+        if (!NT_SUCCESS(status)) {
+            DEBUG_ERROR("KeSetTargetProcessorDpcEx: %x", status);
+            goto end;
+        }
+    }
+
+    KeInitializeEvent(&scheduler->group_complete, NotificationEvent, FALSE);
+    ImpKeInitializeGuardedMutex(&scheduler->lock);
+
+    *Scheduler = scheduler;
+    status = STATUS_SUCCESS;
+
+end:
+    if (!NT_SUCCESS(status))
+        StackwalkFreeScheduler(scheduler);
+
+    return status;
+}
+
+/*
+ * A DPC signals its group complete before it returns, so one may still be
+ * running after the run that queued it. To be called at PASSIVE_LEVEL.
+ */
+VOID
+StackwalkFreeScheduler(_In_ PSTACKWALK_SCHEDULER Scheduler)
+{
+    KeFlushQueuedDpcs();
+
+    if (Scheduler->dpcs)
+        ImpExFreePoolWithTag(Scheduler->dpcs, POOL_TAG_DPC);
+
+    if (Scheduler->buffers)
+        ImpExFreePoolWithTag(Scheduler->buffers, STACK_FRAMES_POOL);
+
+    ImpExFreePoolWithTag(Scheduler, POOL_TAG_STACKWALK);
+}
+
+/* Returns FALSE if the group did not complete within the timeout. */
+STATIC
+BOOLEAN
+StackwalkpRunGroup(_In_ PSTACKWALK_SCHEDULER Scheduler,
+                   _In_ STACKWALK_MODE       Mode,
+                   _In_ UINT32               First,
+                   _In_ UINT32               Last)
+{
+    NTSTATUS      status = STATUS_UNSUCCESSFUL;
+    KAFFINITY_EX  affinity = {0};
+    LARGE_INTEGER timeout = {0};
+    LARGE_INTEGER interval = {.QuadPart =
+                                  RELATIVE(STACKWALK_NMI_POLL_INTERVAL)};
+    UINT64        deadline = 0;
+    UINT64        now = 0;
+    UINT32        generation = 0;
+
+    if (!++Scheduler->generation)
+        Scheduler->generation = 1;
+
+    generation = Scheduler->generation;
+
+    KeClearEvent(&Scheduler->group_complete);
+    InterlockedExchange64(&Scheduler->remaining,
+                          STACKWALK_REMAINING(generation, Last - First));
+
+    for (UINT32 index = First; index < Last; index++) {
+        Scheduler->buffers[index].frame_count = 0;
+        InterlockedExchange(&Scheduler->buffers[index].armed, (LONG)generation);
+    }
+
+    deadline = KeQueryInterruptTime() + STACKWALK_GROUP_TIMEOUT;
+
+    if (Mode == StackwalkModeDpc) {
+        for (UINT32 index = First; index < Last; index++)
+            KeInsertQueueDpc(
+                &Scheduler->dpcs[index], (PVOID)(UINT64)index, NULL);
+
+        /* the last capture of an abandoned group may still set the event */
+        while (STACKWALK_REMAINING_COUNT(
+            ReadAcquire64(&Scheduler->remaining))) {
+            now = KeQueryInterruptTime();
+
+            if (now >= deadline)
+                return FALSE;
+
+            timeout.QuadPart = RELATIVE(deadline - now);
+
+            status = ImpKeWaitForSingleObject(&Scheduler->group_complete,
+                                              Executive,
+                                              KernelMode,
+                                              FALSE,
+                                              &timeout);
+
+            if (status != STATUS_SUCCESS)
+                return FALSE;
+
+            KeClearEvent(&Scheduler->group_complete);
+        }
+
+        return TRUE;
+    }
+
+    ImpKeInitializeAffinityEx(&affinity);
+
+    for (UINT32 index = First; index < Last; index++)
+        ImpKeAddProcessorAffinityEx(&affinity, index);
+
+    HalSendNMI(&affinity);
+
+    while (STACKWALK_REMAINING_COUNT(ReadAcquire64(&Scheduler->remaining))) {
+        if (KeQueryInterruptTime() > deadline)
+            return FALSE;
+
+        ImpKeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+
+    return TRUE;
+}
+
+STATIC
+VOID
+StackwalkpScheduleReports(_In_ STACKWALK_MODE           Mode,
+                          _In_ PSTACKWALK_INVALID_FRAME Frames,
+                          _In_ UINT32                   FrameCount,
+                          _In_ BOOLEAN                  NmisMissed)
+{
+    NTSTATUS              status = STATUS_UNSUCCESSFUL;
+    PVOID                 reports[STACKWALK_MAX_REPORTS_PER_SCAN + 1] = {0};
+    UINT32                lengths[STACKWALK_MAX_REPORTS_PER_SCAN + 1] = {0};
+    UINT32                count = 0;
+    PDPC_STACKWALK_REPORT dpc_report = NULL;
+    PNMI_CALLBACK_FAILURE nmi_report = NULL;
+    MM_COPY_ADDRESS       address = {0};
+    SIZE_T                bytes = 0;
+    UINT32                dpc_size =
+        CryptRequestRequiredBufferLength(sizeof(DPC_STACKWALK_REPORT));
+    UINT32 nmi_size =
+        CryptRequestRequiredBufferLength(sizeof(NMI_CALLBACK_FAILURE));
+
+    for (UINT32 index = 0; index < FrameCount; index++) {
+        if (Mode == StackwalkModeDpc) {
+            dpc_report = ImpExAllocatePool2(
+                POOL_FLAG_NON_PAGED, dpc_size, REPORT_POOL_TAG);
+
+            if (!dpc_report)
+                break;
+
+            INIT_REPORT_PACKET(dpc_report, REPORT_DPC_STACKWALK, 0);
+
+            dpc_report->kthread_address = Frames[index].kthread;
+            dpc_report->invalid_rip = Frames[index].address;
+
+            address.VirtualAddress = (PVOID)(Frames[index].address -
+                                             STACKWALK_REPORT_COPY_OFFSET);
+
+            ImpMmCopyMemory(dpc_report->driver,
+                            address,
+                            APC_STACKWALK_BUFFER_SIZE,
+                            MM_COPY_MEMORY_VIRTUAL,
+                            &bytes);
+
+            reports[count] = dpc_report;
+            lengths[count++] = dpc_size;
+        }
+        else {
+            nmi_report = ImpExAllocatePool2(
+                POOL_FLAG_NON_PAGED, nmi_size, REPORT_POOL_TAG);
+
+            if (!nmi_report)
+                break;
+
+            INIT_REPORT_PACKET(nmi_report, REPORT_NMI_CALLBACK_FAILURE, 0);
+
+            nmi_report->kthread_address = Frames[index].kthread;
+            nmi_report->invalid_rip = Frames[index].address;
+            nmi_report->were_nmis_disabled = FALSE;
+
+            reports[count] = nmi_report;
+            lengths[count++] = nmi_size;
+        }
+    }
+
+    /* a single report covers every processor that never received the NMI */
+    if (NmisMissed) {
+        nmi_report =
+            ImpExAllocatePool2(POOL_FLAG_NON_PAGED, nmi_size, REPORT_POOL_TAG);
+
+        if (nmi_report) {
+            INIT_REPORT_PACKET(nmi_report, REPORT_NMI_CALLBACK_FAILURE, 0);
+            nmi_report->were_nmis_disabled = TRUE;
+            reports[count] = nmi_report;
+            lengths[count++] = nmi_size;
+        }
+    }
+
+    if (!count)
+        return;
+
+    status = CryptEncryptBufferBatch(reports, lengths, count);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("CryptEncryptBufferBatch: %x", status);
+
+        for (UINT32 index = 0; index < count; index++)
+            ImpExFreePoolWithTag(reports[index], REPORT_POOL_TAG);
+
+        return;
+    }
+
+    for (UINT32 index = 0; index < count; index++)
+        IrpQueueSchedulePacket(reports[index], lengths[index]);
+}
+
+/*
+ * Resolves every captured frame against the module table, collecting each
+ * invalid address once. Addresses are deduplicated across processors before
+ * being passed through the report coalescer.
+ */
+STATIC
+UINT32
+StackwalkpResolveFrames(_In_ PSTACKWALK_SCHEDULER     Scheduler,
+                        _In_ PMODULE_INDEX_SNAPSHOT   Snapshot,
+                        _In_ STACKWALK_MODE           Mode,
+                        _Out_ PSTACKWALK_INVALID_FRAME Frames)
+{
+    PSTACKWALK_CPU_BUFFER buffer = NULL;
+    UINT64                address = 0;
+    UINT32                count = 0;
+    UINT32                frame_count = 0;
+    UINT32                index = 0;
+
+    for (UINT32 cpu = 0; cpu < Scheduler->processor_count; cpu++) {
+        buffer = &Scheduler->buffers[cpu];
+        frame_count = min(buffer->frame_count, STACKWALK_MAX_FRAMES);
+
+        InterlockedExchangeAdd64(&Scheduler->frames, frame_count);
+
+        for (UINT32 frame = 0; frame < frame_count; frame++) {
+            address = buffer->frames[frame];
+
+            /* an NMI can equally interrupt user mode */
+            if (address <= WINDOWS_USERMODE_MAX_ADDRESS)
+                continue;
+
+            if (ModuleIndexSnapshotFindRange(Snapshot, address))
+                continue;
+
+            InterlockedIncrement64(&Scheduler->invalid_frames);
+
+            for (index = 0; index < count; index++) {
+                if (Frames[index].address == address)
+                    break;
+            }
+
+            if (index < count || count == STACKWALK_MAX_REPORTS_PER_SCAN)
+                continue;
+
+            if (!ReportShouldSchedule(Mode == StackwalkModeDpc
+                                          ? REPORT_DPC_STACKWALK
+                                          : REPORT_NMI_CALLBACK_FAILURE,
+                                      0,
+                                      address,
+                                      0))
+                continue;
+
+            Frames[count].address = address;
+            Frames[count].kthread = buffer->kthread;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Captures the stack of every logical processor, group_size processors at a
+ * time, then resolves and reports the frames once all groups have completed.
+ * Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS
+StackwalkRunScan(_In_ PSTACKWALK_SCHEDULER Scheduler,
+                 _In_ STACKWALK_MODE       Mode)
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    PMODULE_INDEX_SNAPSHOT  snapshot = NULL;
+    MODULE_INDEX_READ_TOKEN token = 0;
+    PVOID                   nmi_handle = NULL;
+    BOOLEAN                 timed_out = FALSE;
+    BOOLEAN                 nmis_missed = FALSE;
+    UINT32                  last = 0;
+    UINT32                  count = 0;
+    UINT64                  start = PerfBegin();
+    STACKWALK_INVALID_FRAME frames[STACKWALK_MAX_REPORTS_PER_SCAN] = {0};
+
+    ImpKeAcquireGuardedMutex(&Scheduler->lock);
+
+    if (Mode == StackwalkModeNmi) {
+        nmi_handle = ImpKeRegisterNmiCallback(StackwalkpNmiCallback, Scheduler);
+
+        if (!nmi_handle) {
+            DEBUG_ERROR("KeRegisterNmiCallback failed with no status.");
+            status = STATUS_UNSUCCESSFUL;
+            goto end;
+        }
+    }
+
+    for (UINT32 first = 0; first < Scheduler->processor_count;
+         first += Scheduler->group_size) {
+        last = min(first + Scheduler->group_size, Scheduler->processor_count);
+
+        if (StackwalkpRunGroup(Scheduler, Mode, first, last))
+            continue;
+
+        InterlockedIncrement64(&Scheduler->timeouts);
+        timed_out = TRUE;
+
+        /* disarm those yet to start, a capture already under way is no
+         * longer counted once the next group takes a new generation */
+        for (UINT32 index = first; index < last; index++) {
+            if (InterlockedExchange(&Scheduler->buffers[index].armed, 0) &&
+                Mode == StackwalkModeNmi)
+                nmis_missed = TRUE;
+        }
+    }
+
+    /* no capture may still be writing to the buffers once resolved */
+    if (nmi_handle)
+        ImpKeDeregisterNmiCallback(nmi_handle);
+    else if (timed_out)
+        KeFlushQueuedDpcs();
+
+    snapshot = ModuleIndexAcquireSnapshot(&token);
+
+    if (snapshot)
+        count = StackwalkpResolveFrames(Scheduler, snapshot, Mode, frames);
+    else
+        DEBUG_WARNING("Module index inactive, stack frames not resolved.");
+
+    ModuleIndexReleaseSnapshot(token);
+    StackwalkpScheduleReports(Mode, frames, count, nmis_missed);
+
+    InterlockedIncrement64(&Scheduler->scans);
+
+end:
+    ImpKeReleaseGuardedMutex(&Scheduler->lock);
+    PerfRecord(Mode == StackwalkModeNmi ? PerfCounterRunNmiCallbacks
+                                        : PerfCounterInitiateDpcStackwalk,
+               start,
+               0);
+    return status;
+}
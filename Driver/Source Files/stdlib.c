@@ -1,15 +1,181 @@
 #include "stdlib.h"
 
+#include <intrin.h>
+#include <immintrin.h>
+
+/*
+ * SSE2 is architectural on x64 and the kernel preserves XMM state for us, so
+ * the SSE2 paths are used unconditionally. AVX2 requires the caller to save the
+ * extended state of the processor, which costs enough that it is only done for
+ * buffers of at least INT_AVX2_THRESHOLD bytes, and only when both the CPU and
+ * the OS (via XCR0) support it. KeSaveExtendedProcessorState requires IRQL <=
+ * DISPATCH_LEVEL, above which we fall back to SSE2.
+ */
+#define INT_AVX2_THRESHOLD 0x1000
+
+#define INT_SIMD_FEATURES_UNINITIALISED 0xFFFFFFFF
+#define INT_SIMD_FEATURE_AVX2           0x1
+#define INT_SIMD_FEATURE_AES_NI         0x2
+
+#define CPUID_LEAF_1_ECX_AES_NI  (1 << 25)
+#define CPUID_LEAF_1_ECX_OSXSAVE (1 << 27)
+#define CPUID_LEAF_1_ECX_AVX     (1 << 28)
+#define CPUID_LEAF_7_EBX_AVX2    (1 << 5)
+#define XCR0_SSE_AVX_STATE       0x6
+
+STATIC volatile LONG g_SimdFeatures = INT_SIMD_FEATURES_UNINITIALISED;
+
+/* Racing initialisations compute the same value, so no locking is needed. */
+STATIC
+UINT32
+IntpQuerySimdFeatures()
+{
+    INT32  cpuid[4] = {0};
+    UINT32 features = 0;
+
+    if (g_SimdFeatures != INT_SIMD_FEATURES_UNINITIALISED)
+        return (UINT32)g_SimdFeatures;
+
+    __cpuid(cpuid, 1);
+
+    if (cpuid[2] & CPUID_LEAF_1_ECX_AES_NI)
+        features |= INT_SIMD_FEATURE_AES_NI;
+
+    if ((cpuid[2] & CPUID_LEAF_1_ECX_OSXSAVE) &&
+        (cpuid[2] & CPUID_LEAF_1_ECX_AVX) &&
+        (_xgetbv(0) & XCR0_SSE_AVX_STATE) == XCR0_SSE_AVX_STATE) {
+        __cpuidex(cpuid, 7, 0);
+
+        if (cpuid[1] & CPUID_LEAF_7_EBX_AVX2)
+            features |= INT_SIMD_FEATURE_AVX2;
+    }
+
+    InterlockedExchange(&g_SimdFeatures, (LONG)features);
+    return features;
+}
+
+/* AES-NI operates on XMM registers only, so needs no state to be saved. */
+BOOLEAN
+IntIsAesNiSupported()
+{
+    return IntpQuerySimdFeatures() & INT_SIMD_FEATURE_AES_NI ? TRUE : FALSE;
+}
+
+/* On success the caller must call IntEndAvx2 once it is done with AVX. */
+BOOLEAN
+IntBeginAvx2(_In_ SIZE_T Length, _Out_ PXSTATE_SAVE State)
+{
+    if (Length < INT_AVX2_THRESHOLD)
+        return FALSE;
+
+    if (!(IntpQuerySimdFeatures() & INT_SIMD_FEATURE_AVX2))
+        return FALSE;
+
+    if (KeGetCurrentIrql() > DISPATCH_LEVEL)
+        return FALSE;
+
+    return NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, State))
+               ? TRUE
+               : FALSE;
+}
+
+VOID
+IntEndAvx2(_In_ PXSTATE_SAVE State)
+{
+    /* leave the upper halves clean for any following SSE code */
+    _mm256_zeroupper();
+    KeRestoreExtendedProcessorState(State);
+}
+
+/* Returns the number of bytes copied, a multiple of 128. */
+STATIC
+SIZE_T
+IntpCopyMemoryAvx2(_In_ PUCHAR Destination,
+                   _In_ PUCHAR Source,
+                   _In_ SIZE_T Length)
+{
+    SIZE_T  index = 0;
+    __m256i block_1;
+    __m256i block_2;
+    __m256i block_3;
+    __m256i block_4;
+
+    for (; index + 128 <= Length; index += 128) {
+        block_1 = _mm256_loadu_si256((__m256i*)(Source + index));
+        block_2 = _mm256_loadu_si256((__m256i*)(Source + index + 32));
+        block_3 = _mm256_loadu_si256((__m256i*)(Source + index + 64));
+        block_4 = _mm256_loadu_si256((__m256i*)(Source + index + 96));
+        _mm256_storeu_si256((__m256i*)(Destination + index), block_1);
+        _mm256_storeu_si256((__m256i*)(Destination + index + 32), block_2);
+        _mm256_storeu_si256((__m256i*)(Destination + index + 64), block_3);
+        _mm256_storeu_si256((__m256i*)(Destination + index + 96), block_4);
+    }
+
+    return index;
+}
+
+/*
+ * The source and destination must not overlap, as with the original byte
+ * loop which would also have corrupted an overlapping forward copy.
+ */
 VOID
 IntCopyMemory(_In_ PVOID Destination, _In_ PVOID Source, _In_ SIZE_T Length)
 {
-    PUCHAR dest = (PUCHAR)Destination;
-    PUCHAR src = (PUCHAR)Source;
+    PUCHAR      dest = (PUCHAR)Destination;
+    PUCHAR      src = (PUCHAR)Source;
+    SIZE_T      index = 0;
+    XSTATE_SAVE state = {0};
+    __m128i     block_1;
+    __m128i     block_2;
+    __m128i     block_3;
+    __m128i     block_4;
 
-    for (SIZE_T index = 0; index < Length; index++)
+    if (IntBeginAvx2(Length, &state)) {
+        index = IntpCopyMemoryAvx2(dest, src, Length);
+        IntEndAvx2(&state);
+    }
+
+    for (; index + 64 <= Length; index += 64) {
+        block_1 = _mm_loadu_si128((__m128i*)(src + index));
+        block_2 = _mm_loadu_si128((__m128i*)(src + index + 16));
+        block_3 = _mm_loadu_si128((__m128i*)(src + index + 32));
+        block_4 = _mm_loadu_si128((__m128i*)(src + index + 48));
+        _mm_storeu_si128((__m128i*)(dest + index), block_1);
+        _mm_storeu_si128((__m128i*)(dest + index + 16), block_2);
+        _mm_storeu_si128((__m128i*)(dest + index + 32), block_3);
+        _mm_storeu_si128((__m128i*)(dest + index + 48), block_4);
+    }
+
+    for (; index + 16 <= Length; index += 16)
+        _mm_storeu_si128((__m128i*)(dest + index),
+                         _mm_loadu_si128((__m128i*)(src + index)));
+
+    for (; index < Length; index++)
         dest[index] = src[index];
 }
 
+/* Too short to be worth saving the AVX state for, only SSE is used. */
+VOID
+IntZeroMemory(_Out_ PVOID Destination, _In_ SIZE_T Length)
+{
+    PUCHAR  dest = (PUCHAR)Destination;
+    SIZE_T  index = 0;
+    __m128i zero = _mm_setzero_si128();
+
+    for (; index + 64 <= Length; index += 64) {
+        _mm_storeu_si128((__m128i*)(dest + index), zero);
+        _mm_storeu_si128((__m128i*)(dest + index + 16), zero);
+        _mm_storeu_si128((__m128i*)(dest + index + 32), zero);
+        _mm_storeu_si128((__m128i*)(dest + index + 48), zero);
+    }
+
+    for (; index + 16 <= Length; index += 16)
+        _mm_storeu_si128((__m128i*)(dest + index), zero);
+
+    for (; index < Length; index++)
+        dest[index] = 0;
+}
+
 SIZE_T
 IntStringLength(_In_ PCHAR String, _In_ SIZE_T MaxLength)
 {
@@ -21,40 +187,139 @@ IntStringLength(_In_ PCHAR String, _In_ SIZE_T MaxLength)
     return length;
 }
 
+/*
+ * Compares in 32 byte blocks. Returns TRUE with Index set to the offset of the
+ * first mismatching byte, otherwise FALSE with Index set to the number of
+ * bytes compared.
+ */
+STATIC
+BOOLEAN
+IntpCompareMemoryAvx2(_In_ PUCHAR   Source1,
+                      _In_ PUCHAR   Source2,
+                      _In_ SIZE_T   Length,
+                      _Out_ PSIZE_T Index)
+{
+    SIZE_T  index = 0;
+    UINT32  mask = 0;
+    ULONG   bit = 0;
+    BOOLEAN mismatch = FALSE;
+
+    for (; index + 32 <= Length; index += 32) {
+        mask = (UINT32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((__m256i*)(Source1 + index)),
+            _mm256_loadu_si256((__m256i*)(Source2 + index))));
+
+        if (mask != 0xFFFFFFFF) {
+            _BitScanForward(&bit, ~mask);
+            index += bit;
+            mismatch = TRUE;
+            break;
+        }
+    }
+
+    *Index = index;
+    return mismatch;
+}
+
+/* Returns the offset of the first mismatching byte, or Length if equal. */
 SIZE_T
 IntCompareMemory(_In_ PVOID Source1, _In_ PVOID Source2, _In_ SIZE_T Length)
 {
-    PUCHAR src1 = (PUCHAR)Source1;
-    PUCHAR src2 = (PUCHAR)Source2;
+    PUCHAR      src1 = (PUCHAR)Source1;
+    PUCHAR      src2 = (PUCHAR)Source2;
+    SIZE_T      index = 0;
+    UINT32      mask = 0;
+    ULONG       bit = 0;
+    BOOLEAN     mismatch = FALSE;
+    XSTATE_SAVE state = {0};
+
+    if (IntBeginAvx2(Length, &state)) {
+        mismatch = IntpCompareMemoryAvx2(src1, src2, Length, &index);
+        IntEndAvx2(&state);
+
+        if (mismatch)
+            return index;
+    }
+
+    for (; index + 16 <= Length; index += 16) {
+        mask = (UINT32)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(src1 + index)),
+                           _mm_loadu_si128((__m128i*)(src2 + index))));
+
+        if (mask != 0xFFFF) {
+            _BitScanForward(&bit, ~mask);
+            return index + bit;
+        }
+    }
 
-    for (SIZE_T i = 0; i < Length; i++) {
-        if (src1[i] != src2[i])
-            return i;
+    for (; index < Length; index++) {
+        if (src1[index] != src2[index])
+            return index;
     }
 
     return Length;
 }
 
+/*
+ * Strings are scanned in 16 byte aligned blocks. An aligned load never spans a
+ * page boundary, so reading past the terminator within a block cannot fault
+ * even though those bytes are not part of the string. Each block yields a
+ * mask of positions holding the first character of String2, which are then
+ * verified bytewise.
+ */
 PCHAR
 IntFindSubstring(_In_ PCHAR String1, _In_ PCHAR String2)
 {
+    PCHAR   block = NULL;
+    PCHAR   candidate = NULL;
+    PCHAR   p1 = NULL;
+    PCHAR   p2 = NULL;
+    UINT32  offset = 0;
+    UINT32  zero_mask = 0;
+    UINT32  first_mask = 0;
+    ULONG   bit = 0;
+    __m128i zero = _mm_setzero_si128();
+    __m128i first = _mm_set1_epi8(*String2);
+    __m128i data;
+
     if (*String2 == '\0')
         return String1;
 
-    for (PCHAR s1 = String1; *s1 != '\0'; s1++) {
-        PCHAR p1 = s1;
-        PCHAR p2 = String2;
+    offset = (UINT32)((UINT64)String1 & 15);
+    block = String1 - offset;
+
+    for (;; block += 16, offset = 0) {
+        data = _mm_load_si128((__m128i*)block);
+        zero_mask = (UINT32)_mm_movemask_epi8(_mm_cmpeq_epi8(data, zero));
+        first_mask = (UINT32)_mm_movemask_epi8(_mm_cmpeq_epi8(data, first));
+
+        /* discard bytes preceding the string, and those after the end */
+        zero_mask &= 0xFFFFul << offset;
+        first_mask &= 0xFFFFul << offset;
+
+        if (zero_mask)
+            first_mask &= (zero_mask & (0 - zero_mask)) - 1;
 
-        while (*p1 != '\0' && *p2 != '\0' && *p1 == *p2) {
-            p1++;
-            p2++;
+        while (first_mask) {
+            _BitScanForward(&bit, first_mask);
+            first_mask &= first_mask - 1;
+
+            candidate = block + bit;
+            p1 = candidate + 1;
+            p2 = String2 + 1;
+
+            while (*p2 != '\0' && *p1 == *p2) {
+                p1++;
+                p2++;
+            }
+
+            if (*p2 == '\0')
+                return candidate;
         }
 
-        if (*p2 == '\0')
-            return s1;
+        if (zero_mask)
+            return NULL;
     }
-
-    return NULL;
 }
 
 INT32
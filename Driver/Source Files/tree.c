@@ -1,11 +1,13 @@
 #include "tree.h"
 
 #include "../lib/stdlib.h"
+#include "../perf.h"
 
 /*
- * Basic red-black tree implementation. Currently, the enumeration routines are
- * recursive, which may not be the best idea given the environment this is meant
- * for (kernel mode). We can always fix that up later though :).
+ * Basic red-black tree implementation. Since kernel stacks are small, none of
+ * the traversal routines are recursive. Enumeration, printing and teardown all
+ * walk the tree using the parent pointers stored in each node, meaning they
+ * need a constant amount of stack space regardless of how many nodes there are.
  *
  * Example of a Red-Black Tree:
  *
@@ -92,6 +94,7 @@ RtlRbTreePrintCurrentStatistics(_In_ PRB_TREE Tree)
     DEBUG_VERBOSE("Node count: %lx", Tree->node_count);
     DEBUG_VERBOSE("Insertion count: %lx", Tree->insertion_count);
     DEBUG_VERBOSE("Deletion count: %lx", Tree->deletion_count);
+    DEBUG_VERBOSE("Contention count: %lx", Tree->contention_count);
 }
 
 /**
@@ -112,6 +115,11 @@ RtlRbTreePrintCurrentStatistics(_In_ PRB_TREE Tree)
  * will be of size: sizeof(THREAD_LIST_OBJECT) + sizeof(RB_TREE_NODE). This is
  * also this size the lookaside list pools will be set to.
  *
+ * > `EX_PUSH_LOCK lock`:
+ *   - Protects the tree. Routines that only read the tree (lookups and
+ *     enumerations) acquire it shared, whereas insertions and deletions
+ *     acquire it exclusively.
+ *
  * > `LOOKASIDE_LIST_EX pool`:
  *   - This is a lookaside list that provides a fast, efficient way to allocate
  *     and free fixed-size blocks of memory for the tree nodes. The size of each
@@ -140,11 +148,13 @@ RtlRbTreeCreate(
         return status;
 
     Tree->compare = Compare;
+    Tree->object_size = ObjectSize;
     Tree->deletion_count = 0;
     Tree->insertion_count = 0;
     Tree->node_count = 0;
+    Tree->contention_count = 0;
 
-    KeInitializeGuardedMutex(&Tree->lock);
+    ExInitializePushLock(&Tree->lock);
 
     return STATUS_SUCCESS;
 }
@@ -322,8 +332,9 @@ RtlpRbTreeFixupInsert(_In_ PRB_TREE Tree, _In_ PRB_TREE_NODE Node)
  *                 \
  *                (Right)
  */
+STATIC
 PVOID
-RtlRbTreeInsertNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
+RtlpRbTreeInsertNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
 {
     UINT32 result = 0;
     PRB_TREE_NODE node = NULL;
@@ -377,6 +388,16 @@ RtlRbTreeInsertNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
     return node->object;
 }
 
+PVOID
+RtlRbTreeInsertNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
+{
+    UINT64 start = PerfBegin();
+    PVOID object = RtlpRbTreeInsertNode(Tree, Key);
+
+    PerfRecord(PerfCounterRbTreeInsert, start, 0);
+    return object;
+}
+
 /*
  * ASSUMES LOCK IS HELD!
  *
@@ -408,6 +429,39 @@ RtlpRbTreeMinimum(_In_ PRB_TREE_NODE Node)
     return Node;
 }
 
+/*
+ * ASSUMES LOCK IS HELD!
+ *
+ * Returns the in-order successor of the given node, or NULL if the node is the
+ * right-most node. If the node has a right subtree, the successor is the
+ * minimum of that subtree. Otherwise we walk up the parent pointers until we
+ * move up from a left child, that parent is then the successor.
+ *
+ *        (Parent)            <- successor of (Node)
+ *        /
+ *   (Left)
+ *        \
+ *        (Node)
+ */
+STATIC
+PRB_TREE_NODE
+RtlpRbTreeSuccessor(_In_ PRB_TREE_NODE Node)
+{
+    PRB_TREE_NODE parent = NULL;
+
+    if (Node->right)
+        return RtlpRbTreeMinimum(Node->right);
+
+    parent = Node->parent;
+
+    while (parent && Node == parent->right) {
+        Node = parent;
+        parent = parent->parent;
+    }
+
+    return parent;
+}
+
 /*
  * ASSUMES LOCK IS HELD!
  *
@@ -595,8 +649,9 @@ RtlpRbTreeFindNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
  * suitable successor or child, and ensuring the Red-Black Tree properties are
  * maintained.
  */
+STATIC
 VOID
-RtlRbTreeDeleteNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
+RtlpRbTreeDeleteNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
 {
     PRB_TREE_NODE target = NULL;
     PRB_TREE_NODE child = NULL;
@@ -649,11 +704,25 @@ RtlRbTreeDeleteNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
     RtlpRbTreeDecrementNodeCount(Tree);
 }
 
-/* Public API that is used to find the node object for an associated key. Should
+VOID
+RtlRbTreeDeleteNode(_In_ PRB_TREE Tree, _In_ PVOID Key)
+{
+    UINT64 start = PerfBegin();
+
+    RtlpRbTreeDeleteNode(Tree, Key);
+    PerfRecord(PerfCounterRbTreeDelete, start, 0);
+}
+
+/*
+ * ASSUMES LOCK IS HELD! Callers only performing a lookup should acquire the
+ * lock shared via RtlRbTreeAcquireLockShared.
+ *
+ * Public API that is used to find the node object for an associated key. Should
  * be used externally when wanting to find an object with a key value. If you
  * are wanting to get the node itself, use the RtlpRbTreeFindNode routine. */
+STATIC
 PVOID
-RtlRbTreeFindNodeObject(_In_ PRB_TREE Tree, _In_ PVOID Key)
+RtlpRbTreeFindNodeObject(_In_ PRB_TREE Tree, _In_ PVOID Key)
 {
     INT32 result = 0;
     PRB_TREE_NODE current = Tree->root;
@@ -672,76 +741,356 @@ RtlRbTreeFindNodeObject(_In_ PRB_TREE Tree, _In_ PVOID Key)
     return NULL;
 }
 
-STATIC
-VOID
-RtlpRbTreeEnumerate(
-    _In_ PRB_TREE_NODE Node,
-    _In_ RB_ENUM_CALLBACK Callback,
-    _In_opt_ PVOID Context)
+PVOID
+RtlRbTreeFindNodeObject(_In_ PRB_TREE Tree, _In_ PVOID Key)
 {
-    if (Node == NULL)
-        return;
+    UINT64 start = PerfBegin();
+    PVOID object = RtlpRbTreeFindNodeObject(Tree, Key);
+
+    PerfRecord(PerfCounterRbTreeFind, start, 0);
+    return object;
+}
+
+/*
+ * ASSUMES LOCK IS HELD!
+ *
+ * Positions the iterator at the left-most node and returns its object, or NULL
+ * if the tree is empty.
+ */
+PVOID
+RtlRbTreeIteratorBegin(_In_ PRB_TREE Tree, _Out_ PRB_TREE_ITERATOR Iterator)
+{
+    Iterator->tree = Tree;
+    Iterator->current = Tree->root ? RtlpRbTreeMinimum(Tree->root) : NULL;
+
+    return Iterator->current ? Iterator->current->object : NULL;
+}
 
-    RtlpRbTreeEnumerate(Node->left, Callback, Context);
-    Callback(Node->object, Context);
-    RtlpRbTreeEnumerate(Node->right, Callback, Context);
+/*
+ * ASSUMES LOCK IS HELD!
+ *
+ * Advances the iterator to the next node and returns its object, or NULL once
+ * every node has been visited.
+ */
+PVOID
+RtlRbTreeIteratorNext(_Inout_ PRB_TREE_ITERATOR Iterator)
+{
+    if (!Iterator->current)
+        return NULL;
+
+    Iterator->current = RtlpRbTreeSuccessor(Iterator->current);
+
+    return Iterator->current ? Iterator->current->object : NULL;
 }
 
+/*
+ * ASSUMES LOCK IS HELD!
+ *
+ * Positions the iterator at the first node whose key is greater then the given
+ * key and returns its object. This allows a caller to stop enumerating, drop
+ * the lock and later continue from where it left off, even if the node it last
+ * visited has since been deleted.
+ */
+PVOID
+RtlRbTreeIteratorResume(
+    _In_ PRB_TREE Tree, _In_ PVOID Key, _Out_ PRB_TREE_ITERATOR Iterator)
+{
+    PRB_TREE_NODE current = Tree->root;
+    PRB_TREE_NODE candidate = NULL;
+
+    while (current) {
+        if (Tree->compare(Key, current->object) == RB_TREE_LESS_THAN) {
+            candidate = current;
+            current = current->left;
+        }
+        else {
+            current = current->right;
+        }
+    }
+
+    Iterator->tree = Tree;
+    Iterator->current = candidate;
+
+    return candidate ? candidate->object : NULL;
+}
+
+/*
+ * The lock is acquired shared, so multiple enumerations and lookups can run
+ * concurrently. As a result the callback must not insert or delete nodes.
+ */
 VOID
 RtlRbTreeEnumerate(
     _In_ PRB_TREE Tree, _In_ RB_ENUM_CALLBACK Callback, _In_opt_ PVOID Context)
 {
+    RB_TREE_ITERATOR iterator = {0};
+    PVOID object = NULL;
+
     if (Tree->root == NULL)
         return;
 
-    RtlRbTreeAcquireLock(Tree);
-    RtlpRbTreeEnumerate(Tree->root, Callback, Context);
-    RtlRbTreeReleaselock(Tree);
+    RtlRbTreeAcquireLockShared(Tree);
+
+    object = RtlRbTreeIteratorBegin(Tree, &iterator);
+
+    while (object) {
+        Callback(object, Context);
+        object = RtlRbTreeIteratorNext(&iterator);
+    }
+
+    RtlRbTreeReleaseLockShared(Tree);
+}
+
+STATIC
+NTSTATUS
+RtlpRbTreeGrowSnapshot(_Inout_ PRB_TREE_SNAPSHOT Snapshot,
+                       _In_ UINT32               Capacity)
+{
+    PVOID objects = NULL;
+
+    objects = ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)Capacity * Snapshot->object_size,
+        POOL_TAG_RB_TREE);
+
+    if (!objects)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    if (Snapshot->objects) {
+        IntCopyMemory(
+            objects,
+            Snapshot->objects,
+            (SIZE_T)Snapshot->count * Snapshot->object_size);
+
+        ExFreePoolWithTag(Snapshot->objects, POOL_TAG_RB_TREE);
+    }
+
+    Snapshot->objects = objects;
+    Snapshot->capacity = Capacity;
+    return STATUS_SUCCESS;
 }
 
 STATIC
 VOID
-RtlpPrintInOrder(PRB_TREE_NODE Node)
+RtlpRbTreeReleaseSnapshotObjects(_Inout_ PRB_TREE_SNAPSHOT Snapshot,
+                                 _In_opt_ RB_ENUM_CALLBACK ReleaseCallback,
+                                 _In_opt_ PVOID            Context)
 {
-    if (Node == NULL)
-        return;
+    if (ReleaseCallback) {
+        for (UINT32 index = 0; index < Snapshot->count; index++)
+            ReleaseCallback(RB_TREE_SNAPSHOT_OBJECT(Snapshot, index), Context);
+    }
 
-    RtlpPrintInOrder(Node->left);
+    Snapshot->count = 0;
+}
 
-    const char* color = (Node->colour == red) ? "Red" : "Black";
-    DbgPrintEx(
-        DPFLTR_DEFAULT_ID,
-        DPFLTR_INFO_LEVEL,
-        "Node: Key=%p, Color=%s\n",
-        *((PHANDLE)Node->object),
-        color);
+/*
+ * Copies every object in the tree into a flat array, allowing long running
+ * scans to operate on the copy without holding the tree lock for the duration
+ * of the scan.
+ *
+ * To avoid blocking thread creation and termination notifications, objects are
+ * copied ChunkSize at a time, and the lock is dropped between each chunk. The
+ * enumeration is then resumed using the last object copied as the key, which
+ * requires the key of each object to be stored at the start of the object.
+ * This is the case for all trees in the driver, i.e THREAD_LIST_ENTRY. Since
+ * the lock is released between chunks, the snapshot is not atomic - nodes
+ * inserted or deleted whilst the snapshot is being taken may or may not be
+ * present.
+ *
+ * Any pointers stored in the copied objects are no longer protected by the
+ * tree once the lock is released, so the CaptureCallback is invoked on each
+ * copy whilst the lock is still held. It is here callers should take a
+ * reference to any objects they will access later, i.e the PKTHREAD of a
+ * THREAD_LIST_ENTRY. These references can then be released by passing a
+ * ReleaseCallback to RtlRbTreeFreeSnapshot.
+ *
+ * On failure every captured object has already been passed to the
+ * ReleaseCallback and the snapshot is left empty, a pooled objects buffer
+ * having been freed. If the caller supplied the objects buffer and it is not
+ * large enough, STATUS_BUFFER_OVERFLOW is returned.
+ */
+NTSTATUS
+RtlRbTreeSnapshot(
+    _In_ PRB_TREE Tree,
+    _In_ UINT32 ChunkSize,
+    _In_opt_ RB_ENUM_CALLBACK CaptureCallback,
+    _In_opt_ RB_ENUM_CALLBACK ReleaseCallback,
+    _In_opt_ PVOID Context,
+    _Inout_ PRB_TREE_SNAPSHOT Snapshot)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    RB_TREE_ITERATOR iterator = {0};
+    PVOID object = NULL;
+    PVOID destination = NULL;
+    UINT32 copied = 0;
+    UINT32 limit = 0;
+
+    if (ChunkSize == 0)
+        return STATUS_INVALID_PARAMETER;
+
+    if (Snapshot->objects && Snapshot->capacity == 0)
+        return STATUS_INVALID_PARAMETER;
+
+    Snapshot->object_size = Tree->object_size;
+    Snapshot->count = 0;
+    Snapshot->pooled = Snapshot->objects ? FALSE : TRUE;
+
+    if (Snapshot->pooled) {
+        Snapshot->capacity = 0;
+
+        status = RtlpRbTreeGrowSnapshot(Snapshot, Tree->node_count + ChunkSize);
+
+        if (!NT_SUCCESS(status))
+            goto end;
+    }
+
+    do {
+        if (Snapshot->capacity - Snapshot->count < ChunkSize &&
+            Snapshot->pooled) {
+            status = RtlpRbTreeGrowSnapshot(
+                Snapshot,
+                Snapshot->capacity + Tree->node_count + ChunkSize);
+
+            if (!NT_SUCCESS(status))
+                goto end;
+        }
+
+        if (Snapshot->count == Snapshot->capacity) {
+            status = STATUS_BUFFER_OVERFLOW;
+            goto end;
+        }
 
-    RtlpPrintInOrder(Node->right);
+        limit = min(ChunkSize, Snapshot->capacity - Snapshot->count);
+        copied = 0;
+
+        RtlRbTreeAcquireLockShared(Tree);
+
+        if (Snapshot->count == 0)
+            object = RtlRbTreeIteratorBegin(Tree, &iterator);
+        else
+            object = RtlRbTreeIteratorResume(
+                Tree,
+                RB_TREE_SNAPSHOT_OBJECT(Snapshot, Snapshot->count - 1),
+                &iterator);
+
+        while (object && copied < limit) {
+            destination = RB_TREE_SNAPSHOT_OBJECT(Snapshot, Snapshot->count);
+            IntCopyMemory(destination, object, Tree->object_size);
+
+            if (CaptureCallback)
+                CaptureCallback(destination, Context);
+
+            Snapshot->count++;
+            copied++;
+            object = RtlRbTreeIteratorNext(&iterator);
+        }
+
+        RtlRbTreeReleaseLockShared(Tree);
+
+    } while (object);
+
+end:
+    if (!NT_SUCCESS(status)) {
+        if (Snapshot->pooled)
+            RtlRbTreeFreeSnapshot(Snapshot, ReleaseCallback, Context);
+        else
+            RtlpRbTreeReleaseSnapshotObjects(
+                Snapshot, ReleaseCallback, Context);
+    }
+
+    return status;
+}
+
+VOID
+RtlRbTreeFreeSnapshot(
+    _Inout_ PRB_TREE_SNAPSHOT Snapshot,
+    _In_opt_ RB_ENUM_CALLBACK ReleaseCallback,
+    _In_opt_ PVOID Context)
+{
+    RtlpRbTreeReleaseSnapshotObjects(Snapshot, ReleaseCallback, Context);
+
+    if (Snapshot->pooled && Snapshot->objects)
+        ExFreePoolWithTag(Snapshot->objects, POOL_TAG_RB_TREE);
+
+    Snapshot->objects = NULL;
+    Snapshot->count = 0;
+    Snapshot->capacity = 0;
+    Snapshot->pooled = FALSE;
 }
 
 VOID
 RtlRbTreeInOrderPrint(_In_ PRB_TREE Tree)
 {
+    RB_TREE_ITERATOR iterator = {0};
+    PVOID object = NULL;
+
     DEBUG_ERROR("*************************************************");
     DEBUG_ERROR("<><><><>STARTING IN ORDER PRINT <><><><><><");
-    RtlRbTreeAcquireLock(Tree);
-    RtlpPrintInOrder(Tree->root);
-    RtlRbTreeReleaselock(Tree);
+    RtlRbTreeAcquireLockShared(Tree);
+
+    object = RtlRbTreeIteratorBegin(Tree, &iterator);
+
+    while (object) {
+        const char* color =
+            (iterator.current->colour == red) ? "Red" : "Black";
+        DbgPrintEx(
+            DPFLTR_DEFAULT_ID,
+            DPFLTR_INFO_LEVEL,
+            "Node: Key=%p, Color=%s\n",
+            *((PHANDLE)object),
+            color);
+
+        object = RtlRbTreeIteratorNext(&iterator);
+    }
+
+    RtlRbTreeReleaseLockShared(Tree);
     DEBUG_ERROR("<><><><>ENDING IN ORDER PRINT <><><><><><");
     DEBUG_ERROR("*************************************************");
 }
 
+/*
+ * ASSUMES LOCK IS HELD!
+ *
+ * Frees every node in the subtree using a post-order walk. We descend until we
+ * reach a leaf, detach it from its parent, free it and then continue from the
+ * parent. Since each leaf is unlinked before being freed the parent eventually
+ * becomes a leaf itself, so no stack is required.
+ */
 STATIC
 VOID
 RtlpRbTreeDeleteSubtree(_In_ PRB_TREE Tree, _In_ PRB_TREE_NODE Node)
 {
+    PRB_TREE_NODE parent = NULL;
+    PRB_TREE_NODE stop = NULL;
+
     if (Node == NULL)
         return;
 
-    RtlpRbTreeDeleteSubtree(Tree, Node->left);
-    RtlpRbTreeDeleteSubtree(Tree, Node->right);
+    stop = Node->parent;
+
+    while (Node != stop) {
+        if (Node->left) {
+            Node = Node->left;
+            continue;
+        }
+
+        if (Node->right) {
+            Node = Node->right;
+            continue;
+        }
+
+        parent = Node->parent;
 
-    ExFreeToLookasideListEx(&Tree->pool, Node);
+        if (parent != stop) {
+            if (parent->left == Node)
+                parent->left = NULL;
+            else
+                parent->right = NULL;
+        }
+
+        ExFreeToLookasideListEx(&Tree->pool, Node);
+        Node = parent;
+    }
 }
 
 VOID
@@ -751,6 +1100,7 @@ RtlRbTreeDeleteTree(_In_ PRB_TREE Tree)
 
     RtlRbTreeAcquireLock(Tree);
     RtlpRbTreeDeleteSubtree(Tree, Tree->root);
+    Tree->root = NULL;
     ExDeleteLookasideListEx(&Tree->pool);
     RtlRbTreeReleaselock(Tree);
 }
\ No newline at end of file
@@ -0,0 +1,532 @@
+#include "usermod.h"
+
+#include "imports.h"
+#include "lib/stdlib.h"
+#include "pe.h"
+#include "perf.h"
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(PAGE, UserModuleCacheInitialise)
+#    pragma alloc_text(PAGE, UserModuleCacheValidate)
+#endif
+
+#define USER_MODULE_CR3_PFN_MASK 0x000FFFFFFFFFF000ull
+
+STATIC USER_MODULE_CACHE g_UserModuleCache = {0};
+
+FORCEINLINE
+STATIC
+PVOID
+UserModulepMapTable(_In_ UINT64 PageFrameNumber)
+{
+    PHYSICAL_ADDRESS address = {.QuadPart = PageFrameNumber << PAGE_SHIFT};
+    return ImpMmGetVirtualForPhysical(address);
+}
+
+/*
+ * Returns the masked state of the entry mapping Address in the given address
+ * space, or 0 if the address is not mapped. A large page is represented by
+ * its PDE.
+ */
+STATIC
+UINT64
+UserModulepReadPteState(_In_ UINT64 DirectoryTableBase, _In_ UINT64 Address)
+{
+    PML4E_64* pml4 = NULL;
+    PDPTE_64* pdpt = NULL;
+    PDE_64*   pd = NULL;
+    PTE_64*   pt = NULL;
+    PML4E_64  pml4e = {0};
+    PDPTE_64  pdpte = {0};
+    PDE_64    pde = {0};
+    PTE_64    pte = {0};
+
+    pml4 = UserModulepMapTable(
+        (DirectoryTableBase & USER_MODULE_CR3_PFN_MASK) >> PAGE_SHIFT);
+
+    if (!pml4)
+        return 0;
+
+    pml4e = pml4[(Address >> 39) & 0x1ff];
+
+    if (!pml4e.Present)
+        return 0;
+
+    pdpt = UserModulepMapTable(pml4e.PageFrameNumber);
+
+    if (!pdpt)
+        return 0;
+
+    pdpte = pdpt[(Address >> 30) & 0x1ff];
+
+    if (!pdpte.Present || pdpte.LargePage)
+        return pdpte.AsUInt & USER_MODULE_PTE_STATE_MASK;
+
+    pd = UserModulepMapTable(pdpte.PageFrameNumber);
+
+    if (!pd)
+        return 0;
+
+    pde = pd[(Address >> 21) & 0x1ff];
+
+    if (!pde.Present || pde.LargePage)
+        return pde.AsUInt & USER_MODULE_PTE_STATE_MASK;
+
+    pt = UserModulepMapTable(pde.PageFrameNumber);
+
+    if (!pt)
+        return 0;
+
+    pte = pt[(Address >> 12) & 0x1ff];
+    return pte.AsUInt & USER_MODULE_PTE_STATE_MASK;
+}
+
+FORCEINLINE
+STATIC
+UINT64
+UserModulepGetDirectoryTableBase(_In_ PEPROCESS Process)
+{
+    return *(PUINT64)((UINT64)Process + KPROCESS_DIRECTORY_TABLE_BASE_OFFSET);
+}
+
+/*
+ * Pages of the image that have never been touched are not resident, and
+ * MmCopyMemory will not fault them in. Must be called while attached.
+ */
+STATIC
+VOID
+UserModulepMakeResident(_In_ PVOID Base, _In_ UINT32 Size)
+{
+    for (UINT32 offset = 0; offset < Size; offset += PAGE_SIZE) {
+        __try {
+            *(volatile UCHAR*)((UINT64)Base + offset);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            DEBUG_WARNING("Failed to make page %lx resident", offset);
+        }
+    }
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+VOID
+UserModulepMakeSectionsResident(_In_ PUSER_MODULE_CACHE Cache)
+{
+    for (UINT32 index = 0; index < Cache->section_count; index++)
+        UserModulepMakeResident(
+            (PVOID)((UINT64)Cache->base + Cache->sections[index].offset),
+            Cache->sections[index].size);
+}
+
+/*
+ * Records the executable, non writable sections of the image, the only ones
+ * whose pages cannot legitimately change. The headers are read from the
+ * process, so every value is read once and checked against the image size.
+ * Must be called while attached. ASSUMES LOCK IS HELD!
+ */
+STATIC
+NTSTATUS
+UserModulepFindCodeSections(_Inout_ PUSER_MODULE_CACHE Cache)
+{
+    PIMAGE_DOS_HEADER     dos = (PIMAGE_DOS_HEADER)Cache->base;
+    PLOCAL_NT_HEADER      nt = NULL;
+    PIMAGE_SECTION_HEADER section = NULL;
+    PUSER_MODULE_SECTION  entry = NULL;
+    UINT32                nt_offset = 0;
+    UINT32                section_count = 0;
+    UINT32                characteristics = 0;
+    UINT32                address = 0;
+    UINT32                size = 0;
+    UINT64                sections_end = 0;
+
+    Cache->section_count = 0;
+    Cache->page_count = 0;
+
+    __try {
+        if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+            return STATUS_INVALID_IMAGE_FORMAT;
+
+        nt_offset = (UINT32)dos->e_lfanew;
+
+        if (nt_offset > Cache->size - sizeof(LOCAL_NT_HEADER))
+            return STATUS_INVALID_IMAGE_FORMAT;
+
+        nt = (PLOCAL_NT_HEADER)((UINT64)Cache->base + nt_offset);
+
+        if (nt->Signature != IMAGE_NT_SIGNATURE)
+            return STATUS_INVALID_IMAGE_FORMAT;
+
+        section = IMAGE_FIRST_SECTION(nt);
+        section_count = nt->FileHeader.NumberOfSections;
+        sections_end = (UINT64)section - (UINT64)Cache->base +
+                       (UINT64)section_count * sizeof(IMAGE_SECTION_HEADER);
+
+        if (sections_end > Cache->size)
+            return STATUS_INVALID_IMAGE_FORMAT;
+
+        for (UINT32 index = 0; index < section_count; index++) {
+            characteristics = section[index].Characteristics;
+            address = section[index].VirtualAddress;
+            size = section[index].Misc.VirtualSize;
+
+            if (!(characteristics & IMAGE_SCN_MEM_EXECUTE) ||
+                characteristics & IMAGE_SCN_MEM_WRITE)
+                continue;
+
+            if (!size || address >= Cache->size ||
+                address & (PAGE_SIZE - 1)) {
+                DEBUG_WARNING("Skipping code section at %lx", address);
+                continue;
+            }
+
+            if (Cache->section_count == USER_MODULE_MAX_CODE_SECTIONS) {
+                DEBUG_WARNING("Too many code sections, skipping remainder.");
+                break;
+            }
+
+            entry = &Cache->sections[Cache->section_count++];
+            entry->offset = address;
+            entry->size = min(size, Cache->size - address);
+            entry->first_page = Cache->page_count;
+            entry->baseline = NULL;
+
+            Cache->page_count += (entry->size + PAGE_SIZE - 1) / PAGE_SIZE;
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        Cache->section_count = 0;
+        Cache->page_count = 0;
+        return GetExceptionCode();
+    }
+
+    return Cache->section_count ? STATUS_SUCCESS : STATUS_INVALID_IMAGE_FORMAT;
+}
+
+/* ASSUMES LOCK IS HELD! */
+STATIC
+VOID
+UserModulepFreeCache(_Inout_ PUSER_MODULE_CACHE Cache)
+{
+    for (UINT32 index = 0; index < Cache->section_count; index++) {
+        if (Cache->sections[index].baseline)
+            BaselineFreeModulePageHashes(Cache->sections[index].baseline);
+
+        Cache->sections[index].baseline = NULL;
+    }
+
+    if (Cache->page_state)
+        ImpExFreePoolWithTag(Cache->page_state, POOL_TAG_USER_MODULE);
+
+    if (Cache->pages)
+        ImpExFreePoolWithTag(Cache->pages, POOL_TAG_USER_MODULE);
+
+    if (Cache->process)
+        ImpObDereferenceObject(Cache->process);
+
+    Cache->section_count = 0;
+    Cache->page_count = 0;
+    Cache->page_state = NULL;
+    Cache->pages = NULL;
+    Cache->process = NULL;
+}
+
+/* To be called once from DriverEntry, before any session is initialised. */
+VOID
+UserModuleCacheInitialiseLock()
+{
+    ImpKeInitializeGuardedMutex(&g_UserModuleCache.lock);
+}
+
+/*
+ * Reads the state of every page and then takes the baseline of each section.
+ * The state is read before the hashes, so a page modified in between is seen
+ * as changed on the first validation. Must be called while attached.
+ * ASSUMES LOCK IS HELD!
+ */
+STATIC
+NTSTATUS
+UserModulepCreateBaselines(_Inout_ PUSER_MODULE_CACHE Cache, _In_ UINT64 Cr3)
+{
+    NTSTATUS             status = STATUS_UNSUCCESSFUL;
+    PUSER_MODULE_SECTION section = NULL;
+    UINT64               base = 0;
+    UINT32               page_count = 0;
+
+    UserModulepMakeSectionsResident(Cache);
+
+    for (UINT32 index = 0; index < Cache->section_count; index++) {
+        section = &Cache->sections[index];
+        base = (UINT64)Cache->base + section->offset;
+        page_count = (section->size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        for (UINT32 page = 0; page < page_count; page++)
+            Cache->page_state[section->first_page + page] =
+                UserModulepReadPteState(Cr3, base + (UINT64)page * PAGE_SIZE);
+    }
+
+    for (UINT32 index = 0; index < Cache->section_count; index++) {
+        section = &Cache->sections[index];
+
+        status = BaselineCreateModulePageHashes(
+            (PVOID)((UINT64)Cache->base + section->offset),
+            section->size,
+            0,
+            &section->baseline);
+
+        if (!NT_SUCCESS(status)) {
+            DEBUG_ERROR(
+                "BaselineCreateModulePageHashes failed with status %x",
+                status);
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * To be called from SessionInitialise once the module has been validated
+ * against its on disk image, so the baseline is known to be clean.
+ */
+NTSTATUS
+UserModuleCacheInitialise(_In_ PEPROCESS Process,
+                          _In_ PVOID     ImageBase,
+                          _In_ UINT32    ImageSize)
+{
+    PAGED_CODE();
+
+    NTSTATUS           status = STATUS_UNSUCCESSFUL;
+    PUSER_MODULE_CACHE cache = &g_UserModuleCache;
+    KAPC_STATE         apc_state = {0};
+    UINT64             cr3 = 0;
+
+    if (!Process || !ImageBase || ImageSize < PAGE_SIZE)
+        return STATUS_INVALID_PARAMETER;
+
+    UserModuleCacheFree();
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+
+    RtlZeroMemory(&cache->statistics, sizeof(USER_MODULE_STATISTICS));
+
+    if (!cache->full_interval)
+        cache->full_interval = USER_MODULE_DEFAULT_FULL_INTERVAL;
+
+    ImpObfReferenceObject(Process);
+    cache->process = Process;
+    cache->base = ImageBase;
+    cache->size = ImageSize;
+
+    cr3 = UserModulepGetDirectoryTableBase(Process);
+
+    ImpKeStackAttachProcess(Process, &apc_state);
+
+    status = UserModulepFindCodeSections(cache);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("UserModulepFindCodeSections failed with status %x",
+                    status);
+        goto detach;
+    }
+
+    cache->page_state = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                           cache->page_count * sizeof(UINT64),
+                                           POOL_TAG_USER_MODULE);
+
+    /* a full validation verifies every page of a section */
+    cache->pages = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                      cache->page_count * sizeof(UINT32),
+                                      POOL_TAG_USER_MODULE);
+
+    if (!cache->page_state || !cache->pages) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto detach;
+    }
+
+    status = UserModulepCreateBaselines(cache, cr3);
+
+detach:
+    ImpKeUnstackDetachProcess(&apc_state);
+
+    if (!NT_SUCCESS(status))
+        goto end;
+
+    cache->last_full_validation = KeQueryInterruptTime();
+    cache->active = TRUE;
+
+end:
+    if (!NT_SUCCESS(status))
+        UserModulepFreeCache(cache);
+
+    ImpKeReleaseGuardedMutex(&cache->lock);
+    return status;
+}
+
+/* To be called from SessionTerminate. */
+VOID
+UserModuleCacheFree()
+{
+    PUSER_MODULE_CACHE cache = &g_UserModuleCache;
+
+    if (!cache->active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+    cache->active = FALSE;
+    UserModulepFreeCache(cache);
+    ImpKeReleaseGuardedMutex(&cache->lock);
+}
+
+/* An interval of 0 rehashes every page on every validation. */
+VOID
+UserModuleCacheSetFullInterval(_In_ UINT64 Interval)
+{
+    g_UserModuleCache.full_interval = Interval;
+}
+
+/*
+ * Collects the pages of Section whose state changed, or every page on a full
+ * validation, and verifies them. Must be called while attached. ASSUMES LOCK
+ * IS HELD!
+ */
+STATIC
+NTSTATUS
+UserModulepValidateSection(_Inout_ PUSER_MODULE_CACHE  Cache,
+                           _In_ PUSER_MODULE_SECTION   Section,
+                           _In_ UINT64                 Cr3,
+                           _In_ BOOLEAN                Full,
+                           _Out_ PUINT32               Hashed,
+                           _Out_ PUINT32               MismatchOffset)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    PUINT64  page_state = &Cache->page_state[Section->first_page];
+    UINT64   base = (UINT64)Cache->base + Section->offset;
+    UINT64   state = 0;
+    UINT32   count = 0;
+
+    for (UINT32 page = 0; page < Section->baseline->page_count; page++) {
+        state = UserModulepReadPteState(Cr3, base + (UINT64)page * PAGE_SIZE);
+
+        if (!(state & PTE_64_PRESENT_FLAG) ||
+            (!Full && state == page_state[page])) {
+            Cache->statistics.pages_skipped++;
+            continue;
+        }
+
+        /* the state is recorded before the page is hashed, so a change made
+         * while hashing is seen by the next validation */
+        page_state[page] = state;
+        Cache->pages[count++] = page;
+    }
+
+    *Hashed = count;
+
+    status = BaselineVerifyModulePageList(
+        Section->baseline, (PVOID)base, Cache->pages, count, MismatchOffset);
+
+    /* report the offset within the image rather than the section */
+    if (NT_SUCCESS(status) && *MismatchOffset != BASELINE_NO_MISMATCH)
+        *MismatchOffset += Section->offset;
+
+    return status;
+}
+
+/*
+ * Verifies the code pages whose PTE state changed since they were last
+ * verified, or every code page once the full interval has elapsed. Pages are
+ * only marked as verified if no page was found to be modified, so a
+ * modification is found again on each validation until the session ends. On
+ * return MismatchOffset is the offset of the modified page within the image.
+ */
+NTSTATUS
+UserModuleCacheValidate(_Out_ PBOOLEAN Modified, _Out_ PUINT32 MismatchOffset)
+{
+    PAGED_CODE();
+
+    NTSTATUS           status = STATUS_UNSUCCESSFUL;
+    PUSER_MODULE_CACHE cache = &g_UserModuleCache;
+    KAPC_STATE         apc_state = {0};
+    BOOLEAN            full = FALSE;
+    UINT32             hashed = 0;
+    UINT32             total = 0;
+    UINT64             now = 0;
+    UINT64             cr3 = 0;
+    UINT64             start = PerfBegin();
+
+    *Modified = FALSE;
+    *MismatchOffset = BASELINE_NO_MISMATCH;
+
+    if (!cache->active)
+        return STATUS_UNSUCCESSFUL;
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+
+    if (!cache->active)
+        goto end;
+
+    now = KeQueryInterruptTime();
+    full = now - cache->last_full_validation >= cache->full_interval;
+    cr3 = UserModulepGetDirectoryTableBase(cache->process);
+
+    ImpKeStackAttachProcess(cache->process, &apc_state);
+
+    if (full)
+        UserModulepMakeSectionsResident(cache);
+
+    for (UINT32 index = 0; index < cache->section_count; index++) {
+        status = UserModulepValidateSection(cache,
+                                            &cache->sections[index],
+                                            cr3,
+                                            full,
+                                            &hashed,
+                                            MismatchOffset);
+        total += hashed;
+
+        if (!NT_SUCCESS(status) || *MismatchOffset != BASELINE_NO_MISMATCH)
+            break;
+    }
+
+    ImpKeUnstackDetachProcess(&apc_state);
+
+    if (!NT_SUCCESS(status)) {
+        DEBUG_ERROR("BaselineVerifyModulePageList failed with status %x",
+                    status);
+        /* leave the pages to be verified again */
+        RtlZeroMemory(cache->page_state, cache->page_count * sizeof(UINT64));
+        goto end;
+    }
+
+    cache->statistics.validations++;
+    cache->statistics.pages_hashed += total;
+
+    if (full) {
+        cache->statistics.full_validations++;
+        cache->last_full_validation = now;
+    }
+
+    if (*MismatchOffset != BASELINE_NO_MISMATCH) {
+        *Modified = TRUE;
+        cache->statistics.mismatches++;
+        RtlZeroMemory(cache->page_state, cache->page_count * sizeof(UINT64));
+    }
+
+end:
+    ImpKeReleaseGuardedMutex(&cache->lock);
+    PerfRecord(PerfCounterValidateUserModule, start, (UINT64)total * PAGE_SIZE);
+    return status;
+}
+
+VOID
+UserModuleCacheQueryStatistics(_Out_ PUSER_MODULE_STATISTICS Statistics)
+{
+    PUSER_MODULE_CACHE cache = &g_UserModuleCache;
+
+    RtlZeroMemory(Statistics, sizeof(USER_MODULE_STATISTICS));
+
+    if (!cache->active)
+        return;
+
+    ImpKeAcquireGuardedMutex(&cache->lock);
+    *Statistics = cache->statistics;
+    ImpKeReleaseGuardedMutex(&cache->lock);
+}
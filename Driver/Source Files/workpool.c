@@ -0,0 +1,407 @@
+#include "workpool.h"
+
+#include "driver.h"
+#include "imports.h"
+#include "integrity.h"
+#include "lib/stdlib.h"
+
+/* 50 milliseconds in 100ns units, the longest a worker sleeps at once */
+#define WORK_POOL_MAX_THROTTLE_DELAY (50ull * 1000 * 10)
+
+typedef struct _WORK_POOL_WORKER {
+    WORK_POOL_QUEUE     queue;
+    struct _WORK_POOL*  pool;
+    UINT32              index;
+    PIO_WORKITEM        work_item;
+
+} WORK_POOL_WORKER, *PWORK_POOL_WORKER;
+
+typedef struct _WORK_POOL {
+    /* the pool allocation, which the pool is aligned within */
+    PVOID allocation;
+
+    PWORK_POOL_TASK   tasks;
+    WORK_POOL_ROUTINE routine;
+    PVOID             context;
+    UINT32            worker_count;
+
+    /* percent of its own time each worker may spend executing tasks */
+    UINT32 duty_cycle;
+
+    /* Stores the number of actively executing worker threads */
+    volatile LONG active_thread_count;
+    KEVENT        complete;
+
+    volatile LONG64 executed;
+    volatile LONG64 stolen;
+    volatile LONG64 throttled;
+
+    WORK_POOL_WORKER workers[];
+
+} WORK_POOL, *PWORK_POOL;
+
+FORCEINLINE
+STATIC
+LONG64
+WorkPoolpPackRange(_In_ UINT32 Head, _In_ UINT32 Tail)
+{
+    return (LONG64)((UINT64)Tail << 32 | Head);
+}
+
+/* Takes the next task from the head of the workers own range. */
+STATIC
+BOOLEAN
+WorkPoolpTakeHead(_In_ PWORK_POOL_QUEUE Queue, _Out_ PUINT32 Index)
+{
+    LONG64 range = 0;
+    UINT32 head = 0;
+    UINT32 tail = 0;
+
+    for (;;) {
+        range = ReadAcquire64(&Queue->range);
+        head = (UINT32)range;
+        tail = (UINT32)((UINT64)range >> 32);
+
+        if (head >= tail)
+            return FALSE;
+
+        if (InterlockedCompareExchange64(
+                &Queue->range, WorkPoolpPackRange(head + 1, tail), range) ==
+            range)
+            break;
+    }
+
+    *Index = head;
+    return TRUE;
+}
+
+/* Steals the last task of another workers range. */
+STATIC
+BOOLEAN
+WorkPoolpTakeTail(_In_ PWORK_POOL_QUEUE Queue, _Out_ PUINT32 Index)
+{
+    LONG64 range = 0;
+    UINT32 head = 0;
+    UINT32 tail = 0;
+
+    for (;;) {
+        range = ReadAcquire64(&Queue->range);
+        head = (UINT32)range;
+        tail = (UINT32)((UINT64)range >> 32);
+
+        if (head >= tail)
+            return FALSE;
+
+        if (InterlockedCompareExchange64(
+                &Queue->range, WorkPoolpPackRange(head, tail - 1), range) ==
+            range)
+            break;
+    }
+
+    *Index = tail - 1;
+    return TRUE;
+}
+
+STATIC
+BOOLEAN
+WorkPoolpSteal(_In_ PWORK_POOL_WORKER Worker, _Out_ PUINT32 Index)
+{
+    PWORK_POOL pool = Worker->pool;
+    UINT32     victim = 0;
+
+    for (UINT32 offset = 1; offset < pool->worker_count; offset++) {
+        victim = (Worker->index + offset) % pool->worker_count;
+
+        if (WorkPoolpTakeTail(&pool->workers[victim].queue, Index))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Holds the worker back until the time it has spent executing tasks is no
+ * more than duty_cycle percent of the time since it started.
+ */
+STATIC
+VOID
+WorkPoolpThrottle(_In_ PWORK_POOL Pool, _In_ UINT64 Start, _In_ UINT64 Busy)
+{
+    LARGE_INTEGER delay = {0};
+    UINT64        elapsed = 0;
+    UINT64        required = 0;
+    UINT64        throttle_start = 0;
+
+    if (Pool->duty_cycle >= WORK_POOL_UNTHROTTLED)
+        return;
+
+    elapsed = KeQueryInterruptTime() - Start;
+    required = Busy * 100 / Pool->duty_cycle;
+
+    if (required <= elapsed)
+        return;
+
+    throttle_start = elapsed;
+
+    /* each delay is bounded and may end early, so it is repeated until the
+     * worker is back within its duty cycle */
+    do {
+        delay.QuadPart =
+            RELATIVE(min(required - elapsed, WORK_POOL_MAX_THROTTLE_DELAY));
+
+        ImpKeDelayExecutionThread(KernelMode, FALSE, &delay);
+        elapsed = KeQueryInterruptTime() - Start;
+    } while (required > elapsed);
+
+    InterlockedAdd64(&Pool->throttled, elapsed - throttle_start);
+}
+
+STATIC
+VOID
+WorkPoolpExecute(_In_ PWORK_POOL_WORKER Worker)
+{
+    PWORK_POOL pool = Worker->pool;
+    UINT64     start = KeQueryInterruptTime();
+    UINT64     busy = 0;
+    UINT64     task_start = 0;
+    UINT32     index = 0;
+
+    for (;;) {
+        if (!WorkPoolpTakeHead(&Worker->queue, &index)) {
+            if (!WorkPoolpSteal(Worker, &index))
+                break;
+
+            InterlockedIncrement64(&pool->stolen);
+        }
+
+        task_start = KeQueryInterruptTime();
+        pool->routine(&pool->tasks[index], pool->context);
+        busy += KeQueryInterruptTime() - task_start;
+
+        InterlockedIncrement64(&pool->executed);
+        WorkPoolpThrottle(pool, start, busy);
+    }
+}
+
+STATIC
+VOID
+WorkPoolpWorkerRoutine(_In_ PDEVICE_OBJECT DeviceObject, _In_opt_ PVOID Context)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    PWORK_POOL_WORKER worker = (PWORK_POOL_WORKER)Context;
+    PWORK_POOL        pool = worker->pool;
+
+    WorkPoolpExecute(worker);
+
+    if (!InterlockedDecrement(&pool->active_thread_count))
+        KeSetEvent(&pool->complete, IO_NO_INCREMENT, FALSE);
+}
+
+VOID
+WorkPoolInitialiseConfiguration(_Out_ PWORK_POOL_CONFIGURATION Configuration)
+{
+    Configuration->max_workers = WORK_POOL_DEFAULT_MAX_WORKERS;
+    Configuration->cpu_share = WORK_POOL_DEFAULT_CPU_SHARE;
+    Configuration->busy_core_usage = WORK_POOL_DEFAULT_BUSY_CORE;
+}
+
+/*
+ * The worker count is the number of cores below busy_core_usage, bounded by
+ * max_workers and the number of tasks. During a session it is also bounded
+ * by the number of processors cpu_share amounts to, and the duty cycle of
+ * each worker is set so their sum equals cpu_share of the machine.
+ */
+STATIC
+VOID
+WorkPoolpCalculateWorkerCount(_In_ PWORK_POOL_CONFIGURATION Configuration,
+                              _In_ UINT32                   TaskCount,
+                              _Out_ PUINT32                 WorkerCount,
+                              _Out_ PUINT32                 DutyCycle)
+{
+    PACTIVE_SESSION session = GetActiveSession();
+    UINT32          processors = ImpKeQueryActiveProcessorCount(NULL);
+    UINT32          available = 0;
+    UINT32          share = WORK_POOL_UNTHROTTLED;
+    UINT32          workers = 0;
+
+    for (UINT32 core = 0; core < processors; core++) {
+        if (CalculateCpuCoreUsage(core) < Configuration->busy_core_usage)
+            available++;
+    }
+
+    if (session->is_session_active)
+        share = max(1, min(Configuration->cpu_share, WORK_POOL_UNTHROTTLED));
+
+    workers = min(available, Configuration->max_workers);
+    workers = min(workers, (share * processors + 99) / 100);
+    workers = min(workers, TaskCount);
+    workers = max(workers, 1);
+
+    *WorkerCount = workers;
+    *DutyCycle = min(share * processors / workers, WORK_POOL_UNTHROTTLED);
+    *DutyCycle = max(*DutyCycle, 1);
+}
+
+/*
+ * Runs every task to completion, the calling thread acting as the first
+ * worker. Each task is executed exactly once, by any worker. Must be called
+ * at PASSIVE_LEVEL.
+ */
+NTSTATUS
+WorkPoolRun(_In_ PWORK_POOL_TASK            Tasks,
+            _In_ UINT32                     TaskCount,
+            _In_ WORK_POOL_ROUTINE          Routine,
+            _In_opt_ PVOID                  Context,
+            _In_ PWORK_POOL_CONFIGURATION   Configuration,
+            _Out_opt_ PWORK_POOL_STATISTICS Statistics)
+{
+    PWORK_POOL pool = NULL;
+    PVOID      allocation = NULL;
+    UINT32     workers = 0;
+    UINT32     duty_cycle = 0;
+    UINT32     head = 0;
+    UINT32     tail = 0;
+
+    if (Statistics)
+        RtlZeroMemory(Statistics, sizeof(WORK_POOL_STATISTICS));
+
+    if (!TaskCount)
+        return STATUS_SUCCESS;
+
+    WorkPoolpCalculateWorkerCount(
+        Configuration, TaskCount, &workers, &duty_cycle);
+
+    /* pool allocations are only 16 byte aligned, so the allocation is padded
+     * for each workers queue to begin a cache line of its own */
+    allocation = ImpExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(WORK_POOL) + workers * sizeof(WORK_POOL_WORKER) +
+            SYSTEM_CACHE_ALIGNMENT_SIZE,
+        POOL_TAG_WORK_POOL);
+
+    if (!allocation)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    pool = (PWORK_POOL)ALIGN_UP_BY(allocation, SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    pool->allocation = allocation;
+    pool->tasks = Tasks;
+    pool->routine = Routine;
+    pool->context = Context;
+    pool->worker_count = workers;
+    pool->duty_cycle = duty_cycle;
+
+    KeInitializeEvent(&pool->complete, NotificationEvent, FALSE);
+
+    for (UINT32 index = 0; index < workers; index++) {
+        head = (UINT32)((UINT64)TaskCount * index / workers);
+        tail = (UINT32)((UINT64)TaskCount * (index + 1) / workers);
+
+        pool->workers[index].pool = pool;
+        pool->workers[index].index = index;
+        pool->workers[index].queue.range = WorkPoolpPackRange(head, tail);
+    }
+
+    /* the calling thread holds a count of its own until it has finished, so
+     * the event cannot be set before every worker is queued */
+    pool->active_thread_count = 1;
+
+    for (UINT32 index = 1; index < workers; index++) {
+        pool->workers[index].work_item =
+            ImpIoAllocateWorkItem(GetDriverDeviceObject());
+
+        /* its range is left to be stolen by the others */
+        if (!pool->workers[index].work_item)
+            continue;
+
+        InterlockedIncrement(&pool->active_thread_count);
+        ImpIoQueueWorkItem(pool->workers[index].work_item,
+                           WorkPoolpWorkerRoutine,
+                           NormalWorkQueue,
+                           &pool->workers[index]);
+    }
+
+    WorkPoolpExecute(&pool->workers[0]);
+
+    if (InterlockedDecrement(&pool->active_thread_count))
+        ImpKeWaitForSingleObject(
+            &pool->complete, Executive, KernelMode, FALSE, NULL);
+
+    for (UINT32 index = 1; index < workers; index++) {
+        if (pool->workers[index].work_item)
+            ImpIoFreeWorkItem(pool->workers[index].work_item);
+    }
+
+    if (Statistics) {
+        Statistics->worker_count = workers;
+        Statistics->executed = pool->executed;
+        Statistics->stolen = pool->stolen;
+        Statistics->throttled = pool->throttled;
+    }
+
+    ImpExFreePoolWithTag(pool->allocation, POOL_TAG_WORK_POOL);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Creates a task for each module, with modules larger than
+ * WORK_POOL_MODULE_CHUNK_SIZE split into a task per chunk. Each tasks item is
+ * the modules RTL_MODULE_EXTENDED_INFO, so Modules must outlive the tasks.
+ */
+NTSTATUS
+WorkPoolBuildModuleTasks(_In_ PSYSTEM_MODULES   Modules,
+                         _Out_ PWORK_POOL_TASK* Tasks,
+                         _Out_ PUINT32          TaskCount)
+{
+    PWORK_POOL_TASK           tasks = NULL;
+    PRTL_MODULE_EXTENDED_INFO module = NULL;
+    UINT32                    count = 0;
+    UINT32                    task = 0;
+
+    *Tasks = NULL;
+    *TaskCount = 0;
+
+    for (INT index = 0; index < Modules->module_count; index++) {
+        module = &((PRTL_MODULE_EXTENDED_INFO)Modules->address)[index];
+        count += max(1, (module->ImageSize + WORK_POOL_MODULE_CHUNK_SIZE - 1) /
+                            WORK_POOL_MODULE_CHUNK_SIZE);
+    }
+
+    if (!count)
+        return STATUS_SUCCESS;
+
+    tasks = ImpExAllocatePool2(POOL_FLAG_NON_PAGED,
+                               count * sizeof(WORK_POOL_TASK),
+                               POOL_TAG_WORK_POOL);
+
+    if (!tasks)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (INT index = 0; index < Modules->module_count; index++) {
+        module = &((PRTL_MODULE_EXTENDED_INFO)Modules->address)[index];
+
+        for (UINT32 offset = 0;;) {
+            tasks[task].item = module;
+            tasks[task].offset = offset;
+            tasks[task].length =
+                min(module->ImageSize - offset, WORK_POOL_MODULE_CHUNK_SIZE);
+            task++;
+
+            offset += WORK_POOL_MODULE_CHUNK_SIZE;
+
+            if (offset >= module->ImageSize)
+                break;
+        }
+    }
+
+    *Tasks = tasks;
+    *TaskCount = count;
+    return STATUS_SUCCESS;
+}
+
+VOID
+WorkPoolFreeTasks(_In_ PWORK_POOL_TASK Tasks)
+{
+    ImpExFreePoolWithTag(Tasks, POOL_TAG_WORK_POOL);
+}
@@ -9,4 +9,27 @@ const unsigned char *get_test_iv();
 boolean initialise_provider();
 boolean decrypt_packet(void *packet, uint32_t packet_length);
 uint32_t get_padded_packet_size(uint32_t original_size);
-} // namespace crypt
\ No newline at end of file
+
+/* a packet within an IRP buffer, framed by its 16 byte cleartext header */
+struct packet_span {
+  void *buffer;
+  uint32_t length;
+};
+
+struct batch_statistics {
+  uint32_t packets;
+  uint32_t blocks;
+  uint64_t decrypt_ns;
+  bool aes_ni;
+};
+
+/*
+ * decrypts every packet of a batch in place, leaving each header in
+ * cleartext. the key schedule, or the CNG key object if AES-NI is not
+ * available, is created on first use and reused for every later batch, so
+ * no allocation is made per batch or per packet. packets whose length is not
+ * a whole number of blocks are left untouched and fail the batch.
+ */
+bool decrypt_packets(const packet_span *packets, uint32_t count,
+                     batch_statistics *statistics);
+} // namespace crypt
@@ -0,0 +1,252 @@
+#include "crypt.h"
+
+#include "common.h"
+
+#include <bcrypt.h>
+#include <intrin.h>
+#include <wmmintrin.h>
+
+#include <chrono>
+#include <cstring>
+#include <mutex>
+
+#pragma comment(lib, "bcrypt.lib")
+
+namespace {
+constexpr uint32_t block_size = 16;
+constexpr uint32_t header_size = block_size;
+constexpr uint32_t key_size = 32;
+constexpr uint32_t round_key_count = 15;
+constexpr int cpuid_aes_ni_bit = 1 << 25;
+
+struct batch_context {
+  bool initialised = false;
+  bool aes_ni = false;
+
+  /* the decryption key schedule, when AES-NI is available */
+  __m128i round_keys[round_key_count];
+
+  BCRYPT_ALG_HANDLE algorithm = nullptr;
+  BCRYPT_KEY_HANDLE key = nullptr;
+  std::vector<unsigned char> key_object;
+};
+
+batch_context context;
+std::once_flag context_once;
+
+bool has_aes_ni() {
+  int registers[4] = {0};
+  __cpuid(registers, 1);
+  return registers[2] & cpuid_aes_ni_bit;
+}
+
+__m128i expand_key_even(__m128i key, __m128i generated) {
+  generated = _mm_shuffle_epi32(generated, 0xff);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, generated);
+}
+
+__m128i expand_key_odd(__m128i key, __m128i previous) {
+  __m128i generated =
+      _mm_shuffle_epi32(_mm_aeskeygenassist_si128(previous, 0), 0xaa);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, generated);
+}
+
+/* aeskeygenassist takes its round constant as an immediate */
+#define EXPAND_KEY_ROUND(keys, index, rcon)                                    \
+  do {                                                                         \
+    keys[index] = expand_key_even(                                             \
+        keys[index - 2], _mm_aeskeygenassist_si128(keys[index - 1], rcon));    \
+    if (index + 1 < round_key_count)                                           \
+      keys[index + 1] = expand_key_odd(keys[index - 1], keys[index]);          \
+  } while (0)
+
+void expand_decryption_key(const unsigned char *key, __m128i *round_keys) {
+  __m128i keys[round_key_count];
+
+  keys[0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key));
+  keys[1] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + 16));
+
+  EXPAND_KEY_ROUND(keys, 2, 0x01);
+  EXPAND_KEY_ROUND(keys, 4, 0x02);
+  EXPAND_KEY_ROUND(keys, 6, 0x04);
+  EXPAND_KEY_ROUND(keys, 8, 0x08);
+  EXPAND_KEY_ROUND(keys, 10, 0x10);
+  EXPAND_KEY_ROUND(keys, 12, 0x20);
+  EXPAND_KEY_ROUND(keys, 14, 0x40);
+
+  /* the equivalent inverse cipher runs the schedule backwards */
+  round_keys[0] = keys[round_key_count - 1];
+
+  for (uint32_t index = 1; index < round_key_count - 1; index++)
+    round_keys[index] = _mm_aesimc_si128(keys[round_key_count - 1 - index]);
+
+  round_keys[round_key_count - 1] = keys[0];
+}
+
+bool initialise_cng() {
+  ULONG object_length = 0;
+  ULONG copied = 0;
+
+  if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(
+          &context.algorithm, BCRYPT_AES_ALGORITHM, nullptr, 0))) {
+    LOG_ERROR("BCryptOpenAlgorithmProvider failed");
+    return false;
+  }
+
+  if (!BCRYPT_SUCCESS(BCryptSetProperty(
+          context.algorithm, BCRYPT_CHAINING_MODE,
+          reinterpret_cast<PUCHAR>(const_cast<wchar_t *>(BCRYPT_CHAIN_MODE_CBC)),
+          sizeof(BCRYPT_CHAIN_MODE_CBC), 0)) ||
+      !BCRYPT_SUCCESS(BCryptGetProperty(
+          context.algorithm, BCRYPT_OBJECT_LENGTH,
+          reinterpret_cast<PUCHAR>(&object_length), sizeof(object_length),
+          &copied, 0))) {
+    LOG_ERROR("failed to configure the AES provider");
+    return false;
+  }
+
+  context.key_object.resize(object_length);
+
+  if (!BCRYPT_SUCCESS(BCryptGenerateSymmetricKey(
+          context.algorithm, &context.key, context.key_object.data(),
+          object_length, const_cast<PUCHAR>(crypt::get_test_key()), key_size,
+          0))) {
+    LOG_ERROR("BCryptGenerateSymmetricKey failed");
+    return false;
+  }
+
+  return true;
+}
+
+void initialise_context() {
+  context.aes_ni = has_aes_ni();
+
+  if (context.aes_ni) {
+    expand_decryption_key(crypt::get_test_key(), context.round_keys);
+    context.initialised = true;
+    return;
+  }
+
+  context.initialised = initialise_cng();
+}
+
+__m128i decrypt_block(__m128i block) {
+  block = _mm_xor_si128(block, context.round_keys[0]);
+
+  for (uint32_t index = 1; index < round_key_count - 1; index++)
+    block = _mm_aesdec_si128(block, context.round_keys[index]);
+
+  return _mm_aesdeclast_si128(block, context.round_keys[round_key_count - 1]);
+}
+
+/*
+ * unlike encryption, every block of CBC can be decrypted independently of the
+ * others, so four are kept in flight to cover the latency of aesdec.
+ */
+void decrypt_cbc_aes_ni(unsigned char *data, uint32_t blocks) {
+  auto current = reinterpret_cast<__m128i *>(data);
+  __m128i previous =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(crypt::get_test_iv()));
+  uint32_t index = 0;
+
+  for (; index + 4 <= blocks; index += 4) {
+    __m128i c0 = _mm_loadu_si128(current + index);
+    __m128i c1 = _mm_loadu_si128(current + index + 1);
+    __m128i c2 = _mm_loadu_si128(current + index + 2);
+    __m128i c3 = _mm_loadu_si128(current + index + 3);
+
+    __m128i p0 = _mm_xor_si128(c0, context.round_keys[0]);
+    __m128i p1 = _mm_xor_si128(c1, context.round_keys[0]);
+    __m128i p2 = _mm_xor_si128(c2, context.round_keys[0]);
+    __m128i p3 = _mm_xor_si128(c3, context.round_keys[0]);
+
+    for (uint32_t round = 1; round < round_key_count - 1; round++) {
+      p0 = _mm_aesdec_si128(p0, context.round_keys[round]);
+      p1 = _mm_aesdec_si128(p1, context.round_keys[round]);
+      p2 = _mm_aesdec_si128(p2, context.round_keys[round]);
+      p3 = _mm_aesdec_si128(p3, context.round_keys[round]);
+    }
+
+    const __m128i &last = context.round_keys[round_key_count - 1];
+
+    _mm_storeu_si128(current + index,
+                     _mm_xor_si128(_mm_aesdeclast_si128(p0, last), previous));
+    _mm_storeu_si128(current + index + 1,
+                     _mm_xor_si128(_mm_aesdeclast_si128(p1, last), c0));
+    _mm_storeu_si128(current + index + 2,
+                     _mm_xor_si128(_mm_aesdeclast_si128(p2, last), c1));
+    _mm_storeu_si128(current + index + 3,
+                     _mm_xor_si128(_mm_aesdeclast_si128(p3, last), c2));
+
+    previous = c3;
+  }
+
+  for (; index < blocks; index++) {
+    __m128i c0 = _mm_loadu_si128(current + index);
+    _mm_storeu_si128(current + index,
+                     _mm_xor_si128(decrypt_block(c0), previous));
+    previous = c0;
+  }
+}
+
+bool decrypt_cbc_cng(unsigned char *data, uint32_t length) {
+  /* the IV is consumed by every call, so each packet starts from a copy */
+  unsigned char iv[block_size];
+  ULONG copied = 0;
+
+  memcpy(iv, crypt::get_test_iv(), sizeof(iv));
+
+  return BCRYPT_SUCCESS(BCryptDecrypt(context.key, data, length, nullptr, iv,
+                                      sizeof(iv), data, length, &copied, 0));
+}
+} // namespace
+
+bool crypt::decrypt_packets(const packet_span *packets, uint32_t count,
+                            batch_statistics *statistics) {
+  auto start = std::chrono::steady_clock::now();
+  bool result = true;
+  uint32_t blocks = 0;
+
+  std::call_once(context_once, initialise_context);
+
+  if (!context.initialised)
+    return false;
+
+  for (uint32_t index = 0; index < count; index++) {
+    auto data = static_cast<unsigned char *>(packets[index].buffer);
+    uint32_t length = packets[index].length;
+
+    if (length < header_size || length % block_size) {
+      LOG_ERROR("packet length is not a whole number of blocks: %lx", length);
+      result = false;
+      continue;
+    }
+
+    length -= header_size;
+
+    if (context.aes_ni)
+      decrypt_cbc_aes_ni(data + header_size, length / block_size);
+    else if (!decrypt_cbc_cng(data + header_size, length))
+      result = false;
+
+    blocks += length / block_size;
+  }
+
+  if (statistics) {
+    statistics->packets = count;
+    statistics->blocks = blocks;
+    statistics->aes_ni = context.aes_ni;
+    statistics->decrypt_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+  }
+
+  return result;
+}
@@ -0,0 +1,223 @@
+#include "irp_pool.h"
+
+#include <cstring>
+
+namespace {
+constexpr uint32_t packet_header_size = 16;
+constexpr uint32_t record_type_data = 0x0;
+constexpr uint32_t max_depth = 64;
+
+uint32_t get_record_size(uint32_t length) {
+  return (sizeof(irp_pool::batch_record) + length +
+          irp_pool::record_alignment - 1) &
+         ~(irp_pool::record_alignment - 1);
+}
+} // namespace
+
+irp_pool::pool::~pool() {
+  cancel();
+
+  if (port_)
+    CloseHandle(port_);
+
+  if (device_ != INVALID_HANDLE_VALUE)
+    CloseHandle(device_);
+}
+
+bool irp_pool::pool::initialise(const wchar_t *device_name,
+                                const config &configuration) {
+  if (!configuration.depth || configuration.depth > max_depth ||
+      configuration.buffer_size < min_buffer_size) {
+    LOG_ERROR("invalid request pool configuration: depth %lu size %lx",
+              configuration.depth, configuration.buffer_size);
+    return false;
+  }
+
+  device_ = CreateFileW(device_name, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                        OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+
+  if (device_ == INVALID_HANDLE_VALUE) {
+    LOG_ERROR("CreateFileW failed with status %lx", GetLastError());
+    return false;
+  }
+
+  port_ = CreateIoCompletionPort(device_, nullptr, 0, 1);
+
+  if (!port_) {
+    LOG_ERROR("CreateIoCompletionPort failed with status %lx",
+              GetLastError());
+    return false;
+  }
+
+  depth_ = configuration.depth;
+  buffer_size_ = configuration.buffer_size & ~(record_alignment - 1);
+
+  /* the smallest record is a record header and a single block */
+  span_capacity_ = (buffer_size_ - sizeof(batch_header)) /
+                   get_record_size(packet_header_size);
+
+  requests_ = std::make_unique<request[]>(depth_);
+  buffers_ = std::make_unique<unsigned char[]>(
+      static_cast<size_t>(depth_) * buffer_size_);
+  entries_ = std::make_unique<OVERLAPPED_ENTRY[]>(depth_);
+  spans_ = std::make_unique<crypt::packet_span[]>(span_capacity_);
+
+  for (uint32_t index = 0; index < depth_; index++) {
+    requests_[index].buffer =
+        &buffers_[static_cast<size_t>(index) * buffer_size_];
+
+    if (!issue(&requests_[index])) {
+      cancel();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* maps a dequeued completion back to its request, nullptr if not our own */
+irp_pool::pool::request *
+irp_pool::pool::find_request(OVERLAPPED *overlapped) const {
+  auto address = reinterpret_cast<uintptr_t>(overlapped);
+  auto first = reinterpret_cast<uintptr_t>(requests_.get());
+
+  if (address < first || address >= first + depth_ * sizeof(request) ||
+      (address - first) % sizeof(request))
+    return nullptr;
+
+  return &requests_[(address - first) / sizeof(request)];
+}
+
+bool irp_pool::pool::issue(request *entry) {
+  memset(&entry->overlapped, 0, sizeof(entry->overlapped));
+
+  /* the driver always pends the request, so a completion is always queued */
+  if (!DeviceIoControl(device_, ioctl_retrieve_report_batch, nullptr, 0,
+                       entry->buffer, buffer_size_, nullptr,
+                       &entry->overlapped) &&
+      GetLastError() != ERROR_IO_PENDING) {
+    LOG_ERROR("DeviceIoControl failed with status %lx", GetLastError());
+    statistics_.failed++;
+    return false;
+  }
+
+  outstanding_++;
+  return true;
+}
+
+void irp_pool::pool::process(request *entry, uint32_t length,
+                             const report_callback &callback) {
+  auto header = reinterpret_cast<batch_header *>(entry->buffer);
+  uint32_t offset = sizeof(batch_header);
+  uint32_t count = 0;
+
+  /* every record is padded to the alignment, so a batch that is not a
+   * multiple of it cannot be walked without stepping past its end */
+  if (length < sizeof(batch_header) ||
+      header->length > length - sizeof(batch_header) ||
+      header->length % record_alignment) {
+    LOG_ERROR("report batch length is invalid: %lx", length);
+    return;
+  }
+
+  uint32_t end = sizeof(batch_header) + header->length;
+
+  while (count < header->count && count < span_capacity_ &&
+         end - offset >= sizeof(batch_record)) {
+    auto record = reinterpret_cast<batch_record *>(entry->buffer + offset);
+
+    if (record->type != record_type_data ||
+        record->length > end - offset - sizeof(batch_record) ||
+        get_record_size(record->length) > end - offset) {
+      LOG_ERROR("report batch record is invalid: %lx", record->length);
+      break;
+    }
+
+    uint32_t record_size = get_record_size(record->length);
+
+    spans_[count].buffer = record + 1;
+    spans_[count].length = record->length;
+    offset += record_size;
+    count++;
+  }
+
+  statistics_.batches++;
+  statistics_.queued = header->queued;
+  statistics_.dropped = header->dropped;
+
+  if (!count)
+    return;
+
+  /* packets that fail are still framed, so the rest of the batch is kept */
+  if (!crypt::decrypt_packets(spans_.get(), count, nullptr))
+    LOG_ERROR("failed to decrypt every packet of a report batch");
+
+  offset = sizeof(batch_header);
+
+  for (uint32_t index = 0; index < count; index++) {
+    auto record = reinterpret_cast<batch_record *>(entry->buffer + offset);
+    callback(spans_[index].buffer, spans_[index].length, record->sequence);
+    offset += get_record_size(record->length);
+  }
+
+  statistics_.reports += count;
+}
+
+bool irp_pool::pool::poll(uint32_t timeout_ms,
+                          const report_callback &callback) {
+  ULONG removed = 0;
+
+  if (!port_ || cancelled_)
+    return false;
+
+  if (!GetQueuedCompletionStatusEx(port_, entries_.get(), depth_, &removed,
+                                   timeout_ms, FALSE))
+    return GetLastError() == WAIT_TIMEOUT;
+
+  for (ULONG index = 0; index < removed; index++) {
+    auto entry = find_request(entries_[index].lpOverlapped);
+    DWORD transferred = 0;
+
+    if (!entry) {
+      LOG_ERROR("completion does not belong to a request: %p",
+                entries_[index].lpOverlapped);
+      statistics_.failed++;
+      continue;
+    }
+
+    outstanding_--;
+
+    if (GetOverlappedResult(device_, &entry->overlapped, &transferred,
+                            FALSE))
+      process(entry, transferred, callback);
+    else
+      statistics_.failed++;
+
+    issue(entry);
+  }
+
+  /* every request failing to reissue means nothing will ever complete */
+  return outstanding_ != 0;
+}
+
+void irp_pool::pool::cancel() {
+  ULONG removed = 0;
+
+  if (!port_ || cancelled_)
+    return;
+
+  cancelled_ = true;
+
+  for (uint32_t index = 0; index < depth_; index++)
+    CancelIoEx(device_, &requests_[index].overlapped);
+
+  /* the buffers must outlive every request the driver still holds */
+  while (outstanding_ &&
+         GetQueuedCompletionStatusEx(port_, entries_.get(), depth_, &removed,
+                                     INFINITE, FALSE)) {
+    for (ULONG index = 0; index < removed; index++) {
+      if (find_request(entries_[index].lpOverlapped))
+        outstanding_--;
+    }
+  }
+}
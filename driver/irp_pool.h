@@ -0,0 +1,110 @@
+#pragma once
+
+#include "common.h"
+#include "crypt.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <windows.h>
+#include <winioctl.h>
+
+namespace irp_pool {
+
+/* must match IOCTL_RETRIEVE_REPORT_BATCH and REPORT_BATCH_HEADER within the
+ * drivers io.h, records are framed as within the shared report ring */
+constexpr DWORD ioctl_retrieve_report_batch =
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x20031, METHOD_BUFFERED, FILE_ANY_ACCESS);
+constexpr uint32_t min_buffer_size = 0x1000;
+constexpr uint32_t record_alignment = 16;
+
+struct batch_header {
+  uint32_t count;
+  uint32_t length;
+  uint32_t queued;
+  uint32_t dropped;
+};
+
+struct batch_record {
+  uint32_t length;
+  uint32_t type;
+  uint64_t sequence;
+};
+
+struct config {
+  /* requests kept pending within the driver at all times */
+  uint32_t depth = 8;
+  /* output buffer size of each request, at least min_buffer_size */
+  uint32_t buffer_size = 0x10000;
+};
+
+struct statistics {
+  uint64_t batches;
+  uint64_t reports;
+  uint64_t failed;
+  /* the drivers counts as of the most recent batch */
+  uint32_t queued;
+  uint32_t dropped;
+};
+
+/* called for each decrypted packet, which is only valid during the call */
+using report_callback =
+    std::function<void(void *packet, uint32_t length, uint64_t sequence)>;
+
+/*
+ * keeps depth overlapped report requests pending on the driver, so that a
+ * request is almost always waiting when a report is scheduled. completions are
+ * dequeued from an I/O completion port in bulk, each batch is decrypted in
+ * place and its request immediately reissued with the same buffer, so no
+ * allocation is made once the pool is initialised.
+ */
+class pool {
+public:
+  ~pool();
+
+  /*
+   * opens a handle of its own to device_name with FILE_FLAG_OVERLAPPED. the
+   * handle is bound to the pools completion port, so it is never shared with
+   * any other overlapped I/O.
+   */
+  bool initialise(const wchar_t *device_name, const config &configuration);
+
+  /*
+   * waits up to timeout_ms for completed requests and returns the reports
+   * they carry. returns false only if the pool can no longer make progress.
+   */
+  bool poll(uint32_t timeout_ms, const report_callback &callback);
+
+  /* cancels every pending request and waits for them to complete */
+  void cancel();
+
+  statistics get_statistics() const { return statistics_; }
+
+private:
+  struct request {
+    /* must remain first, completions are mapped back to their request */
+    OVERLAPPED overlapped;
+    unsigned char *buffer;
+  };
+
+  request *find_request(OVERLAPPED *overlapped) const;
+  bool issue(request *entry);
+  void process(request *entry, uint32_t length,
+               const report_callback &callback);
+
+  HANDLE device_ = INVALID_HANDLE_VALUE;
+  HANDLE port_ = nullptr;
+  uint32_t buffer_size_ = 0;
+  uint32_t outstanding_ = 0;
+  bool cancelled_ = false;
+
+  std::unique_ptr<request[]> requests_;
+  std::unique_ptr<unsigned char[]> buffers_;
+  std::unique_ptr<OVERLAPPED_ENTRY[]> entries_;
+  std::unique_ptr<crypt::packet_span[]> spans_;
+  uint32_t depth_ = 0;
+  uint32_t span_capacity_ = 0;
+
+  statistics statistics_ = {};
+};
+} // namespace irp_pool
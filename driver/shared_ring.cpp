@@ -0,0 +1,85 @@
+#include "shared_ring.h"
+
+#include <cstddef>
+
+bool shared_ring::consumer::initialise(void *buffer, size_t size) {
+  if (size < ring_offset + sizeof(ring))
+    return false;
+
+  auto candidate =
+      reinterpret_cast<ring *>(static_cast<unsigned char *>(buffer) +
+                               ring_offset);
+
+  if (candidate->magic != ring_magic || !candidate->size ||
+      (candidate->size & (candidate->size - 1)) ||
+      ring_offset + offsetof(ring, data) + candidate->size > size) {
+    LOG_ERROR("shared report ring is invalid");
+    return false;
+  }
+
+  ring_ = candidate;
+  size_ = candidate->size;
+  return true;
+}
+
+bool shared_ring::consumer::read_next(std::vector<unsigned char> &out) {
+  if (!ring_)
+    return false;
+
+  for (;;) {
+    uint32_t head = ring_->head;
+    uint32_t tail = ring_->tail;
+
+    if (head == tail)
+      return false;
+
+    /* order the data reads after observing tail */
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    uint32_t offset = head & (size_ - 1);
+    auto entry = reinterpret_cast<record *>(&ring_->data[offset]);
+    uint32_t length = entry->length;
+
+    if (length > size_ - offset - sizeof(record)) {
+      LOG_ERROR("shared report ring record length is invalid: %lx", length);
+      ring_->head = tail;
+      return false;
+    }
+
+    uint32_t record_size = (sizeof(record) + length + record_alignment - 1) &
+                           ~(record_alignment - 1);
+
+    bool data = entry->type == record_type_data;
+
+    if (data)
+      out.assign(reinterpret_cast<unsigned char *>(entry + 1),
+                 reinterpret_cast<unsigned char *>(entry + 1) + length);
+
+    /* release the space back to the driver once the copy is complete */
+    std::atomic_thread_fence(std::memory_order_release);
+    ring_->head = head + record_size;
+
+    if (data)
+      return true;
+  }
+}
+
+bool shared_ring::consumer::wait(HANDLE event, uint32_t timeout_ms) {
+  if (!ring_)
+    return false;
+
+  if (ring_->head != ring_->tail)
+    return true;
+
+  /* the driver only signals if we are waiting, so recheck after setting */
+  InterlockedExchange(reinterpret_cast<volatile LONG *>(&ring_->waiting), 1);
+
+  if (ring_->head != ring_->tail) {
+    ring_->waiting = 0;
+    return true;
+  }
+
+  WaitForSingleObject(event, timeout_ms);
+  ring_->waiting = 0;
+  return ring_->head != ring_->tail;
+}
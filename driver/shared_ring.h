@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <windows.h>
+
+namespace shared_ring {
+
+/* must match SHARED_REPORT_RING within the drivers io.h */
+constexpr uint32_t ring_offset = 64;
+constexpr uint32_t ring_magic = 'gnir';
+constexpr uint32_t record_alignment = 16;
+constexpr uint32_t record_type_data = 0x0;
+constexpr uint32_t record_type_padding = 0x1;
+
+struct record {
+  uint32_t length;
+  uint32_t type;
+  uint64_t sequence;
+};
+
+struct ring {
+  uint32_t magic;
+  uint32_t size;
+  alignas(64) volatile uint32_t head;
+  volatile uint32_t waiting;
+  alignas(64) volatile uint32_t tail;
+  volatile uint32_t dropped;
+  alignas(64) unsigned char data[1];
+};
+
+class consumer {
+public:
+  /* buffer is the shared mapping returned by the driver */
+  bool initialise(void *buffer, size_t size);
+
+  /*
+   * copies the next packet into out, returning false if the ring is empty.
+   * packets are still encrypted and framed by their packet header.
+   */
+  bool read_next(std::vector<unsigned char> &out);
+
+  /*
+   * blocks until a packet is available or the timeout elapses. event must be
+   * the auto reset event passed to the driver when the mapping was created.
+   */
+  bool wait(HANDLE event, uint32_t timeout_ms);
+
+  uint32_t dropped() const { return ring_ ? ring_->dropped : 0; }
+
+private:
+  ring *ring_ = nullptr;
+  uint32_t size_ = 0;
+};
+} // namespace shared_ring
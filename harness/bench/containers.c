@@ -0,0 +1,444 @@
+#include "containers/map.h"
+#include "containers/tree.h"
+
+#include "harness.h"
+
+/*
+ * Insert, lookup, delete and enumerate throughput of the red-black tree
+ * against the hashmap with each of its storage types, followed by lookups
+ * mixed with updates from 1 to BENCH_MAX_THREADS threads contending on a
+ * single container. Usage: containers [max elements] [max threads]
+ */
+#define BENCH_MAX_ELEMENTS 1000000
+#define BENCH_MAX_THREADS  64
+
+/*
+ * One in BENCH_UPDATE_RATIO contended operations is a delete and reinsert.
+ * BENCH_CONTENDED_OPS are split between the threads of each run.
+ */
+#define BENCH_UPDATE_RATIO  8
+#define BENCH_CONTENDED_OPS 1000000
+
+typedef struct _BENCH_OBJECT {
+    UINT64 key;
+    UINT64 value;
+
+} BENCH_OBJECT, *PBENCH_OBJECT;
+
+typedef enum _BENCH_CONTAINER {
+    BenchRbTree,
+    BenchHashmapChained,
+    BenchHashmapOpenAddressed,
+    BenchHashmapResizable,
+    BenchContainerMax
+
+} BENCH_CONTAINER;
+
+STATIC PCSTR BenchContainerNames[BenchContainerMax] = {
+    "rbtree", "hashmap-chained", "hashmap-open", "hashmap-resizable"};
+
+typedef struct _BENCH_CONTAINERS {
+    BENCH_CONTAINER type;
+    RB_TREE         tree;
+    RTL_HASHMAP     map;
+
+} BENCH_CONTAINERS, *PBENCH_CONTAINERS;
+
+STATIC PUINT64 BenchKeys = NULL;
+
+/* bucket_count - 1 of the live non resizable map */
+STATIC UINT32 BenchBucketMask = 0;
+
+STATIC
+UINT32
+BenchTreeCompare(_In_ PVOID Key, _In_ PVOID Object)
+{
+    UINT64 key = *(PUINT64)Key;
+    UINT64 other = ((PBENCH_OBJECT)Object)->key;
+
+    if (key < other)
+        return RB_TREE_LESS_THAN;
+    else if (key > other)
+        return RB_TREE_GREATER_THAN;
+    else
+        return RB_TREE_EQUAL;
+}
+
+STATIC
+UINT32
+BenchHash(_In_ UINT64 Key)
+{
+    return (UINT32)((Key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+STATIC
+UINT32
+BenchHashIndex(_In_ UINT64 Key)
+{
+    return BenchHash(Key) & BenchBucketMask;
+}
+
+STATIC
+BOOLEAN
+BenchHashCompare(_In_ PVOID Struct1, _In_ PVOID Struct2)
+{
+    return ((PBENCH_OBJECT)Struct1)->key == *(PUINT64)Struct2;
+}
+
+STATIC
+NTSTATUS
+BenchCreate(_In_ BENCH_CONTAINER    Type,
+            _In_ UINT32             Elements,
+            _Out_ PBENCH_CONTAINERS Containers)
+{
+    RTL_HASHMAP_CONFIGURATION config = {0};
+    UINT32 buckets = 1;
+
+    memset(Containers, 0, sizeof(*Containers));
+    Containers->type = Type;
+
+    if (Type == BenchRbTree)
+        return RtlRbTreeCreate(
+            BenchTreeCompare, sizeof(BENCH_OBJECT), &Containers->tree);
+
+    /* two entries per bucket, or a quarter of the tree's initial size for
+     * resizable maps so that they grow during the insert pass */
+    while (buckets < Elements / 2)
+        buckets <<= 1;
+
+    config.storage = Type == BenchHashmapOpenAddressed
+                         ? HashmapStorageOpenAddressed
+                         : HashmapStorageChained;
+
+    if (Type == BenchHashmapResizable) {
+        config.resizable = TRUE;
+        buckets = max(buckets / 4, 16);
+    }
+
+    BenchBucketMask = buckets - 1;
+
+    return RtlHashmapCreateEx(buckets,
+                              sizeof(BENCH_OBJECT),
+                              config.resizable ? BenchHash : BenchHashIndex,
+                              BenchHashCompare,
+                              NULL,
+                              &config,
+                              &Containers->map);
+}
+
+STATIC
+VOID
+BenchDestroy(_Inout_ PBENCH_CONTAINERS Containers)
+{
+    if (Containers->type == BenchRbTree)
+        RtlRbTreeDeleteTree(&Containers->tree);
+    else
+        RtlHashmapDelete(&Containers->map);
+}
+
+STATIC
+VOID
+BenchInsert(_Inout_ PBENCH_CONTAINERS Containers, _In_ UINT64 Key)
+{
+    PBENCH_OBJECT object = NULL;
+    INT32 index = 0;
+
+    if (Containers->type == BenchRbTree) {
+        RtlRbTreeAcquireLock(&Containers->tree);
+        object = RtlRbTreeInsertNode(&Containers->tree, &Key);
+        object->key = Key;
+        object->value = Key;
+        RtlRbTreeReleaselock(&Containers->tree);
+        return;
+    }
+
+    index = RtlHashmapHashKeyAndAcquireBucket(&Containers->map, Key);
+    object = RtlHashmapEntryInsert(&Containers->map, index);
+
+    if (object) {
+        object->key = Key;
+        object->value = Key;
+    }
+
+    RtlHashmapReleaseBucket(&Containers->map, index);
+}
+
+STATIC
+UINT64
+BenchLookup(_Inout_ PBENCH_CONTAINERS Containers, _In_ UINT64 Key)
+{
+    PBENCH_OBJECT object = NULL;
+    UINT64 value = 0;
+    INT32 index = 0;
+
+    if (Containers->type == BenchRbTree) {
+        RtlRbTreeAcquireLockShared(&Containers->tree);
+        object = RtlRbTreeFindNodeObject(&Containers->tree, &Key);
+        value = object ? object->value : 0;
+        RtlRbTreeReleaseLockShared(&Containers->tree);
+        return value;
+    }
+
+    index = RtlHashmapHashKeyAndAcquireBucket(&Containers->map, Key);
+    object = RtlHashmapEntryLookup(&Containers->map, index, &Key);
+    value = object ? object->value : 0;
+    RtlHashmapReleaseBucket(&Containers->map, index);
+    return value;
+}
+
+STATIC
+VOID
+BenchDelete(_Inout_ PBENCH_CONTAINERS Containers, _In_ UINT64 Key)
+{
+    INT32 index = 0;
+
+    if (Containers->type == BenchRbTree) {
+        RtlRbTreeAcquireLock(&Containers->tree);
+        RtlRbTreeDeleteNode(&Containers->tree, &Key);
+        RtlRbTreeReleaselock(&Containers->tree);
+        return;
+    }
+
+    index = RtlHashmapHashKeyAndAcquireBucket(&Containers->map, Key);
+    RtlHashmapEntryDelete(&Containers->map, index, &Key);
+    RtlHashmapReleaseBucket(&Containers->map, index);
+}
+
+/* Both containers pass the object itself to the callback. */
+STATIC
+VOID
+BenchEnumerateCallback(_In_ PVOID Object, _In_opt_ PVOID Context)
+{
+    *(PUINT64)Context += ((PBENCH_OBJECT)Object)->value;
+}
+
+STATIC
+UINT64
+BenchEnumerate(_Inout_ PBENCH_CONTAINERS Containers)
+{
+    UINT64 sum = 0;
+
+    if (Containers->type == BenchRbTree)
+        RtlRbTreeEnumerate(&Containers->tree, BenchEnumerateCallback, &sum);
+    else
+        RtlHashmapEnumerate(&Containers->map,
+                            (ENUMERATE_HASHMAP)BenchEnumerateCallback,
+                            &sum);
+
+    return sum;
+}
+
+/* Lookups are made in an order unrelated to insertion. */
+FORCEINLINE
+STATIC
+UINT64
+BenchShuffledKey(_In_ UINT32 Index, _In_ UINT32 Elements)
+{
+    return BenchKeys[(Index * 7919ull) % Elements];
+}
+
+STATIC
+VOID
+BenchSingleThreaded(_In_ BENCH_CONTAINER Type, _In_ UINT32 Elements)
+{
+    BENCH_CONTAINERS containers;
+    UINT64 start = 0;
+    UINT64 sum = 0;
+    double insert = 0;
+    double lookup = 0;
+    double enumerate = 0;
+    double delete = 0;
+
+    if (!NT_SUCCESS(BenchCreate(Type, Elements, &containers))) {
+        printf("%-18s %8u create failed\n",
+               BenchContainerNames[Type],
+               Elements);
+        return;
+    }
+
+    start = BenchNow();
+    for (UINT32 index = 0; index < Elements; index++)
+        BenchInsert(&containers, BenchKeys[index]);
+    insert = BenchElapsed(start);
+
+    start = BenchNow();
+    for (UINT32 index = 0; index < Elements; index++)
+        sum += BenchLookup(&containers, BenchShuffledKey(index, Elements));
+    lookup = BenchElapsed(start);
+
+    start = BenchNow();
+    sum -= BenchEnumerate(&containers);
+    enumerate = BenchElapsed(start);
+
+    start = BenchNow();
+    for (UINT32 index = 0; index < Elements; index++)
+        BenchDelete(&containers, BenchKeys[index]);
+    delete = BenchElapsed(start);
+
+    /* every key was found and enumerated exactly once */
+    BENCH_CHECK(sum == 0);
+
+    printf("%-18s %8u %10.1f %10.1f %10.1f %10.1f\n",
+           BenchContainerNames[Type],
+           Elements,
+           BenchMops(Elements, insert),
+           BenchMops(Elements, lookup),
+           BenchMops(Elements, delete),
+           BenchMops(Elements, enumerate));
+
+    BenchDestroy(&containers);
+}
+
+typedef struct _BENCH_THREAD {
+    PBENCH_CONTAINERS containers;
+    UINT32            elements;
+    UINT32            thread;
+    UINT32            threads;
+    pthread_barrier_t* barrier;
+
+} BENCH_THREAD, *PBENCH_THREAD;
+
+/*
+ * Thread n only updates keys whose index is congruent to n, so that a
+ * delete is always followed by the reinsertion of the same key before any
+ * other thread touches it, and lookups of other threads keys may miss.
+ */
+STATIC
+PVOID
+BenchContendedThread(_In_ PVOID Context)
+{
+    PBENCH_THREAD thread = (PBENCH_THREAD)Context;
+    UINT32 seed = thread->thread + 1;
+    volatile UINT64 sink = 0;
+
+    pthread_barrier_wait(thread->barrier);
+
+    for (UINT32 op = 0; op < BENCH_CONTENDED_OPS / thread->threads; op++) {
+        UINT32 index = RtlRandomEx(&seed) % thread->elements;
+
+        if (op % BENCH_UPDATE_RATIO) {
+            sink += BenchLookup(thread->containers, BenchKeys[index]);
+            continue;
+        }
+
+        index = index - index % thread->threads + thread->thread;
+
+        if (index >= thread->elements)
+            continue;
+
+        BenchDelete(thread->containers, BenchKeys[index]);
+        BenchInsert(thread->containers, BenchKeys[index]);
+    }
+
+    UNREFERENCED_PARAMETER(sink);
+    return NULL;
+}
+
+STATIC
+VOID
+BenchContended(_In_ BENCH_CONTAINER Type,
+               _In_ UINT32          Elements,
+               _In_ UINT32          MaxThreads)
+{
+    BENCH_CONTAINERS containers;
+    BENCH_THREAD threads[BENCH_MAX_THREADS];
+    pthread_t handles[BENCH_MAX_THREADS];
+    pthread_barrier_t barrier;
+    UINT64 start = 0;
+    double elapsed = 0;
+
+    if (!NT_SUCCESS(BenchCreate(Type, Elements, &containers)))
+        return;
+
+    for (UINT32 index = 0; index < Elements; index++)
+        BenchInsert(&containers, BenchKeys[index]);
+
+    printf("%-18s %8u", BenchContainerNames[Type], Elements);
+
+    for (UINT32 count = 1; count <= MaxThreads; count *= 2) {
+        pthread_barrier_init(&barrier, NULL, count + 1);
+
+        for (UINT32 index = 0; index < count; index++) {
+            threads[index].containers = &containers;
+            threads[index].elements = Elements;
+            threads[index].thread = index;
+            threads[index].threads = count;
+            threads[index].barrier = &barrier;
+            pthread_create(
+                &handles[index], NULL, BenchContendedThread, &threads[index]);
+        }
+
+        pthread_barrier_wait(&barrier);
+        start = BenchNow();
+
+        for (UINT32 index = 0; index < count; index++)
+            pthread_join(handles[index], NULL);
+
+        elapsed = BenchElapsed(start);
+        pthread_barrier_destroy(&barrier);
+
+        printf(" %8.2f", BenchMops(BENCH_CONTENDED_OPS, elapsed));
+    }
+
+    printf("\n");
+
+    /* updates never change the contents, only the nodes */
+    for (UINT32 index = 0; index < Elements; index++)
+        BENCH_CHECK(BenchLookup(&containers, BenchKeys[index]) ==
+                    BenchKeys[index]);
+
+    BenchDestroy(&containers);
+}
+
+int
+main(int argc, char** argv)
+{
+    UINT32 max_elements = BenchQuick() ? 10000 : BENCH_MAX_ELEMENTS;
+    UINT32 max_threads = BenchQuick() ? 4 : BENCH_MAX_THREADS;
+    UINT32 seed = 0x5eed;
+    UINT32 contended = 0;
+
+    if (argc > 1)
+        max_elements = atoi(argv[1]);
+    if (argc > 2)
+        max_threads = atoi(argv[2]);
+
+    max_elements = max(min(max_elements, BENCH_MAX_ELEMENTS), 1000);
+    max_threads = max(min(max_threads, BENCH_MAX_THREADS), 1);
+    BenchKeys = malloc(sizeof(UINT64) * max_elements);
+
+    /* distinct keys, since the low bits are the index */
+    for (UINT32 index = 0; index < max_elements; index++)
+        BenchKeys[index] = ((UINT64)RtlRandomEx(&seed) << 32) |
+                           ((UINT64)RtlRandomEx(&seed) << 21 ^ index);
+
+    printf("single threaded, Mops/s\n");
+    printf("%-18s %8s %10s %10s %10s %10s\n",
+           "container",
+           "elements",
+           "insert",
+           "lookup",
+           "delete",
+           "enumerate");
+
+    for (UINT32 elements = 1000; elements <= max_elements; elements *= 10)
+        for (UINT32 type = 0; type < BenchContainerMax; type++)
+            BenchSingleThreaded(type, elements);
+
+    contended = min(100000, max_elements);
+
+    printf("\ncontended, 1 in %u operations an update, total Mops/s\n",
+           BENCH_UPDATE_RATIO);
+    printf("%-18s %8s", "container", "elements");
+
+    for (UINT32 count = 1; count <= max_threads; count *= 2)
+        printf(" %7ut", count);
+
+    printf("\n");
+
+    for (UINT32 type = 0; type < BenchContainerMax; type++)
+        BenchContended(type, contended, max_threads);
+
+    free(BenchKeys);
+    return 0;
+}
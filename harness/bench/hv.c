@@ -0,0 +1,280 @@
+#include "hv.h"
+
+#include "harness.h"
+
+#include <sched.h>
+
+/*
+ * The cpuid and reference workload timing distribution of hv.c, taken
+ * through PerformVirtualizationDetection as the IOCTL would. Each processor
+ * the process may run on is a thread pinned to it in place of a generic call
+ * DPC, so the samples are of the real cpuid, which traps to the hypervisor
+ * when run inside a VM exactly as it does in the kernel.
+ *
+ * Neither interrupts nor preemption are masked in user mode, and APERF
+ * cannot be read, so it is stood in for by the TSC, which always advances.
+ * INVD cannot be executed either and is never reported as emulated.
+ */
+STATIC BOOLEAN BenchAperfStalled;
+STATIC ULONG   BenchIrpInputLength;
+STATIC ULONG   BenchIrpOutputLength;
+
+unsigned long long
+__readmsr(unsigned long Register)
+{
+    BENCH_CHECK(Register == IA32_APERF_MSR);
+    return BenchAperfStalled ? 0 : __rdtsc();
+}
+
+void
+_disable(void)
+{
+}
+
+void
+_enable(void)
+{
+}
+
+INT
+TestINVDEmulation()
+{
+    return FALSE;
+}
+
+NTSTATUS
+ValidateIrpInputBuffer(_In_ PIRP Irp, _In_ ULONG RequiredSize)
+{
+    UNREFERENCED_PARAMETER(Irp);
+    return BenchIrpInputLength < RequiredSize ? STATUS_INVALID_BUFFER_SIZE
+                                               : STATUS_SUCCESS;
+}
+
+NTSTATUS
+ValidateIrpOutputBuffer(_In_ PIRP Irp, _In_ ULONG RequiredSize)
+{
+    UNREFERENCED_PARAMETER(Irp);
+    return BenchIrpOutputLength < RequiredSize ? STATUS_INVALID_BUFFER_SIZE
+                                                : STATUS_SUCCESS;
+}
+
+void*
+ImpExAllocatePool2(_In_ POOL_FLAGS Flags,
+                   _In_ SIZE_T     NumberOfBytes,
+                   _In_ ULONG      Tag)
+{
+    return ExAllocatePool2(Flags, NumberOfBytes, Tag);
+}
+
+VOID
+ImpExFreePoolWithTag(_In_ PVOID P, _In_ ULONG Tag)
+{
+    ExFreePoolWithTag(P, Tag);
+}
+
+typedef struct _BENCH_DPC_THREAD {
+    pthread_t          thread;
+    ULONG              processor;
+    PKDEFERRED_ROUTINE routine;
+    PVOID              context;
+    volatile LONG*     remaining;
+
+} BENCH_DPC_THREAD, *PBENCH_DPC_THREAD;
+
+VOID
+ImpKeSignalCallDpcDone(_In_ PVOID SystemArgument1)
+{
+    InterlockedDecrement((volatile LONG*)SystemArgument1);
+}
+
+STATIC
+PVOID
+BenchDpcThread(_In_ PVOID Argument)
+{
+    PBENCH_DPC_THREAD dpc = (PBENCH_DPC_THREAD)Argument;
+    cpu_set_t         set;
+
+    CPU_ZERO(&set);
+    CPU_SET(dpc->processor, &set);
+    BENCH_CHECK(!pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+    BENCH_CHECK(KeGetCurrentProcessorNumberEx(NULL) == dpc->processor);
+
+    dpc->routine(NULL, dpc->context, (PVOID)dpc->remaining, NULL);
+    return NULL;
+}
+
+/* Runs the routine once on every processor in parallel. */
+VOID
+ImpKeGenericCallDpc(_In_ PKDEFERRED_ROUTINE DpcRoutine, _In_ PVOID Context)
+{
+    ULONG             count = KeQueryActiveProcessorCount(NULL);
+    PBENCH_DPC_THREAD threads = calloc(count, sizeof(BENCH_DPC_THREAD));
+    volatile LONG     remaining = count;
+
+    BENCH_CHECK(threads != NULL);
+
+    for (ULONG index = 0; index < count; index++) {
+        threads[index].processor = index;
+        threads[index].routine = DpcRoutine;
+        threads[index].context = Context;
+        threads[index].remaining = &remaining;
+
+        BENCH_CHECK(!pthread_create(
+            &threads[index].thread, NULL, BenchDpcThread, &threads[index]));
+    }
+
+    for (ULONG index = 0; index < count; index++)
+        pthread_join(threads[index].thread, NULL);
+
+    /* every routine signalled its completion */
+    BENCH_CHECK(remaining == 0);
+    free(threads);
+}
+
+STATIC
+VOID
+BenchDetect(_In_opt_ PHYPERVISOR_TIMING_CONFIGURATION Configuration,
+            _Out_ PHYPERVISOR_DETECTION_REPORT        Report,
+            _Out_ double*                            Seconds)
+{
+    IRP    irp = {0};
+    UINT64 start = 0;
+    union {
+        HYPERVISOR_TIMING_CONFIGURATION configuration;
+        HYPERVISOR_DETECTION_REPORT     report;
+    } buffer = {0};
+
+    if (Configuration)
+        buffer.configuration = *Configuration;
+
+    irp.AssociatedIrp.SystemBuffer = &buffer;
+    BenchIrpInputLength =
+        Configuration ? sizeof(HYPERVISOR_TIMING_CONFIGURATION) : 0;
+    BenchIrpOutputLength = sizeof(HYPERVISOR_DETECTION_REPORT);
+
+    start = BenchNow();
+    BENCH_CHECK(NT_SUCCESS(PerformVirtualizationDetection(&irp)));
+    *Seconds = BenchElapsed(start);
+
+    BENCH_CHECK(irp.IoStatus.Information ==
+                sizeof(HYPERVISOR_DETECTION_REPORT));
+
+    *Report = buffer.report;
+}
+
+STATIC
+VOID
+BenchPrintReport(_In_ PCSTR                        Name,
+                 _In_ PHYPERVISOR_DETECTION_REPORT Report,
+                 _In_ double                       Seconds)
+{
+    PHYPERVISOR_TIMING_DISTRIBUTION distribution = &Report->distribution;
+
+    printf("%-8s %5u %7u %6llu %6llu %6llu %6llu %6llu %6llu %7.2f %4u/%-4u "
+           "%5u %5u %8.2f\n",
+           Name,
+           distribution->processor_count,
+           distribution->samples_per_processor,
+           distribution->cpuid_min,
+           distribution->cpuid_median,
+           distribution->cpuid_p90,
+           distribution->reference_min,
+           distribution->reference_median,
+           distribution->reference_p90,
+           (double)distribution->cpuid_median /
+               max(distribution->reference_median, 1),
+           distribution->flagged_processor_count,
+           distribution->processor_count,
+           Report->cpuid_timing_check,
+           Report->aperf_msr_timing_check,
+           Seconds * 1e3);
+}
+
+STATIC
+VOID
+BenchCheckReport(_In_ PHYPERVISOR_DETECTION_REPORT Report,
+                 _In_ UINT32                       BurstCount,
+                 _In_ UINT32                       SamplesPerBurst)
+{
+    PHYPERVISOR_TIMING_DISTRIBUTION distribution = &Report->distribution;
+
+    BENCH_CHECK(distribution->processor_count ==
+                KeQueryActiveProcessorCount(NULL));
+    BENCH_CHECK(distribution->samples_per_processor ==
+                BurstCount * SamplesPerBurst);
+    BENCH_CHECK(distribution->burst_count ==
+                BurstCount * distribution->processor_count);
+
+    BENCH_CHECK(distribution->cpuid_min <= distribution->cpuid_median);
+    BENCH_CHECK(distribution->cpuid_median <= distribution->cpuid_p90);
+    BENCH_CHECK(distribution->reference_min <=
+                distribution->reference_median);
+    BENCH_CHECK(distribution->reference_median <=
+                distribution->reference_p90);
+
+    BENCH_CHECK(distribution->flagged_processor_count <=
+                distribution->processor_count);
+    BENCH_CHECK(Report->cpuid_timing_check ==
+                (distribution->flagged_processor_count * 2 >
+                 distribution->processor_count));
+    BENCH_CHECK(!Report->invd_emulation_check);
+}
+
+int
+main()
+{
+    HYPERVISOR_DETECTION_REPORT     report = {0};
+    HYPERVISOR_TIMING_CONFIGURATION maximum = {
+        HV_TIMING_MAX_BURST_COUNT, HV_TIMING_MAX_SAMPLES_PER_BURST, 0};
+    double seconds = 0;
+    int    registers[4] = {0};
+
+    __cpuid(registers, 1);
+
+    printf("hypervisor timing, %u processors, hypervisor bit %s, ticks\n",
+           KeQueryActiveProcessorCount(NULL),
+           registers[2] & (1 << 31) ? "set" : "clear");
+    printf("%-8s %5s %7s %6s %6s %6s %6s %6s %6s %7s %9s %5s %5s %8s\n",
+           "config",
+           "procs",
+           "samples",
+           "id min",
+           "id med",
+           "id p90",
+           "rf min",
+           "rf med",
+           "rf p90",
+           "ratio",
+           "flagged",
+           "cpuid",
+           "aperf",
+           "ms");
+
+    /* without an input buffer the defaults are used */
+    BenchDetect(NULL, &report, &seconds);
+    BenchCheckReport(&report,
+                     HV_TIMING_DEFAULT_BURST_COUNT,
+                     HV_TIMING_DEFAULT_SAMPLES_PER_BURST);
+    BENCH_CHECK(!report.aperf_msr_timing_check);
+    BenchPrintReport("default", &report, seconds);
+
+    BenchDetect(&maximum, &report, &seconds);
+    BenchCheckReport(&report,
+                     HV_TIMING_MAX_BURST_COUNT,
+                     HV_TIMING_MAX_SAMPLES_PER_BURST);
+    BENCH_CHECK(!report.aperf_msr_timing_check);
+    BenchPrintReport("maximum", &report, seconds);
+
+    /* the APERF check is flagged once a majority of bursts stall */
+    BenchAperfStalled = TRUE;
+    BenchDetect(NULL, &report, &seconds);
+    BenchCheckReport(&report,
+                     HV_TIMING_DEFAULT_BURST_COUNT,
+                     HV_TIMING_DEFAULT_SAMPLES_PER_BURST);
+    BENCH_CHECK(report.aperf_msr_timing_check);
+    BENCH_CHECK(report.distribution.aperf_zero_count ==
+                report.distribution.burst_count);
+    BenchPrintReport("stalled", &report, seconds);
+
+    return 0;
+}
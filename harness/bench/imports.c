@@ -0,0 +1,278 @@
+/* CryptDecryptPointerOutOfPlace64 passes its volatile temporary on */
+#pragma GCC diagnostic ignored "-Wdiscarded-qualifiers"
+
+#include "crypt.h"
+#include "lib/stdlib.h"
+
+#include "harness.h"
+
+/*
+ * Per call cost of decrypting one import entry, the work each Imp* wrapper
+ * does before calling through, with per entry keys against the 32 byte
+ * block scheme they replaced. The block scheme's decryption is reproduced
+ * below as it was in crypt.c, with its block copy made both by the original
+ * byte at a time IntCopyMemory and by the current one.
+ *
+ * Calls visit the entries in a pseudo random order, as calls from different
+ * wrappers would, and each decrypted pointer is checked against the plain
+ * text array.
+ */
+#define BENCH_ENTRIES 128
+#define BENCH_CALLS   20000000
+
+#define BENCH_BLOCK_SIZE (sizeof(__m256i) / sizeof(UINT64))
+
+STATIC DECLSPEC_ALIGN(32) UINT64 BenchPlain[BENCH_ENTRIES];
+STATIC DECLSPEC_ALIGN(32) UINT64 BenchBlockArray[BENCH_ENTRIES];
+STATIC DECLSPEC_ALIGN(32) UINT64 BenchEntryArray[BENCH_ENTRIES];
+STATIC __m256i BenchImportsKey;
+STATIC UINT32 BenchOrder[BENCH_ENTRIES];
+
+typedef VOID (*BENCH_COPY)(_In_ PVOID  Destination,
+                           _In_ PVOID  Source,
+                           _In_ SIZE_T Length);
+
+/* IntCopyMemory before it was vectorised. */
+__attribute__((noinline, optimize("no-tree-vectorize")))
+STATIC
+VOID
+BenchByteCopy(_In_ PVOID Destination, _In_ PVOID Source, _In_ SIZE_T Length)
+{
+    PUCHAR dest = (PUCHAR)Destination;
+    PUCHAR src = (PUCHAR)Source;
+
+    for (SIZE_T index = 0; index < Length; index++)
+        dest[index] = src[index];
+}
+
+/* the block scheme crypt.c used before imports were encrypted per entry */
+STATIC
+VOID
+BenchBlockEncrypt(_In_ PUINT64 Array, _In_ UINT32 Entries)
+{
+    UINT32 block_count = Entries / BENCH_BLOCK_SIZE;
+
+    for (UINT32 block_index = 0; block_index < block_count; block_index++) {
+        __m256i* block = (__m256i*)&Array[block_index * BENCH_BLOCK_SIZE];
+
+        _mm256_storeu_si256(
+            block,
+            _mm256_xor_si256(_mm256_loadu_si256(block), BenchImportsKey));
+    }
+}
+
+FORCEINLINE
+STATIC
+__m256i
+BenchBlockDecryptBlock(_In_ PUINT64    Array,
+                       _In_ UINT32     BlockIndex,
+                       _In_ BENCH_COPY Copy)
+{
+    __m256i load_block = {0};
+
+    Copy(&load_block, &Array[BlockIndex * BENCH_BLOCK_SIZE], sizeof(__m256i));
+
+    return _mm256_xor_si256(load_block, BenchImportsKey);
+}
+
+FORCEINLINE
+STATIC
+VOID
+BenchBlockFindContainingBlock(_In_ UINT32   EntryIndex,
+                              _In_ UINT32   BlockSize,
+                              _Out_ PUINT32 ContainingBlockIndex,
+                              _Out_ PUINT32 BlockSubIndex)
+{
+    UINT32 containing_block = EntryIndex;
+    UINT32 block_index = 0;
+
+    if (EntryIndex < BlockSize) {
+        *ContainingBlockIndex = 0;
+        *BlockSubIndex = EntryIndex;
+        return;
+    }
+
+    if (EntryIndex == BlockSize) {
+        *ContainingBlockIndex = 1;
+        *BlockSubIndex = 0;
+        return;
+    }
+
+    while (containing_block % BlockSize != 0) {
+        containing_block--;
+        block_index++;
+    }
+
+    *ContainingBlockIndex = containing_block / BlockSize;
+    *BlockSubIndex = block_index;
+}
+
+/* out of line, as CryptDecryptImportsArrayEntry was */
+__attribute__((noinline))
+STATIC
+UINT64
+BenchBlockDecrypt(_In_ PUINT64    Array,
+                  _In_ UINT32     EntryIndex,
+                  _In_ BENCH_COPY Copy)
+{
+    __m256i original_block = {0};
+    __m128i original_half = {0};
+    UINT32 containing_block_index = 0;
+    UINT32 block_sub_index = 0;
+
+    BenchBlockFindContainingBlock(EntryIndex,
+                                  BENCH_BLOCK_SIZE,
+                                  &containing_block_index,
+                                  &block_sub_index);
+
+    original_block =
+        BenchBlockDecryptBlock(Array, containing_block_index, Copy);
+
+    if (block_sub_index < 2) {
+        original_half = _mm256_extracti128_si256(original_block, 0);
+
+        if (block_sub_index < 1)
+            return _mm_extract_epi64(original_half, 0);
+        else
+            return _mm_extract_epi64(original_half, 1);
+    }
+    else {
+        original_half = _mm256_extracti128_si256(original_block, 1);
+
+        if (block_sub_index == 2)
+            return _mm_extract_epi64(original_half, 0);
+        else
+            return _mm_extract_epi64(original_half, 1);
+    }
+}
+
+/* > `per entry scheme`, crypt.h */
+STATIC
+VOID
+BenchEntryEncrypt(_In_ PUINT64 Array, _In_ UINT32 Entries)
+{
+    for (UINT32 index = 0; index < Entries; index++)
+        CryptEncryptPointer64(
+            &Array[index],
+            CryptDeriveImportEntryKey((PUINT64)&BenchImportsKey, index));
+}
+
+/* out of line, as CryptDecryptImportsArrayEntry is */
+__attribute__((noinline))
+STATIC
+UINT64
+BenchEntryDecryptOutOfLine(_In_ PUINT64 Array, _In_ UINT32 EntryIndex)
+{
+    return CryptDecryptImportEntry(
+        Array, (PUINT64)&BenchImportsKey, EntryIndex);
+}
+
+typedef enum _BENCH_SCHEME {
+    BenchSchemeBlockByteCopy,
+    BenchSchemeBlockIntCopy,
+    BenchSchemeEntryOutOfLine,
+    BenchSchemeEntryInline,
+    BenchSchemeMax
+
+} BENCH_SCHEME;
+
+STATIC PCSTR BenchSchemeNames[BenchSchemeMax] = {
+    "block, byte at a time copy",
+    "block, IntCopyMemory",
+    "per entry, out of line",
+    "per entry, inlined"};
+
+FORCEINLINE
+STATIC
+UINT64
+BenchDecrypt(_In_ BENCH_SCHEME Scheme, _In_ UINT32 EntryIndex)
+{
+    switch (Scheme) {
+    case BenchSchemeBlockByteCopy:
+        return BenchBlockDecrypt(BenchBlockArray, EntryIndex, BenchByteCopy);
+    case BenchSchemeBlockIntCopy:
+        return BenchBlockDecrypt(BenchBlockArray, EntryIndex, IntCopyMemory);
+    case BenchSchemeEntryOutOfLine:
+        return BenchEntryDecryptOutOfLine(BenchEntryArray, EntryIndex);
+    default:
+        return CryptDecryptImportEntry(
+            BenchEntryArray, (PUINT64)&BenchImportsKey, EntryIndex);
+    }
+}
+
+/* Inlined with a constant Scheme, so each loop is specialised. */
+FORCEINLINE
+STATIC
+double
+BenchScheme(_In_ BENCH_SCHEME Scheme, _In_ UINT64 Calls)
+{
+    UINT64 start = BenchNow();
+    UINT64 mismatches = 0;
+
+    for (UINT64 call = 0; call < Calls; call++) {
+        UINT32 index = BenchOrder[call % BENCH_ENTRIES];
+
+        mismatches += BenchDecrypt(Scheme, index) != BenchPlain[index];
+    }
+
+    BENCH_CHECK(mismatches == 0);
+    return BenchElapsed(start);
+}
+
+STATIC
+double
+BenchRun(_In_ BENCH_SCHEME Scheme, _In_ UINT64 Calls)
+{
+    switch (Scheme) {
+    case BenchSchemeBlockByteCopy:
+        return BenchScheme(BenchSchemeBlockByteCopy, Calls);
+    case BenchSchemeBlockIntCopy:
+        return BenchScheme(BenchSchemeBlockIntCopy, Calls);
+    case BenchSchemeEntryOutOfLine:
+        return BenchScheme(BenchSchemeEntryOutOfLine, Calls);
+    default:
+        return BenchScheme(BenchSchemeEntryInline, Calls);
+    }
+}
+
+int
+main()
+{
+    UINT64 calls = BenchQuick() ? BENCH_CALLS / 20 : BENCH_CALLS;
+    UINT32 seed = 0x5eed;
+
+    BenchImportsKey = _mm256_set_epi64x(0x0123456789abcdefull,
+                                        0xfedcba9876543210ull,
+                                        0x0f1e2d3c4b5a6978ull,
+                                        0x8796a5b4c3d2e1f0ull);
+
+    for (UINT32 index = 0; index < BENCH_ENTRIES; index++) {
+        BenchPlain[index] = 0xfffff80000000000ull |
+                            ((UINT64)RtlRandomEx(&seed) << 4);
+        BenchOrder[index] = index;
+    }
+
+    /* a fixed permutation of the entries */
+    for (UINT32 index = BENCH_ENTRIES - 1; index > 0; index--) {
+        UINT32 other = RtlRandomEx(&seed) % (index + 1);
+        UINT32 swap = BenchOrder[index];
+
+        BenchOrder[index] = BenchOrder[other];
+        BenchOrder[other] = swap;
+    }
+
+    memcpy(BenchBlockArray, BenchPlain, sizeof(BenchPlain));
+    memcpy(BenchEntryArray, BenchPlain, sizeof(BenchPlain));
+    BenchBlockEncrypt(BenchBlockArray, BENCH_ENTRIES);
+    BenchEntryEncrypt(BenchEntryArray, BENCH_ENTRIES);
+
+    printf("import decrypt, %u entries, %llu calls\n", BENCH_ENTRIES, calls);
+    printf("%-28s %10s\n", "scheme", "ns/call");
+
+    for (UINT32 scheme = 0; scheme < BenchSchemeMax; scheme++)
+        printf("%-28s %10.2f\n",
+               BenchSchemeNames[scheme],
+               BenchRun(scheme, calls) * 1e9 / calls);
+
+    return 0;
+}
@@ -0,0 +1,233 @@
+#include "lib/stdlib.h"
+
+#include "harness.h"
+
+#include <string.h>
+
+/*
+ * Copy, compare and substring scan throughput of the lib routines against
+ * byte at a time scalar loops and the C runtime, for buffers either side of
+ * INT_AVX2_THRESHOLD. Each size processes BENCH_BYTES_PER_SIZE bytes in
+ * total, so small sizes are dominated by per call overhead. Buffers are
+ * cache resident except for the largest. The speedup is of lib over the
+ * scalar loops.
+ */
+#define BENCH_BYTES_PER_SIZE (512ull << 20)
+#define BENCH_MAX_SIZE       (1 << 20)
+
+STATIC CONST SIZE_T BenchSizes[] = {
+    16, 64, 1024, 4096, 65536, BENCH_MAX_SIZE};
+
+/* absent from the haystack, so each scan runs its full length */
+#define BENCH_NEEDLE "zyxq"
+
+typedef struct _BENCH_BUFFERS {
+    PUCHAR source;
+    PUCHAR destination;
+    PCHAR  haystack;
+
+} BENCH_BUFFERS, *PBENCH_BUFFERS;
+
+/* Keeps a result alive without the cost of a volatile sink in the loop. */
+#define BENCH_USE(value) __asm__ volatile("" : : "r"(value) : "memory")
+
+typedef enum _BENCH_IMPLEMENTATION {
+    BenchLib,
+    BenchScalar,
+    BenchRuntime,
+    BenchImplementationMax
+
+} BENCH_IMPLEMENTATION;
+
+/*
+ * The scalar loops the lib routines replaced, kept from being vectorised so
+ * that they remain a byte at a time baseline.
+ */
+#define BENCH_SCALAR __attribute__((noinline, optimize("no-tree-vectorize")))
+
+BENCH_SCALAR
+STATIC
+VOID
+BenchScalarCopy(_In_ PUCHAR Destination, _In_ PUCHAR Source, _In_ SIZE_T Length)
+{
+    for (SIZE_T index = 0; index < Length; index++)
+        Destination[index] = Source[index];
+}
+
+BENCH_SCALAR
+STATIC
+SIZE_T
+BenchScalarCompare(_In_ PUCHAR Source1, _In_ PUCHAR Source2, _In_ SIZE_T Length)
+{
+    for (SIZE_T index = 0; index < Length; index++)
+        if (Source1[index] != Source2[index])
+            return index;
+
+    return Length;
+}
+
+BENCH_SCALAR
+STATIC
+PCHAR
+BenchScalarFindSubstring(_In_ PCHAR String1, _In_ PCHAR String2)
+{
+    for (; *String1; String1++) {
+        SIZE_T index = 0;
+
+        while (String2[index] && String1[index] == String2[index])
+            index++;
+
+        if (!String2[index])
+            return String1;
+    }
+
+    return *String2 ? NULL : String1;
+}
+
+STATIC
+double
+BenchCopy(_In_ PBENCH_BUFFERS Buffers,
+          _In_ SIZE_T         Size,
+          _In_ UINT64         Iterations,
+          _In_ BENCH_IMPLEMENTATION Implementation)
+{
+    UINT64 start = BenchNow();
+
+    for (UINT64 index = 0; index < Iterations; index++) {
+        if (Implementation == BenchLib)
+            IntCopyMemory(Buffers->destination, Buffers->source, Size);
+        else if (Implementation == BenchScalar)
+            BenchScalarCopy(Buffers->destination, Buffers->source, Size);
+        else
+            memcpy(Buffers->destination, Buffers->source, Size);
+
+        BENCH_USE(Buffers->destination);
+    }
+
+    return BenchElapsed(start);
+}
+
+STATIC
+double
+BenchCompare(_In_ PBENCH_BUFFERS Buffers,
+             _In_ SIZE_T         Size,
+             _In_ UINT64         Iterations,
+             _In_ BENCH_IMPLEMENTATION Implementation)
+{
+    UINT64 start = BenchNow();
+    SIZE_T result = 0;
+
+    for (UINT64 index = 0; index < Iterations; index++) {
+        if (Implementation == BenchLib)
+            result = IntCompareMemory(
+                Buffers->destination, Buffers->source, Size);
+        else if (Implementation == BenchScalar)
+            result = BenchScalarCompare(
+                Buffers->destination, Buffers->source, Size);
+        else
+            result = memcmp(Buffers->destination, Buffers->source, Size);
+
+        BENCH_USE(result);
+    }
+
+    return BenchElapsed(start);
+}
+
+STATIC
+double
+BenchScan(_In_ PBENCH_BUFFERS Buffers,
+          _In_ SIZE_T         Size,
+          _In_ UINT64         Iterations,
+          _In_ BENCH_IMPLEMENTATION Implementation)
+{
+    UINT64 start = BenchNow();
+    PCHAR result = NULL;
+    PCHAR haystack = Buffers->haystack + BENCH_MAX_SIZE - Size;
+
+    for (UINT64 index = 0; index < Iterations; index++) {
+        if (Implementation == BenchLib)
+            result = IntFindSubstring(haystack, BENCH_NEEDLE);
+        else if (Implementation == BenchScalar)
+            result = BenchScalarFindSubstring(haystack, BENCH_NEEDLE);
+        else
+            result = strstr(haystack, BENCH_NEEDLE);
+
+        BENCH_USE(result);
+    }
+
+    BENCH_CHECK(result == NULL);
+    return BenchElapsed(start);
+}
+
+typedef double (*BENCH_ROUTINE)(_In_ PBENCH_BUFFERS Buffers,
+                                _In_ SIZE_T         Size,
+                                _In_ UINT64         Iterations,
+                                _In_ BENCH_IMPLEMENTATION Implementation);
+
+STATIC
+VOID
+BenchRoutine(_In_ PCSTR          Name,
+             _In_ BENCH_ROUTINE  Routine,
+             _In_ PBENCH_BUFFERS Buffers,
+             _In_ UINT64         BytesPerSize)
+{
+    double seconds[BenchImplementationMax] = {0};
+
+    for (UINT32 index = 0; index < ARRAYSIZE(BenchSizes); index++) {
+        SIZE_T size = BenchSizes[index];
+        UINT64 iterations = max(BytesPerSize / size, 1);
+
+        for (UINT32 type = 0; type < BenchImplementationMax; type++)
+            seconds[type] = Routine(Buffers, size, iterations, type);
+
+        printf("%-8s %8llu %10.2f %10.2f %10.2f %9.2fx\n",
+               Name,
+               size,
+               BenchGbps(iterations * size, seconds[BenchLib]),
+               BenchGbps(iterations * size, seconds[BenchScalar]),
+               BenchGbps(iterations * size, seconds[BenchRuntime]),
+               seconds[BenchLib] > 0
+                   ? seconds[BenchScalar] / seconds[BenchLib]
+                   : 0);
+    }
+}
+
+int
+main()
+{
+    BENCH_BUFFERS buffers = {0};
+    UINT64 bytes = BenchQuick() ? BENCH_BYTES_PER_SIZE / 64
+                                : BENCH_BYTES_PER_SIZE;
+    UINT32 seed = 0x5eed;
+
+    buffers.source = malloc(BENCH_MAX_SIZE);
+    buffers.destination = malloc(BENCH_MAX_SIZE);
+    buffers.haystack = malloc(BENCH_MAX_SIZE + 1);
+
+    /* equal buffers so that comparisons run their full length */
+    for (UINT32 index = 0; index < BENCH_MAX_SIZE; index++) {
+        buffers.source[index] = (UCHAR)RtlRandomEx(&seed);
+        buffers.haystack[index] = 'a' + RtlRandomEx(&seed) % 24;
+    }
+
+    buffers.haystack[BENCH_MAX_SIZE] = '\0';
+    memcpy(buffers.destination, buffers.source, BENCH_MAX_SIZE);
+
+    printf("GB/s, lib against scalar loops and the C runtime\n");
+    printf("%-8s %8s %10s %10s %10s %10s\n",
+           "routine",
+           "bytes",
+           "lib",
+           "scalar",
+           "runtime",
+           "speedup");
+
+    BenchRoutine("copy", BenchCopy, &buffers, bytes);
+    BenchRoutine("compare", BenchCompare, &buffers, bytes);
+    BenchRoutine("scan", BenchScan, &buffers, bytes / 4);
+
+    free(buffers.source);
+    free(buffers.destination);
+    free(buffers.haystack);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+/*
+ * Shared by the benchmarks and tests, which are built against the driver
+ * sources unmodified on top of shim/. See the Makefile for the include
+ * order that lets the driver's relative includes resolve.
+ */
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Unlike assert, still checked in the optimised benchmark builds. */
+#define BENCH_CHECK(expression)                                          \
+    do {                                                                 \
+        if (!(expression)) {                                             \
+            fprintf(stderr,                                              \
+                    "%s:%d: check failed: %s\n",                         \
+                    __FILE__,                                            \
+                    __LINE__,                                            \
+                    #expression);                                        \
+            exit(1);                                                     \
+        }                                                                \
+    } while (0)
+
+/* Set by make ci, benchmarks should shrink to a run of a few seconds. */
+FORCEINLINE
+STATIC
+BOOLEAN
+BenchQuick()
+{
+    return getenv("BENCH_QUICK") != NULL;
+}
+
+FORCEINLINE
+STATIC
+UINT64
+BenchNow()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Seconds since Start, as returned by BenchNow. */
+FORCEINLINE
+STATIC
+double
+BenchElapsed(_In_ UINT64 Start)
+{
+    return (double)(BenchNow() - Start) / 1e9;
+}
+
+FORCEINLINE
+STATIC
+double
+BenchMops(_In_ UINT64 Operations, _In_ double Seconds)
+{
+    return Seconds > 0 ? Operations / Seconds / 1e6 : 0;
+}
+
+FORCEINLINE
+STATIC
+double
+BenchGbps(_In_ UINT64 Bytes, _In_ double Seconds)
+{
+    return Seconds > 0 ? Bytes / Seconds / 1e9 : 0;
+}
+
+#endif
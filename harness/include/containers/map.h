@@ -0,0 +1 @@
+#include "../../../Driver/Header Files/map.h"
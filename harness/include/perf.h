@@ -0,0 +1 @@
+#include "../../Driver/Header Files/perf.h"
@@ -0,0 +1,52 @@
+#ifndef MODULE_BCRYPT_H
+#define MODULE_BCRYPT_H
+
+/*
+ * Declarations only. A target linking a source that falls back to CNG
+ * defines whichever of these it calls.
+ */
+#include "windows.h"
+
+typedef PVOID BCRYPT_ALG_HANDLE, BCRYPT_KEY_HANDLE;
+
+#define BCRYPT_SUCCESS(status) ((NTSTATUS)(status) >= 0)
+
+#define BCRYPT_AES_ALGORITHM   L"AES"
+#define BCRYPT_CHAINING_MODE   L"ChainingMode"
+#define BCRYPT_CHAIN_MODE_CBC  L"ChainingModeCBC"
+#define BCRYPT_OBJECT_LENGTH   L"ObjectLength"
+
+NTSTATUS BCryptOpenAlgorithmProvider(BCRYPT_ALG_HANDLE* Algorithm,
+                                     LPCWSTR            AlgorithmId,
+                                     LPCWSTR            Implementation,
+                                     ULONG              Flags);
+NTSTATUS BCryptSetProperty(PVOID   Object,
+                           LPCWSTR Property,
+                           PUCHAR  Input,
+                           ULONG   InputLength,
+                           ULONG   Flags);
+NTSTATUS BCryptGetProperty(PVOID   Object,
+                           LPCWSTR Property,
+                           PUCHAR  Output,
+                           ULONG   OutputLength,
+                           PULONG  Result,
+                           ULONG   Flags);
+NTSTATUS BCryptGenerateSymmetricKey(BCRYPT_ALG_HANDLE  Algorithm,
+                                    BCRYPT_KEY_HANDLE* Key,
+                                    PUCHAR             KeyObject,
+                                    ULONG              KeyObjectLength,
+                                    PUCHAR             Secret,
+                                    ULONG              SecretLength,
+                                    ULONG              Flags);
+NTSTATUS BCryptDecrypt(BCRYPT_KEY_HANDLE Key,
+                       PUCHAR            Input,
+                       ULONG             InputLength,
+                       PVOID             PaddingInfo,
+                       PUCHAR            Iv,
+                       ULONG             IvLength,
+                       PUCHAR            Output,
+                       ULONG             OutputLength,
+                       PULONG            Result,
+                       ULONG             Flags);
+
+#endif
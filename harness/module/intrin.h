@@ -0,0 +1,16 @@
+#ifndef MODULE_INTRIN_H
+#define MODULE_INTRIN_H
+
+#include <cpuid.h>
+
+/* the MSVC form, gcc's __cpuid being a macro of a different shape */
+#undef __cpuid
+
+static inline void
+__cpuid(int Registers[4], int Leaf)
+{
+    __cpuid_count(
+        Leaf, 0, Registers[0], Registers[1], Registers[2], Registers[3]);
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef MODULE_WINDOWS_H
+#define MODULE_WINDOWS_H
+
+/*
+ * The Win32 types the user mode module's sources use, for building them
+ * with g++. Only what the linked sources reference is declared.
+ */
+#include <cstdint>
+
+typedef unsigned char  boolean;
+typedef unsigned char  UCHAR, *PUCHAR;
+typedef unsigned long  ULONG, *PULONG;
+typedef unsigned long  DWORD;
+typedef long           LONG, NTSTATUS;
+typedef void*          PVOID;
+typedef const wchar_t* LPCWSTR;
+
+#endif
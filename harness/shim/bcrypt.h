@@ -0,0 +1,40 @@
+#ifndef SHIM_BCRYPT_H
+#define SHIM_BCRYPT_H
+
+/*
+ * Declarations only. The harness does not build the BCrypt backed parts of
+ * crypt.c, so none of these are defined in shim.c.
+ */
+typedef PVOID BCRYPT_ALG_HANDLE, BCRYPT_KEY_HANDLE, BCRYPT_HASH_HANDLE;
+
+typedef struct _BCRYPT_KEY_DATA_BLOB_HEADER {
+    ULONG dwMagic;
+    ULONG dwVersion;
+    ULONG cbKeyData;
+} BCRYPT_KEY_DATA_BLOB_HEADER, *PBCRYPT_KEY_DATA_BLOB_HEADER;
+
+#define BCRYPT_KEY_DATA_BLOB_MAGIC    0x4d42444b
+#define BCRYPT_KEY_DATA_BLOB_VERSION1 1
+#define BCRYPT_OBJECT_LENGTH          L"ObjectLength"
+#define BCRYPT_HASH_LENGTH            L"HashDigestLength"
+#define BCRYPT_KEY_DATA_BLOB          L"KeyDataBlob"
+#define BCRYPT_AES_ALGORITHM          L"AES"
+#define BCRYPT_SHA256_ALGORITHM       L"SHA256"
+#define BCRYPT_PROV_DISPATCH          1
+#define BCRYPT_HASH_REUSABLE_FLAG     0x20
+#define BCRYPT_BLOCK_PADDING          1
+
+NTSTATUS BCryptGetProperty();
+NTSTATUS BCryptCreateHash();
+NTSTATUS BCryptHashData();
+NTSTATUS BCryptFinishHash();
+NTSTATUS BCryptDestroyHash();
+NTSTATUS BCryptEncrypt();
+NTSTATUS BCryptDecrypt();
+NTSTATUS BCryptDestroyKey();
+NTSTATUS BCryptImportKey();
+NTSTATUS BCryptGenerateSymmetricKey();
+NTSTATUS BCryptOpenAlgorithmProvider();
+NTSTATUS BCryptCloseAlgorithmProvider();
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef SHIM_INTRIN_H
+#define SHIM_INTRIN_H
+
+/* the MSVC intrinsics shim.c does not provide out of line */
+static inline unsigned long long
+_udiv128(unsigned long long  High,
+         unsigned long long  Low,
+         unsigned long long  Divisor,
+         unsigned long long* Remainder)
+{
+    unsigned __int128 n = ((unsigned __int128)High << 64) | Low;
+
+    *Remainder = (unsigned long long)(n % Divisor);
+    return (unsigned long long)(n / Divisor);
+}
+
+/* privileged, so a target whose driver sources use them defines its own */
+unsigned long long __readmsr(unsigned long Register);
+unsigned long long __readcr3(void);
+void               _disable(void);
+void               _enable(void);
+
+#endif
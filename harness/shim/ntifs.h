@@ -0,0 +1,608 @@
+#ifndef SHIM_NTIFS_H
+#define SHIM_NTIFS_H
+
+/*
+ * Just enough of the WDK for the driver headers to compile in user mode, and
+ * for the containers, lib and crypt primitives to run on top of shim.c. Types
+ * the harness never touches are declared opaquely with the size of the real
+ * structure or larger, so that the layout of the driver structures embedding
+ * them is similar to that of the driver.
+ */
+#include <immintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* > `annotations` */
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _In_reads_bytes_(x)
+#define _Out_writes_(x)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_bytes_to_(x, y)
+#define _Inout_updates_(x)
+#define _Inout_updates_bytes_(x)
+#define _Field_size_(x)
+#define _Field_size_bytes_(x)
+#define _Function_class_(x)
+#define _IRQL_requires_(x)
+#define _IRQL_requires_max_(x)
+#define _IRQL_requires_min_(x)
+#define _IRQL_requires_same_
+#define _IRQL_raises_(x)
+#define _IRQL_saves_
+#define _IRQL_restores_
+#define _Requires_lock_held_(x)
+#define _Acquires_lock_(x)
+#define _Releases_lock_(x)
+#define _Use_decl_annotations_
+#define _When_(a, b)
+#define _At_(a, b)
+#define _Success_(x)
+#define _Must_inspect_result_
+#define _Deref_pre_maybenull_
+#define _Deref_post_maybenull_
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define IN
+#define OUT
+#define OPTIONAL
+
+/* > `compiler` */
+#define __int64            long long
+#define FORCEINLINE        inline __attribute__((always_inline))
+#define __forceinline      inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x)  __attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE)
+#define NTAPI
+#define NTKERNELAPI
+#define NTSYSAPI
+#define FASTCALL
+#define EXTERN_C
+#define __stdcall
+#define C_ASSERT(e) _Static_assert(e, #e)
+#ifndef static_assert
+#    define static_assert _Static_assert
+#endif
+#ifndef CONST
+#    define CONST const
+#endif
+
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+
+/* > `types` */
+typedef void VOID, *PVOID, **PPVOID;
+typedef char CHAR, *PCHAR, CCHAR;
+typedef const char *LPCSTR, *PCSZ, *PCSTR, *PCZPSTR;
+typedef signed char INT8, *PINT8;
+typedef unsigned char UCHAR, *PUCHAR, BYTE, BOOLEAN, *PBOOLEAN, UINT8, *PUINT8;
+typedef short SHORT, CSHORT;
+typedef unsigned short USHORT, *PUSHORT, WCHAR, *PWCHAR, *PWSTR, UINT16,
+    *PUINT16;
+typedef const WCHAR* PCWSTR;
+typedef int INT, INT32, *PINT32, LONG32, LONG, *PLONG;
+typedef unsigned int UINT, UINT32, *PUINT32, ULONG32, ULONG, *PULONG, DWORD32;
+typedef long long LONGLONG, INT64, *PINT64, LONG64, *PLONG64, LONG_PTR;
+typedef unsigned long long ULONGLONG, UINT64, *PUINT64, ULONG64, *PULONG64,
+    ULONG_PTR, *PULONG_PTR, SIZE_T, *PSIZE_T, DWORD_PTR, DWORD64, KAFFINITY,
+    *PKAFFINITY;
+typedef LONG  NTSTATUS;
+typedef LONG  KPRIORITY;
+typedef void *HANDLE, **PHANDLE;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef CCHAR KPROCESSOR_MODE;
+typedef ULONG ACCESS_MASK, DEVICE_TYPE;
+typedef ULONG64 POOL_FLAGS;
+typedef int   PROCESSINFOCLASS;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG  HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct { ULONG Flink, Blink; } LIST_ENTRY32;
+typedef struct { ULONG64 Flink, Blink; } LIST_ENTRY64;
+
+typedef struct _SINGLE_LIST_ENTRY {
+    struct _SINGLE_LIST_ENTRY* Next;
+} SINGLE_LIST_ENTRY, *PSINGLE_LIST_ENTRY;
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCHAR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+typedef struct { USHORT Length, MaximumLength; ULONG Buffer; } UNICODE_STRING32;
+
+typedef struct _ANSI_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PCHAR  Buffer;
+} ANSI_STRING, *PANSI_STRING;
+typedef const ANSI_STRING* PCANSI_STRING;
+
+typedef struct _CLIENT_ID {
+    HANDLE UniqueProcess;
+    HANDLE UniqueThread;
+} CLIENT_ID, *PCLIENT_ID;
+
+typedef struct {
+    ULONG dwOSVersionInfoSize, dwMajorVersion, dwMinorVersion, dwBuildNumber,
+        dwPlatformId;
+    WCHAR szCSDVersion[128];
+} RTL_OSVERSIONINFOW, *PRTL_OSVERSIONINFOW;
+
+typedef struct {
+    USHORT Group;
+    UCHAR  Number;
+    UCHAR  Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef struct _GROUP_AFFINITY {
+    KAFFINITY Mask;
+    USHORT    Group;
+    USHORT    Reserved[3];
+} GROUP_AFFINITY;
+
+typedef struct _RTL_BITMAP {
+    ULONG  SizeOfBitMap;
+    PULONG Buffer;
+} RTL_BITMAP, *PRTL_BITMAP;
+
+typedef struct {
+    union {
+        PVOID    VirtualAddress;
+        LONGLONG PhysicalAddress;
+    };
+} MM_COPY_ADDRESS;
+
+/* the lock types are backed by shim.c, and must fit the state it keeps */
+typedef struct { char opaque[64]; } KGUARDED_MUTEX, *PKGUARDED_MUTEX;
+typedef struct { char opaque[128]; } LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX,
+    NPAGED_LOOKASIDE_LIST, *PNPAGED_LOOKASIDE_LIST;
+typedef ULONG_PTR EX_PUSH_LOCK, *PEX_PUSH_LOCK;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+typedef LONG      EX_SPIN_LOCK, *PEX_SPIN_LOCK;
+
+/* opaque, never used by the harness */
+typedef struct { char opaque[64]; } FAST_MUTEX, KTIMER, *PKTIMER, KDPC, *PKDPC,
+    *PRKDPC, KAPC, *PKAPC, *PRKAPC, KEVENT, *PKEVENT, KAPC_STATE, *PKAPC_STATE,
+    IO_CSQ, *PIO_CSQ, EX_RUNDOWN_REF, *PEX_RUNDOWN_REF, ERESOURCE, XSTATE_SAVE,
+    *PXSTATE_SAVE, KSPIN_LOCK_QUEUE;
+typedef struct { ULONG opaque; } QUAD, OBJECT_HANDLE_INFORMATION,
+    *POBJECT_HANDLE_INFORMATION;
+typedef struct { PVOID opaque; } PHYSICAL_MEMORY_RANGE, *PPHYSICAL_MEMORY_RANGE,
+    IMAGE_INFO, *PIMAGE_INFO;
+typedef struct _SECURITY_QUALITY_OF_SERVICE {
+    int opaque;
+} SECURITY_QUALITY_OF_SERVICE;
+
+typedef struct _KTHREAD*                      PKTHREAD, *PETHREAD, *PRKTHREAD;
+typedef struct _KPROCESS*                     PKPROCESS, *PEPROCESS, *PRKPROCESS;
+typedef struct _DEVICE_OBJECT*                PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT*                PDRIVER_OBJECT;
+typedef struct _MDL*                          PMDL;
+typedef struct _IO_WORKITEM*                  PIO_WORKITEM;
+typedef struct _OBJECT_TYPE*                  POBJECT_TYPE;
+typedef struct _OBJECT_ATTRIBUTES*            POBJECT_ATTRIBUTES;
+typedef struct _IO_STATUS_BLOCK*              PIO_STATUS_BLOCK;
+typedef struct _CONTEXT*                      PCONTEXT;
+typedef struct _RTL_QUERY_REGISTRY_TABLE*     PRTL_QUERY_REGISTRY_TABLE;
+typedef struct _OB_CALLBACK_REGISTRATION*     POB_CALLBACK_REGISTRATION;
+typedef struct _OB_PRE_OPERATION_INFORMATION* POB_PRE_OPERATION_INFORMATION;
+typedef struct _OB_POST_OPERATION_INFORMATION* POB_POST_OPERATION_INFORMATION;
+typedef int OB_PREOP_CALLBACK_STATUS;
+
+typedef struct _IRP {
+    struct {
+        PVOID SystemBuffer;
+    } AssociatedIrp;
+    struct {
+        NTSTATUS  Status;
+        ULONG_PTR Information;
+    } IoStatus;
+    PVOID      UserBuffer;
+    PVOID      MdlAddress;
+    LIST_ENTRY ListEntry;
+    struct {
+        struct {
+            LIST_ENTRY ListEntry;
+        } Overlay;
+    } Tail;
+} IRP, *PIRP;
+
+typedef struct _IO_STACK_LOCATION {
+    union {
+        struct {
+            ULONG OutputBufferLength;
+            ULONG InputBufferLength;
+            ULONG IoControlCode;
+            PVOID Type3InputBuffer;
+        } DeviceIoControl;
+    } Parameters;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef enum { NonPagedPool, NonPagedPoolNx = 512 } POOL_TYPE;
+typedef enum {
+    CriticalWorkQueue,
+    DelayedWorkQueue,
+    NormalWorkQueue = 1,
+    HyperCriticalWorkQueue,
+    BackgroundWorkQueue
+} WORK_QUEUE_TYPE;
+typedef enum { Executive } KWAIT_REASON;
+typedef enum { KernelMode, UserMode } MODE;
+typedef enum { ViewShare = 1 } SECTION_INHERIT;
+typedef enum { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum {
+    HighImportance,
+    MediumImportance,
+    LowImportance
+} KDPC_IMPORTANCE;
+typedef enum {
+    EventCategoryReserved,
+    EventCategoryHardwareProfileChange,
+    EventCategoryDeviceInterfaceChange
+} IO_NOTIFICATION_EVENT_CATEGORY;
+
+typedef VOID (*PCREATE_PROCESS_NOTIFY_ROUTINE)(HANDLE, HANDLE, BOOLEAN);
+typedef VOID (*PCREATE_THREAD_NOTIFY_ROUTINE)(HANDLE, HANDLE, BOOLEAN);
+typedef VOID KDEFERRED_ROUTINE(PKDPC, PVOID, PVOID, PVOID);
+typedef KDEFERRED_ROUTINE* PKDEFERRED_ROUTINE;
+typedef VOID IO_WORKITEM_ROUTINE(PDEVICE_OBJECT, PVOID);
+typedef IO_WORKITEM_ROUTINE* PIO_WORKITEM_ROUTINE;
+typedef VOID KSTART_ROUTINE(PVOID);
+typedef KSTART_ROUTINE* PKSTART_ROUTINE;
+typedef NTSTATUS DRIVER_NOTIFICATION_CALLBACK_ROUTINE(PVOID, PVOID);
+typedef DRIVER_NOTIFICATION_CALLBACK_ROUTINE*
+    PDRIVER_NOTIFICATION_CALLBACK_ROUTINE;
+typedef VOID (*PIO_APC_ROUTINE)(PVOID, PIO_STATUS_BLOCK, ULONG);
+typedef ULONG_PTR KIPI_BROADCAST_WORKER(ULONG_PTR);
+typedef KIPI_BROADCAST_WORKER* PKIPI_BROADCAST_WORKER;
+typedef VOID (*PIO_CSQ_INSERT_IRP)(PIO_CSQ, PIRP);
+typedef VOID (*PIO_CSQ_REMOVE_IRP)(PIO_CSQ, PIRP);
+typedef PIRP (*PIO_CSQ_PEEK_NEXT_IRP)(PIO_CSQ, PIRP, PVOID);
+typedef VOID (*PIO_CSQ_ACQUIRE_LOCK)(PIO_CSQ, PKIRQL);
+typedef VOID (*PIO_CSQ_RELEASE_LOCK)(PIO_CSQ, KIRQL);
+typedef VOID (*PIO_CSQ_COMPLETE_CANCELED_IRP)(PIO_CSQ, PIRP);
+
+/* > `constants` */
+#ifndef NULL
+#    define NULL ((void*)0)
+#endif
+#define TRUE  1
+#define FALSE 0
+
+#define STATUS_SUCCESS                 ((NTSTATUS)0x00000000L)
+#define STATUS_ABANDONED               ((NTSTATUS)0x00000080L)
+#define STATUS_TIMEOUT                 ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                 ((NTSTATUS)0x00000103L)
+#define STATUS_MORE_ENTRIES            ((NTSTATUS)0x00000105L)
+#define STATUS_BUFFER_OVERFLOW         ((NTSTATUS)0x80000005L)
+#define STATUS_PARTIAL_COPY            ((NTSTATUS)0x8000000DL)
+#define STATUS_DEVICE_BUSY             ((NTSTATUS)0x80000011L)
+#define STATUS_NO_MORE_ENTRIES         ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL            ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED         ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER       ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE          ((NTSTATUS)0xC000000EL)
+#define STATUS_BUFFER_TOO_SMALL        ((NTSTATUS)0xC0000023L)
+#define STATUS_DATA_ERROR              ((NTSTATUS)0xC000003EL)
+#define STATUS_QUOTA_EXCEEDED          ((NTSTATUS)0xC0000044L)
+#define STATUS_DELETE_PENDING          ((NTSTATUS)0xC0000056L)
+#define STATUS_INVALID_IMAGE_FORMAT    ((NTSTATUS)0xC000007BL)
+#define STATUS_INSUFFICIENT_RESOURCES  ((NTSTATUS)0xC000009AL)
+#define STATUS_MEMORY_NOT_ALLOCATED    ((NTSTATUS)0xC00000A0L)
+#define STATUS_DEVICE_NOT_READY        ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED           ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED               ((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_ADDRESS         ((NTSTATUS)0xC0000141L)
+#define STATUS_INVALID_BUFFER_SIZE     ((NTSTATUS)0xC0000206L)
+#define STATUS_IMAGE_CHECKSUM_MISMATCH ((NTSTATUS)0xC0000221L)
+#define STATUS_NOT_FOUND               ((NTSTATUS)0xC0000225L)
+#define STATUS_RETRY                   ((NTSTATUS)0xC000022DL)
+#define STATUS_INVALID_IMAGE_HASH      ((NTSTATUS)0xC0000428L)
+#define STATUS_ALREADY_REGISTERED      ((NTSTATUS)0xC0000718L)
+#define NT_SUCCESS(s)                  (((NTSTATUS)(s)) >= 0)
+
+#define PAGE_SIZE      0x1000
+#define PAGE_SHIFT     12
+#define PAGE_READONLY  0x02
+#define PAGE_NOCACHE   0x200
+#define PASSIVE_LEVEL  0
+#define APC_LEVEL      1
+#define DISPATCH_LEVEL 2
+#define HIGH_LEVEL     15
+
+#define MAXUCHAR   0xff
+#define MAXUINT16  0xffff
+#define MAXLONG    0x7fffffff
+#define MAXULONG   (~0u)
+#define MAXUINT32  (~0u)
+#define MAXUINT64  (~0ull)
+#define MAXULONG64 (~0ull)
+
+#define ALL_PROCESSOR_GROUPS           0xffff
+#define POOL_FLAG_UNINITIALIZED        0x2ull
+#define POOL_FLAG_CACHE_ALIGNED        0x4ull
+#define POOL_FLAG_NON_PAGED            0x40ull
+#define XSTATE_MASK_LEGACY             3ull
+#define XSTATE_MASK_AVX                (1ull << 2)
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#define EX_DEFAULT_PUSH_LOCK_FLAGS     0
+#define MM_COPY_MEMORY_PHYSICAL        0x1
+#define MM_COPY_MEMORY_VIRTUAL         0x2
+#define EVENT_MODIFY_STATE             0x2
+#define IO_NO_INCREMENT                0
+#define DPFLTR_DEFAULT_ID              101
+#define DPFLTR_INFO_LEVEL              3
+#define EXCEPTION_EXECUTE_HANDLER      1
+
+/* > `macros` */
+#define ARGUMENT_PRESENT(a)       ((a) != NULL)
+#define UNREFERENCED_PARAMETER(p) (void)(p)
+#define FIELD_OFFSET(t, f)        offsetof(t, f)
+#define RTL_FIELD_SIZE(t, f)      (sizeof(((t*)0)->f))
+#define RTL_NUMBER_OF(a)          (sizeof(a) / sizeof((a)[0]))
+#define ARRAYSIZE                 RTL_NUMBER_OF
+#define CONTAINING_RECORD(a, t, f) ((t*)((PCHAR)(a) - offsetof(t, f)))
+#define NT_ASSERT(x)              ((void)0)
+#define PAGED_CODE()              ((void)0)
+#define Add2Ptr(p, i)             ((PVOID)((PUCHAR)(p) + (i)))
+#define ALIGN_UP_BY(l, a) \
+    ((((ULONG_PTR)(l)) + (a) - 1) & ~((ULONG_PTR)(a) - 1))
+#define ALIGN_DOWN_BY(l, a) (((ULONG_PTR)(l)) & ~((ULONG_PTR)(a) - 1))
+#define PAGE_ALIGN(va)      ((PVOID)((ULONG_PTR)(va) & ~(PAGE_SIZE - 1)))
+#define ROUND_TO_PAGES(s) \
+    (((ULONG_PTR)(s) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define BYTES_TO_PAGES(s) \
+    (((s) >> PAGE_SHIFT) + (((s) & (PAGE_SIZE - 1)) != 0))
+#ifndef min
+#    define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#    define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define RtlZeroMemory(d, l)       memset((d), 0, (l))
+#define RtlSecureZeroMemory(d, l) memset((d), 0, (l))
+#define RtlMoveMemory(d, s, l)    memmove((d), (s), (l))
+#define RtlCopyMemory(d, s, l)    memcpy((d), (s), (l))
+
+/* only code that never faults is built, so a handler is never entered */
+#define __try             if (1)
+#define __except(x)       else if (x)
+#define GetExceptionCode() ((NTSTATUS)0xC0000005L)
+
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define YieldProcessor()  _mm_pause()
+
+#define ReadNoFence(p)         __atomic_load_n((volatile LONG*)(p), __ATOMIC_RELAXED)
+#define ReadAcquire(p)         __atomic_load_n((volatile LONG*)(p), __ATOMIC_ACQUIRE)
+#define WriteRelease(p, v)     __atomic_store_n((volatile LONG*)(p), (v), __ATOMIC_RELEASE)
+#define ReadULongNoFence(p)    __atomic_load_n((volatile ULONG*)(p), __ATOMIC_RELAXED)
+#define ReadULongAcquire(p)    __atomic_load_n((volatile ULONG*)(p), __ATOMIC_ACQUIRE)
+#define WriteULongRelease(p, v) \
+    __atomic_store_n((volatile ULONG*)(p), (v), __ATOMIC_RELEASE)
+#define ReadAcquire64(p)       __atomic_load_n((volatile LONG64*)(p), __ATOMIC_ACQUIRE)
+#define ReadULong64NoFence(p)  __atomic_load_n((volatile ULONG64*)(p), __ATOMIC_RELAXED)
+#define ReadULong64Acquire(p)  __atomic_load_n((volatile ULONG64*)(p), __ATOMIC_ACQUIRE)
+#define WriteULong64Release(p, v) \
+    __atomic_store_n((volatile ULONG64*)(p), (v), __ATOMIC_RELEASE)
+#define WriteULong64NoFence(p, v) \
+    __atomic_store_n((volatile ULONG64*)(p), (v), __ATOMIC_RELAXED)
+#define ReadUShortNoFence(p)   __atomic_load_n((volatile USHORT*)(p), __ATOMIC_RELAXED)
+#define ReadBooleanNoFence(p)  __atomic_load_n((volatile BOOLEAN*)(p), __ATOMIC_RELAXED)
+#define ReadPointerAcquire(p)  __atomic_load_n((PVOID volatile*)(p), __ATOMIC_ACQUIRE)
+#define WritePointerRelease(p, v) \
+    __atomic_store_n((PVOID volatile*)(p), (v), __ATOMIC_RELEASE)
+
+/* > `interlocked` */
+#define InterlockedIncrement(p)   __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)   __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64     InterlockedExchange
+#define InterlockedAdd(p, v)           __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64               InterlockedAdd
+#define InterlockedExchangeAdd(p, v)   __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64       InterlockedExchangeAdd
+#define InterlockedOr(p, v)            __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr64                InterlockedOr
+#define InterlockedAnd(p, v)           __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, x, c) \
+    __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedCompareExchange64 InterlockedCompareExchange
+
+/* functions rather than macros so that discarding the result is silent */
+static inline PVOID
+InterlockedExchangePointer(PVOID volatile* Target, PVOID Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+static inline PVOID
+InterlockedCompareExchangePointer(PVOID volatile* Destination,
+                                  PVOID           Exchange,
+                                  PVOID           Comperand)
+{
+    return __sync_val_compare_and_swap(Destination, Comperand, Exchange);
+}
+#define InterlockedBitTestAndSet(p, b) \
+    ((__atomic_fetch_or((p), 1u << (b), __ATOMIC_SEQ_CST) >> (b)) & 1)
+#define InterlockedBitTestAndReset(p, b) \
+    ((__atomic_fetch_and((p), ~(1u << (b)), __ATOMIC_SEQ_CST) >> (b)) & 1)
+#define InterlockedBitTestAndSet64(p, b) \
+    ((__atomic_fetch_or((p), 1ull << (b), __ATOMIC_SEQ_CST) >> (b)) & 1)
+#define InterlockedBitTestAndReset64(p, b) \
+    ((__atomic_fetch_and((p), ~(1ull << (b)), __ATOMIC_SEQ_CST) >> (b)) & 1)
+
+/* > `intrinsics`, see shim.c */
+BOOLEAN _BitScanForward(ULONG* Index, ULONG Mask);
+BOOLEAN _BitScanForward64(ULONG* Index, ULONG64 Mask);
+BOOLEAN _BitScanReverse(ULONG* Index, ULONG Mask);
+BOOLEAN _BitScanReverse64(ULONG* Index, ULONG64 Mask);
+ULONG64 _rotl64(ULONG64 Value, int Shift);
+ULONG64 _rotr64(ULONG64 Value, int Shift);
+UINT64  _umul128(UINT64 A, UINT64 B, UINT64* High);
+UINT32  __popcnt(UINT32 Value);
+UINT64  __popcnt64(UINT64 Value);
+void    __cpuid(int Registers[4], int Leaf);
+void    __cpuidex(int Registers[4], int Leaf, int Subleaf);
+void    __movsb(PUCHAR Destination, const UCHAR* Source, SIZE_T Count);
+void    __stosb(PUCHAR Destination, UCHAR Value, SIZE_T Count);
+
+/* > `runtime`, see shim.c */
+ULONG DbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, ...);
+
+PVOID ExAllocatePool2(POOL_FLAGS Flags, SIZE_T Size, ULONG Tag);
+VOID  ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside,
+                                     PVOID              Allocate,
+                                     PVOID              Free,
+                                     POOL_TYPE          PoolType,
+                                     ULONG              Flags,
+                                     SIZE_T             Size,
+                                     ULONG              Tag,
+                                     USHORT             Depth);
+PVOID    ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside);
+VOID     ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry);
+VOID     ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside);
+
+VOID    KeInitializeGuardedMutex(PKGUARDED_MUTEX Mutex);
+VOID    KeAcquireGuardedMutex(PKGUARDED_MUTEX Mutex);
+VOID    KeReleaseGuardedMutex(PKGUARDED_MUTEX Mutex);
+BOOLEAN KeTryToAcquireGuardedMutex(PKGUARDED_MUTEX Mutex);
+
+VOID    ExInitializePushLock(PEX_PUSH_LOCK Lock);
+VOID    ExAcquirePushLockExclusiveEx(PEX_PUSH_LOCK Lock, ULONG Flags);
+VOID    ExReleasePushLockExclusiveEx(PEX_PUSH_LOCK Lock, ULONG Flags);
+VOID    ExAcquirePushLockSharedEx(PEX_PUSH_LOCK Lock, ULONG Flags);
+VOID    ExReleasePushLockSharedEx(PEX_PUSH_LOCK Lock, ULONG Flags);
+BOOLEAN ExTryAcquirePushLockExclusiveEx(PEX_PUSH_LOCK Lock, ULONG Flags);
+BOOLEAN ExTryAcquirePushLockSharedEx(PEX_PUSH_LOCK Lock, ULONG Flags);
+
+VOID KeEnterCriticalRegion(VOID);
+VOID KeLeaveCriticalRegion(VOID);
+VOID KeEnterGuardedRegion(VOID);
+VOID KeLeaveGuardedRegion(VOID);
+
+KIRQL    KeGetCurrentIrql(VOID);
+ULONG    KeGetCurrentProcessorNumber(VOID);
+ULONG    KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER Number);
+ULONG    KeQueryActiveProcessorCount(PKAFFINITY Affinity);
+ULONG    KeQueryActiveProcessorCountEx(USHORT Group);
+ULONG    KeQueryMaximumProcessorCountEx(USHORT Group);
+NTSTATUS KeSaveExtendedProcessorState(ULONG64 Mask, PXSTATE_SAVE State);
+VOID     KeRestoreExtendedProcessorState(PXSTATE_SAVE State);
+BOOLEAN  ExIsProcessorFeaturePresent(ULONG Feature);
+
+/* a target whose driver sources wait on an event defines these */
+VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+VOID KeClearEvent(PKEVENT Event);
+LONG KeSetEvent(PKEVENT Event, KPRIORITY Increment, BOOLEAN Wait);
+
+/* when non zero, returned by KeQueryInterruptTime in place of the clock */
+extern volatile ULONGLONG ShimInterruptTime;
+
+ULONGLONG KeQueryInterruptTime(VOID);
+VOID      KeQuerySystemTimePrecise(PLARGE_INTEGER Time);
+ULONG     RtlRandomEx(PULONG Seed);
+
+FORCEINLINE
+VOID
+InitializeListHead(PLIST_ENTRY Head)
+{
+    Head->Flink = Head->Blink = Head;
+}
+
+FORCEINLINE
+BOOLEAN
+IsListEmpty(PLIST_ENTRY Head)
+{
+    return Head->Flink == Head;
+}
+
+FORCEINLINE
+BOOLEAN
+RemoveEntryList(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY flink = Entry->Flink;
+    PLIST_ENTRY blink = Entry->Blink;
+
+    blink->Flink = flink;
+    flink->Blink = blink;
+    return flink == blink;
+}
+
+FORCEINLINE
+PLIST_ENTRY
+RemoveHeadList(PLIST_ENTRY Head)
+{
+    PLIST_ENTRY entry = Head->Flink;
+
+    RemoveEntryList(entry);
+    return entry;
+}
+
+FORCEINLINE
+VOID
+InsertHeadList(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+    Entry->Flink = Head->Flink;
+    Entry->Blink = Head;
+    Head->Flink->Blink = Entry;
+    Head->Flink = Entry;
+}
+
+FORCEINLINE
+VOID
+InsertTailList(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+    Entry->Blink = Head->Blink;
+    Entry->Flink = Head;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+
+/*
+ * Everything else the driver headers reference is declared without
+ * parameters. Calling one from a file the harness builds fails to link.
+ */
+VOID KeInitializeDpc();
+VOID KeInitializeTimer();
+VOID KeInitializeSpinLock();
+VOID KeAcquireSpinLock();
+VOID KeReleaseSpinLock();
+BOOLEAN KeSetTimer();
+BOOLEAN KeCancelTimer();
+VOID KeFlushQueuedDpcs();
+VOID ExInitializeRundownProtection();
+BOOLEAN MmIsAddressValid();
+PVOID MmMapIoSpaceEx();
+VOID MmUnmapIoSpace();
+PIO_STACK_LOCATION IoGetCurrentIrpStackLocation();
+NTSTATUS IoCsqInitialize();
+VOID IoCsqInsertIrp();
+PIRP IoCsqRemoveNextIrp();
+
+#endif
@@ -0,0 +1,478 @@
+#include <ntifs.h>
+
+#include "perf.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The kernel routines used by the containers, lib and crypt primitives,
+ * implemented over pthreads and the C runtime. Locks are real so that the
+ * contended benchmarks measure the containers locking schemes, everything
+ * else is the simplest thing that behaves like the kernel routine for the
+ * way the driver uses it.
+ */
+
+C_ASSERT(sizeof(pthread_mutex_t) <= sizeof(KGUARDED_MUTEX));
+
+/* > `intrinsics` */
+BOOLEAN
+_BitScanForward(ULONG* Index, ULONG Mask)
+{
+    if (!Mask)
+        return FALSE;
+
+    *Index = __builtin_ctz(Mask);
+    return TRUE;
+}
+
+BOOLEAN
+_BitScanForward64(ULONG* Index, ULONG64 Mask)
+{
+    if (!Mask)
+        return FALSE;
+
+    *Index = __builtin_ctzll(Mask);
+    return TRUE;
+}
+
+BOOLEAN
+_BitScanReverse(ULONG* Index, ULONG Mask)
+{
+    if (!Mask)
+        return FALSE;
+
+    *Index = 31 - __builtin_clz(Mask);
+    return TRUE;
+}
+
+BOOLEAN
+_BitScanReverse64(ULONG* Index, ULONG64 Mask)
+{
+    if (!Mask)
+        return FALSE;
+
+    *Index = 63 - __builtin_clzll(Mask);
+    return TRUE;
+}
+
+ULONG64
+_rotl64(ULONG64 Value, int Shift)
+{
+    Shift &= 63;
+    return Shift ? (Value << Shift) | (Value >> (64 - Shift)) : Value;
+}
+
+ULONG64
+_rotr64(ULONG64 Value, int Shift)
+{
+    Shift &= 63;
+    return Shift ? (Value >> Shift) | (Value << (64 - Shift)) : Value;
+}
+
+UINT64
+_umul128(UINT64 A, UINT64 B, UINT64* High)
+{
+    unsigned __int128 result = (unsigned __int128)A * B;
+
+    *High = (UINT64)(result >> 64);
+    return (UINT64)result;
+}
+
+UINT32
+__popcnt(UINT32 Value)
+{
+    return __builtin_popcount(Value);
+}
+
+UINT64
+__popcnt64(UINT64 Value)
+{
+    return __builtin_popcountll(Value);
+}
+
+void
+__cpuidex(int Registers[4], int Leaf, int Subleaf)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(Registers[0]),
+                       "=b"(Registers[1]),
+                       "=c"(Registers[2]),
+                       "=d"(Registers[3])
+                     : "a"(Leaf), "c"(Subleaf));
+}
+
+void
+__cpuid(int Registers[4], int Leaf)
+{
+    __cpuidex(Registers, Leaf, 0);
+}
+
+void
+__movsb(PUCHAR Destination, const UCHAR* Source, SIZE_T Count)
+{
+    __asm__ volatile("rep movsb"
+                     : "+D"(Destination), "+S"(Source), "+c"(Count)
+                     :
+                     : "memory");
+}
+
+void
+__stosb(PUCHAR Destination, UCHAR Value, SIZE_T Count)
+{
+    __asm__ volatile("rep stosb"
+                     : "+D"(Destination), "+c"(Count)
+                     : "a"(Value)
+                     : "memory");
+}
+
+/* > `runtime` */
+
+/* DEBUG_* output is only printed when HARNESS_DEBUG is set. */
+ULONG
+DbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, ...)
+{
+    va_list args;
+
+    UNREFERENCED_PARAMETER(ComponentId);
+    UNREFERENCED_PARAMETER(Level);
+
+    if (!getenv("HARNESS_DEBUG"))
+        return 0;
+
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+    return 0;
+}
+
+PVOID
+ExAllocatePool2(POOL_FLAGS Flags, SIZE_T Size, ULONG Tag)
+{
+    PVOID pool = NULL;
+
+    UNREFERENCED_PARAMETER(Tag);
+
+    if (Flags & POOL_FLAG_CACHE_ALIGNED) {
+        if (posix_memalign(&pool, SYSTEM_CACHE_ALIGNMENT_SIZE, Size))
+            return NULL;
+    }
+    else {
+        pool = malloc(Size);
+    }
+
+    if (pool && !(Flags & POOL_FLAG_UNINITIALIZED))
+        memset(pool, 0, Size);
+
+    return pool;
+}
+
+VOID
+ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    free(P);
+}
+
+typedef struct _SHIM_LOOKASIDE {
+    SIZE_T size;
+
+} SHIM_LOOKASIDE, *PSHIM_LOOKASIDE;
+
+C_ASSERT(sizeof(SHIM_LOOKASIDE) <= sizeof(LOOKASIDE_LIST_EX));
+
+NTSTATUS
+ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside,
+                            PVOID              Allocate,
+                            PVOID              Free,
+                            POOL_TYPE          PoolType,
+                            ULONG              Flags,
+                            SIZE_T             Size,
+                            ULONG              Tag,
+                            USHORT             Depth)
+{
+    UNREFERENCED_PARAMETER(Allocate);
+    UNREFERENCED_PARAMETER(Free);
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Flags);
+    UNREFERENCED_PARAMETER(Tag);
+    UNREFERENCED_PARAMETER(Depth);
+
+    ((PSHIM_LOOKASIDE)Lookaside)->size = Size;
+    return STATUS_SUCCESS;
+}
+
+/* Like the kernel, lookaside entries are not zeroed. */
+PVOID
+ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+    return malloc(((PSHIM_LOOKASIDE)Lookaside)->size);
+}
+
+VOID
+ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry)
+{
+    UNREFERENCED_PARAMETER(Lookaside);
+    free(Entry);
+}
+
+VOID
+ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+    UNREFERENCED_PARAMETER(Lookaside);
+}
+
+/* > `guarded mutex` */
+VOID
+KeInitializeGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+    pthread_mutex_init((pthread_mutex_t*)Mutex, NULL);
+}
+
+VOID
+KeAcquireGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+    pthread_mutex_lock((pthread_mutex_t*)Mutex);
+}
+
+VOID
+KeReleaseGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)Mutex);
+}
+
+BOOLEAN
+KeTryToAcquireGuardedMutex(PKGUARDED_MUTEX Mutex)
+{
+    return !pthread_mutex_trylock((pthread_mutex_t*)Mutex);
+}
+
+/*
+ * > `push lock`:
+ *   - bit 0 is set while held exclusive.
+ *   - bit 1 is set while an exclusive waiter is spinning, and holds off new
+ *     shared owners so a stream of lookups cannot starve a writer.
+ *   - the remaining bits count the shared owners.
+ */
+#define SHIM_PUSH_LOCK_EXCLUSIVE 0x1ull
+#define SHIM_PUSH_LOCK_WAITING   0x2ull
+#define SHIM_PUSH_LOCK_SHARED    0x4ull
+
+VOID
+ExInitializePushLock(PEX_PUSH_LOCK Lock)
+{
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+BOOLEAN
+ExTryAcquirePushLockExclusiveEx(PEX_PUSH_LOCK Lock, ULONG Flags)
+{
+    ULONG_PTR value = __atomic_load_n(Lock, __ATOMIC_RELAXED);
+
+    UNREFERENCED_PARAMETER(Flags);
+
+    if (value & ~SHIM_PUSH_LOCK_WAITING)
+        return FALSE;
+
+    return __atomic_compare_exchange_n(Lock,
+                                       &value,
+                                       SHIM_PUSH_LOCK_EXCLUSIVE,
+                                       FALSE,
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+VOID
+ExAcquirePushLockExclusiveEx(PEX_PUSH_LOCK Lock, ULONG Flags)
+{
+    while (!ExTryAcquirePushLockExclusiveEx(Lock, Flags)) {
+        __atomic_fetch_or(Lock, SHIM_PUSH_LOCK_WAITING, __ATOMIC_RELAXED);
+        sched_yield();
+    }
+}
+
+VOID
+ExReleasePushLockExclusiveEx(PEX_PUSH_LOCK Lock, ULONG Flags)
+{
+    UNREFERENCED_PARAMETER(Flags);
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+BOOLEAN
+ExTryAcquirePushLockSharedEx(PEX_PUSH_LOCK Lock, ULONG Flags)
+{
+    ULONG_PTR value = __atomic_load_n(Lock, __ATOMIC_RELAXED);
+
+    UNREFERENCED_PARAMETER(Flags);
+
+    while (!(value & (SHIM_PUSH_LOCK_EXCLUSIVE | SHIM_PUSH_LOCK_WAITING))) {
+        if (__atomic_compare_exchange_n(Lock,
+                                        &value,
+                                        value + SHIM_PUSH_LOCK_SHARED,
+                                        TRUE,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+VOID
+ExAcquirePushLockSharedEx(PEX_PUSH_LOCK Lock, ULONG Flags)
+{
+    while (!ExTryAcquirePushLockSharedEx(Lock, Flags))
+        sched_yield();
+}
+
+VOID
+ExReleasePushLockSharedEx(PEX_PUSH_LOCK Lock, ULONG Flags)
+{
+    UNREFERENCED_PARAMETER(Flags);
+    __atomic_fetch_sub(Lock, SHIM_PUSH_LOCK_SHARED, __ATOMIC_RELEASE);
+}
+
+VOID
+KeEnterCriticalRegion(VOID)
+{
+}
+
+VOID
+KeLeaveCriticalRegion(VOID)
+{
+}
+
+VOID
+KeEnterGuardedRegion(VOID)
+{
+}
+
+VOID
+KeLeaveGuardedRegion(VOID)
+{
+}
+
+/* > `processor` */
+KIRQL
+KeGetCurrentIrql(VOID)
+{
+    return PASSIVE_LEVEL;
+}
+
+ULONG
+KeGetCurrentProcessorNumber(VOID)
+{
+    int cpu = sched_getcpu();
+
+    return cpu < 0 ? 0 : (ULONG)cpu;
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER Number)
+{
+    ULONG cpu = KeGetCurrentProcessorNumber();
+
+    if (Number) {
+        Number->Group = 0;
+        Number->Number = (UCHAR)cpu;
+        Number->Reserved = 0;
+    }
+
+    return cpu;
+}
+
+ULONG
+KeQueryActiveProcessorCount(PKAFFINITY Affinity)
+{
+    UNREFERENCED_PARAMETER(Affinity);
+    return (ULONG)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+ULONG
+KeQueryActiveProcessorCountEx(USHORT Group)
+{
+    UNREFERENCED_PARAMETER(Group);
+    return KeQueryActiveProcessorCount(NULL);
+}
+
+ULONG
+KeQueryMaximumProcessorCountEx(USHORT Group)
+{
+    UNREFERENCED_PARAMETER(Group);
+    return (ULONG)sysconf(_SC_NPROCESSORS_CONF);
+}
+
+/* User mode threads may always use the AVX registers. */
+NTSTATUS
+KeSaveExtendedProcessorState(ULONG64 Mask, PXSTATE_SAVE State)
+{
+    UNREFERENCED_PARAMETER(Mask);
+    UNREFERENCED_PARAMETER(State);
+    return STATUS_SUCCESS;
+}
+
+VOID
+KeRestoreExtendedProcessorState(PXSTATE_SAVE State)
+{
+    UNREFERENCED_PARAMETER(State);
+}
+
+BOOLEAN
+ExIsProcessorFeaturePresent(ULONG Feature)
+{
+    if (Feature == PF_AVX2_INSTRUCTIONS_AVAILABLE)
+        return __builtin_cpu_supports("avx2") != 0;
+
+    return FALSE;
+}
+
+/* > `time` */
+
+/* set by the tests that step time themselves */
+volatile ULONGLONG ShimInterruptTime = 0;
+
+ULONGLONG
+KeQueryInterruptTime(VOID)
+{
+    struct timespec now;
+
+    if (ShimInterruptTime)
+        return ShimInterruptTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+}
+
+VOID
+KeQuerySystemTimePrecise(PLARGE_INTEGER Time)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    Time->QuadPart = (LONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+}
+
+ULONG
+RtlRandomEx(PULONG Seed)
+{
+    *Seed = *Seed * 1103515245 + 12345;
+    return (*Seed >> 1) & MAXLONG;
+}
+
+/*
+ * perf.c depends on the import table and the IOCTL path, so it is not built.
+ * The containers record into it unconditionally, which is a no-op here, so
+ * the benchmarks measure the containers without the counter updates.
+ */
+VOID
+PerfRecord(_In_ PERF_COUNTER_ID Id, _In_ UINT64 Start, _In_ UINT64 Bytes)
+{
+    UNREFERENCED_PARAMETER(Id);
+    UNREFERENCED_PARAMETER(Start);
+    UNREFERENCED_PARAMETER(Bytes);
+}
@@ -0,0 +1,3 @@
+#ifndef SHIM_WDF_H
+#define SHIM_WDF_H
+#endif
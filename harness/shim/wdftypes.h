@@ -0,0 +1,3 @@
+#ifndef SHIM_WDFTYPES_H
+#define SHIM_WDFTYPES_H
+#endif
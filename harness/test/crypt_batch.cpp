@@ -0,0 +1,252 @@
+#include "crypt.h"
+
+#include <bcrypt.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * crypt::decrypt_packets against AES-256-CBC known answers. The key, IV and
+ * first 4 blocks are the CBC-AES256 vector of NIST SP 800-38A F.2.5, and the
+ * following 13 blocks were encrypted by OpenSSL continuing the same chain:
+ *
+ *   openssl enc -aes-256-cbc -nopad -K <TestKey> -iv <TestIv>
+ *
+ * Every packet restarts the chain from the IV, so the first n blocks of the
+ * ciphertext make a packet of n blocks. One packet of each length from 1 to
+ * TEST_MAX_BLOCKS is decrypted in a single batch, covering the 4 block loop
+ * alone, the tail loop alone and both together.
+ */
+#define TEST_BLOCK_SIZE  16
+#define TEST_HEADER_SIZE 16
+#define TEST_NIST_BLOCKS 4
+#define TEST_MAX_BLOCKS  17
+#define TEST_GUARD       0xAA
+
+/* Unlike assert, still checked in the optimised builds. */
+#define TEST_CHECK(expression)                                           \
+    do {                                                                 \
+        if (!(expression)) {                                             \
+            fprintf(stderr,                                              \
+                    "%s:%d: check failed: %s\n",                         \
+                    __FILE__,                                            \
+                    __LINE__,                                            \
+                    #expression);                                        \
+            exit(1);                                                     \
+        }                                                                \
+    } while (0)
+
+static const unsigned char TestKey[32] = {
+    0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0,
+    0x85, 0x7d, 0x77, 0x81, 0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+    0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4};
+
+static const unsigned char TestIv[TEST_BLOCK_SIZE] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+
+static const unsigned char
+    TestNistPlaintext[TEST_NIST_BLOCKS * TEST_BLOCK_SIZE] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e,
+        0x11, 0x73, 0x93, 0x17, 0x2a, 0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03,
+        0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51, 0x30,
+        0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19,
+        0x1a, 0x0a, 0x52, 0xef, 0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b,
+        0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+
+static const unsigned char
+    TestCiphertext[TEST_MAX_BLOCKS * TEST_BLOCK_SIZE] = {
+    0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba, 0x77, 0x9e, 0xab, 0xfb,
+    0x5f, 0x7b, 0xfb, 0xd6, 0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d,
+    0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d, 0x39, 0xf2, 0x33, 0x69,
+    0xa9, 0xd9, 0xba, 0xcf, 0xa5, 0x30, 0xe2, 0x63, 0x04, 0x23, 0x14, 0x61,
+    0xb2, 0xeb, 0x05, 0xe2, 0xc3, 0x9b, 0xe9, 0xfc, 0xda, 0x6c, 0x19, 0x07,
+    0x8c, 0x6a, 0x9d, 0x1b, 0x1a, 0xa1, 0xcf, 0x35, 0x88, 0x79, 0x74, 0xb4,
+    0x43, 0x36, 0x51, 0x9f, 0x30, 0x6d, 0xc2, 0x35, 0x7c, 0x5e, 0x80, 0x73,
+    0x1b, 0xf1, 0x8c, 0xda, 0xe3, 0xe6, 0xe2, 0xa2, 0x9e, 0xb2, 0xd0, 0x9d,
+    0xee, 0x66, 0x74, 0xf6, 0xfe, 0x49, 0x3f, 0x4d, 0x8b, 0xdd, 0x21, 0x3f,
+    0x61, 0xc9, 0xbb, 0x09, 0x5a, 0xb8, 0x16, 0xb7, 0x8c, 0x4b, 0xdf, 0x0e,
+    0x40, 0x1c, 0xc5, 0xe4, 0x1c, 0x2c, 0x99, 0x06, 0xbc, 0x71, 0x5d, 0xc6,
+    0x6b, 0x80, 0x3e, 0x1b, 0x56, 0x06, 0xe5, 0xb7, 0xd0, 0x5f, 0xee, 0xcb,
+    0xee, 0x5e, 0xa9, 0x69, 0x42, 0x20, 0x52, 0x21, 0x5f, 0xfb, 0xb8, 0x93,
+    0x5a, 0x33, 0x97, 0xcb, 0x01, 0x71, 0xed, 0x08, 0x90, 0xe3, 0x0f, 0xbc,
+    0xa1, 0x57, 0x6e, 0x22, 0x94, 0xe9, 0x2f, 0xfd, 0x59, 0xa8, 0x51, 0x86,
+    0xd0, 0x99, 0x54, 0x0e, 0x09, 0x38, 0x4d, 0x41, 0x3b, 0x91, 0xff, 0x01,
+    0x35, 0x10, 0xcb, 0xf9, 0xed, 0x2c, 0xe2, 0x6c, 0x7e, 0x88, 0x16, 0xc6,
+    0x48, 0xed, 0x99, 0xda, 0xdb, 0x70, 0x65, 0xae, 0x73, 0x1f, 0x11, 0x55,
+    0x2d, 0xab, 0xeb, 0xf2, 0xcb, 0x7f, 0xa2, 0x6b, 0x76, 0x0d, 0xc6, 0xb2,
+    0x07, 0x47, 0xbe, 0x11, 0xf2, 0x33, 0x00, 0x4d, 0x03, 0x08, 0x19, 0xcf,
+    0x08, 0x6e, 0xb4, 0x20, 0x3b, 0x7c, 0x35, 0xc2, 0xb5, 0xcd, 0xb8, 0x15,
+    0x4e, 0x4a, 0x25, 0x9b, 0x84, 0x83, 0xd9, 0x83, 0x09, 0xe9, 0xc8, 0x66,
+    0x91, 0xa2, 0x71, 0x50, 0x5f, 0xaf, 0xcd, 0x81,
+};
+
+/* crypt.cpp, which defines these, is not part of the tree */
+const unsigned char*
+crypt::get_test_key()
+{
+    return TestKey;
+}
+
+const unsigned char*
+crypt::get_test_iv()
+{
+    return TestIv;
+}
+
+/* every machine the harness builds for has AES-NI, so CNG is never used */
+NTSTATUS
+BCryptOpenAlgorithmProvider(BCRYPT_ALG_HANDLE*, LPCWSTR, LPCWSTR, ULONG)
+{
+    TEST_CHECK(false);
+    return -1;
+}
+
+NTSTATUS
+BCryptSetProperty(PVOID, LPCWSTR, PUCHAR, ULONG, ULONG)
+{
+    TEST_CHECK(false);
+    return -1;
+}
+
+NTSTATUS
+BCryptGetProperty(PVOID, LPCWSTR, PUCHAR, ULONG, PULONG, ULONG)
+{
+    TEST_CHECK(false);
+    return -1;
+}
+
+NTSTATUS
+BCryptGenerateSymmetricKey(
+    BCRYPT_ALG_HANDLE, BCRYPT_KEY_HANDLE*, PUCHAR, ULONG, PUCHAR, ULONG, ULONG)
+{
+    TEST_CHECK(false);
+    return -1;
+}
+
+NTSTATUS
+BCryptDecrypt(BCRYPT_KEY_HANDLE,
+              PUCHAR,
+              ULONG,
+              PVOID,
+              PUCHAR,
+              ULONG,
+              PUCHAR,
+              ULONG,
+              PULONG,
+              ULONG)
+{
+    TEST_CHECK(false);
+    return -1;
+}
+
+static void
+TestPlaintext(unsigned char* Plaintext)
+{
+    memcpy(Plaintext, TestNistPlaintext, sizeof(TestNistPlaintext));
+
+    for (unsigned index = 0; index < (TEST_MAX_BLOCKS - TEST_NIST_BLOCKS) *
+                                         TEST_BLOCK_SIZE;
+         index++)
+        Plaintext[sizeof(TestNistPlaintext) + index] =
+            (unsigned char)(index * 7 + 3);
+}
+
+/* header, blocks, then a guard block that must be left alone */
+static void
+TestFramePacket(unsigned char* Packet, unsigned Blocks)
+{
+    for (unsigned index = 0; index < TEST_HEADER_SIZE; index++)
+        Packet[index] = (unsigned char)(0xF0 | Blocks);
+
+    memcpy(Packet + TEST_HEADER_SIZE, TestCiphertext, Blocks * TEST_BLOCK_SIZE);
+    memset(Packet + TEST_HEADER_SIZE + Blocks * TEST_BLOCK_SIZE,
+           TEST_GUARD,
+           TEST_BLOCK_SIZE);
+}
+
+static void
+TestCheckPacket(const unsigned char* Packet,
+                unsigned             Blocks,
+                const unsigned char* Plaintext)
+{
+    for (unsigned index = 0; index < TEST_HEADER_SIZE; index++)
+        TEST_CHECK(Packet[index] == (unsigned char)(0xF0 | Blocks));
+
+    TEST_CHECK(!memcmp(
+        Packet + TEST_HEADER_SIZE, Plaintext, Blocks * TEST_BLOCK_SIZE));
+
+    for (unsigned index = 0; index < TEST_BLOCK_SIZE; index++)
+        TEST_CHECK(Packet[TEST_HEADER_SIZE + Blocks * TEST_BLOCK_SIZE +
+                          index] == TEST_GUARD);
+}
+
+int
+main()
+{
+    const unsigned stride =
+        TEST_HEADER_SIZE + (TEST_MAX_BLOCKS + 1) * TEST_BLOCK_SIZE + 1;
+    unsigned char           plaintext[TEST_MAX_BLOCKS * TEST_BLOCK_SIZE];
+    unsigned char           malformed[TEST_HEADER_SIZE + TEST_BLOCK_SIZE + 1];
+    unsigned char*          buffer = nullptr;
+    crypt::packet_span      packets[TEST_MAX_BLOCKS] = {};
+    crypt::batch_statistics statistics = {};
+
+    TestPlaintext(plaintext);
+
+    /* successive packets start one byte further into a block, so nearly
+     * every load is unaligned */
+    buffer = static_cast<unsigned char*>(
+        malloc(static_cast<size_t>(stride) * TEST_MAX_BLOCKS + 1));
+    TEST_CHECK(buffer);
+
+    for (unsigned blocks = 1; blocks <= TEST_MAX_BLOCKS; blocks++) {
+        unsigned char* packet = buffer + 1 + (blocks - 1) * stride;
+
+        TestFramePacket(packet, blocks);
+        packets[blocks - 1].buffer = packet;
+        packets[blocks - 1].length =
+            TEST_HEADER_SIZE + blocks * TEST_BLOCK_SIZE;
+    }
+
+    TEST_CHECK(crypt::decrypt_packets(packets, TEST_MAX_BLOCKS, &statistics));
+    TEST_CHECK(statistics.aes_ni);
+    TEST_CHECK(statistics.packets == TEST_MAX_BLOCKS);
+    TEST_CHECK(statistics.blocks ==
+               TEST_MAX_BLOCKS * (TEST_MAX_BLOCKS + 1) / 2);
+
+    for (unsigned blocks = 1; blocks <= TEST_MAX_BLOCKS; blocks++)
+        TestCheckPacket(static_cast<unsigned char*>(packets[blocks - 1].buffer),
+                        blocks,
+                        plaintext);
+
+    /* a packet that is not a whole number of blocks is left untouched and
+     * fails the batch, without affecting the packets after it */
+    memset(malformed, 0x5A, sizeof(malformed));
+    packets[0].buffer = malformed;
+    packets[0].length = sizeof(malformed);
+    TestFramePacket(static_cast<unsigned char*>(packets[1].buffer), 2);
+
+    TEST_CHECK(!crypt::decrypt_packets(packets, 2, &statistics));
+    TEST_CHECK(statistics.packets == 2 && statistics.blocks == 2);
+
+    for (unsigned index = 0; index < sizeof(malformed); index++)
+        TEST_CHECK(malformed[index] == 0x5A);
+
+    TestCheckPacket(
+        static_cast<unsigned char*>(packets[1].buffer), 2, plaintext);
+
+    /* a header alone holds no blocks */
+    packets[0].buffer = malformed;
+    packets[0].length = TEST_HEADER_SIZE;
+    TEST_CHECK(crypt::decrypt_packets(packets, 1, &statistics));
+    TEST_CHECK(statistics.blocks == 0);
+
+    for (unsigned index = 0; index < sizeof(malformed); index++)
+        TEST_CHECK(malformed[index] == 0x5A);
+
+    free(buffer);
+    printf("ok\n");
+    return 0;
+}
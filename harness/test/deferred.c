@@ -0,0 +1,291 @@
+#include "deferred.h"
+
+#include "harness.h"
+
+/*
+ * The slicing of the deferred hash queue, run against a clock that only
+ * advances as modules are hashed. The work item, timer and DPC are recorded
+ * rather than run, and each is then run by the test, so every slice boundary
+ * is deterministic.
+ */
+#define TEST_HASH_TIME   4000
+#define TEST_ENTRY_COUNT 10
+
+STATIC BOOLEAN              TestLockHeld;
+STATIC UINT32               TestLockAcquires;
+STATIC PIO_WORKITEM_ROUTINE TestPendingWork;
+STATIC UINT32               TestWorkQueued;
+STATIC PKDPC                TestTimerDpc;
+STATIC LONGLONG             TestTimerDue;
+STATIC PKDEFERRED_ROUTINE   TestDpcRoutine;
+STATIC PVOID                TestDpcContext;
+STATIC UINT32               TestHashes;
+STATIC UINT32               TestFailHashes;
+
+VOID
+ImpKeAcquireGuardedMutex(_In_ PKGUARDED_MUTEX GuardedMutex)
+{
+    UNREFERENCED_PARAMETER(GuardedMutex);
+    BENCH_CHECK(!TestLockHeld);
+    TestLockHeld = TRUE;
+    TestLockAcquires++;
+}
+
+VOID
+ImpKeReleaseGuardedMutex(_In_ PKGUARDED_MUTEX GuardedMutex)
+{
+    UNREFERENCED_PARAMETER(GuardedMutex);
+    BENCH_CHECK(TestLockHeld);
+    TestLockHeld = FALSE;
+}
+
+/* unload never has to wait, every slice is run to completion by the test */
+NTSTATUS
+ImpKeDelayExecutionThread(KPROCESSOR_MODE WaitMode,
+                          BOOLEAN         Alertable,
+                          PLARGE_INTEGER  Interval)
+{
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+    UNREFERENCED_PARAMETER(Interval);
+    BENCH_CHECK(FALSE);
+    return STATUS_SUCCESS;
+}
+
+VOID
+ImpIoQueueWorkItem(_In_ PIO_WORKITEM         IoWorkItem,
+                   _In_ PIO_WORKITEM_ROUTINE WorkerRoutine,
+                   _In_ WORK_QUEUE_TYPE      QueueType,
+                   _In_opt_ PVOID            Context)
+{
+    UNREFERENCED_PARAMETER(IoWorkItem);
+    UNREFERENCED_PARAMETER(QueueType);
+    UNREFERENCED_PARAMETER(Context);
+
+    /* a slice is never queued while another is scheduled */
+    BENCH_CHECK(!TestPendingWork);
+    TestPendingWork = WorkerRoutine;
+    TestWorkQueued++;
+}
+
+VOID
+KeInitializeTimer(_Out_ PKTIMER Timer)
+{
+    UNREFERENCED_PARAMETER(Timer);
+}
+
+BOOLEAN
+KeSetTimer(_Inout_ PKTIMER Timer, _In_ LARGE_INTEGER DueTime, _In_opt_ PKDPC Dpc)
+{
+    UNREFERENCED_PARAMETER(Timer);
+    BENCH_CHECK(!TestTimerDpc);
+    TestTimerDpc = Dpc;
+    TestTimerDue = DueTime.QuadPart;
+    return FALSE;
+}
+
+BOOLEAN
+KeCancelTimer(_Inout_ PKTIMER Timer)
+{
+    UNREFERENCED_PARAMETER(Timer);
+
+    if (!TestTimerDpc)
+        return FALSE;
+
+    TestTimerDpc = NULL;
+    return TRUE;
+}
+
+VOID
+KeInitializeDpc(_Out_ PKDPC              Dpc,
+                _In_ PKDEFERRED_ROUTINE DeferredRoutine,
+                _In_opt_ PVOID          DeferredContext)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    TestDpcRoutine = DeferredRoutine;
+    TestDpcContext = DeferredContext;
+}
+
+VOID
+KeFlushQueuedDpcs()
+{
+}
+
+VOID
+DriverListEntryToExtendedModuleInfo(_In_ PDRIVER_LIST_ENTRY         Entry,
+                                    _Out_ PRTL_MODULE_EXTENDED_INFO Extended)
+{
+    UNREFERENCED_PARAMETER(Entry);
+    UNREFERENCED_PARAMETER(Extended);
+}
+
+NTSTATUS
+HashModule(_In_ PRTL_MODULE_EXTENDED_INFO Module, _Out_ PVOID Hash)
+{
+    UNREFERENCED_PARAMETER(Module);
+    UNREFERENCED_PARAMETER(Hash);
+
+    /* modules are hashed without the list lock held */
+    BENCH_CHECK(!TestLockHeld);
+
+    ShimInterruptTime += TEST_HASH_TIME;
+    TestHashes++;
+
+    if (TestFailHashes) {
+        TestFailHashes--;
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+STATIC
+BOOLEAN
+TestRunWork()
+{
+    PIO_WORKITEM_ROUTINE routine = TestPendingWork;
+
+    if (!routine)
+        return FALSE;
+
+    TestPendingWork = NULL;
+    routine(NULL, NULL);
+    return TRUE;
+}
+
+STATIC
+BOOLEAN
+TestFireTimer()
+{
+    if (!TestTimerDpc)
+        return FALSE;
+
+    TestTimerDpc = NULL;
+    TestDpcRoutine(NULL, TestDpcContext, NULL, NULL);
+    return TRUE;
+}
+
+int
+main()
+{
+    DRIVER_LIST_HEAD         list = {0};
+    DRIVER_LIST_ENTRY        entries[TEST_ENTRY_COUNT] = {0};
+    DRIVER_LIST_ENTRY        failing = {0};
+    DEFERRED_HASH_STATISTICS statistics = {0};
+    ULONG                    depth = 1;
+    UINT64                   slice = 0;
+
+    ShimInterruptTime = 1;
+
+    /* a query before the list exists takes no lock */
+    DeferredHashQueryStatistics(&depth, &statistics);
+    BENCH_CHECK(!depth && !statistics.slices && !TestLockAcquires);
+
+    InitializeListHead(&list.deferred_list);
+    list.work_item = (PIO_WORKITEM)1;
+    BENCH_CHECK(NT_SUCCESS(DeferredHashInitialise(&list)));
+
+    for (UINT32 index = 0; index < TEST_ENTRY_COUNT; index++)
+        DeferredHashEnqueue(&entries[index]);
+
+    /* nothing is queued until x86 modules can be hashed */
+    BENCH_CHECK(!TestPendingWork && list.deferred_count == TEST_ENTRY_COUNT);
+
+    TestFailHashes = 1;
+    DeferredHashStart();
+    BENCH_CHECK(TestPendingWork && TestWorkQueued == 1);
+
+    /* a 1000us budget at 400us a module hashes 3 a slice, each taking the
+     * lock to dequeue and to record, plus the statistics update. The first
+     * module fails and is put back at the tail of the queue by the slice
+     * itself. */
+    TestLockAcquires = 0;
+    TestRunWork();
+    BENCH_CHECK(TestLockAcquires == 7 && TestHashes == 3);
+    BENCH_CHECK(list.deferred_count == TEST_ENTRY_COUNT - 2 && TestTimerDpc);
+    BENCH_CHECK(TestTimerDue ==
+                RELATIVE(MILLISECONDS(DEFERRED_HASH_DEFAULT_YIELD_INTERVAL_MS)));
+    BENCH_CHECK(!entries[0].hashed && entries[0].deferred_attempts == 1);
+    BENCH_CHECK(CONTAINING_RECORD(list.deferred_list.Blink,
+                                  DRIVER_LIST_ENTRY,
+                                  deferred_entry) == &entries[0]);
+    BENCH_CHECK(!TestPendingWork);
+
+    while (TestFireTimer())
+        TestRunWork();
+
+    BENCH_CHECK(TestHashes == TEST_ENTRY_COUNT + 1);
+    BENCH_CHECK(!list.deferred_count && list.deferred_complete);
+    BENCH_CHECK(!TestPendingWork && entries[0].hashed);
+
+    DeferredHashQueryStatistics(&depth, &statistics);
+    BENCH_CHECK(!depth);
+    BENCH_CHECK(statistics.hashed == TEST_ENTRY_COUNT);
+    BENCH_CHECK(statistics.failed == 1 && !statistics.abandoned);
+    BENCH_CHECK(statistics.slices == 4);
+
+    /* the slice that found the list empty cleared the state, so the next
+     * module queues a slice of its own */
+    DeferredHashEnqueue(&entries[1]);
+    BENCH_CHECK(TestPendingWork && TestWorkQueued == 5);
+    TestRunWork();
+    BENCH_CHECK(!list.deferred_count && !TestTimerDpc && !TestPendingWork);
+
+    /* a module that never hashes is retried until abandoned. Though it is
+     * the only module queued, each retry waits for the next slice. */
+    TestFailHashes = DEFERRED_HASH_MAX_ATTEMPTS;
+    DeferredHashEnqueue(&failing);
+    TestRunWork();
+
+    for (UINT32 attempt = 1; attempt < DEFERRED_HASH_MAX_ATTEMPTS; attempt++) {
+        /* failed in the slice just run, and in none before it */
+        BENCH_CHECK(failing.deferred_slice == list.deferred_statistics.slices);
+        BENCH_CHECK(failing.deferred_slice > slice);
+        slice = failing.deferred_slice;
+
+        BENCH_CHECK(TestHashes == TEST_ENTRY_COUNT + 2 + attempt);
+        BENCH_CHECK(failing.deferred_attempts == attempt);
+        BENCH_CHECK(list.deferred_count == 1 && !TestPendingWork);
+        BENCH_CHECK(TestTimerDpc);
+        BENCH_CHECK(TestTimerDue ==
+                    RELATIVE(MILLISECONDS(DEFERRED_HASH_DEFAULT_YIELD_INTERVAL_MS)));
+
+        BENCH_CHECK(TestFireTimer() && TestRunWork());
+    }
+
+    BENCH_CHECK(TestHashes == TEST_ENTRY_COUNT + 2 + DEFERRED_HASH_MAX_ATTEMPTS);
+    BENCH_CHECK(!list.deferred_count && !TestTimerDpc && !TestPendingWork);
+    BENCH_CHECK(!failing.hashed && list.deferred_complete);
+
+    DeferredHashQueryStatistics(&depth, &statistics);
+    BENCH_CHECK(statistics.failed == 1 + DEFERRED_HASH_MAX_ATTEMPTS);
+    BENCH_CHECK(statistics.abandoned == 1);
+    BENCH_CHECK(statistics.slices == 5 + DEFERRED_HASH_MAX_ATTEMPTS);
+
+    /* a budget of 0 hashes a single module a slice */
+    DeferredHashConfigure(0, 5);
+    DeferredHashEnqueue(&entries[2]);
+    DeferredHashEnqueue(&entries[3]);
+    TestRunWork();
+    BENCH_CHECK(TestHashes == TEST_ENTRY_COUNT + 3 + DEFERRED_HASH_MAX_ATTEMPTS &&
+                TestTimerDpc);
+    BENCH_CHECK(TestTimerDue == RELATIVE(MILLISECONDS(5)));
+
+    /* unloading with a slice waiting on the timer cancels it, and waits on
+     * the list lock for a slice that cleared the state while holding it */
+    TestLockAcquires = 0;
+    DeferredHashFree();
+    BENCH_CHECK(!TestTimerDpc && !TestPendingWork && TestLockAcquires == 1);
+
+    /* nothing is queued once unloaded */
+    DeferredHashEnqueue(&entries[4]);
+    BENCH_CHECK(!TestPendingWork);
+
+    printf("deferred: %llu hashed, %llu failed, %llu abandoned over %llu "
+           "slices\n",
+           statistics.hashed,
+           statistics.failed,
+           statistics.abandoned,
+           statistics.slices);
+    return 0;
+}
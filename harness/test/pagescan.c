@@ -0,0 +1,390 @@
+#include "pagescan.h"
+
+#include "harness.h"
+
+#include <string.h>
+
+/*
+ * Sweeps a fake paging hierarchy. Nearly all of system space is not present,
+ * so a sweep only finishes in reasonable time if the cursor skips each
+ * non-present PML4E and PDPTE region, including when another thread has
+ * claimed a unit within the region in the meantime.
+ *
+ * The first sweep runs on the calling thread alone, and the claim of another
+ * thread is simulated at the start of every non-present region, after the
+ * region has been claimed but before it is skipped. Later sweeps run the work
+ * items as threads, so units are claimed concurrently.
+ */
+#define TEST_TABLE_COUNT 8
+#define TEST_PAGE_COUNT  8
+
+#define TEST_ENTRY_PRESENT 0x1ull
+#define TEST_ENTRY_LARGE   0x80ull
+
+/* table n is mapped at PFN n + 1, so no table has PFN 0 */
+#define TEST_PML4     0
+#define TEST_PDPT_256 1
+#define TEST_PD_256_0 2
+#define TEST_PT_256_0 3
+#define TEST_PDPT_300 4
+#define TEST_PD_300_5 5
+
+#define TEST_PT_PAGES 3
+
+typedef struct _TEST_PAGE {
+    UINT64        address;
+    UINT32        size;
+    volatile LONG seen;
+
+} TEST_PAGE, *PTEST_PAGE;
+
+typedef struct _IO_WORKITEM {
+    pthread_t            thread;
+    PIO_WORKITEM_ROUTINE routine;
+    PVOID                context;
+
+} IO_WORKITEM;
+
+STATIC DECLSPEC_ALIGN(PAGE_SIZE) UINT64
+    TestTables[TEST_TABLE_COUNT][PAGE_SIZE / sizeof(UINT64)];
+
+STATIC TEST_PAGE     TestPages[TEST_PAGE_COUNT];
+STATIC UINT32        TestPageCount;
+STATIC volatile LONG TestUnexpected;
+
+/* the PML4 is mapped once per claimed unit */
+STATIC volatile LONG64 TestClaims;
+
+/* set for the single threaded sweep, which simulates racing claims */
+STATIC PPAGE_SCAN_CONTEXT TestRaceContext;
+STATIC UINT32             TestRaces;
+
+/* interrupt time added by each callback, 0 to leave the clock alone */
+STATIC UINT64 TestCallbackTime;
+
+STATIC pthread_mutex_t TestEventLock = PTHREAD_MUTEX_INITIALIZER;
+STATIC pthread_cond_t  TestEventCondition = PTHREAD_COND_INITIALIZER;
+STATIC BOOLEAN         TestEventSignalled;
+
+unsigned long long
+__readcr3(void)
+{
+    return (UINT64)(TEST_PML4 + 1) << PAGE_SHIFT;
+}
+
+/*
+ * Called as the unit just claimed is scanned. If it is the first unit of a
+ * region that is not present, the next unit is claimed as another thread
+ * would, so the cursor has moved before the region is skipped.
+ */
+STATIC
+VOID
+TestRaceClaim(_In_ PPAGE_SCAN_CONTEXT Context)
+{
+    UINT64 unit = (UINT64)Context->cursor - 1;
+    UINT64 pml4e = 0;
+    UINT64 pdpte = 0;
+
+    pml4e = TestTables[TEST_PML4][256 + unit / PAGE_SCAN_UNITS_PER_PML4E];
+
+    if (!pml4e) {
+        if (unit % PAGE_SCAN_UNITS_PER_PML4E)
+            return;
+    }
+    else {
+        pdpte = TestTables[(pml4e >> PAGE_SHIFT) - 1]
+                          [unit / PAGE_SCAN_UNITS_PER_PDPTE % 512];
+
+        if (pdpte || unit % PAGE_SCAN_UNITS_PER_PDPTE)
+            return;
+    }
+
+    InterlockedIncrement64(&Context->cursor);
+    TestRaces++;
+}
+
+PVOID
+ImpMmGetVirtualForPhysical(_In_ PHYSICAL_ADDRESS PhysicalAddress)
+{
+    UINT64 pfn = (UINT64)PhysicalAddress.QuadPart >> PAGE_SHIFT;
+
+    BENCH_CHECK(pfn && pfn <= TEST_TABLE_COUNT);
+
+    if (pfn == TEST_PML4 + 1) {
+        InterlockedIncrement64(&TestClaims);
+
+        if (TestRaceContext)
+            TestRaceClaim(TestRaceContext);
+    }
+
+    return TestTables[pfn - 1];
+}
+
+PDEVICE_OBJECT
+GetDriverDeviceObject()
+{
+    return NULL;
+}
+
+STATIC
+PVOID
+TestWorkItemThread(_In_ PVOID Argument)
+{
+    PIO_WORKITEM item = (PIO_WORKITEM)Argument;
+
+    item->routine(NULL, item->context);
+    return NULL;
+}
+
+/* the sweep proceeds on the calling thread alone while racing is simulated */
+PIO_WORKITEM
+ImpIoAllocateWorkItem(PDEVICE_OBJECT DeviceObject)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+    return TestRaceContext ? NULL : calloc(1, sizeof(IO_WORKITEM));
+}
+
+VOID
+ImpIoQueueWorkItem(_In_ PIO_WORKITEM         IoWorkItem,
+                   _In_ PIO_WORKITEM_ROUTINE WorkerRoutine,
+                   _In_ WORK_QUEUE_TYPE      QueueType,
+                   _In_opt_ PVOID            Context)
+{
+    UNREFERENCED_PARAMETER(QueueType);
+
+    IoWorkItem->routine = WorkerRoutine;
+    IoWorkItem->context = Context;
+    BENCH_CHECK(!pthread_create(
+        &IoWorkItem->thread, NULL, TestWorkItemThread, IoWorkItem));
+}
+
+/* the run has waited on the workers, so the thread has already returned */
+void
+ImpIoFreeWorkItem(PIO_WORKITEM WorkItem)
+{
+    pthread_join(WorkItem->thread, NULL);
+    free(WorkItem);
+}
+
+/* PageScanRun is the only user of an event, so a single one is kept */
+VOID
+KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(Type);
+    TestEventSignalled = State;
+}
+
+VOID
+KeClearEvent(PKEVENT Event)
+{
+    UNREFERENCED_PARAMETER(Event);
+    pthread_mutex_lock(&TestEventLock);
+    TestEventSignalled = FALSE;
+    pthread_mutex_unlock(&TestEventLock);
+}
+
+LONG
+KeSetEvent(PKEVENT Event, KPRIORITY Increment, BOOLEAN Wait)
+{
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    pthread_mutex_lock(&TestEventLock);
+    TestEventSignalled = TRUE;
+    pthread_cond_broadcast(&TestEventCondition);
+    pthread_mutex_unlock(&TestEventLock);
+    return 0;
+}
+
+NTSTATUS
+ImpKeWaitForSingleObject(_In_ PVOID           Object,
+                         _In_ KWAIT_REASON    WaitReason,
+                         _In_ KPROCESSOR_MODE WaitMode,
+                         _In_ BOOLEAN         Alertable,
+                         _In_ PLARGE_INTEGER  Timeout)
+{
+    UNREFERENCED_PARAMETER(Object);
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+    UNREFERENCED_PARAMETER(Timeout);
+
+    pthread_mutex_lock(&TestEventLock);
+
+    while (!TestEventSignalled)
+        pthread_cond_wait(&TestEventCondition, &TestEventLock);
+
+    pthread_mutex_unlock(&TestEventLock);
+    return STATUS_SUCCESS;
+}
+
+STATIC
+UINT64
+TestEntry(_In_ UINT32 Table, _In_ UINT64 Flags)
+{
+    return (UINT64)(Table + 1) << PAGE_SHIFT | TEST_ENTRY_PRESENT | Flags;
+}
+
+STATIC
+UINT64
+TestAddress(_In_ UINT64 Pml4,
+            _In_ UINT64 Pdpt,
+            _In_ UINT64 Pd,
+            _In_ UINT64 Pt)
+{
+    return 0xFFFF000000000000ull | Pml4 << 39 | Pdpt << 30 | Pd << 21 |
+           Pt << 12;
+}
+
+STATIC
+VOID
+TestExpect(_In_ UINT64 Address, _In_ UINT32 Size)
+{
+    TestPages[TestPageCount].address = Address;
+    TestPages[TestPageCount].size = Size;
+    TestPageCount++;
+}
+
+/*
+ * PML4E 256: PDPTE 0 maps a PD whose PDE 0 is a 2 MiB page and PDE 1 a PT
+ * with 3 present pages, and PDPTE 1 is a 1 GiB page. PML4E 300: PDPTE 5
+ * maps a PD whose PDE 7 is a 2 MiB page. Nothing else is present.
+ */
+STATIC
+VOID
+TestBuildHierarchy()
+{
+    UINT32 pt_pages[TEST_PT_PAGES] = {0, 17, 511};
+
+    TestTables[TEST_PML4][256] = TestEntry(TEST_PDPT_256, 0);
+    TestTables[TEST_PML4][300] = TestEntry(TEST_PDPT_300, 0);
+
+    TestTables[TEST_PDPT_256][0] = TestEntry(TEST_PD_256_0, 0);
+    TestTables[TEST_PD_256_0][0] = TestEntry(0, TEST_ENTRY_LARGE);
+    TestExpect(TestAddress(256, 0, 0, 0), 0x200000);
+
+    TestTables[TEST_PD_256_0][1] = TestEntry(TEST_PT_256_0, 0);
+
+    for (UINT32 index = 0; index < TEST_PT_PAGES; index++) {
+        TestTables[TEST_PT_256_0][pt_pages[index]] = TestEntry(0, 0);
+        TestExpect(TestAddress(256, 0, 1, pt_pages[index]), PAGE_SIZE);
+    }
+
+    TestTables[TEST_PDPT_256][1] = TestEntry(0, TEST_ENTRY_LARGE);
+    TestExpect(TestAddress(256, 1, 0, 0), 0x40000000);
+
+    TestTables[TEST_PDPT_300][5] = TestEntry(TEST_PD_300_5, 0);
+    TestTables[TEST_PD_300_5][7] = TestEntry(0, TEST_ENTRY_LARGE);
+    TestExpect(TestAddress(300, 5, 7, 0), 0x200000);
+}
+
+STATIC
+BOOLEAN
+TestCallback(_In_ UINT64 Page, _In_ UINT32 PageSize, _In_opt_ PVOID Context)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    if (TestCallbackTime)
+        __atomic_fetch_add(
+            &ShimInterruptTime, TestCallbackTime, __ATOMIC_SEQ_CST);
+
+    for (UINT32 index = 0; index < TestPageCount; index++) {
+        if (TestPages[index].address == Page &&
+            TestPages[index].size == PageSize) {
+            InterlockedIncrement(&TestPages[index].seen);
+            return TRUE;
+        }
+    }
+
+    InterlockedIncrement(&TestUnexpected);
+    return TRUE;
+}
+
+STATIC
+VOID
+TestCheckSweep(_In_ PPAGE_SCAN_CONTEXT Context)
+{
+    BENCH_CHECK(!TestUnexpected);
+
+    for (UINT32 index = 0; index < TestPageCount; index++) {
+        BENCH_CHECK(TestPages[index].seen == 1);
+        TestPages[index].seen = 0;
+    }
+
+    BENCH_CHECK(Context->pages == TestPageCount);
+
+    /*
+     * Without skipping every one of the 2^26 units is claimed. With it, each
+     * PDPTE of PML4E 256 not mapping a 1 GiB page is claimed whole, and each
+     * other region costs its first unit and at most one unit for each of the
+     * other threads racing the skip.
+     */
+    BENCH_CHECK(TestClaims < 2 * PAGE_SCAN_UNITS_PER_PDPTE +
+                                 (PAGE_SCAN_THREAD_COUNT + 1) * 2 *
+                                     (256 + PAGE_SCAN_UNITS_PER_PDPTE));
+}
+
+int
+main()
+{
+    PAGE_SCAN_CONTEXT context = {0};
+    BOOLEAN           complete = FALSE;
+    UINT32            runs = 0;
+
+    TestBuildHierarchy();
+
+    /* every non-present region is skipped though its next unit was claimed
+     * by someone else first */
+    PageScanInitialise(&context);
+    TestRaceContext = &context;
+    BENCH_CHECK(NT_SUCCESS(
+        PageScanRun(&context, TestCallback, NULL, 0, &complete)));
+    TestRaceContext = NULL;
+
+    BENCH_CHECK(complete && context.sweeps == 1 && TestRaces);
+    TestCheckSweep(&context);
+
+    /* the two PDs are claimed a unit at a time, the 1 GiB page and each
+     * raced region once. A skip that gave up on losing the race would claim
+     * the unit after the racing one as well. */
+    BENCH_CHECK(TestClaims == 2 * PAGE_SCAN_UNITS_PER_PDPTE + 1 + TestRaces);
+
+    printf("pagescan: %lld units claimed racing %u claims\n",
+           (long long)TestClaims,
+           TestRaces);
+
+    /* an unlimited budget sweeps all of system space in one run */
+    PageScanInitialise(&context);
+    TestClaims = 0;
+    BENCH_CHECK(NT_SUCCESS(
+        PageScanRun(&context, TestCallback, NULL, 0, &complete)));
+    BENCH_CHECK(complete && context.sweeps == 1);
+    BENCH_CHECK(context.cursor >= PAGE_SCAN_UNIT_COUNT);
+    TestCheckSweep(&context);
+
+    printf("pagescan: %lld units claimed in a single run\n",
+           (long long)TestClaims);
+
+    /* every page found moves the clock past the budget, so the next sweep
+     * spans several runs with none of its pages lost or repeated */
+    PageScanInitialise(&context);
+    TestClaims = 0;
+    TestCallbackTime = 100;
+    ShimInterruptTime = 1;
+
+    do {
+        BENCH_CHECK(NT_SUCCESS(
+            PageScanRun(&context, TestCallback, NULL, 50, &complete)));
+        runs++;
+    } while (!complete && runs < TestPageCount * 2);
+
+    BENCH_CHECK(complete && context.sweeps == 1 && runs > 1);
+    TestCheckSweep(&context);
+
+    printf("pagescan: %lld units claimed over %u runs\n",
+           (long long)TestClaims,
+           runs);
+    return 0;
+}
@@ -0,0 +1,217 @@
+#include "procmod.h"
+
+#include "harness.h"
+
+#include <string.h>
+
+/*
+ * The sorted module array and the interned path table, including the table
+ * filling up and modules falling back to private paths.
+ */
+#define TEST_PATH_FORMAT "\\Device\\HarddiskVolume3\\Windows\\System32\\%u.dll"
+
+PVOID
+ImpExAllocatePool2(_In_ POOL_FLAGS Flags,
+                   _In_ SIZE_T     NumberOfBytes,
+                   _In_ ULONG      Tag)
+{
+    return ExAllocatePool2(Flags, NumberOfBytes, Tag);
+}
+
+VOID
+ImpExFreePoolWithTag(_In_ PVOID P, _In_ ULONG Tag)
+{
+    ExFreePoolWithTag(P, Tag);
+}
+
+VOID
+ImpKeInitializeGuardedMutex(_In_ PKGUARDED_MUTEX GuardedMutex)
+{
+    KeInitializeGuardedMutex(GuardedMutex);
+}
+
+VOID
+ImpKeAcquireGuardedMutex(_In_ PKGUARDED_MUTEX GuardedMutex)
+{
+    KeAcquireGuardedMutex(GuardedMutex);
+}
+
+VOID
+ImpKeReleaseGuardedMutex(_In_ PKGUARDED_MUTEX GuardedMutex)
+{
+    KeReleaseGuardedMutex(GuardedMutex);
+}
+
+STATIC
+BOOLEAN
+TestStopAtSecond(_In_ PPROCESS_MODULE Module, _In_opt_ PVOID Context)
+{
+    PUINT32 visited = (PUINT32)Context;
+
+    UNREFERENCED_PARAMETER(Module);
+    return ++*visited == 2;
+}
+
+STATIC
+VOID
+TestFind()
+{
+    PROCESS_MODULE_ARRAY array = {0};
+    PPROCESS_MODULE      module = NULL;
+    UINT32               visited = 0;
+
+    ProcessModuleArrayInitialise(&array);
+
+    /* inserted out of order, kept sorted by base */
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&array, 0x30000, 0x1000, "c.dll")));
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&array, 0x10000, 0x1000, "a.dll")));
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&array, 0x20000, 0x2000, "b.dll")));
+
+    BENCH_CHECK(array.count == 3);
+
+    for (UINT32 index = 1; index < array.count; index++)
+        BENCH_CHECK(array.modules[index - 1].base < array.modules[index].base);
+
+    BENCH_CHECK(!ProcessModuleArrayFind(&array, 0xffff));
+    BENCH_CHECK(ProcessModuleArrayFind(&array, 0x10000)->base == 0x10000);
+    BENCH_CHECK(ProcessModuleArrayFind(&array, 0x21fff)->base == 0x20000);
+    BENCH_CHECK(!ProcessModuleArrayFind(&array, 0x22000));
+    BENCH_CHECK(!ProcessModuleArrayFind(&array, 0x31000));
+
+    /* a module loaded at the base of another replaces it */
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&array, 0x20000, 0x4000, "d.dll")));
+    BENCH_CHECK(array.count == 3);
+    BENCH_CHECK(ProcessModuleArrayFind(&array, 0x23fff)->base == 0x20000);
+    BENCH_CHECK(!ProcessModuleArrayFindByPath(&array, "b.dll"));
+
+    module = ProcessModuleArrayFindByPath(&array, "d.dll");
+    BENCH_CHECK(module && module->base == 0x20000 && !module->path);
+    BENCH_CHECK(!strcmp(ProcessModuleGetModulePath(module), "d.dll"));
+
+    /* a path never interned is not found, and is not interned by looking */
+    BENCH_CHECK(!ProcessModuleArrayFindByPath(&array, "e.dll"));
+
+    ProcessModuleArrayEnumerate(&array, TestStopAtSecond, &visited);
+    BENCH_CHECK(visited == 2);
+
+    ProcessModuleArrayFree(&array);
+    BENCH_CHECK(!array.modules && !array.count && !array.capacity);
+}
+
+STATIC
+VOID
+TestInterning()
+{
+    PROCESS_MODULE_ARRAY first = {0};
+    PROCESS_MODULE_ARRAY second = {0};
+    CHAR                 path[MAX_MODULE_PATH + 16] = {0};
+    UINT32               first_id = 0;
+    UINT32               second_id = 0;
+
+    /* processes loading the same module share its path */
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&first, 0x10000, 0x1000, "ntdll.dll")));
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&second, 0x50000, 0x1000, "ntdll.dll")));
+    BENCH_CHECK(first.modules[0].path_id == second.modules[0].path_id);
+    BENCH_CHECK(ProcessModuleArrayFindByPath(&second, "ntdll.dll"));
+
+    /* paths are truncated to MAX_MODULE_PATH - 1 characters */
+    memset(path, 'a', sizeof(path) - 1);
+    BENCH_CHECK(NT_SUCCESS(ProcessModuleInternPath(path, &first_id)));
+    path[MAX_MODULE_PATH - 1] = '\0';
+    BENCH_CHECK(NT_SUCCESS(ProcessModuleInternPath(path, &second_id)));
+    BENCH_CHECK(first_id == second_id);
+    BENCH_CHECK(strlen(ProcessModuleGetPath(first_id)) == MAX_MODULE_PATH - 1);
+
+    BENCH_CHECK(!ProcessModuleGetPath(PROCESS_MODULE_PATH_INVALID));
+
+    ProcessModuleArrayFree(&first);
+    ProcessModuleArrayFree(&second);
+}
+
+/* Fills the table, growing the index and arenas many times over. */
+STATIC
+VOID
+TestOverflow()
+{
+    PROCESS_MODULE_ARRAY array = {0};
+    PPROCESS_MODULE      module = NULL;
+    CHAR                 path[MAX_MODULE_PATH] = {0};
+    NTSTATUS             status = STATUS_SUCCESS;
+    UINT32               id = 0;
+    UINT32               index = 0;
+
+    for (;; index++) {
+        snprintf(path, sizeof(path), TEST_PATH_FORMAT, index);
+        status = ProcessModuleInternPath(path, &id);
+
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    BENCH_CHECK(status == STATUS_QUOTA_EXCEEDED);
+    BENCH_CHECK(id == PROCESS_MODULE_PATH_INVALID);
+
+    /* the 4 paths of the find test, ntdll.dll and the long path came first */
+    BENCH_CHECK(index == PROCESS_MODULE_PATH_MAX_COUNT - 6);
+
+    /* every id still resolves to its own path */
+    for (UINT32 check = 0; check < index; check += 97) {
+        snprintf(path, sizeof(path), TEST_PATH_FORMAT, check);
+        BENCH_CHECK(NT_SUCCESS(ProcessModuleInternPath(path, &id)));
+        BENCH_CHECK(!strcmp(ProcessModuleGetPath(id), path));
+    }
+
+    /* a full table still interns nothing new, so the module keeps a private
+     * copy of its path */
+    snprintf(path, sizeof(path), TEST_PATH_FORMAT, index);
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&array, 0x10000, 0x1000, path)));
+
+    module = &array.modules[0];
+    BENCH_CHECK(module->path && module->path != path);
+    BENCH_CHECK(!strcmp(ProcessModuleGetModulePath(module), path));
+    BENCH_CHECK(ProcessModuleArrayFindByPath(&array, path) == module);
+
+    /* interned and private paths are matched alike */
+    snprintf(path, sizeof(path), TEST_PATH_FORMAT, 0);
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&array, 0x20000, 0x1000, path)));
+    BENCH_CHECK(!array.modules[1].path);
+    BENCH_CHECK(ProcessModuleArrayFindByPath(&array, path) ==
+                &array.modules[1]);
+
+    /* replacing a module with a private path frees it */
+    BENCH_CHECK(NT_SUCCESS(
+        ProcessModuleArrayInsert(&array, 0x10000, 0x1000, path)));
+    BENCH_CHECK(!array.modules[0].path);
+
+    ProcessModuleArrayFree(&array);
+}
+
+int
+main()
+{
+    UINT32 id = 0;
+
+    /* nothing is interned before the table exists */
+    BENCH_CHECK(!NT_SUCCESS(ProcessModuleInternPath("a.dll", &id)));
+    BENCH_CHECK(id == PROCESS_MODULE_PATH_INVALID);
+
+    BENCH_CHECK(NT_SUCCESS(ProcessModulePathTableInitialise()));
+
+    TestFind();
+    TestInterning();
+    TestOverflow();
+
+    ProcessModulePathTableFree();
+    BENCH_CHECK(!ProcessModuleGetPath(0));
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include "lib/stdlib.h"
+
+#include "harness.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * IntCopyMemory, IntCompareMemory and IntFindSubstring against byte at a
+ * time reference loops. Every source misalignment within a cache line is
+ * paired with a spread of destination misalignments, at lengths that
+ * exercise each of the 64, 16 and 1 byte tails on both sides of
+ * INT_AVX2_THRESHOLD.
+ */
+#define TEST_ALIGNMENTS 64
+#define TEST_GUARD      0xAA
+#define TEST_MAX_LENGTH 0x3000
+
+/* the lengths around each block size boundary of the vector loops */
+STATIC CONST SIZE_T TestLengths[] = {
+    0,    1,    2,    15,   16,   17,   31,   32,   33,   63,   64,
+    65,   127,  128,  129,  255,  256,  257,  300,  4095, 4096, 4097,
+    4111, 4112, 4159, 4160, 4161, 4223, 4224, 4225, 8191, 8192, 8193,
+    8319, 0x2f00};
+
+STATIC UCHAR TestSource[TEST_MAX_LENGTH + TEST_ALIGNMENTS];
+STATIC UCHAR TestDestination[TEST_MAX_LENGTH + 2 * TEST_ALIGNMENTS];
+
+STATIC
+SIZE_T
+TestScalarCompare(_In_ PUCHAR Source1, _In_ PUCHAR Source2, _In_ SIZE_T Length)
+{
+    for (SIZE_T index = 0; index < Length; index++)
+        if (Source1[index] != Source2[index])
+            return index;
+
+    return Length;
+}
+
+STATIC
+PCHAR
+TestScalarFindSubstring(_In_ PCHAR String1, _In_ PCHAR String2)
+{
+    for (; *String1; String1++) {
+        SIZE_T index = 0;
+
+        while (String2[index] && String1[index] == String2[index])
+            index++;
+
+        if (!String2[index])
+            return String1;
+    }
+
+    return *String2 ? NULL : String1;
+}
+
+STATIC
+VOID
+TestCopy(_In_ SIZE_T SourceOffset,
+         _In_ SIZE_T DestinationOffset,
+         _In_ SIZE_T Length)
+{
+    PUCHAR source = TestSource + SourceOffset;
+    PUCHAR destination = TestDestination + TEST_ALIGNMENTS + DestinationOffset;
+
+    memset(TestDestination, TEST_GUARD, sizeof(TestDestination));
+    IntCopyMemory(destination, source, Length);
+
+    BENCH_CHECK(TestScalarCompare(destination, source, Length) == Length);
+
+    /* nothing either side of the destination is written */
+    for (PUCHAR byte = TestDestination; byte < destination; byte++)
+        BENCH_CHECK(*byte == TEST_GUARD);
+
+    for (PUCHAR byte = destination + Length;
+         byte < TestDestination + sizeof(TestDestination);
+         byte++)
+        BENCH_CHECK(*byte == TEST_GUARD);
+}
+
+STATIC
+VOID
+TestCompare(_In_ SIZE_T SourceOffset,
+            _In_ SIZE_T DestinationOffset,
+            _In_ SIZE_T Length,
+            _Inout_ PUINT32 Seed)
+{
+    PUCHAR source = TestSource + SourceOffset;
+    PUCHAR destination = TestDestination + DestinationOffset;
+    SIZE_T positions[3] = {0};
+
+    memcpy(destination, source, Length);
+    BENCH_CHECK(IntCompareMemory(source, destination, Length) == Length);
+
+    if (!Length)
+        return;
+
+    /* a mismatch in the head, the tail and somewhere in between */
+    positions[0] = 0;
+    positions[1] = Length - 1;
+    positions[2] = RtlRandomEx(Seed) % Length;
+
+    for (UINT32 index = 0; index < ARRAYSIZE(positions); index++) {
+        destination[positions[index]] ^= 1 + RtlRandomEx(Seed) % 255;
+
+        BENCH_CHECK(IntCompareMemory(source, destination, Length) ==
+                    TestScalarCompare(source, destination, Length));
+
+        destination[positions[index]] = source[positions[index]];
+    }
+}
+
+/*
+ * Haystacks end immediately before an inaccessible page, so a routine that
+ * reads past the terminator faults.
+ */
+STATIC
+VOID
+TestFindSubstring(_Inout_ PUINT32 Seed)
+{
+    PCSTR alphabet = "abc";
+    PCHAR page = mmap(NULL,
+                      2 * PAGE_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+
+    BENCH_CHECK(page != MAP_FAILED);
+    BENCH_CHECK(!mprotect(page + PAGE_SIZE, PAGE_SIZE, PROT_NONE));
+
+    for (UINT32 iteration = 0; iteration < 100000; iteration++) {
+        UINT32 haystack_length = RtlRandomEx(Seed) % 200;
+        UINT32 needle_length = RtlRandomEx(Seed) % 6;
+        PCHAR haystack = page + PAGE_SIZE - haystack_length - 1;
+        CHAR needle[8] = {0};
+
+        for (UINT32 index = 0; index < haystack_length; index++)
+            haystack[index] = alphabet[RtlRandomEx(Seed) % 3];
+
+        for (UINT32 index = 0; index < needle_length; index++)
+            needle[index] = alphabet[RtlRandomEx(Seed) % 3];
+
+        haystack[haystack_length] = '\0';
+
+        BENCH_CHECK(IntFindSubstring(haystack, needle) ==
+                    TestScalarFindSubstring(haystack, needle));
+    }
+
+    munmap(page, 2 * PAGE_SIZE);
+}
+
+int
+main()
+{
+    UINT32 seed = 0x5eed;
+
+    for (UINT32 index = 0; index < sizeof(TestSource); index++)
+        TestSource[index] = (UCHAR)RtlRandomEx(&seed);
+
+    for (UINT32 length = 0; length < ARRAYSIZE(TestLengths); length++) {
+        for (SIZE_T source = 0; source < TEST_ALIGNMENTS; source++) {
+            for (SIZE_T destination = 0; destination < TEST_ALIGNMENTS;
+                 destination += 7) {
+                TestCopy(source, destination, TestLengths[length]);
+                TestCompare(source, destination, TestLengths[length], &seed);
+            }
+        }
+    }
+
+    TestFindSubstring(&seed);
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,3 @@
+module ac/server
+
+go 1.21
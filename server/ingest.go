@@ -0,0 +1,480 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"io"
+	"log"
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	connReaderBufferSize = 256 << 10
+	workerQueueLength    = 256
+	pooledFrameCapacity  = 256 << 10
+)
+
+// Frame buffers are pooled, a batch being decrypted in place within the
+// buffer it was read into.
+var framePool = sync.Pool{
+	New: func() any {
+		buffer := make([]byte, 0, pooledFrameCapacity)
+		return &buffer
+	},
+}
+
+func getFrame(length int) *[]byte {
+	buffer := framePool.Get().(*[]byte)
+
+	if cap(*buffer) < length {
+		*buffer = make([]byte, length)
+	}
+
+	*buffer = (*buffer)[:length]
+	return buffer
+}
+
+func putFrame(buffer *[]byte) {
+	// don't keep a rare oversized frame alive in the pool
+	if cap(*buffer) > pooledFrameCapacity*4 {
+		return
+	}
+
+	framePool.Put(buffer)
+}
+
+type statistics struct {
+	reports    atomic.Uint64
+	heartbeats atomic.Uint64
+	rejected   atomic.Uint64
+	batches    atomic.Uint64
+	bytes      atomic.Uint64
+}
+
+// A batch routed to a worker. Only the offsets of the reports are kept, the
+// heartbeats and malformed packets having been handled by the reader.
+type job struct {
+	conn     *connection
+	session  *session
+	sequence uint64
+	received int64
+	frame    *[]byte
+	reports  []packetSpan
+	rejected uint32
+
+	// the first failure to append one of the reports
+	err error
+}
+
+type packetSpan struct {
+	offset uint32
+	length uint32
+	header packetHeader
+}
+
+// Batches are routed to a worker by session id so that the reports of a
+// session are logged in the order they were sent.
+type worker struct {
+	index int
+	jobs  chan *job
+	log   *segmentLog
+	stats *statistics
+}
+
+func (w *worker) run(wg *sync.WaitGroup) {
+	defer wg.Done()
+
+	pending := make([]*job, 0, workerQueueLength)
+
+	for j := range w.jobs {
+		pending = append(pending[:0], j)
+
+		// group commit whatever else is queued behind this batch
+	drain:
+		for len(pending) < cap(pending) {
+			select {
+			case next, ok := <-w.jobs:
+				if !ok {
+					break drain
+				}
+				pending = append(pending, next)
+			default:
+				break drain
+			}
+		}
+
+		for _, j := range pending {
+			w.process(j)
+		}
+
+		flushed := true
+
+		// an ack is a commit, so it is only sent once the batch is durable
+		if err := w.log.flush(); err != nil {
+			log.Printf("worker %d: flush failed: %v", w.index, err)
+			flushed = false
+		}
+
+		for _, j := range pending {
+			status := uint32(ackStatusOk)
+			accepted := uint32(len(j.reports))
+
+			if !flushed || j.err != nil {
+				status = ackStatusLogFailure
+				accepted = 0
+			}
+
+			j.conn.ack(j.session.id, j.sequence, status, accepted, j.rejected)
+			j.reports = j.reports[:0]
+			j.err = nil
+			putFrame(j.frame)
+			j.conn.release(j)
+		}
+	}
+
+	if err := w.log.close(); err != nil {
+		log.Printf("worker %d: close failed: %v", w.index, err)
+	}
+}
+
+func (w *worker) process(j *job) {
+	frame := *j.frame
+
+	for _, span := range j.reports {
+		packet := frame[span.offset : span.offset+span.length]
+		j.session.decrypt(packet)
+
+		if err := w.log.append(j.session.id, j.received, span.header,
+			packet[packetHeaderSize:]); err != nil {
+			log.Printf("worker %d: append failed: %v", w.index, err)
+			j.err = err
+			return
+		}
+	}
+
+	j.session.reports.Add(uint64(len(j.reports)))
+	w.stats.reports.Add(uint64(len(j.reports)))
+}
+
+type connection struct {
+	net.Conn
+	server *server
+
+	writeLock sync.Mutex
+	ackBuffer []byte
+
+	// jobs are recycled per connection to avoid an allocation per batch
+	jobPool sync.Pool
+}
+
+func (c *connection) ack(sessionID, sequence uint64, status, accepted,
+	rejected uint32) {
+	c.writeLock.Lock()
+	defer c.writeLock.Unlock()
+
+	c.ackBuffer = putAck(c.ackBuffer[:0], sessionID, sequence, status, accepted,
+		rejected)
+
+	// a failed write will also fail the reader, which closes the connection
+	c.SetWriteDeadline(time.Now().Add(c.server.config.writeTimeout))
+	c.Write(c.ackBuffer)
+}
+
+func (c *connection) acquire() *job {
+	if j, ok := c.jobPool.Get().(*job); ok {
+		return j
+	}
+
+	return &job{conn: c}
+}
+
+func (c *connection) release(j *job) {
+	j.session = nil
+	j.frame = nil
+	c.jobPool.Put(j)
+}
+
+type serverConfig struct {
+	nodeIndex      uint64
+	nodeCount      uint64
+	workers        int
+	logDir         string
+	segmentSize    int64
+	readTimeout    time.Duration
+	writeTimeout   time.Duration
+	sessionTimeout time.Duration
+}
+
+type server struct {
+	config   serverConfig
+	sessions *sessionTable
+	workers  []*worker
+	stats    statistics
+
+	workerGroup sync.WaitGroup
+	connGroup   sync.WaitGroup
+
+	connLock sync.Mutex
+	conns    map[net.Conn]struct{}
+	closing  bool
+}
+
+func newServer(config serverConfig) (*server, error) {
+	s := &server{
+		config:   config,
+		sessions: newSessionTable(config.nodeIndex, config.nodeCount),
+		conns:    make(map[net.Conn]struct{}),
+	}
+
+	for index := 0; index < config.workers; index++ {
+		segments, err := newSegmentLog(config.logDir, index, config.segmentSize)
+
+		if err != nil {
+			s.closeWorkers()
+			return nil, err
+		}
+
+		w := &worker{
+			index: index,
+			jobs:  make(chan *job, workerQueueLength),
+			log:   segments,
+			stats: &s.stats,
+		}
+
+		s.workers = append(s.workers, w)
+		s.workerGroup.Add(1)
+		go w.run(&s.workerGroup)
+	}
+
+	return s, nil
+}
+
+func (s *server) worker(sessionID uint64) *worker {
+	// the low bits select the node, so route on the quotient
+	return s.workers[(sessionID/s.config.nodeCount)%uint64(len(s.workers))]
+}
+
+func (s *server) serve(listener net.Listener) error {
+	for {
+		conn, err := listener.Accept()
+
+		if err != nil {
+			if errors.Is(err, net.ErrClosed) {
+				return nil
+			}
+
+			log.Printf("accept failed: %v", err)
+			time.Sleep(100 * time.Millisecond)
+			continue
+		}
+
+		s.connLock.Lock()
+
+		if s.closing {
+			s.connLock.Unlock()
+			conn.Close()
+			continue
+		}
+
+		s.conns[conn] = struct{}{}
+		s.connGroup.Add(1)
+		s.connLock.Unlock()
+
+		go s.handle(&connection{Conn: conn, server: s})
+	}
+}
+
+func (s *server) handle(c *connection) {
+	defer s.connGroup.Done()
+	defer func() {
+		s.connLock.Lock()
+		delete(s.conns, c.Conn)
+		s.connLock.Unlock()
+		c.Close()
+	}()
+
+	reader := bufio.NewReaderSize(c, connReaderBufferSize)
+	var lengthBuffer [frameLengthSize]byte
+
+	for {
+		c.SetReadDeadline(time.Now().Add(s.config.readTimeout))
+
+		if _, err := io.ReadFull(reader, lengthBuffer[:]); err != nil {
+			if !errors.Is(err, io.EOF) && !errors.Is(err, net.ErrClosed) {
+				log.Printf("%s: read failed: %v", c.RemoteAddr(), err)
+			}
+			return
+		}
+
+		length := binary.LittleEndian.Uint32(lengthBuffer[:])
+
+		if length == 0 || length > frameMaxLength {
+			log.Printf("%s: %v", c.RemoteAddr(), errFrameLength)
+			return
+		}
+
+		frame := getFrame(int(length))
+
+		if _, err := io.ReadFull(reader, *frame); err != nil {
+			putFrame(frame)
+			log.Printf("%s: read failed: %v", c.RemoteAddr(), err)
+			return
+		}
+
+		s.stats.bytes.Add(uint64(frameLengthSize + length))
+
+		if err := s.dispatch(c, frame); err != nil {
+			log.Printf("%s: %v", c.RemoteAddr(), err)
+			return
+		}
+	}
+}
+
+// Takes ownership of the frame.
+func (s *server) dispatch(c *connection, frame *[]byte) error {
+	switch (*frame)[0] {
+	case frameSession:
+		defer putFrame(frame)
+
+		id := uint64(0)
+
+		if len(*frame) >= 9 {
+			id = binary.LittleEndian.Uint64((*frame)[1:])
+		}
+
+		if !s.sessions.owns(id) {
+			c.ack(id, 0, ackStatusWrongNode, 0, 0)
+			return nil
+		}
+
+		if _, err := s.sessions.register(*frame); err != nil {
+			status := uint32(ackStatusMalformed)
+
+			if errors.Is(err, errSessionExists) {
+				status = ackStatusSessionExists
+			}
+
+			c.ack(id, 0, status, 0, 0)
+			return nil
+		}
+
+		c.ack(id, 0, ackStatusOk, 0, 0)
+		return nil
+
+	case frameBatch:
+		return s.route(c, frame)
+
+	default:
+		putFrame(frame)
+		return errFrameType
+	}
+}
+
+// Routes each packet of a batch on its cleartext header. Heartbeats only
+// refresh the session and are never decrypted, reports are queued to the
+// session's worker for decryption.
+func (s *server) route(c *connection, frame *[]byte) error {
+	header, body, err := parseBatchHeader(*frame)
+
+	if err != nil {
+		putFrame(frame)
+		return err
+	}
+
+	s.stats.batches.Add(1)
+
+	if !s.sessions.owns(header.sessionID) {
+		putFrame(frame)
+		c.ack(header.sessionID, header.sequence, ackStatusWrongNode, 0,
+			header.count)
+		return nil
+	}
+
+	session := s.sessions.lookup(header.sessionID)
+
+	if session == nil {
+		putFrame(frame)
+		c.ack(header.sessionID, header.sequence, ackStatusUnknownSession, 0,
+			header.count)
+		return nil
+	}
+
+	now := time.Now()
+	session.touch(now)
+
+	j := c.acquire()
+	j.session = session
+	j.sequence = header.sequence
+	j.received = now.UnixNano()
+	j.frame = frame
+	j.rejected = 0
+
+	heartbeats := uint64(0)
+
+	for index := uint32(0); index < header.count; index++ {
+		packet, remainder, err := nextPacket(body)
+
+		if err != nil {
+			// the remainder of the batch cannot be framed
+			j.rejected += header.count - index
+			break
+		}
+
+		offset := uint32(len(*frame) - len(body) + packetLengthSize)
+		body = remainder
+
+		packetHeader, err := parsePacketHeader(packet)
+
+		if err != nil {
+			j.rejected++
+			continue
+		}
+
+		if packetHeader.packetType == packetTypeHeartbeat {
+			heartbeats++
+			continue
+		}
+
+		j.reports = append(j.reports, packetSpan{
+			offset: offset,
+			length: uint32(len(packet)),
+			header: packetHeader,
+		})
+	}
+
+	session.heartbeats.Add(heartbeats)
+	session.rejected.Add(uint64(j.rejected))
+	s.stats.heartbeats.Add(heartbeats)
+	s.stats.rejected.Add(uint64(j.rejected))
+
+	// blocks when the worker falls behind, pushing back on the client
+	s.worker(session.id).jobs <- j
+	return nil
+}
+
+func (s *server) closeWorkers() {
+	for _, w := range s.workers {
+		close(w.jobs)
+	}
+
+	s.workerGroup.Wait()
+}
+
+// Closes every connection, then waits for the queued batches to be logged.
+func (s *server) shutdown() {
+	s.connLock.Lock()
+	s.closing = true
+
+	for conn := range s.conns {
+		conn.Close()
+	}
+
+	s.connLock.Unlock()
+
+	s.connGroup.Wait()
+	s.closeWorkers()
+}
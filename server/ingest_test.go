@@ -0,0 +1,188 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"io"
+	"net"
+	"testing"
+	"time"
+)
+
+type testClient struct {
+	t    *testing.T
+	conn net.Conn
+}
+
+// Serves one end of a pipe, the other end being returned to the test.
+func newTestClient(t *testing.T, s *server) *testClient {
+	server, client := net.Pipe()
+
+	s.connGroup.Add(1)
+	go s.handle(&connection{Conn: server, server: s})
+
+	return &testClient{t: t, conn: client}
+}
+
+func (c *testClient) send(frame []byte) {
+	c.t.Helper()
+
+	buffer := binary.LittleEndian.AppendUint32(nil, uint32(len(frame)))
+
+	if _, err := c.conn.Write(append(buffer, frame...)); err != nil {
+		c.t.Fatal(err)
+	}
+}
+
+// Returns the status, accepted and rejected counts of the next ack.
+func (c *testClient) ack(sessionID, sequence uint64) (uint32, uint32, uint32) {
+	c.t.Helper()
+
+	ack := make([]byte, frameLengthSize+ackFrameSize)
+
+	c.conn.SetReadDeadline(time.Now().Add(10 * time.Second))
+
+	if _, err := io.ReadFull(c.conn, ack); err != nil {
+		c.t.Fatal(err)
+	}
+
+	if ack[4] != frameAck || binary.LittleEndian.Uint64(ack[5:]) != sessionID ||
+		binary.LittleEndian.Uint64(ack[13:]) != sequence {
+		c.t.Fatalf("ack %x is not for session %d sequence %d", ack, sessionID,
+			sequence)
+	}
+
+	return binary.LittleEndian.Uint32(ack[21:]),
+		binary.LittleEndian.Uint32(ack[25:]),
+		binary.LittleEndian.Uint32(ack[29:])
+}
+
+func makeBatchFrame(sessionID, sequence uint64, packets ...[]byte) []byte {
+	frame := []byte{frameBatch}
+	frame = binary.LittleEndian.AppendUint64(frame, sessionID)
+	frame = binary.LittleEndian.AppendUint64(frame, sequence)
+	frame = binary.LittleEndian.AppendUint32(frame, uint32(len(packets)))
+
+	for _, packet := range packets {
+		frame = appendPacket(frame, uint32(len(packet)), packet)
+	}
+
+	return frame
+}
+
+func newTestServer(t *testing.T) *server {
+	s, err := newServer(serverConfig{
+		nodeCount:      1,
+		workers:        1,
+		logDir:         t.TempDir(),
+		segmentSize:    1 << 20,
+		readTimeout:    time.Minute,
+		writeTimeout:   10 * time.Second,
+		sessionTimeout: time.Minute,
+	})
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	return s
+}
+
+func TestIngestAckOnLogFailure(t *testing.T) {
+	s := newTestServer(t)
+	c := newTestClient(t, s)
+	key := mustDecodeHex(t, cbcVectorKey)
+	iv := mustDecodeHex(t, cbcVectorIV)
+
+	c.send(makeSessionFrame(7, key, iv))
+
+	if status, _, _ := c.ack(7, 0); status != ackStatusOk {
+		t.Fatalf("session: status %d", status)
+	}
+
+	header := makePacketHeader(packetTypeReport, packetMagicNumber, packetHeaderSize)
+	report := append(append([]byte{}, header...),
+		mustDecodeHex(t, cbcVectorCiphertext)...)
+	heartbeat := makePacketHeader(packetTypeHeartbeat, packetMagicNumber, 16)
+	malformed := makePacketHeader(packetTypeReport, 0x1338, 32)
+
+	// the buffered reports cannot be synced once their segment is gone
+	s.workers[0].log.file.Close()
+
+	c.send(makeBatchFrame(7, 1, report, heartbeat, report, malformed))
+
+	if status, accepted, rejected := c.ack(7, 1); status != ackStatusLogFailure ||
+		accepted != 0 || rejected != 1 {
+		t.Errorf("failed batch: status %d, accepted %d, rejected %d", status,
+			accepted, rejected)
+	}
+
+	// the next batch is logged to a new segment
+	c.send(makeBatchFrame(7, 2, report, heartbeat))
+
+	if status, accepted, rejected := c.ack(7, 2); status != ackStatusOk ||
+		accepted != 1 || rejected != 0 {
+		t.Errorf("retried batch: status %d, accepted %d, rejected %d", status,
+			accepted, rejected)
+	}
+
+	c.conn.Close()
+	s.shutdown()
+
+	records, _ := readSegments(t, s.config.logDir)
+
+	if len(records) != 1 || records[0].sessionID != 7 ||
+		!bytes.Equal(records[0].body, mustDecodeHex(t, cbcVectorPlaintext)) {
+		t.Errorf("logged %+v, want the one acknowledged report", records)
+	}
+}
+
+func TestIngestSessionExists(t *testing.T) {
+	s := newTestServer(t)
+	c := newTestClient(t, s)
+	key := mustDecodeHex(t, cbcVectorKey)
+	iv := mustDecodeHex(t, cbcVectorIV)
+
+	c.send(makeSessionFrame(3, key, iv))
+
+	if status, _, _ := c.ack(3, 0); status != ackStatusOk {
+		t.Fatalf("session: status %d", status)
+	}
+
+	otherKey := append([]byte{}, key...)
+	otherKey[31] ^= 1
+
+	c.send(makeSessionFrame(3, otherKey, iv))
+
+	if status, _, _ := c.ack(3, 0); status != ackStatusSessionExists {
+		t.Errorf("replacement: status %d, want %d", status, ackStatusSessionExists)
+	}
+
+	c.send(makeSessionFrame(3, key, iv))
+
+	if status, _, _ := c.ack(3, 0); status != ackStatusOk {
+		t.Errorf("retry: status %d, want %d", status, ackStatusOk)
+	}
+
+	// reports are still decrypted with the original key
+	header := makePacketHeader(packetTypeReport, packetMagicNumber, packetHeaderSize)
+	report := append(append([]byte{}, header...),
+		mustDecodeHex(t, cbcVectorCiphertext)...)
+
+	c.send(makeBatchFrame(3, 1, report))
+
+	if status, accepted, _ := c.ack(3, 1); status != ackStatusOk || accepted != 1 {
+		t.Errorf("batch: status %d, accepted %d", status, accepted)
+	}
+
+	c.conn.Close()
+	s.shutdown()
+
+	records, _ := readSegments(t, s.config.logDir)
+
+	if len(records) != 1 ||
+		!bytes.Equal(records[0].body, mustDecodeHex(t, cbcVectorPlaintext)) {
+		t.Errorf("logged %+v, want the report decrypted with the original key",
+			records)
+	}
+}
@@ -0,0 +1,222 @@
+// Drives a server with batches of encrypted reports and prints the rate at
+// which they are acknowledged. Each connection registers its own session and
+// keeps a number of batches in flight, the batch being encrypted once up
+// front so that the client costs little more than the writes.
+//
+//	go run loadgen/main.go -addr 127.0.0.1:8443 -conns 16 -duration 10s
+package main
+
+import (
+	"crypto/aes"
+	"crypto/cipher"
+	"crypto/rand"
+	"encoding/binary"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Mirrors server/protocol.go.
+const (
+	frameSession = 0x1
+	frameBatch   = 0x2
+	frameAck     = 0x3
+
+	frameLengthSize  = 4
+	ackFrameSize     = 1 + 8 + 8 + 4 + 4 + 4
+	packetHeaderSize = 16
+
+	packetTypeReport  = 0x0
+	packetMagicNumber = 0x1337
+
+	ackStatusOk = 0x0
+)
+
+type totals struct {
+	accepted atomic.Uint64
+	rejected atomic.Uint64
+	failed   atomic.Uint64
+}
+
+func appendFrame(buffer []byte, frame []byte) []byte {
+	buffer = binary.LittleEndian.AppendUint32(buffer, uint32(len(frame)))
+	return append(buffer, frame...)
+}
+
+// Returns a batch frame, including its length, of count packets of size
+// bytes each, encrypted under key and iv.
+func makeBatch(sessionID uint64, key, iv []byte, count, size int) []byte {
+	block, err := aes.NewCipher(key)
+
+	if err != nil {
+		log.Fatal(err)
+	}
+
+	packet := make([]byte, size)
+	binary.LittleEndian.PutUint32(packet[0:], packetTypeReport)
+	binary.LittleEndian.PutUint32(packet[4:], packetMagicNumber)
+	binary.LittleEndian.PutUint32(packet[8:], 0x20)
+
+	for index := packetHeaderSize; index < size; index++ {
+		packet[index] = byte(index)
+	}
+
+	cipher.NewCBCEncrypter(block, iv).CryptBlocks(packet[packetHeaderSize:],
+		packet[packetHeaderSize:])
+
+	frame := []byte{frameBatch}
+	frame = binary.LittleEndian.AppendUint64(frame, sessionID)
+	frame = binary.LittleEndian.AppendUint64(frame, 0)
+	frame = binary.LittleEndian.AppendUint32(frame, uint32(count))
+
+	for index := 0; index < count; index++ {
+		frame = binary.LittleEndian.AppendUint32(frame, uint32(size))
+		frame = append(frame, packet...)
+	}
+
+	return appendFrame(nil, frame)
+}
+
+func readAck(conn net.Conn, buffer []byte) (uint32, uint32, uint32, error) {
+	if _, err := io.ReadFull(conn, buffer); err != nil {
+		return 0, 0, 0, err
+	}
+
+	if buffer[frameLengthSize] != frameAck {
+		return 0, 0, 0, fmt.Errorf("unexpected frame type %d",
+			buffer[frameLengthSize])
+	}
+
+	ack := buffer[frameLengthSize+1:]
+
+	return binary.LittleEndian.Uint32(ack[16:]),
+		binary.LittleEndian.Uint32(ack[20:]),
+		binary.LittleEndian.Uint32(ack[24:]), nil
+}
+
+func run(addr string, sessionID uint64, count, size, inflight int,
+	deadline time.Time, t *totals) error {
+	conn, err := net.Dial("tcp", addr)
+
+	if err != nil {
+		return err
+	}
+
+	defer conn.Close()
+
+	key := make([]byte, 32)
+	iv := make([]byte, 16)
+	rand.Read(key)
+	rand.Read(iv)
+
+	session := []byte{frameSession}
+	session = binary.LittleEndian.AppendUint64(session, sessionID)
+	session = append(append(session, key...), iv...)
+
+	if _, err := conn.Write(appendFrame(nil, session)); err != nil {
+		return err
+	}
+
+	ack := make([]byte, frameLengthSize+ackFrameSize)
+
+	if status, _, _, err := readAck(conn, ack); err != nil {
+		return err
+	} else if status != ackStatusOk {
+		return fmt.Errorf("session %d: status %d", sessionID, status)
+	}
+
+	batch := makeBatch(sessionID, key, iv, count, size)
+	credits := make(chan struct{}, inflight)
+	acks := make(chan error, 1)
+
+	go func() {
+		for {
+			status, accepted, rejected, err := readAck(conn, ack)
+
+			if err != nil {
+				acks <- err
+				return
+			}
+
+			if status != ackStatusOk {
+				t.failed.Add(1)
+			}
+
+			t.accepted.Add(uint64(accepted))
+			t.rejected.Add(uint64(rejected))
+			<-credits
+		}
+	}()
+
+	for sequence := uint64(1); time.Now().Before(deadline); sequence++ {
+		credits <- struct{}{}
+
+		binary.LittleEndian.PutUint64(batch[frameLengthSize+9:], sequence)
+
+		if _, err := conn.Write(batch); err != nil {
+			return err
+		}
+	}
+
+	// wait for the batches still in flight
+	for index := 0; index < inflight; index++ {
+		select {
+		case credits <- struct{}{}:
+		case err := <-acks:
+			return err
+		}
+	}
+
+	return nil
+}
+
+func main() {
+	addr := flag.String("addr", "127.0.0.1:8443", "address of the server")
+	conns := flag.Int("conns", 16, "connections, each with its own session")
+	count := flag.Int("batch", 256, "packets per batch")
+	size := flag.Int("size", 256, "bytes per packet including its header")
+	inflight := flag.Int("inflight", 4, "unacknowledged batches per connection")
+	duration := flag.Duration("duration", 10*time.Second, "time to send for")
+	firstSession := flag.Uint64("session", 1, "session id of the first connection")
+	flag.Parse()
+
+	if *size < packetHeaderSize || (*size-packetHeaderSize)%aes.BlockSize != 0 {
+		log.Fatalf("packet size must be the header plus whole %d byte blocks",
+			aes.BlockSize)
+	}
+
+	var t totals
+	var wg sync.WaitGroup
+
+	start := time.Now()
+	deadline := start.Add(*duration)
+
+	for index := 0; index < *conns; index++ {
+		wg.Add(1)
+
+		go func(sessionID uint64) {
+			defer wg.Done()
+
+			if err := run(*addr, sessionID, *count, *size, *inflight, deadline,
+				&t); err != nil {
+				log.Printf("session %d: %v", sessionID, err)
+			}
+		}(*firstSession + uint64(index))
+	}
+
+	wg.Wait()
+	elapsed := time.Since(start).Seconds()
+
+	fmt.Printf("%d connections, %d packets of %d bytes per batch, %.1fs\n",
+		*conns, *count, *size, elapsed)
+	fmt.Printf("accepted %d reports, %.0f reports/s, %.1f MB/s\n",
+		t.accepted.Load(), float64(t.accepted.Load())/elapsed,
+		float64(t.accepted.Load())*float64(*size)/elapsed/1e6)
+	fmt.Printf("rejected %d packets, %d batches failed\n", t.rejected.Load(),
+		t.failed.Load())
+}
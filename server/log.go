@@ -0,0 +1,182 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"hash/crc32"
+	"os"
+	"path/filepath"
+	"time"
+)
+
+// Each worker appends to its own sequence of segment files, so appends never
+// contend. A record is
+//
+//	u32 length of the remainder of the record
+//	u32 crc32c of the remainder of the record
+//	u64 session id
+//	i64 time received, unix nanoseconds
+//	u32 report code
+//	u32 report sub type
+//	decrypted packet body following the 16 byte header
+//
+// all little endian. A segment is closed once it exceeds the segment size, a
+// torn record at the end of a segment indicates a crash while writing it.
+//
+// Appends are only durable once flush returns, which syncs the segment. After
+// a failed write the segment is abandoned, every append until the next flush
+// fails, and flush reports the failure so that none of the records buffered
+// since the previous flush are acknowledged. The next append opens a new
+// segment.
+const (
+	logRecordHeaderSize = 4 + 4 + 8 + 8 + 4 + 4
+	logWriterBufferSize = 1 << 20
+)
+
+var castagnoli = crc32.MakeTable(crc32.Castagnoli)
+
+type segmentLog struct {
+	dir         string
+	partition   int
+	segmentSize int64
+
+	file     *os.File
+	writer   *bufio.Writer
+	written  int64
+	sequence int
+
+	// the first failure since the last flush
+	err error
+
+	header [logRecordHeaderSize]byte
+}
+
+func newSegmentLog(dir string, partition int, segmentSize int64) (*segmentLog, error) {
+	log := &segmentLog{dir: dir, partition: partition, segmentSize: segmentSize}
+
+	if err := log.rotate(); err != nil {
+		return nil, err
+	}
+
+	return log, nil
+}
+
+// Opens the next segment, the current one must already have been closed.
+func (l *segmentLog) rotate() error {
+	l.sequence++
+
+	name := fmt.Sprintf("reports-%03d-%d-%06d.log", l.partition,
+		time.Now().Unix(), l.sequence)
+
+	file, err := os.OpenFile(filepath.Join(l.dir, name),
+		os.O_CREATE|os.O_WRONLY|os.O_EXCL, 0o644)
+
+	if err != nil {
+		return err
+	}
+
+	l.file = file
+	l.written = 0
+
+	if l.writer == nil {
+		l.writer = bufio.NewWriterSize(file, logWriterBufferSize)
+	} else {
+		l.writer.Reset(file)
+	}
+
+	return nil
+}
+
+func (l *segmentLog) append(sessionID uint64, received int64,
+	header packetHeader, body []byte) error {
+	length := uint32(logRecordHeaderSize - 8 + len(body))
+
+	if l.err != nil {
+		return l.err
+	}
+
+	if l.file == nil {
+		if err := l.rotate(); err != nil {
+			return l.fail(err)
+		}
+	}
+
+	binary.LittleEndian.PutUint32(l.header[0:], length)
+	binary.LittleEndian.PutUint64(l.header[8:], sessionID)
+	binary.LittleEndian.PutUint64(l.header[16:], uint64(received))
+	binary.LittleEndian.PutUint32(l.header[24:], header.reportCode)
+	binary.LittleEndian.PutUint32(l.header[28:], header.reportSubType)
+
+	crc := crc32.Update(0, castagnoli, l.header[8:])
+	crc = crc32.Update(crc, castagnoli, body)
+	binary.LittleEndian.PutUint32(l.header[4:], crc)
+
+	if _, err := l.writer.Write(l.header[:]); err != nil {
+		return l.fail(err)
+	}
+
+	if _, err := l.writer.Write(body); err != nil {
+		return l.fail(err)
+	}
+
+	l.written += int64(logRecordHeaderSize + len(body))
+
+	// the next segment is opened by the next append
+	if l.written >= l.segmentSize {
+		if err := l.close(); err != nil {
+			return l.fail(err)
+		}
+	}
+
+	return nil
+}
+
+// Abandons the current segment, discarding whatever it still buffers.
+func (l *segmentLog) fail(err error) error {
+	if l.err == nil {
+		l.err = err
+	}
+
+	if l.file != nil {
+		l.file.Close()
+		l.file = nil
+	}
+
+	return l.err
+}
+
+// Makes every record appended since the last flush durable, or returns the
+// failure that lost any of them.
+func (l *segmentLog) flush() error {
+	if l.err == nil && l.file != nil {
+		if err := l.writer.Flush(); err != nil {
+			l.fail(err)
+		} else if err := l.file.Sync(); err != nil {
+			l.fail(err)
+		}
+	}
+
+	err := l.err
+	l.err = nil
+	return err
+}
+
+func (l *segmentLog) close() error {
+	if l.file == nil {
+		return nil
+	}
+
+	err := l.writer.Flush()
+
+	if err == nil {
+		err = l.file.Sync()
+	}
+
+	if closeErr := l.file.Close(); err == nil {
+		err = closeErr
+	}
+
+	l.file = nil
+	return err
+}
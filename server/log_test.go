@@ -0,0 +1,250 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"hash/crc32"
+	"os"
+	"path/filepath"
+	"sort"
+	"testing"
+)
+
+type logRecord struct {
+	sessionID     uint64
+	received      int64
+	reportCode    uint32
+	reportSubType uint32
+	body          []byte
+}
+
+// Parses every record of the segments in dir, in the order written.
+func readSegments(t *testing.T, dir string) ([]logRecord, int) {
+	t.Helper()
+
+	names, err := filepath.Glob(filepath.Join(dir, "reports-*.log"))
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	sort.Strings(names)
+
+	var records []logRecord
+
+	for _, name := range names {
+		data, err := os.ReadFile(name)
+
+		if err != nil {
+			t.Fatal(err)
+		}
+
+		for len(data) > 0 {
+			if len(data) < logRecordHeaderSize {
+				t.Fatalf("%s: torn record header of %d bytes", name, len(data))
+			}
+
+			length := binary.LittleEndian.Uint32(data)
+
+			if int(length) < logRecordHeaderSize-8 || int(length)+8 > len(data) {
+				t.Fatalf("%s: record length %d with %d bytes left", name, length,
+					len(data))
+			}
+
+			record := data[8 : 8+length]
+
+			if crc := crc32.Checksum(record, castagnoli); crc != binary.LittleEndian.Uint32(data[4:]) {
+				t.Fatalf("%s: crc %08x, record has %08x", name, crc,
+					binary.LittleEndian.Uint32(data[4:]))
+			}
+
+			records = append(records, logRecord{
+				sessionID:     binary.LittleEndian.Uint64(record[0:]),
+				received:      int64(binary.LittleEndian.Uint64(record[8:])),
+				reportCode:    binary.LittleEndian.Uint32(record[16:]),
+				reportSubType: binary.LittleEndian.Uint32(record[20:]),
+				body:          record[24:],
+			})
+
+			data = data[8+length:]
+		}
+	}
+
+	return records, len(names)
+}
+
+func appendRecords(t *testing.T, l *segmentLog, count int) []logRecord {
+	t.Helper()
+
+	var records []logRecord
+
+	for index := 0; index < count; index++ {
+		record := logRecord{
+			sessionID:     uint64(index) + 100,
+			received:      int64(index) * 1000,
+			reportCode:    uint32(index),
+			reportSubType: uint32(index) * 2,
+			body:          bytes.Repeat([]byte{byte(index)}, index*16),
+		}
+
+		if err := l.append(record.sessionID, record.received, packetHeader{
+			reportCode:    record.reportCode,
+			reportSubType: record.reportSubType,
+		}, record.body); err != nil {
+			t.Fatal(err)
+		}
+
+		records = append(records, record)
+	}
+
+	return records
+}
+
+func checkRecords(t *testing.T, got, want []logRecord) {
+	t.Helper()
+
+	if len(got) != len(want) {
+		t.Fatalf("read %d records, want %d", len(got), len(want))
+	}
+
+	for index := range want {
+		if got[index].sessionID != want[index].sessionID ||
+			got[index].received != want[index].received ||
+			got[index].reportCode != want[index].reportCode ||
+			got[index].reportSubType != want[index].reportSubType ||
+			!bytes.Equal(got[index].body, want[index].body) {
+			t.Errorf("record %d: got %+v, want %+v", index, got[index], want[index])
+		}
+	}
+}
+
+func TestSegmentLogFraming(t *testing.T) {
+	dir := t.TempDir()
+	l, err := newSegmentLog(dir, 0, 1<<20)
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	want := appendRecords(t, l, 8)
+
+	if err := l.flush(); err != nil {
+		t.Fatal(err)
+	}
+
+	// flushed records are on disk before the log is closed
+	got, segments := readSegments(t, dir)
+
+	if segments != 1 {
+		t.Errorf("wrote %d segments, want 1", segments)
+	}
+
+	checkRecords(t, got, want)
+
+	if err := l.close(); err != nil {
+		t.Fatal(err)
+	}
+}
+
+func TestSegmentLogRotation(t *testing.T) {
+	dir := t.TempDir()
+
+	// every record but the first fills a segment by itself
+	l, err := newSegmentLog(dir, 3, logRecordHeaderSize+1)
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	want := appendRecords(t, l, 5)
+
+	if err := l.flush(); err != nil {
+		t.Fatal(err)
+	}
+
+	if err := l.close(); err != nil {
+		t.Fatal(err)
+	}
+
+	got, segments := readSegments(t, dir)
+
+	if segments != 4 {
+		t.Errorf("wrote %d segments, want 4", segments)
+	}
+
+	checkRecords(t, got, want)
+}
+
+func TestSegmentLogCorruption(t *testing.T) {
+	dir := t.TempDir()
+	l, err := newSegmentLog(dir, 0, 1<<20)
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	appendRecords(t, l, 2)
+
+	if err := l.close(); err != nil {
+		t.Fatal(err)
+	}
+
+	names, _ := filepath.Glob(filepath.Join(dir, "reports-*.log"))
+	data, err := os.ReadFile(names[0])
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// the second record, the first has an empty body
+	data = data[logRecordHeaderSize:]
+	stored := binary.LittleEndian.Uint32(data[4:])
+
+	// the crc covers every field following it as well as the body
+	for offset := 8; offset < len(data); offset++ {
+		data[offset] ^= 1
+
+		if crc32.Checksum(data[8:], castagnoli) == stored {
+			t.Errorf("corrupting byte %d left the crc matching", offset)
+		}
+
+		data[offset] ^= 1
+	}
+}
+
+func TestSegmentLogFailureUntilFlush(t *testing.T) {
+	dir := t.TempDir()
+	l, err := newSegmentLog(dir, 0, 1<<20)
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	appendRecords(t, l, 1)
+
+	// the buffered record cannot be written once its segment is gone
+	l.file.Close()
+
+	if err := l.flush(); err == nil {
+		t.Fatal("flush of a closed segment succeeded")
+	}
+
+	// the failure is reported once, the next append opens a new segment
+	want := appendRecords(t, l, 3)
+
+	if err := l.flush(); err != nil {
+		t.Fatal(err)
+	}
+
+	if err := l.close(); err != nil {
+		t.Fatal(err)
+	}
+
+	got, segments := readSegments(t, dir)
+
+	if segments != 2 {
+		t.Errorf("wrote %d segments, want 2", segments)
+	}
+
+	checkRecords(t, got, want)
+}
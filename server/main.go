@@ -1,7 +1,137 @@
 package main
 
-import "fmt"
+import (
+	"crypto/tls"
+	"flag"
+	"log"
+	"net"
+	"os"
+	"os/signal"
+	"runtime"
+	"syscall"
+	"time"
+)
+
+const (
+	statisticsInterval = 10 * time.Second
+	expiryInterval     = time.Minute
+)
 
 func main() {
-	fmt.Println("Hello, People looking through this code!")
+	listen := flag.String("listen", ":8443", "address to accept clients on")
+	certFile := flag.String("tls-cert", "", "TLS certificate, plaintext if unset")
+	keyFile := flag.String("tls-key", "", "TLS private key")
+	logDir := flag.String("log-dir", "reports", "directory to write report segments to")
+	segmentSize := flag.Int64("segment-size", 256<<20, "bytes after which a segment is closed")
+	workers := flag.Int("workers", runtime.GOMAXPROCS(0), "decryption and log workers")
+	nodeIndex := flag.Uint64("node-index", 0, "index of this node")
+	nodeCount := flag.Uint64("node-count", 1, "number of nodes sessions are sharded across")
+	readTimeout := flag.Duration("read-timeout", 2*time.Minute, "idle time after which a client is dropped")
+	sessionTimeout := flag.Duration("session-timeout", 10*time.Minute, "idle time after which a session is forgotten")
+	flag.Parse()
+
+	if *nodeCount == 0 || *nodeIndex >= *nodeCount || *workers <= 0 {
+		log.Fatalf("invalid node index %d of %d with %d workers",
+			*nodeIndex, *nodeCount, *workers)
+	}
+
+	if err := os.MkdirAll(*logDir, 0o755); err != nil {
+		log.Fatalf("creating %s: %v", *logDir, err)
+	}
+
+	s, err := newServer(serverConfig{
+		nodeIndex:      *nodeIndex,
+		nodeCount:      *nodeCount,
+		workers:        *workers,
+		logDir:         *logDir,
+		segmentSize:    *segmentSize,
+		readTimeout:    *readTimeout,
+		writeTimeout:   10 * time.Second,
+		sessionTimeout: *sessionTimeout,
+	})
+
+	if err != nil {
+		log.Fatalf("starting server: %v", err)
+	}
+
+	listener, err := net.Listen("tcp", *listen)
+
+	if err != nil {
+		log.Fatalf("listening on %s: %v", *listen, err)
+	}
+
+	if *certFile != "" {
+		certificate, err := tls.LoadX509KeyPair(*certFile, *keyFile)
+
+		if err != nil {
+			log.Fatalf("loading certificate: %v", err)
+		}
+
+		listener = tls.NewListener(listener, &tls.Config{
+			Certificates: []tls.Certificate{certificate},
+			MinVersion:   tls.VersionTLS12,
+		})
+	} else {
+		log.Printf("no certificate given, session keys are sent in plaintext")
+	}
+
+	log.Printf("node %d of %d listening on %s with %d workers",
+		*nodeIndex, *nodeCount, listener.Addr(), *workers)
+
+	done := make(chan struct{})
+	go s.report(done)
+
+	go func() {
+		signals := make(chan os.Signal, 1)
+		signal.Notify(signals, syscall.SIGINT, syscall.SIGTERM)
+		<-signals
+
+		log.Printf("shutting down")
+		close(done)
+		listener.Close()
+	}()
+
+	if err := s.serve(listener); err != nil {
+		log.Printf("serve: %v", err)
+	}
+
+	s.shutdown()
+	log.Printf("reports: %d heartbeats: %d rejected: %d",
+		s.stats.reports.Load(), s.stats.heartbeats.Load(),
+		s.stats.rejected.Load())
+}
+
+// Periodically logs throughput and expires idle sessions.
+func (s *server) report(done chan struct{}) {
+	statistics := time.NewTicker(statisticsInterval)
+	expiry := time.NewTicker(expiryInterval)
+	defer statistics.Stop()
+	defer expiry.Stop()
+
+	var reports, bytes uint64
+
+	for {
+		select {
+		case <-done:
+			return
+
+		case <-statistics.C:
+			currentReports := s.stats.reports.Load()
+			currentBytes := s.stats.bytes.Load()
+			seconds := statisticsInterval.Seconds()
+
+			log.Printf("%.0f reports/s, %.1f MiB/s, %d batches, %d rejected",
+				float64(currentReports-reports)/seconds,
+				float64(currentBytes-bytes)/seconds/(1<<20),
+				s.stats.batches.Load(), s.stats.rejected.Load())
+
+			reports = currentReports
+			bytes = currentBytes
+
+		case now := <-expiry.C:
+			if expired := s.sessions.expire(now, s.config.sessionTimeout); expired > 0 {
+				log.Printf("expired %d idle sessions", expired)
+			}
+		}
+	}
 }
@@ -0,0 +1,152 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+)
+
+// Packet definitions mirrored from Driver/Header Files/types.h. Every packet
+// begins with a 16 byte cleartext header, the remainder is encrypted with
+// AES-256-CBC using the session key, the IV restarting for each packet.
+const (
+	packetTypeReport    = 0x0
+	packetTypeHeartbeat = 0x1
+
+	packetMagicNumber = 0x1337
+
+	aesBlockSize     = 16
+	packetHeaderSize = aesBlockSize
+)
+
+// Frames exchanged with a client. Each is a little endian uint32 length of
+// the remainder of the frame, followed by a one byte frame type.
+//
+//	session: u64 session id, [32]byte key, [16]byte iv
+//	batch:   u64 session id, u64 sequence, u32 count,
+//	         count * (u32 length, packet)
+//	ack:     u64 session id, u64 sequence, u32 status, u32 accepted,
+//	         u32 rejected
+//
+// A session frame registers the key of a session and must precede its batches
+// on the node owning it. The key of a live session cannot be replaced, a
+// second session frame for it is acknowledged with ackStatusSessionExists
+// unless it repeats the original key and iv. Every batch is acknowledged once
+// its reports have been appended and synced to the log, or with
+// ackStatusLogFailure and none accepted if any of them could not be.
+const (
+	frameSession = 0x1
+	frameBatch   = 0x2
+	frameAck     = 0x3
+
+	frameLengthSize  = 4
+	frameMaxLength   = 4 << 20
+	sessionFrameSize = 1 + 8 + sessionKeyLength + sessionIVLength
+	batchHeaderSize  = 1 + 8 + 8 + 4
+	ackFrameSize     = 1 + 8 + 8 + 4 + 4 + 4
+	batchMaxPackets  = 1 << 16
+	packetLengthSize = 4
+	packetMaxLength  = 64 << 10
+	sessionKeyLength = 32
+	sessionIVLength  = aesBlockSize
+)
+
+const (
+	ackStatusOk             = 0x0
+	ackStatusUnknownSession = 0x1
+	ackStatusWrongNode      = 0x2
+	ackStatusMalformed      = 0x3
+	ackStatusLogFailure     = 0x4
+	ackStatusSessionExists  = 0x5
+)
+
+var (
+	errFrameLength  = errors.New("invalid frame length")
+	errFrameType    = errors.New("unknown frame type")
+	errBatchFormat  = errors.New("malformed batch")
+	errPacketHeader = errors.New("invalid packet header")
+)
+
+// REPORT_PACKET_HEADER, for a heartbeat the report fields are unused.
+type packetHeader struct {
+	packetType    uint32
+	magicNumber   uint32
+	reportCode    uint32
+	reportSubType uint32
+}
+
+// Packets shorter than a header or not a whole number of blocks cannot have
+// been produced by the driver.
+func parsePacketHeader(packet []byte) (packetHeader, error) {
+	if len(packet) < packetHeaderSize || len(packet)%aesBlockSize != 0 {
+		return packetHeader{}, errPacketHeader
+	}
+
+	header := packetHeader{
+		packetType:    binary.LittleEndian.Uint32(packet[0:]),
+		magicNumber:   binary.LittleEndian.Uint32(packet[4:]),
+		reportCode:    binary.LittleEndian.Uint32(packet[8:]),
+		reportSubType: binary.LittleEndian.Uint32(packet[12:]),
+	}
+
+	if header.magicNumber != packetMagicNumber {
+		return packetHeader{}, errPacketHeader
+	}
+
+	if header.packetType != packetTypeReport &&
+		header.packetType != packetTypeHeartbeat {
+		return packetHeader{}, errPacketHeader
+	}
+
+	return header, nil
+}
+
+type batchHeader struct {
+	sessionID uint64
+	sequence  uint64
+	count     uint32
+}
+
+func parseBatchHeader(frame []byte) (batchHeader, []byte, error) {
+	if len(frame) < batchHeaderSize {
+		return batchHeader{}, nil, errBatchFormat
+	}
+
+	header := batchHeader{
+		sessionID: binary.LittleEndian.Uint64(frame[1:]),
+		sequence:  binary.LittleEndian.Uint64(frame[9:]),
+		count:     binary.LittleEndian.Uint32(frame[17:]),
+	}
+
+	if header.count > batchMaxPackets {
+		return batchHeader{}, nil, errBatchFormat
+	}
+
+	return header, frame[batchHeaderSize:], nil
+}
+
+// Returns the next packet of a batch and the remainder following it.
+func nextPacket(body []byte) ([]byte, []byte, error) {
+	if len(body) < packetLengthSize {
+		return nil, nil, errBatchFormat
+	}
+
+	length := binary.LittleEndian.Uint32(body)
+	body = body[packetLengthSize:]
+
+	if length > packetMaxLength || uint64(length) > uint64(len(body)) {
+		return nil, nil, errBatchFormat
+	}
+
+	return body[:length], body[length:], nil
+}
+
+func putAck(buffer []byte, sessionID, sequence uint64, status, accepted,
+	rejected uint32) []byte {
+	buffer = binary.LittleEndian.AppendUint32(buffer, ackFrameSize)
+	buffer = append(buffer, frameAck)
+	buffer = binary.LittleEndian.AppendUint64(buffer, sessionID)
+	buffer = binary.LittleEndian.AppendUint64(buffer, sequence)
+	buffer = binary.LittleEndian.AppendUint32(buffer, status)
+	buffer = binary.LittleEndian.AppendUint32(buffer, accepted)
+	return binary.LittleEndian.AppendUint32(buffer, rejected)
+}
@@ -0,0 +1,129 @@
+package main
+
+import (
+	"encoding/binary"
+	"testing"
+)
+
+func makePacketHeader(packetType, magic uint32, length int) []byte {
+	packet := make([]byte, length)
+
+	if length >= packetHeaderSize {
+		binary.LittleEndian.PutUint32(packet[0:], packetType)
+		binary.LittleEndian.PutUint32(packet[4:], magic)
+		binary.LittleEndian.PutUint32(packet[8:], 0x20)
+		binary.LittleEndian.PutUint32(packet[12:], 0x3)
+	}
+
+	return packet
+}
+
+func TestParsePacketHeader(t *testing.T) {
+	tests := []struct {
+		name   string
+		packet []byte
+		valid  bool
+	}{
+		{"report", makePacketHeader(packetTypeReport, packetMagicNumber, 64), true},
+		{"heartbeat", makePacketHeader(packetTypeHeartbeat, packetMagicNumber, 16), true},
+		{"empty", nil, false},
+		{"short", makePacketHeader(packetTypeReport, packetMagicNumber, 15), false},
+		{"partial block", makePacketHeader(packetTypeReport, packetMagicNumber, 40), false},
+		{"bad magic", makePacketHeader(packetTypeReport, 0x1338, 32), false},
+		{"unknown type", makePacketHeader(0x2, packetMagicNumber, 32), false},
+	}
+
+	for _, test := range tests {
+		header, err := parsePacketHeader(test.packet)
+
+		if test.valid != (err == nil) {
+			t.Errorf("%s: got error %v, want valid %v", test.name, err, test.valid)
+			continue
+		}
+
+		if !test.valid {
+			if header != (packetHeader{}) {
+				t.Errorf("%s: rejected header not zeroed: %+v", test.name, header)
+			}
+			continue
+		}
+
+		if header.magicNumber != packetMagicNumber || header.reportCode != 0x20 ||
+			header.reportSubType != 0x3 {
+			t.Errorf("%s: header fields not decoded: %+v", test.name, header)
+		}
+	}
+}
+
+func appendPacket(body []byte, length uint32, packet []byte) []byte {
+	body = binary.LittleEndian.AppendUint32(body, length)
+	return append(body, packet...)
+}
+
+func TestNextPacket(t *testing.T) {
+	packet := make([]byte, 32)
+
+	for index := range packet {
+		packet[index] = byte(index)
+	}
+
+	tests := []struct {
+		name      string
+		body      []byte
+		length    int
+		remainder int
+		valid     bool
+	}{
+		{"exact", appendPacket(nil, 32, packet), 32, 0, true},
+		{"with remainder", append(appendPacket(nil, 32, packet), 1, 2, 3), 32, 3, true},
+		{"zero length", appendPacket(nil, 0, nil), 0, 0, true},
+		{"empty", nil, 0, 0, false},
+		{"truncated length", []byte{32, 0, 0}, 0, 0, false},
+		{"length past end", appendPacket(nil, 33, packet), 0, 0, false},
+		{"length overflows", appendPacket(nil, 0xffffffff, packet), 0, 0, false},
+		{"over maximum", appendPacket(nil, packetMaxLength+16,
+			make([]byte, packetMaxLength+16)), 0, 0, false},
+	}
+
+	for _, test := range tests {
+		next, remainder, err := nextPacket(test.body)
+
+		if test.valid != (err == nil) {
+			t.Errorf("%s: got error %v, want valid %v", test.name, err, test.valid)
+			continue
+		}
+
+		if !test.valid {
+			continue
+		}
+
+		if len(next) != test.length || len(remainder) != test.remainder {
+			t.Errorf("%s: got %d byte packet and %d byte remainder, want %d and %d",
+				test.name, len(next), len(remainder), test.length, test.remainder)
+		}
+
+		for index := range next {
+			if next[index] != byte(index) {
+				t.Errorf("%s: packet byte %d is %d", test.name, index, next[index])
+				break
+			}
+		}
+	}
+}
+
+func TestPutAck(t *testing.T) {
+	ack := putAck(nil, 7, 9, ackStatusLogFailure, 1, 2)
+
+	if len(ack) != frameLengthSize+ackFrameSize {
+		t.Fatalf("ack is %d bytes, want %d", len(ack), frameLengthSize+ackFrameSize)
+	}
+
+	if binary.LittleEndian.Uint32(ack) != ackFrameSize || ack[4] != frameAck ||
+		binary.LittleEndian.Uint64(ack[5:]) != 7 ||
+		binary.LittleEndian.Uint64(ack[13:]) != 9 ||
+		binary.LittleEndian.Uint32(ack[21:]) != ackStatusLogFailure ||
+		binary.LittleEndian.Uint32(ack[25:]) != 1 ||
+		binary.LittleEndian.Uint32(ack[29:]) != 2 {
+		t.Errorf("ack fields not encoded: %x", ack)
+	}
+}
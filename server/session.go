@@ -0,0 +1,164 @@
+package main
+
+import (
+	"crypto/aes"
+	"crypto/cipher"
+	"crypto/subtle"
+	"encoding/binary"
+	"errors"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const sessionTableShards = 64
+
+var (
+	errSessionKey    = errors.New("invalid session key")
+	errSessionExists = errors.New("session already registered")
+)
+
+type session struct {
+	id    uint64
+	block cipher.Block
+	iv    [sessionIVLength]byte
+
+	// the key and iv it was registered with, to recognise a retried frame
+	credentials [sessionKeyLength + sessionIVLength]byte
+
+	lastSeen   atomic.Int64
+	reports    atomic.Uint64
+	heartbeats atomic.Uint64
+	rejected   atomic.Uint64
+}
+
+// Decrypts a packet in place, leaving the cleartext header untouched.
+func (s *session) decrypt(packet []byte) {
+	var previous, current [aesBlockSize]byte
+
+	previous = s.iv
+
+	for offset := packetHeaderSize; offset < len(packet); offset += aesBlockSize {
+		block := packet[offset : offset+aesBlockSize]
+		copy(current[:], block)
+		s.block.Decrypt(block, block)
+
+		for index := range block {
+			block[index] ^= previous[index]
+		}
+
+		previous = current
+	}
+}
+
+func (s *session) touch(now time.Time) {
+	s.lastSeen.Store(now.UnixNano())
+}
+
+// Sessions are sharded across nodes by id, a node only accepting the sessions
+// for which id % nodeCount == nodeIndex. Within a node the table is striped
+// to keep lookups from contending across connections.
+type sessionTable struct {
+	nodeIndex uint64
+	nodeCount uint64
+
+	shards [sessionTableShards]struct {
+		sync.RWMutex
+		sessions map[uint64]*session
+	}
+}
+
+func newSessionTable(nodeIndex, nodeCount uint64) *sessionTable {
+	table := &sessionTable{nodeIndex: nodeIndex, nodeCount: nodeCount}
+
+	for index := range table.shards {
+		table.shards[index].sessions = make(map[uint64]*session)
+	}
+
+	return table
+}
+
+func (t *sessionTable) owns(id uint64) bool {
+	return id%t.nodeCount == t.nodeIndex
+}
+
+func (t *sessionTable) shard(id uint64) int {
+	// session ids are issued sequentially, mix them before striping
+	return int((id * 0x9E3779B97F4A7C15) >> 58)
+}
+
+func (t *sessionTable) lookup(id uint64) *session {
+	shard := &t.shards[t.shard(id)]
+
+	shard.RLock()
+	s := shard.sessions[id]
+	shard.RUnlock()
+
+	return s
+}
+
+// Registers a session from a session frame. A live session keeps the key it
+// was registered with, a frame carrying the same key and iv is taken as a
+// retry whose ack was lost and returns the existing session, any other is
+// rejected with errSessionExists. Once a session has expired its id may be
+// registered again.
+func (t *sessionTable) register(frame []byte) (*session, error) {
+	if len(frame) != sessionFrameSize {
+		return nil, errSessionKey
+	}
+
+	id := binary.LittleEndian.Uint64(frame[1:])
+	key := frame[9 : 9+sessionKeyLength]
+
+	block, err := aes.NewCipher(key)
+
+	if err != nil {
+		return nil, err
+	}
+
+	s := &session{id: id, block: block}
+	copy(s.iv[:], frame[9+sessionKeyLength:])
+	copy(s.credentials[:], frame[9:])
+	s.touch(time.Now())
+
+	shard := &t.shards[t.shard(id)]
+
+	shard.Lock()
+	defer shard.Unlock()
+
+	if existing := shard.sessions[id]; existing != nil {
+		if subtle.ConstantTimeCompare(existing.credentials[:],
+			s.credentials[:]) != 1 {
+			return nil, errSessionExists
+		}
+
+		existing.touch(time.Now())
+		return existing, nil
+	}
+
+	shard.sessions[id] = s
+	return s, nil
+}
+
+// Removes sessions not seen within timeout.
+func (t *sessionTable) expire(now time.Time, timeout time.Duration) int {
+	deadline := now.Add(-timeout).UnixNano()
+	expired := 0
+
+	for index := range t.shards {
+		shard := &t.shards[index]
+
+		shard.Lock()
+
+		for id, s := range shard.sessions {
+			if s.lastSeen.Load() < deadline {
+				delete(shard.sessions, id)
+				expired++
+			}
+		}
+
+		shard.Unlock()
+	}
+
+	return expired
+}
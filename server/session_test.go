@@ -0,0 +1,149 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/hex"
+	"errors"
+	"testing"
+	"time"
+)
+
+// NIST SP 800-38A F.2.5, CBC-AES256.Decrypt
+const (
+	cbcVectorKey        = "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4"
+	cbcVectorIV         = "000102030405060708090a0b0c0d0e0f"
+	cbcVectorCiphertext = "f58c4c04d6e5f1ba779eabfb5f7bfbd6" +
+		"9cfc4e967edb808d679f777bc6702c7d" +
+		"39f23369a9d9bacfa530e26304231461" +
+		"b2eb05e2c39be9fcda6c19078c6a9d1b"
+	cbcVectorPlaintext = "6bc1bee22e409f96e93d7e117393172a" +
+		"ae2d8a571e03ac9c9eb76fac45af8e51" +
+		"30c81c46a35ce411e5fbc1191a0a52ef" +
+		"f69f2445df4f9b17ad2b417be66c3710"
+)
+
+func mustDecodeHex(t *testing.T, value string) []byte {
+	t.Helper()
+
+	decoded, err := hex.DecodeString(value)
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	return decoded
+}
+
+func makeSessionFrame(id uint64, key, iv []byte) []byte {
+	frame := []byte{frameSession}
+	frame = binary.LittleEndian.AppendUint64(frame, id)
+	frame = append(frame, key...)
+	return append(frame, iv...)
+}
+
+func TestSessionDecryptKnownVector(t *testing.T) {
+	key := mustDecodeHex(t, cbcVectorKey)
+	iv := mustDecodeHex(t, cbcVectorIV)
+	table := newSessionTable(0, 1)
+
+	s, err := table.register(makeSessionFrame(1, key, iv))
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	header := makePacketHeader(packetTypeReport, packetMagicNumber, packetHeaderSize)
+	packet := append(append([]byte{}, header...),
+		mustDecodeHex(t, cbcVectorCiphertext)...)
+
+	s.decrypt(packet)
+
+	if !bytes.Equal(packet[:packetHeaderSize], header) {
+		t.Errorf("cleartext header modified: %x", packet[:packetHeaderSize])
+	}
+
+	if want := mustDecodeHex(t, cbcVectorPlaintext); !bytes.Equal(packet[packetHeaderSize:], want) {
+		t.Errorf("decrypted %x, want %x", packet[packetHeaderSize:], want)
+	}
+
+	// the iv restarts for each packet
+	packet = append(append([]byte{}, header...),
+		mustDecodeHex(t, cbcVectorCiphertext)...)
+	s.decrypt(packet)
+
+	if want := mustDecodeHex(t, cbcVectorPlaintext); !bytes.Equal(packet[packetHeaderSize:], want) {
+		t.Errorf("second packet decrypted %x, want %x", packet[packetHeaderSize:], want)
+	}
+}
+
+func TestSessionRegisterMalformed(t *testing.T) {
+	table := newSessionTable(0, 1)
+	frame := makeSessionFrame(1, make([]byte, sessionKeyLength), make([]byte, sessionIVLength))
+
+	if _, err := table.register(frame[:len(frame)-1]); !errors.Is(err, errSessionKey) {
+		t.Errorf("short frame: got %v, want %v", err, errSessionKey)
+	}
+
+	if table.lookup(1) != nil {
+		t.Errorf("short frame registered a session")
+	}
+}
+
+func TestSessionRegisterLiveSession(t *testing.T) {
+	key := mustDecodeHex(t, cbcVectorKey)
+	iv := mustDecodeHex(t, cbcVectorIV)
+	table := newSessionTable(0, 1)
+
+	original, err := table.register(makeSessionFrame(5, key, iv))
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// a retried frame is idempotent
+	retried, err := table.register(makeSessionFrame(5, key, iv))
+
+	if err != nil || retried != original {
+		t.Fatalf("retry: got %p, %v, want the original session", retried, err)
+	}
+
+	otherKey := append([]byte{}, key...)
+	otherKey[0] ^= 1
+	otherIV := append([]byte{}, iv...)
+	otherIV[15] ^= 1
+
+	for _, frame := range [][]byte{
+		makeSessionFrame(5, otherKey, iv),
+		makeSessionFrame(5, key, otherIV),
+	} {
+		if _, err := table.register(frame); !errors.Is(err, errSessionExists) {
+			t.Errorf("replacement: got %v, want %v", err, errSessionExists)
+		}
+	}
+
+	if table.lookup(5) != original {
+		t.Errorf("live session was replaced")
+	}
+
+	// once expired the id is free to be registered with a new key
+	if expired := table.expire(time.Now().Add(time.Hour), time.Minute); expired != 1 {
+		t.Fatalf("expired %d sessions, want 1", expired)
+	}
+
+	replacement, err := table.register(makeSessionFrame(5, otherKey, iv))
+
+	if err != nil || replacement == original || table.lookup(5) != replacement {
+		t.Errorf("after expiry: got %p, %v", replacement, err)
+	}
+}
+
+func TestSessionTableOwns(t *testing.T) {
+	table := newSessionTable(1, 3)
+
+	for id := uint64(0); id < 9; id++ {
+		if table.owns(id) != (id%3 == 1) {
+			t.Errorf("owns(%d) = %v", id, table.owns(id))
+		}
+	}
+}